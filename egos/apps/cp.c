@@ -1,7 +1,8 @@
 #include "egos.h"
 #include "string.h"
+#include "file.h"
 
-#define BUF_SIZE		4096
+#define BUF_SIZE		FILE_MAX_XFER
 
 int cp(char *from, char *to){
 	FILE *f_from, *f_to;
@@ -16,8 +17,22 @@ int cp(char *from, char *to){
 		return 1;
 	}
 
+	/* Have the file servers copy regular files, without the data passing
+	 * through here.  Otherwise, or if they can't, copy it.
+	 */
+	struct file_stat st_from, st_to;
+	if (file_stat(f_from->fid.server, f_from->fid.ino, &st_from) && st_from.st_alloc &&
+			file_stat(f_to->fid.server, f_to->fid.ino, &st_to) && st_to.st_alloc) {
+		unsigned int size = st_from.st_size;
+		if (file_copy(f_to->fid.server, f_to->fid.ino, 0, f_from->fid.server,
+										f_from->fid.ino, 0, &size)) {
+			fclose(f_from);
+			fclose(f_to);
+			return 0;
+		}
+	}
 
-	char buf[BUF_SIZE];
+	char *buf = malloc(BUF_SIZE);
 	int n;
 	while ((n = fread(buf, 1, BUF_SIZE, f_from)) > 0) {
 		int m = fwrite(buf, 1, n, f_to);
@@ -26,6 +41,7 @@ int cp(char *from, char *to){
 			break;
 		}
 	}
+	free(buf);
 	fclose(f_from);
 	fclose(f_to);
 
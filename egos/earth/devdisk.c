@@ -1,3 +1,6 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE			// for fallocate()
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -73,20 +76,23 @@ static void disk_seek(struct dev_disk *dd, unsigned int offset){
 	lseek(dd->fd, (off_t) offset * BLOCK_SIZE, SEEK_SET);
 }
 
-/* Write a block.  Invoke completion() when done.
+/* Write nblocks consecutive blocks.  Invoke completion() when done.  The
+ * blocks are written with a single write and, if the disk is synchronous,
+ * a single fsync.
  */
-void dev_disk_write(struct dev_disk *dd, unsigned int offset, const char *data,
-				void (*completion)(void *arg, bool_t success), void *arg){
+void dev_disk_write(struct dev_disk *dd, unsigned int offset, unsigned int nblocks,
+				const char *data, void (*completion)(void *arg, bool_t success), void *arg){
 	bool_t success;
 
 	disk_seek(dd, offset);
+	assert(nblocks <= dd->nblocks - offset);
 
-	int n = write(dd->fd, data, BLOCK_SIZE);
+	int n = write(dd->fd, data, nblocks * BLOCK_SIZE);
 	if (n < 0) {
 		perror("dev_disk_write");
 		success = False;
 	}
-	else if (n != BLOCK_SIZE) {
+	else if (n != (int) (nblocks * BLOCK_SIZE)) {
 		fprintf(stderr, "disk_write: wrote only %d bytes\n", n);
 		success = False;
 	}
@@ -100,6 +106,44 @@ void dev_disk_write(struct dev_disk *dd, unsigned int offset, const char *data,
 	dev_disk_make_event(dd, completion, arg, success);
 }
 
+/* Discard nblocks consecutive blocks, so that they read as zeroes and,
+ * where the underlying file system allows, no longer take up space.
+ * Invoke completion() when done.
+ */
+void dev_disk_discard(struct dev_disk *dd, unsigned int offset, unsigned int nblocks,
+				void (*completion)(void *arg, bool_t success), void *arg){
+	bool_t success = True;
+
+	assert(offset <= dd->nblocks && nblocks <= dd->nblocks - offset);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(dd->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t) offset * BLOCK_SIZE, (off_t) nblocks * BLOCK_SIZE) == 0) {
+		if (dd->sync) {
+			fsync(dd->fd);
+		}
+		dev_disk_make_event(dd, completion, arg, success);
+		return;
+	}
+#endif
+
+	/* Can't punch holes.  Write zeroes instead.
+	 */
+	static char zeroes[BLOCK_SIZE];
+	unsigned int i;
+	for (i = 0; i < nblocks && success; i++) {
+		disk_seek(dd, offset + i);
+		if (write(dd->fd, zeroes, BLOCK_SIZE) != BLOCK_SIZE) {
+			perror("dev_disk_discard");
+			success = False;
+		}
+	}
+	if (success && dd->sync) {
+		fsync(dd->fd);
+	}
+	dev_disk_make_event(dd, completion, arg, success);
+}
+
 /* Read a block.  Invoke completion() when done.
  */
 void dev_disk_read(struct dev_disk *dd, unsigned int offset, char *data,
@@ -11,6 +11,7 @@
 #include <arpa/inet.h>
 #include "../earth/earth.h"
 #include "../earth/myalloc.h"
+#include "../earth/log.h"
 #include "../earth/tlb.h"
 #include "../earth/intr.h"
 #include "../earth/mem.h"
@@ -22,20 +23,173 @@
 #include "exec.h"
 #include "process.h"
 
-// for MAX_INODES
-#include "blocksvr.h"
+/* The stat table lives in inode 0.  Its first block holds a header, then
+ * follows a bitmap of the allocated inodes, then the stat entries, which
+ * do not straddle blocks.  The number of inodes is that of the block
+ * server's file system when the table is made, and is fixed after that.
+ * The bitmap is kept in memory, and the entries are paged in on demand
+ * into a cache of STAT_NPAGES blocks.
+ */
+#define STAT_MAGIC           0x54415453		// "STAT"
+#define STATS_PER_BLOCK      (BLOCK_SIZE / sizeof(struct file_stat))
+#define BITS_PER_BLOCK       (BLOCK_SIZE * 8)
+#define STAT_NPAGES          16
+
+struct stat_header {
+	uint32_t magic;
+	uint32_t n_inodes;
+	uint32_t n_staged;		// #blocks of an old table still to convert
+};
+
+/* Changes to the stat table are collected and written out together, at
+ * most STAT_FLUSH_DELAY ms after the first one, when the server has been
+ * idle that long, or on FILE_SYNC.  Only the blocks that changed are
+ * written.  A file's data is always written before its larger size, and
+ * a smaller size before the data is cut off, so the size on disk never
+ * covers data that was not written.
+ */
+#define STAT_FLUSH_DELAY     50
+
+/* Read-ahead cache; see blkfile_readahead().  Sizes are in units of the
+ * largest read, RA_REQ_NBLOCK blocks when not aligned.  A stream reads up
+ * to two reads ahead, and the cache holds two of the largest jobs.  It is
+ * set-associative, with LRU replacement within a set, and the blocks of a
+ * job are spread over the sets so that a job never replaces its own.
+ */
+#define RA_REQ_NBLOCK        (FILE_MAX_XFER / BLOCK_SIZE + 1)
+#define RA_NSTREAMS          8
+#define RA_MIN_WINDOW        BLOCK_MAX_NBLOCK
+#define RA_MAX_WINDOW        (2 * (FILE_MAX_XFER / BLOCK_SIZE))
+#define RA_NWAYS             8
+#define RA_NSETS             ((2 * JOB_MAX_NBLOCK + RA_NWAYS - 1) / RA_NWAYS)
+#define RA_NBLOCKS           (RA_NSETS * RA_NWAYS)
+
+struct ra_entry {
+	bool_t valid, hole;
+	unsigned int ino, bno;
+	unsigned long last_use;				// for LRU within the set
+};
+
+/* A stream of sequential reads of a file.
+ */
+struct ra_stream {
+	bool_t used;
+	unsigned int ino;
+	unsigned long next;					// offset where the next read is expected
+	unsigned int window;				// #blocks to read ahead
+	unsigned int ra_next, ra_end;		// blocks still to read ahead
+};
+
+/* Requests that need I/O on the data of a file are handed to worker
+ * processes, each serving a shard of the inodes, so that they do not hold
+ * up requests that can be answered right away, such as reads of cached
+ * blocks.  The server keeps all the state.  It sends a job to the worker
+ * of the inode, which does the block I/O and sends the job back, and then
+ * the server finishes the request.  While a job for an inode is out, the
+ * requests for that inode that need another job wait in a queue.  Copies
+ * from files of other servers go to a worker of their own, so that they
+ * never hold up the jobs that those servers may be waiting for.
+ */
+#define BLKFILE_NWORKERS     4
+#define JOB_MAX_NBLOCK       (RA_REQ_NBLOCK + RA_MAX_WINDOW)
+#define BLKFILE_MSG_MAX      (sizeof(struct blkfile_job) + JOB_MAX_NBLOCK * BLOCK_SIZE)
+
+struct blkfile_job {
+	enum job_type { JOB_READ, JOB_WRITE, JOB_TRUNCATE, JOB_COPY } type;
+	struct blkfile_cont *cont;			// handed back as is
+	unsigned int ino;
+	unsigned long offset;				// READ: first block; WRITE, COPY: offset
+	unsigned int size;					// READ: #blocks; WRITE: #bytes that follow
+										// COPY: #bytes to copy, then copied
+	unsigned long file_size;			// WRITE, TRUNCATE, COPY: current size of the file
+										// COPY: set to the size covering the copy
+	unsigned long new_size;				// TRUNCATE: size to cut the file to
+	gpid_t src_server;					// COPY: server of the file to copy from
+	unsigned int src_ino;				// COPY: file to copy from
+	unsigned long src_offset;			// COPY: offset in that file
+	unsigned int uid;					// COPY: client, for another server's file
+	bool_t ok;							// set by the worker
+	unsigned char holes[(JOB_MAX_NBLOCK + 7) / 8];	// READ: blocks that are holes
+};
+
+/* What is left to do for a request once its job comes back.
+ */
+struct blkfile_cont {
+	gpid_t src;							// client, or 0 when reading ahead
+	struct file_request req;			// the request without the data
+	unsigned long n;					// READ: #bytes to return
+};
+
+/* A request waiting for the job of its inode to finish.
+ */
+struct blkfile_deferred {
+	gpid_t src;
+	unsigned int size;					// size of the request, with the data
+	struct file_request req;			// the data follows
+};
+
+struct blkfile_worker_state {
+	gpid_t server;						// the file server
+	gpid_t block_svr;
+	struct blkfile_job *job;			// the job being done
+};
 
 struct file_server_state {
 	gpid_t block_svr;
-	struct file_stat stat_cache[MAX_INODES];
+	unsigned int n_inodes;
+	unsigned int nbitmap;				// #blocks in the bitmap
+	unsigned char *bitmap;				// allocated inodes
+	bool_t *bitmap_dirty;				// per block of the bitmap
+	unsigned int hint;					// where to look for a free inode
+	unsigned char *checked;				// inodes checked since boot
+	unsigned char *busy;				// inodes with a job out
+
+	gpid_t workers[BLKFILE_NWORKERS + 1];	// the last copies from other servers
+	struct queue deferred;				// of struct blkfile_deferred
+
+	/* Cache of blocks of stat entries.
+	 */
+	char pages[STAT_NPAGES][BLOCK_SIZE];
+	unsigned int page_no[STAT_NPAGES];	// block number in inode 0, or 0
+	bool_t page_dirty[STAT_NPAGES];
+
+	unsigned int stat_ndirty;			// number of dirty blocks
+	unsigned long stat_dirty_since;		// when the first one got dirty
+
+	/* Cache of blocks read ahead.
+	 */
+	char ra_blocks[RA_NBLOCKS][BLOCK_SIZE];
+	struct ra_entry ra_entries[RA_NBLOCKS];
+	struct ra_stream ra_streams[RA_NSTREAMS];
+	unsigned int ra_clock;				// next stream to replace
+	unsigned long ra_time;				// ticks on every use of a block
 };
 
-// file_stat is 16 bytes on Linux64
-#define STATS_PER_BLOCK      (BLOCK_SIZE / sizeof(struct file_stat))
+/* The only other file server that files are copied from.  A copy from a
+ * server that does not answer would hold up the worker for such copies,
+ * and the file copied to, for good.
+ */
+static gpid_t blkfile_ramfile;
 
 // these helper functions are declared here and defined later
 static void flush_stat_cache(struct file_server_state *);
+static struct file_stat *stat_get(struct file_server_state *, unsigned int ino);
+static void stat_update(struct file_server_state *, unsigned int ino);
+static bool_t inode_allocated(struct file_server_state *, unsigned int ino);
+static void inode_set(struct file_server_state *, unsigned int ino, bool_t alloc);
+static bool_t blkfile_check(struct file_server_state *, unsigned int ino);
+static void ra_drop(struct file_server_state *, unsigned int ino, unsigned int b, unsigned int n);
+static void blkfile_readahead(struct file_server_state *, struct ra_stream *rs);
+static void blkfile_job_done(struct file_server_state *, struct blkfile_job *job, unsigned int size);
+static bool_t blkfile_read_blocks(gpid_t svr, unsigned int ino, unsigned int b,
+                            unsigned int n, char *addr, unsigned char *holes);
+static int blkfile_put(gpid_t svr, unsigned int ino, unsigned long offset, void* data,
+                                    unsigned int size, unsigned long file_size);
+static bool_t blkfile_truncate(gpid_t svr, unsigned int ino, unsigned long size, unsigned long old_size);
+static bool_t blkfile_copy(gpid_t svr, struct blkfile_job *job);
+static bool_t blkfile_pull(gpid_t svr, struct blkfile_job *job);
 static bool_t load_stat_cache(struct file_server_state *);
+static void format_stat_cache(struct file_server_state *, struct file_stat *old, unsigned int n_old);
 static void blkfile_do_create(struct file_server_state *, struct file_request *req, gpid_t src);
 static void blkfile_do_delete(struct file_server_state *, struct file_request *req, gpid_t src);
 static void blkfile_do_chown(struct file_server_state *, struct file_request *req, gpid_t src);
@@ -44,8 +198,11 @@ static void blkfile_do_read(struct file_server_state *, struct file_request *req
 static void blkfile_do_write(struct file_server_state *, struct file_request *req, void *data, unsigned int size, gpid_t src);
 static void blkfile_do_stat(struct file_server_state *, struct file_request *req, gpid_t src);
 static void blkfile_do_setsize(struct file_server_state *, struct file_request *req, gpid_t src);
+static void blkfile_do_sync(struct file_server_state *, struct file_request *req, gpid_t src);
+static void blkfile_do_copy(struct file_server_state *, struct file_request *req, void *data, unsigned int size, gpid_t src);
 static void blkfile_respond(struct file_request *req, enum file_status status,
                 void *data, unsigned int size, gpid_t src);
+static bool_t blkfile_may_read(struct file_stat *stat, unsigned int uid);
 static bool_t blkfile_read_allowed(struct file_stat *stat, gpid_t src);
 static bool_t blkfile_write_allowed(struct file_stat *stat, gpid_t src);
 
@@ -70,20 +227,116 @@ bool_t multiblock_read(gpid_t svr, unsigned int ino, unsigned int offset, void *
 	return True;
 }
 
+/* Write nblocks blocks, BLOCK_MAX_NBLOCK at a time.
+ */
 bool_t multiblock_write(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr, unsigned int nblocks){
-	unsigned int i;
-
-	for (i = 0; i < nblocks; i++) {
-		bool_t r = block_write(svr, ino, offset, addr);
-		if (!r) {
+	while (nblocks > 0) {
+		unsigned int n = nblocks < BLOCK_MAX_NBLOCK ? nblocks : BLOCK_MAX_NBLOCK;
+		if (!block_write_range(svr, ino, offset, n, addr)) {
 			return False;
 		}
-		offset++;
-		addr = (char *) addr + BLOCK_SIZE;
+		offset += n;
+		nblocks -= n;
+		addr = (char *) addr + n * BLOCK_SIZE;
 	}
 	return True;
 }
 
+/* Handle a request from a client.
+ */
+static void blkfile_request(struct file_server_state *fss, struct file_request *req,
+                                        unsigned int req_size, gpid_t src){
+    assert(req_size >= sizeof(*req));
+    switch (req->type) {
+    case FILE_CREATE:
+        //fprintf(stderr, "!!DEBUG: calling blkfile create\n");
+        blkfile_do_create(fss, req, src);
+        break;
+    case FILE_DELETE:
+        blkfile_do_delete(fss, req, src);
+        break;
+    case FILE_CHOWN:
+        //fprintf(stderr, "!!DEBUG: calling blkfile chown\n");
+        blkfile_do_chown(fss, req, src);
+        break;
+    case FILE_CHMOD:
+        //fprintf(stderr, "!!DEBUG: calling blkfile chmod\n");
+        blkfile_do_chmod(fss, req, src);
+        break;
+    case FILE_READ:
+        //fprintf(stderr, "!!DEBUG: calling blkfile read\n");
+        blkfile_do_read(fss, req, src);
+        break;
+    case FILE_WRITE:
+        //fprintf(stderr, "!!DEBUG: calling blkfile write\n");
+        blkfile_do_write(fss, req, &req[1], req_size - sizeof(*req), src);
+        break;
+    case FILE_STAT:
+        //fprintf(stderr, "!!DEBUG: calling blkfile stat\n");
+        blkfile_do_stat(fss, req, src);
+        break;
+    case FILE_SETSIZE:
+        //fprintf(stderr, "!!DEBUG: calling blkfile create\n");
+        blkfile_do_setsize(fss, req, src);
+        break;
+    case FILE_SYNC:
+        blkfile_do_sync(fss, req, src);
+        break;
+    case FILE_COPY:
+        blkfile_do_copy(fss, req, &req[1], req_size - sizeof(*req), src);
+        break;
+    default:
+        assert(0);
+    }
+}
+
+/* Keep a request until the job out for its inode is back.
+ */
+static void blkfile_defer(struct file_server_state *fss, struct file_request *req,
+                                        unsigned int req_size, gpid_t src){
+    struct blkfile_deferred *d = new_alloc_ext(struct blkfile_deferred, req_size - sizeof(*req));
+    d->src = src;
+    d->size = req_size;
+    memcpy(&d->req, req, req_size);
+    queue_add(&fss->deferred, d);
+}
+
+/* A job came back, so try the waiting requests again, in order.  Those
+ * whose inode is still busy go back in the queue.
+ */
+static void blkfile_restart(struct file_server_state *fss){
+    struct queue waiting = fss->deferred;
+    struct blkfile_deferred *d;
+
+    queue_init(&fss->deferred);
+    while ((d = queue_get(&waiting)) != 0) {
+        blkfile_request(fss, &d->req, d->size, d->src);
+        free(d);
+    }
+}
+
+static bool_t inode_busy(struct file_server_state *fss, unsigned int ino) {
+    return (fss->busy[ino / 8] & (1 << (ino % 8))) != 0;
+}
+
+/* Hand a job to the worker of its inode.  The data, if any, follows.
+ */
+static void blkfile_submit(struct file_server_state *fss, struct blkfile_job *job,
+                            struct blkfile_cont *cont, const void *data, unsigned int size){
+    struct blkfile_job *msg = new_alloc_ext(struct blkfile_job, size);
+    gpid_t worker = fss->workers[job->ino % BLKFILE_NWORKERS];
+
+    if (job->type == JOB_COPY && job->src_server != sys_getpid()) {
+        worker = fss->workers[BLKFILE_NWORKERS];
+    }
+    *msg = *job;
+    msg->cont = cont;
+    memcpy(&msg[1], data, size);
+    fss->busy[job->ino / 8] |= 1 << (job->ino % 8);
+    (void) proc_send(sys_getpid(), worker, MSG_REQUEST, msg, sizeof(*msg) + size);
+    free(msg);
+}
+
 /* A file server based on block server. Each file corresponds to an inode in block server
  */
 static void blkfile_proc(void *arg){
@@ -93,87 +346,191 @@ static void blkfile_proc(void *arg){
 
     // initialize blkfile internal states
     if (!load_stat_cache(fss)) {
-        memset(fss->stat_cache, 0, sizeof(fss->stat_cache));
-        fss->stat_cache[0].st_alloc = True;
-        fss->stat_cache[0].st_size = MAX_INODES / STATS_PER_BLOCK;
-        flush_stat_cache(fss);
+        format_stat_cache(fss, 0, 0);
     }
+    queue_init(&fss->deferred);
 
-    struct file_request *req = new_alloc_ext(struct file_request, PAGESIZE);
+    // room for a request or for a job coming back
+    char *msg = malloc(BLKFILE_MSG_MAX);
     for (;;) {
         gpid_t src;
-        int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + PAGESIZE, &src);
+        int req_size = sys_recv(MSG_REQUEST, fss->stat_ndirty > 0 ? STAT_FLUSH_DELAY : 0,
+								msg, BLKFILE_MSG_MAX, &src);
+		if (req_size < 0 && fss->stat_ndirty > 0) {
+			flush_stat_cache(fss);
+			continue;
+		}
 		if (req_size < 0) {
 			printf("block file server terminated\n\r");
-			free(req);
+			flush_stat_cache(fss);
+			(void) block_sync(fss->block_svr);
+			free(msg);
+			free(fss->bitmap);
+			free(fss->bitmap_dirty);
+			free(fss->checked);
+			free(fss->busy);
 			free(fss);
 			break;
 		}
 
-        assert(req_size >= (int) sizeof(*req));
-        switch (req->type) {
-        case FILE_CREATE:
-            //fprintf(stderr, "!!DEBUG: calling blkfile create\n");
-            blkfile_do_create(fss, req, src);
-            break;
-        case FILE_DELETE:
-            blkfile_do_delete(fss, req, src);
-            break;
-        case FILE_CHOWN:
-            //fprintf(stderr, "!!DEBUG: calling blkfile chown\n");
-            blkfile_do_chown(fss, req, src);
-            break;
-        case FILE_CHMOD:
-            //fprintf(stderr, "!!DEBUG: calling blkfile chmod\n");
-            blkfile_do_chmod(fss, req, src);
+        unsigned int i;
+        for (i = 0; i <= BLKFILE_NWORKERS && src != fss->workers[i]; i++)
+            ;
+        if (i <= BLKFILE_NWORKERS) {
+            blkfile_job_done(fss, (struct blkfile_job *) msg, req_size);
+            if (!queue_empty(&fss->deferred)) {
+                blkfile_restart(fss);
+            }
+        }
+        else {
+            blkfile_request(fss, (struct file_request *) msg, req_size, src);
+        }
+
+        // don't let a steady stream of requests hold back the flush
+        if (fss->stat_ndirty > 0 &&
+                sys_gettime() - fss->stat_dirty_since >= STAT_FLUSH_DELAY) {
+            flush_stat_cache(fss);
+        }
+    }
+}
+
+static void blkfile_worker_cleanup(void *arg){
+    struct blkfile_worker_state *ws = arg;
+
+    free(ws->job);
+    free(ws);
+}
+
+/* A worker does the block I/O of the jobs it is sent, one at a time,
+ * and sends each job back with the result.
+ */
+static void blkfile_worker(void *arg){
+    struct blkfile_worker_state *ws = arg;
+    struct blkfile_job *job = new_alloc_ext(struct blkfile_job, JOB_MAX_NBLOCK * BLOCK_SIZE);
+
+    ws->job = job;
+    proc_current->finish = blkfile_worker_cleanup;
+    for (;;) {
+        gpid_t src;
+        int size = sys_recv(MSG_REQUEST, 0, job, sizeof(*job) + FILE_MAX_XFER, &src);
+        if (size < 0) {
             break;
-        case FILE_READ:
-            //fprintf(stderr, "!!DEBUG: calling blkfile read\n");
-            blkfile_do_read(fss, req, src);
+        }
+        assert(src == ws->server && size >= (int) sizeof(*job));
+
+        unsigned int nreply = sizeof(*job);
+        switch (job->type) {
+        case JOB_READ:
+            job->ok = blkfile_read_blocks(ws->block_svr, job->ino, job->offset,
+                                    job->size, (char *) &job[1], job->holes);
+            if (job->ok) {
+                nreply += job->size * BLOCK_SIZE;
+            }
             break;
-        case FILE_WRITE:
-            //fprintf(stderr, "!!DEBUG: calling blkfile write\n");
-            blkfile_do_write(fss, req, &req[1], req_size - sizeof(*req), src);
+        case JOB_WRITE:
+            job->ok = blkfile_put(ws->block_svr, job->ino, job->offset,
+                                    &job[1], job->size, job->file_size) == 0;
             break;
-        case FILE_STAT:
-            //fprintf(stderr, "!!DEBUG: calling blkfile stat\n");
-            blkfile_do_stat(fss, req, src);
+        case JOB_TRUNCATE:
+            job->ok = blkfile_truncate(ws->block_svr, job->ino,
+                                    job->new_size, job->file_size);
             break;
-        case FILE_SETSIZE:
-            //fprintf(stderr, "!!DEBUG: calling blkfile create\n");
-            blkfile_do_setsize(fss, req, src);
+        case JOB_COPY:
+            job->ok = job->src_server == ws->server ? blkfile_copy(ws->block_svr, job) :
+                                    blkfile_pull(ws->block_svr, job);
             break;
         default:
             assert(0);
         }
+        (void) proc_send(sys_getpid(), ws->server, MSG_REQUEST, job, nreply);
     }
 }
 
 gpid_t blkfile_init(gpid_t block_server){
 	struct file_server_state *fss = new_alloc(struct file_server_state);
     fss->block_svr = block_server;
-    return proc_create(1, "blkfile", blkfile_proc, fss);
+    gpid_t pid = proc_create(1, "blkfile", blkfile_proc, fss);
+
+    unsigned int i;
+    for (i = 0; i <= BLKFILE_NWORKERS; i++) {
+        struct blkfile_worker_state *ws = new_alloc(struct blkfile_worker_state);
+        ws->server = pid;
+        ws->block_svr = block_server;
+        fss->workers[i] = proc_create(1, "blkfile worker", blkfile_worker, ws);
+    }
+    return pid;
+}
+
+/* Allow copies from the files of the given ram file server.
+ */
+void blkfile_set_ramfile(gpid_t ramfile_server){
+    blkfile_ramfile = ramfile_server;
 }
 
-/* Respond to a create request.
+/* Respond to a create request.  The inode is cleared first, and gets
+ * allocated once that is done.
  */
 static void blkfile_do_create(struct file_server_state *fss, struct file_request *req, gpid_t src) {
-    unsigned int ino;
-    for(ino = 1; ino < MAX_INODES; ino++) {
-        if (!fss->stat_cache[ino].st_alloc) {
+    // find a free inode, starting where the last one was found
+    unsigned int ino = fss->hint, i;
+    for (i = 0; i < fss->n_inodes; i++, ino++) {
+        if (ino >= fss->n_inodes) {
+            ino = 0;
+        }
+        if ((ino & 7) == 0 && fss->bitmap[ino / 8] == 0xFF) {
+            i += 7;
+            ino += 7;
+            continue;
+        }
+        if (!inode_allocated(fss, ino) && !inode_busy(fss, ino)) {
             break;
         }
     }
 
-    if (ino == MAX_INODES) {
+    if (i >= fss->n_inodes) {
         printf("blkfile_do_create: out of files\n");
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
-    fss->stat_cache[ino].st_alloc = True;
-    fss->stat_cache[ino].st_mode = req->mode;
-    struct process *p = proc_find(src);
-    fss->stat_cache[ino].st_uid = p->uid;
+    fss->hint = ino + 1;
+
+    // a delete that did not finish may have left blocks behind
+    struct blkfile_cont *cont = new_alloc(struct blkfile_cont);
+    cont->src = src;
+    cont->req = *req;
+    cont->req.ino = ino;
+    cont->req.uid = proc_find(src)->uid;
+
+    struct blkfile_job job;
+    memset(&job, 0, sizeof(job));
+    job.type = JOB_TRUNCATE;
+    job.ino = ino;
+    blkfile_submit(fss, &job, cont, 0, 0);
+}
+
+/* Finish a create request once the inode has been cleared.
+ */
+static void blkfile_create_done(struct file_server_state *fss, struct blkfile_job *job) {
+    struct blkfile_cont *cont = job->cont;
+    unsigned int ino = job->ino;
+
+    if (!job->ok) {
+        printf("blkfile_do_create: can't clear inode %u\n", ino);
+        blkfile_respond(&cont->req, FILE_ERROR, 0, 0, cont->src);
+        return;
+    }
+    fss->checked[ino / 8] |= 1 << (ino % 8);
+    ra_drop(fss, ino, 0, ~0U);
+
+    struct file_stat *st = stat_get(fss, ino);
+    st->st_alloc = True;
+    st->st_mode = cont->req.mode;
+    st->st_uid = cont->req.uid;
+    st->st_size = 0;
+
+    // the inode must be allocated on disk before anybody can refer to it
+    stat_update(fss, ino);
+    inode_set(fss, ino, True);
     flush_stat_cache(fss);
 
     /* Send response.
@@ -182,51 +539,65 @@ static void blkfile_do_create(struct file_server_state *fss, struct file_request
     memset(&rep, 0, sizeof(rep));
     rep.status = FILE_OK;
     rep.ino = ino;
-    sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+    sys_send(cont->src, MSG_REPLY, &rep, sizeof(rep));
 }
 
 /* Respond to a delete request.
  */
 static void blkfile_do_delete(struct file_server_state *fss, struct file_request *req, gpid_t src) {
-    if (req->ino > MAX_INODES) {
+    if (req->ino >= fss->n_inodes) {
         printf("blkfile_do_delete: invalid req->ino\n");
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
 
-    // check permission
-    if (!blkfile_write_allowed(&fss->stat_cache[req->ino], src)) {
-        printf("blkfile_do_delete: permission denied: %u\n", req->ino);
-        blkfile_respond(req, FILE_ERROR, 0, 0, src);
-        return;
-    }
-
     struct file_reply rep;
     memset(&rep, 0, sizeof(rep));
     rep.status = FILE_OK;
 
-    if (!fss->stat_cache[req->ino].st_alloc) {
+    if (!inode_allocated(fss, req->ino)) {
         // already deleted
         sys_send(src, MSG_REPLY, &rep, sizeof(rep));
-    } else {
-        // delete the file
-        fss->stat_cache[req->ino].st_alloc = False;
-        flush_stat_cache(fss);
+        return;
+    }
 
-        if (!block_setsize(fss->block_svr, req->ino, 0)) {
-            printf("blkfile_do_delete: bad size %u\n", req->ino);
-            blkfile_respond(req, FILE_ERROR, 0, 0, src);
-        }
-        sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+    // check permission
+    struct file_stat *st = stat_get(fss, req->ino);
+    if (!blkfile_write_allowed(st, src)) {
+        printf("blkfile_do_delete: permission denied: %u\n", req->ino);
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
     }
 
+    if (inode_busy(fss, req->ino)) {
+        blkfile_defer(fss, req, sizeof(*req), src);
+        return;
+    }
+
+    // delete the file
+    struct blkfile_job job;
+    memset(&job, 0, sizeof(job));
+    job.type = JOB_TRUNCATE;
+    job.ino = req->ino;
+    job.file_size = st->st_size;
+    st->st_alloc = False;
+    st->st_size = 0;
+    stat_update(fss, req->ino);
+    inode_set(fss, req->ino, False);
+    flush_stat_cache(fss);
+
+    ra_drop(fss, req->ino, 0, ~0U);
+    struct blkfile_cont *cont = new_alloc(struct blkfile_cont);
+    cont->src = src;
+    cont->req = *req;
+    blkfile_submit(fss, &job, cont, 0, 0);
 }
 
 /* Respond to a chown request.
  */
 static void blkfile_do_chown(struct file_server_state *fss, struct file_request *req, gpid_t src) {
     unsigned int ino = req->ino;
-    if (ino >= MAX_INODES || !fss->stat_cache[ino].st_alloc) {
+    if (!inode_allocated(fss, ino)) {
         printf("blkfile_do_chown: bad inode: %u\n", req->ino); 
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
@@ -238,8 +609,8 @@ static void blkfile_do_chown(struct file_server_state *fss, struct file_request
         return;
     }
 
-    fss->stat_cache[ino].st_uid = req->uid;
-    flush_stat_cache(fss);
+    stat_get(fss, ino)->st_uid = req->uid;
+    stat_update(fss, ino);
 
     /* Send response.
      */
@@ -253,20 +624,21 @@ static void blkfile_do_chown(struct file_server_state *fss, struct file_request
  */
 static void blkfile_do_chmod(struct file_server_state *fss, struct file_request *req, gpid_t src) {
     unsigned int ino = req->ino;
-    if (ino >= MAX_INODES || !fss->stat_cache[ino].st_alloc) {
+    if (!inode_allocated(fss, ino)) {
         printf("blkfile_do_chmod: bad inode: %u\n", req->ino); 
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
+    struct file_stat *st = stat_get(fss, ino);
     struct process *p = proc_find(src);
-    if (p->uid != 0 && p->uid != fss->stat_cache[ino].st_uid) {
+    if (p->uid != 0 && p->uid != st->st_uid) {
         printf("blkfile_do_chmod: permission denied for uid %u\n", p->uid); 
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
 
-    fss->stat_cache[ino].st_mode = req->mode;
-    flush_stat_cache(fss);
+    st->st_mode = req->mode;
+    stat_update(fss, ino);
 
     /* Send response.
      */
@@ -277,11 +649,223 @@ static void blkfile_do_chmod(struct file_server_state *fss, struct file_request
 }
 
 
-/* Respond to a read request.
+/* Sequential reads are detected per inode, and the blocks that follow
+ * are read ahead into a cache, so that the next read finds them there.
+ * A read that misses reads ahead in the same job, a read that hits sends
+ * a job of its own.  The window starts at the size of the read, at least
+ * RA_MIN_WINDOW blocks, and doubles up to RA_MAX_WINDOW as long as the
+ * reads stay sequential.  Writes, truncation and deletion drop the blocks
+ * of the file from the cache.  As no job for a file is sent while another
+ * one is out, jobs never bring stale blocks.
+ */
+static struct ra_entry *ra_set(struct file_server_state *fss, unsigned int ino, unsigned int b) {
+    return &fss->ra_entries[((ino * 31 + b) % RA_NSETS) * RA_NWAYS];
+}
+
+static struct ra_entry *ra_lookup(struct file_server_state *fss, unsigned int ino, unsigned int b) {
+    struct ra_entry *re = ra_set(fss, ino, b);
+    unsigned int w;
+
+    for (w = 0; w < RA_NWAYS; w++, re++) {
+        if (re->valid && re->ino == ino && re->bno == b) {
+            re->last_use = ++fss->ra_time;
+            return re;
+        }
+    }
+    return 0;
+}
+
+/* Put n blocks read by a job into the cache, each in a free way of its
+ * set or else in the one used least recently.
+ */
+static void ra_insert(struct file_server_state *fss, unsigned int ino, unsigned int b,
+                            unsigned int n, const char *blocks, const unsigned char *holes) {
+    unsigned int i, w;
+
+    for (i = 0; i < n; i++) {
+        struct ra_entry *set = ra_set(fss, ino, b + i), *re = set;
+        for (w = 0; w < RA_NWAYS; w++) {
+            if (set[w].valid && set[w].ino == ino && set[w].bno == b + i) {
+                break;
+            }
+        }
+        if (w < RA_NWAYS) {
+            re = &set[w];
+        }
+        else {
+            for (w = 0; w < RA_NWAYS; w++) {
+                if (!set[w].valid) {
+                    re = &set[w];
+                    break;
+                }
+                if (set[w].last_use < re->last_use) {
+                    re = &set[w];
+                }
+            }
+        }
+        unsigned int slot = re - fss->ra_entries;
+        re->valid = True;
+        re->last_use = ++fss->ra_time;
+        re->hole = (holes[i / 8] & (1 << (i % 8))) != 0;
+        re->ino = ino;
+        re->bno = b + i;
+        memcpy(fss->ra_blocks[slot], &blocks[i * BLOCK_SIZE], BLOCK_SIZE);
+    }
+}
+
+/* Drop blocks [b, b + n) of a file from the cache.
+ */
+static void ra_drop(struct file_server_state *fss, unsigned int ino, unsigned int b, unsigned int n) {
+    unsigned int i;
+
+    for (i = 0; i < RA_NBLOCKS; i++) {
+        struct ra_entry *re = &fss->ra_entries[i];
+        if (re->valid && re->ino == ino && re->bno >= b && re->bno - b < n) {
+            re->valid = False;
+        }
+    }
+}
+
+/* Find the stream of reads of the given inode, and see if a read at the
+ * given offset continues it.  A read from the start of a file starts one.
+ */
+static struct ra_stream *ra_stream(struct file_server_state *fss, unsigned int ino,
+                                        unsigned long offset, unsigned int nblock) {
+    struct ra_stream *rs;
+    unsigned int i, start = nblock < RA_MIN_WINDOW ? RA_MIN_WINDOW : nblock;
+
+    for (i = 0; i < RA_NSTREAMS; i++) {
+        rs = &fss->ra_streams[i];
+        if (rs->used && rs->ino == ino) {
+            if (offset == rs->next) {
+                rs->window = rs->window * 2 < start ? start : rs->window * 2;
+            }
+            else {
+                rs->window = offset == 0 ? start : 0;
+                rs->ra_next = 0;
+            }
+            if (rs->window > RA_MAX_WINDOW) {
+                rs->window = RA_MAX_WINDOW;
+            }
+            return rs;
+        }
+    }
+    rs = &fss->ra_streams[fss->ra_clock++ % RA_NSTREAMS];
+    rs->used = True;
+    rs->ino = ino;
+    rs->window = offset == 0 ? start : 0;
+    if (rs->window > RA_MAX_WINDOW) {
+        rs->window = RA_MAX_WINDOW;
+    }
+    rs->ra_next = 0;
+    return rs;
+}
+
+/* Read ahead for a stream, skipping blocks that are in the cache already.
+ * Nothing is read if a job for the file is out.
+ */
+static void blkfile_readahead(struct file_server_state *fss, struct ra_stream *rs) {
+    unsigned int b;
+
+    if (rs->window == 0 || inode_busy(fss, rs->ino)) {
+        return;
+    }
+    for (b = rs->ra_next; b < rs->ra_end && ra_lookup(fss, rs->ino, b) != 0; b++)
+        ;
+    rs->ra_next = rs->ra_end;
+    if (b < rs->ra_end) {
+        struct blkfile_cont *cont = new_alloc(struct blkfile_cont);
+        cont->req.type = FILE_READ;
+
+        struct blkfile_job job;
+        memset(&job, 0, sizeof(job));
+        job.type = JOB_READ;
+        job.ino = rs->ino;
+        job.offset = b;
+        job.size = rs->ra_end - b;
+        blkfile_submit(fss, &job, cont, 0, 0);
+    }
+}
+
+/* Read n blocks of a file starting at block b into addr, and set a bit in
+ * holes for each block that is a hole.  The requests for them are all
+ * sent to the block server at once.
+ */
+static bool_t blkfile_read_blocks(gpid_t svr, unsigned int ino, unsigned int b,
+                            unsigned int n, char *addr, unsigned char *holes) {
+    unsigned int nchunks = (n + BLOCK_MAX_NBLOCK - 1) / BLOCK_MAX_NBLOCK;
+    unsigned int repsize = sizeof(struct block_reply) + BLOCK_MAX_NBLOCK * BLOCK_SIZE;
+    struct rpc_call *calls = calloc(nchunks, sizeof(*calls));
+    struct block_request *reqs = calloc(nchunks, sizeof(*reqs));
+    char *replies = malloc(nchunks * repsize);
+    unsigned int c, i;
+    bool_t result = True;
+
+    for (c = 0; c < nchunks; c++) {
+        unsigned int nb = n - c * BLOCK_MAX_NBLOCK;
+        reqs[c].type = BLOCK_READ;
+        reqs[c].ino = ino;
+        reqs[c].offset_nblock = b + c * BLOCK_MAX_NBLOCK;
+        reqs[c].nblock = nb < BLOCK_MAX_NBLOCK ? nb : BLOCK_MAX_NBLOCK;
+        calls[c].pid = svr;
+        calls[c].request = &reqs[c];
+        calls[c].reqsize = sizeof(reqs[c]);
+        calls[c].reply = &replies[c * repsize];
+        calls[c].repsize = sizeof(struct block_reply) + reqs[c].nblock * BLOCK_SIZE;
+    }
+    (void) sys_rpc_multi(calls, nchunks);
+
+    memset(holes, 0, (n + 7) / 8);
+    for (c = 0; c < nchunks && result; c++) {
+        struct block_reply *rep = calls[c].reply;
+        if (calls[c].result < (int) sizeof(*rep) || rep->status != BLOCK_OK ||
+                !block_unpack(rep, calls[c].result, reqs[c].nblock,
+                                &addr[c * BLOCK_MAX_NBLOCK * BLOCK_SIZE])) {
+            result = False;
+        }
+        for (i = 0; i < reqs[c].nblock; i++) {
+            if (rep->holes & (1 << i)) {
+                unsigned int k = c * BLOCK_MAX_NBLOCK + i;
+                holes[k / 8] |= 1 << (k % 8);
+            }
+        }
+    }
+    free(calls);
+    free(reqs);
+    free(replies);
+    return result;
+}
+
+/* Send the reply to a read of n bytes at the given offset.  contents holds
+ * the blocks the data is in, of which the first ndata hold data and the
+ * rest are holes, which are left for the client to fill in.
+ */
+static void blkfile_read_reply(gpid_t src, unsigned long offset, unsigned int n,
+                                        const char *contents, unsigned int ndata) {
+    struct file_reply *rep = new_alloc_ext(struct file_reply, n);
+    unsigned int skip = offset % BLOCK_SIZE;
+    unsigned int nsend = ndata * BLOCK_SIZE <= skip ? 0 : ndata * BLOCK_SIZE - skip;
+
+    if (nsend > n) {
+        nsend = n;
+    }
+    if (nsend > 0) {
+        memcpy(&rep[1], &contents[skip], nsend);
+    }
+    rep->status = FILE_OK;
+	rep->op = FILE_READ;
+    rep->stat.st_size = n;
+    rep->nzero = n - nsend;
+    sys_send(src, MSG_REPLY, rep, sizeof(*rep) + nsend);
+    free(rep);
+}
+
+/* Respond to a read request.  It is answered right away if all the blocks
+ * are in the cache, and otherwise the worker reads them.
  */
 static void blkfile_do_read(struct file_server_state *fss, struct file_request *req, gpid_t src){
 
-    if (req->ino >= MAX_INODES || !fss->stat_cache[req->ino].st_alloc) {
+    if (!inode_allocated(fss, req->ino)) {
         if (req->size == 0 && req->ino == 1) {
             // initializing dir server for new disk
             // print nothing
@@ -292,121 +876,178 @@ static void blkfile_do_read(struct file_server_state *fss, struct file_request *
         return;
     }
     // check permission
-    if (!blkfile_read_allowed(&fss->stat_cache[req->ino], src)) {
-        printf("blkfile_do_read: permission denied: %u, %u\n", req->ino, fss->stat_cache[req->ino].st_mode);
+    struct file_stat *st = stat_get(fss, req->ino);
+    if (!blkfile_read_allowed(st, src)) {
+        printf("blkfile_do_read: permission denied: %u, %u\n", req->ino, st->st_mode);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
 
-    /* Allocate room for the reply.
-     */
-    struct file_reply *rep = new_alloc_ext(struct file_reply, req->size);
-    char *contents = NULL;
-
-    if (req->size == 0) {
-        // the request is just checking whether the file exists
-        rep->status = FILE_OK;
-		rep->op = FILE_READ;
-        rep->stat.st_size = 0;
-        sys_send(src, MSG_REPLY, rep, sizeof(*rep));
+    if (req->size > FILE_MAX_XFER) {
+        req->size = FILE_MAX_XFER;
+    }
+    if (req->size == 0 || req->offset >= st->st_size) {
+        // checking whether the file exists, or reading at the end
+        blkfile_read_reply(src, req->offset, 0, 0, 0);
+        return;
+    }
 
-        free(rep);
+    unsigned long file_size = st->st_size;
+    unsigned int n = file_size - req->offset;
+    if (n > req->size) {
+        n = req->size;
+    }
+    unsigned int start_block_no = req->offset / BLOCK_SIZE;
+    unsigned int end_block_no = (req->offset + n - 1) / BLOCK_SIZE;
+    unsigned int psize_nblock = end_block_no - start_block_no + 1;
+
+    // see if all the blocks are cached
+    unsigned int i;
+    for (i = 0; i < psize_nblock && ra_lookup(fss, req->ino, start_block_no + i) != 0; i++)
+        ;
+    if (i < psize_nblock && inode_busy(fss, req->ino)) {
+        blkfile_defer(fss, req, sizeof(*req), src);
         return;
     }
 
-    unsigned int n;
-    if (req->offset < fss->stat_cache[req->ino].st_size) {
-        n = fss->stat_cache[req->ino].st_size - req->offset;
-        if (n > req->size) {
-            n = req->size;
+    // see how far to read ahead
+    struct ra_stream *rs = ra_stream(fss, req->ino, req->offset, psize_nblock);
+    rs->next = req->offset + n;
+    rs->ra_end = 0;
+    if (rs->window > 0) {
+        unsigned int file_nblock = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (rs->ra_next <= end_block_no) {
+            rs->ra_next = end_block_no + 1;
         }
-
-        // Read file parameters
-		// TODO  is this reading one more block than necessary?
-        unsigned int start_block_no = req->offset / BLOCK_SIZE;
-        unsigned int end_block_no = (req->offset + n) / BLOCK_SIZE;
-        unsigned int psize_nblock = end_block_no - start_block_no + 1;
-
-        // Call block server
-        contents = malloc(psize_nblock * BLOCK_SIZE);
-        if (!multiblock_read(fss->block_svr, req->ino, start_block_no, contents, &psize_nblock) 
-          || psize_nblock != end_block_no - start_block_no + 1) {
-            free(contents);
-            free(rep);
-            printf("blkfile_do_read: block server read error: %d %d\n", psize_nblock, end_block_no - start_block_no + 1);
-            blkfile_respond(req, FILE_ERROR, 0, 0, src);
-            return;
+        rs->ra_end = end_block_no + 1 + rs->window;
+        if (rs->ra_end > file_nblock) {
+            rs->ra_end = file_nblock;
         }
-
-        memcpy(&rep[1], &contents[req->offset % BLOCK_SIZE], n);
     }
-    else {
-        n = 0;
+
+    // answer from the cache, and find the last block that is not a hole
+    if (i == psize_nblock) {
+        char *contents = malloc(psize_nblock * BLOCK_SIZE);
+        unsigned int ndata = 0;
+        for (i = 0; i < psize_nblock; i++) {
+            struct ra_entry *re = ra_lookup(fss, req->ino, start_block_no + i);
+            memcpy(&contents[i * BLOCK_SIZE], fss->ra_blocks[re - fss->ra_entries], BLOCK_SIZE);
+            if (!re->hole) {
+                ndata = i + 1;
+            }
+        }
+        blkfile_read_reply(src, req->offset, n, contents, ndata);
+        free(contents);
+        blkfile_readahead(fss, rs);
+        return;
     }
 
-    rep->status = FILE_OK;
-	rep->op = FILE_READ;
-    rep->stat.st_size = n;
-    sys_send(src, MSG_REPLY, rep, sizeof(*rep) + n);
+    // read the blocks, and those to read ahead along with them
+    struct blkfile_job job;
+    memset(&job, 0, sizeof(job));
+    job.type = JOB_READ;
+    job.ino = req->ino;
+    job.offset = start_block_no;
+    job.size = psize_nblock;
+    if (rs->ra_end > end_block_no + 1) {
+        job.size = rs->ra_end - start_block_no;
+        rs->ra_next = rs->ra_end;
+    }
 
-    free(rep);
-    if (contents != NULL)
-        free(contents);
+    struct blkfile_cont *cont = new_alloc(struct blkfile_cont);
+    cont->src = src;
+    cont->req = *req;
+    cont->n = n;
+    blkfile_submit(fss, &job, cont, 0, 0);
 }
 
-static int blkfile_put(struct file_server_state *fss, unsigned int ino, unsigned long offset, void* data, unsigned int size) {
+/* Finish a read once its blocks are in.
+ */
+static void blkfile_read_done(struct file_server_state *fss, struct blkfile_job *job) {
+    struct blkfile_cont *cont = job->cont;
+    const char *contents = (char *) &job[1];
+
+    if (!job->ok) {
+        if (cont->src != 0) {
+            printf("blkfile_do_read: block server read error: %u\n", job->ino);
+            blkfile_respond(&cont->req, FILE_ERROR, 0, 0, cont->src);
+        }
+        return;
+    }
+    ra_insert(fss, job->ino, job->offset, job->size, contents, job->holes);
+    if (cont->src == 0) {
+        return;
+    }
+
+    unsigned int psize_nblock = (cont->req.offset + cont->n - 1) / BLOCK_SIZE - job->offset + 1;
+    unsigned int i, ndata = 0;
+    for (i = 0; i < psize_nblock; i++) {
+        if (!(job->holes[i / 8] & (1 << (i % 8)))) {
+            ndata = i + 1;
+        }
+    }
+    blkfile_read_reply(cont->src, cont->req.offset, cont->n, contents, ndata);
+}
 
-    // Get file size and nblock
-    unsigned long file_size = fss->stat_cache[ino].st_size;
+/* See if block b has to be read before writing 'size' bytes at 'offset',
+ * which is the case if the write does not cover all of the file's data
+ * in the block.  Beyond the end of the file the block holds zeroes.
+ */
+static bool_t blkfile_partial(unsigned long file_size, unsigned long b,
+										unsigned long offset, unsigned int size){
+    unsigned long lo = b * BLOCK_SIZE, hi = (b + 1) * BLOCK_SIZE;
 
-    // File read parameter
-    unsigned long start_block_no = offset / BLOCK_SIZE;
-    unsigned long final_size;
-    unsigned long end_block_no;
-    unsigned int psize_nblock; // how many to read from file
-
-    if (offset + size > file_size) {
-        final_size = offset + size;
-        end_block_no = final_size / BLOCK_SIZE;
-        psize_nblock = (file_size / BLOCK_SIZE) - start_block_no + 1;
-    } else {
-        final_size = file_size;
-        end_block_no = (offset + size) / BLOCK_SIZE;
-        psize_nblock = end_block_no - start_block_no + 1;
+    if (hi > file_size) {
+        hi = file_size;
     }
+    return lo < hi && (offset > lo || offset + size < hi);
+}
 
-    // Get file content
-    char *contents = malloc((end_block_no - start_block_no + 1) * BLOCK_SIZE);
-    memset(contents, 0, (end_block_no - start_block_no + 1) * BLOCK_SIZE);
+/* Write 'size' bytes at 'offset' in a file of file_size bytes.
+ */
+static int blkfile_put(gpid_t svr, unsigned int ino, unsigned long offset, void* data,
+                                    unsigned int size, unsigned long file_size) {
+    if (size == 0) {
+        return 0;
+    }
 
-    if (start_block_no > file_size / BLOCK_SIZE) {
-        // Write directly to block server
-        memcpy(&contents[offset % BLOCK_SIZE], data, size);
-        if (!multiblock_write(fss->block_svr, ino, start_block_no, contents, end_block_no - start_block_no + 1)) {
+    // Blocks to write.  Only the first and the last may be partial
+    unsigned long start_block_no = offset / BLOCK_SIZE;
+    unsigned long end_block_no = (offset + size - 1) / BLOCK_SIZE;
+    unsigned long nblocks = end_block_no - start_block_no + 1;
+    char *contents = malloc(nblocks * BLOCK_SIZE);
+
+    // Read the partial blocks that hold data of the file.  Blocks that
+    // are written in full, or past the end of the file, are not read
+    if (blkfile_partial(file_size, start_block_no, offset, size)) {
+        if (!block_read(svr, ino, start_block_no, contents)) {
             free(contents);
             return -1;
         }
-    } else {
-        // Read file first
-        if (file_size != 0 && 
-            (!multiblock_read(fss->block_svr, ino, start_block_no, contents, &psize_nblock))) {
-            free(contents);
-            return -1;
+    }
+    else {
+        memset(contents, 0, BLOCK_SIZE);
+    }
+    if (nblocks > 1) {
+        char *last = &contents[(nblocks - 1) * BLOCK_SIZE];
+        if (blkfile_partial(file_size, end_block_no, offset, size)) {
+            if (!block_read(svr, ino, end_block_no, last)) {
+                free(contents);
+                return -1;
+            }
         }
-
-        // Modify file content
-        memcpy(&contents[offset % BLOCK_SIZE], data, size);
-
-        // Write back to block store
-        if (!multiblock_write(fss->block_svr, ino, start_block_no, contents, end_block_no - start_block_no + 1)) {
-            free(contents);
-            return -1;
+        else {
+            memset(last, 0, BLOCK_SIZE);
         }
     }
 
+    // Modify file content and write it
+    memcpy(&contents[offset % BLOCK_SIZE], data, size);
+    if (!multiblock_write(svr, ino, start_block_no, contents, nblocks)) {
+        free(contents);
+        return -1;
+    }
     free(contents);
-    fss->stat_cache[ino].st_size = final_size;
-    flush_stat_cache(fss);
     return 0;
 }
 
@@ -416,7 +1057,7 @@ static void blkfile_do_write(struct file_server_state *fss, struct file_request
     // req->ino
     // req->offset
     // req->size
-    if (req->ino >= MAX_INODES || !fss->stat_cache[req->ino].st_alloc) {
+    if (!inode_allocated(fss, req->ino)) {
         printf("blkfile_do_write: bad inode %u\n", req->ino);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
@@ -429,30 +1070,73 @@ static void blkfile_do_write(struct file_server_state *fss, struct file_request
     }
 
     // check permission
-    if (!blkfile_write_allowed(&fss->stat_cache[req->ino], src)) {
+    if (!blkfile_write_allowed(stat_get(fss, req->ino), src)) {
         printf("blkfile_do_write: permission denied: %u\n", req->ino);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
 
-    if (blkfile_put(fss, req->ino, req->offset, data, size) == 0) {
-        blkfile_respond(req, FILE_OK, 0, 0, src);
-    } else {
-        printf("blkfile_do_write: write error, offset: %lu, size: %u\n", req->offset, req->size);
+    if (inode_busy(fss, req->ino)) {
+        blkfile_defer(fss, req, sizeof(*req) + size, src);
+        return;
+    }
+
+    if (!blkfile_check(fss, req->ino)) {
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+
+    if (size == 0) {
+        blkfile_respond(req, FILE_OK, 0, 0, src);
+        return;
     }
+
+    // the size changes once the data has been written
+    struct blkfile_job job;
+    memset(&job, 0, sizeof(job));
+    job.type = JOB_WRITE;
+    job.ino = req->ino;
+    job.offset = req->offset;
+    job.size = size;
+    job.file_size = stat_get(fss, req->ino)->st_size;
+    ra_drop(fss, req->ino, req->offset / BLOCK_SIZE,
+                (req->offset + size - 1) / BLOCK_SIZE - req->offset / BLOCK_SIZE + 1);
+
+    struct blkfile_cont *cont = new_alloc(struct blkfile_cont);
+    cont->src = src;
+    cont->req = *req;
+    blkfile_submit(fss, &job, cont, data, size);
+}
+
+/* Finish a write once the data has been written.
+ */
+static void blkfile_write_done(struct file_server_state *fss, struct blkfile_job *job) {
+    struct blkfile_cont *cont = job->cont;
+
+    if (!job->ok) {
+        printf("blkfile_do_write: write error, offset: %lu, size: %u\n", cont->req.offset, cont->req.size);
+        blkfile_respond(&cont->req, FILE_ERROR, 0, 0, cont->src);
+        return;
+    }
+    struct file_stat *st = stat_get(fss, job->ino);
+    if (job->offset + job->size > st->st_size) {
+        st->st_size = job->offset + job->size;
+        stat_update(fss, job->ino);
+    }
+    blkfile_respond(&cont->req, FILE_OK, 0, 0, cont->src);
 }
 
 /* Respond to a stat request.
  */
 static void blkfile_do_stat(struct file_server_state *fss, struct file_request *req, gpid_t src){
-    if (req->ino >= MAX_INODES || !fss->stat_cache[req->ino].st_alloc) {
+    if (!inode_allocated(fss, req->ino)) {
         printf("blkfile_do_stat: bad inode %u\n", req->ino);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
     // check permission
-    if (!blkfile_read_allowed(&fss->stat_cache[req->ino], src)) {
+    struct file_stat *st = stat_get(fss, req->ino);
+    if (!blkfile_read_allowed(st, src)) {
         // printf("blkfile_do_stat: permission denied: %u\n", req->ino);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
@@ -464,41 +1148,379 @@ static void blkfile_do_stat(struct file_server_state *fss, struct file_request *
     memset(&rep, 0, sizeof(rep));
     rep.status = FILE_OK;
 	rep.op = FILE_STAT;
-    rep.stat = fss->stat_cache[req->ino];
+    rep.stat = *st;
     sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 }
 
+/* Cut the data of a file from old_size bytes down to size bytes.  The
+ * file system below can only truncate to nothing, so otherwise the blocks
+ * that were cut off are discarded, which leaves them zero, and so is the
+ * tail of the new last block, as blkfile_put relies on that.  The tail is
+ * cleared whatever old_size is, as after a crash it may hold data written
+ * beyond a size that never made it to disk.
+ */
+static bool_t blkfile_truncate(gpid_t svr, unsigned int ino,
+										unsigned long size, unsigned long old_size){
+    unsigned int final_nblock = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int old_nblock = (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    if (final_nblock == 0) {
+        if (!block_setsize(svr, ino, 0)) {
+            printf("blkfile_truncate: bad size %u\n", ino);
+            return False;
+        }
+        return True;
+    }
+    if (final_nblock < old_nblock) {
+        if (!block_discard(svr, ino, final_nblock, old_nblock - final_nblock)) {
+            printf("blkfile_truncate: can't discard %u\n", ino);
+            return False;
+        }
+    }
+
+    unsigned int tail = size % BLOCK_SIZE;
+    if (tail != 0) {
+        char block[BLOCK_SIZE];
+        unsigned int i;
+        if (!block_read(svr, ino, final_nblock - 1, block)) {
+            printf("blkfile_truncate: can't read last block %u\n", ino);
+            return False;
+        }
+        for (i = tail; i < BLOCK_SIZE && block[i] == 0; i++)
+            ;
+        if (i == BLOCK_SIZE) {
+            return True;
+        }
+        memset(&block[tail], 0, BLOCK_SIZE - tail);
+        if (!block_write(svr, ino, final_nblock - 1, block)) {
+            printf("blkfile_truncate: can't write last block %u\n", ino);
+            return False;
+        }
+    }
+    return True;
+}
+
 /* Respond to a setsize request.
  */
 static void blkfile_do_setsize(struct file_server_state *fss, struct file_request *req, gpid_t src){
-    if (req->ino >= MAX_INODES || !fss->stat_cache[req->ino].st_alloc) {
+    if (!inode_allocated(fss, req->ino)) {
         printf("blkfile_do_setsize: bad inode %u\n", req->ino);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
 
-    if (req->offset > fss->stat_cache[req->ino].st_size) {
+    struct file_stat *st = stat_get(fss, req->ino);
+    if (req->offset > st->st_size) {
         printf("blkfile_do_setsize: bad size %u\n", req->ino);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
 
     // check permission
-    if (!blkfile_write_allowed(&fss->stat_cache[req->ino], src)) {
+    if (!blkfile_write_allowed(st, src)) {
         printf("blkfile_do_setsize: permission denied: %u\n", req->ino);
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
         return;
     }
 
-    // call block server set size
-    unsigned int final_nblock = (req->offset == 0? 0 : 1 + (req->offset / BLOCK_SIZE));
-    if (!block_setsize(fss->block_svr, req->ino, final_nblock)) {
-        printf("blkfile_do_setsize: bad size %u\n", req->ino);
+    if (inode_busy(fss, req->ino)) {
+        blkfile_defer(fss, req, sizeof(*req), src);
+        return;
+    }
+
+    if (!blkfile_check(fss, req->ino)) {
         blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+
+    // nothing to cut off
+    st = stat_get(fss, req->ino);
+    unsigned long old_size = st->st_size;
+    if (req->offset == old_size) {
+        blkfile_respond(req, FILE_OK, 0, 0, src);
+        return;
+    }
+
+    // the smaller size goes to disk before the data is cut off
+    st->st_size = req->offset;
+    stat_update(fss, req->ino);
+    flush_stat_cache(fss);
+
+    struct blkfile_job job;
+    memset(&job, 0, sizeof(job));
+    job.type = JOB_TRUNCATE;
+    job.ino = req->ino;
+    job.file_size = old_size;
+    job.new_size = req->offset;
+    ra_drop(fss, req->ino, req->offset / BLOCK_SIZE, ~0U);
+
+    struct blkfile_cont *cont = new_alloc(struct blkfile_cont);
+    cont->src = src;
+    cont->req = *req;
+    blkfile_submit(fss, &job, cont, 0, 0);
+}
+
+/* Copy 'size' bytes from src_offset in file src_ino to offset in file ino
+ * by reading and writing them, FILE_MAX_XFER bytes at a time, in buf.
+ * *pfile_size is the size of file ino, and grows along with the copy.
+ */
+static bool_t blkfile_copy_bytes(gpid_t svr, unsigned int ino, unsigned long offset,
+                    unsigned int src_ino, unsigned long src_offset, unsigned long size,
+                    unsigned long *pfile_size, char *buf) {
+    unsigned char holes[(FILE_MAX_XFER / BLOCK_SIZE + 8) / 8];
+
+    while (size > 0) {
+        unsigned int n = size < FILE_MAX_XFER ? size : FILE_MAX_XFER;
+        unsigned int skip = src_offset % BLOCK_SIZE;
+        if (!blkfile_read_blocks(svr, src_ino, src_offset / BLOCK_SIZE,
+                            (skip + n - 1) / BLOCK_SIZE + 1, buf, holes) ||
+                blkfile_put(svr, ino, offset, &buf[skip], n, *pfile_size) < 0) {
+            return False;
+        }
+        if (offset + n > *pfile_size) {
+            *pfile_size = offset + n;
+        }
+        offset += n;
+        src_offset += n;
+        size -= n;
+    }
+    return True;
+}
+
+/* Copy between two files of this server.  If the offsets are aligned
+ * alike, the blocks that are copied in full are copied by the block
+ * server, which shares them rather than moving the data, and only the
+ * partial blocks at either end are read and written.
+ */
+static bool_t blkfile_copy(gpid_t svr, struct blkfile_job *job) {
+    unsigned long offset = job->offset, src_offset = job->src_offset, size = job->size;
+    char *buf = (char *) &job[1];
+
+    if (offset % BLOCK_SIZE == src_offset % BLOCK_SIZE) {
+        unsigned long head = (BLOCK_SIZE - offset % BLOCK_SIZE) % BLOCK_SIZE;
+        if (head > size) {
+            head = size;
+        }
+        if (!blkfile_copy_bytes(svr, job->ino, offset, job->src_ino, src_offset,
+                                            head, &job->file_size, buf)) {
+            return False;
+        }
+        offset += head;
+        src_offset += head;
+        size -= head;
+
+        unsigned long nblock = size / BLOCK_SIZE;
+        if (nblock > 0) {
+            if (!block_copy(svr, job->ino, offset / BLOCK_SIZE,
+                                job->src_ino, src_offset / BLOCK_SIZE, nblock)) {
+                return False;
+            }
+            offset += nblock * BLOCK_SIZE;
+            src_offset += nblock * BLOCK_SIZE;
+            size -= nblock * BLOCK_SIZE;
+            if (offset > job->file_size) {
+                job->file_size = offset;
+            }
+        }
+    }
+    return blkfile_copy_bytes(svr, job->ino, offset, job->src_ino, src_offset,
+                                            size, &job->file_size, buf);
+}
+
+/* Copy from a file of another server, which is read with the permissions
+ * of the client, up to the end of that file.
+ */
+static bool_t blkfile_pull(gpid_t svr, struct blkfile_job *job) {
+    char *buf = (char *) &job[1];
+    unsigned long done = 0;
+    bool_t ok = True;
+
+    struct file_stat stat;
+    if (!file_stat(job->src_server, job->src_ino, &stat) || !stat.st_alloc ||
+                                        !blkfile_may_read(&stat, job->uid)) {
+        printf("blkfile_do_copy: can't copy from %u:%u\n", job->src_server, job->src_ino);
+        job->size = 0;
+        return False;
+    }
+    while (done < job->size) {
+        unsigned int want = job->size - done < FILE_MAX_XFER ? job->size - done : FILE_MAX_XFER;
+        unsigned int got = want;
+        if (!file_read(job->src_server, job->src_ino, job->src_offset + done, buf, &got) ||
+                blkfile_put(svr, job->ino, job->offset + done, buf, got, job->file_size) < 0) {
+            ok = False;
+            break;
+        }
+        if (got > 0 && job->offset + done + got > job->file_size) {
+            job->file_size = job->offset + done + got;
+        }
+        done += got;
+        if (got < want) {
+            break;
+        }
+    }
+    job->size = done;
+    return ok;
+}
+
+/* Respond to a copy request.  Both files are busy while a worker copies
+ * between files of this server.  A file of the ram file server, the only
+ * other one accepted, is read by the worker for such copies, so that the
+ * server itself never waits for it.
+ */
+static void blkfile_do_copy(struct file_server_state *fss, struct file_request *req, void *data, unsigned int size, gpid_t src){
+    struct file_copy_source *cs = data;
+
+    if (!inode_allocated(fss, req->ino)) {
+        printf("blkfile_do_copy: bad inode %u\n", req->ino);
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+    if (size < sizeof(*cs)) {
+        printf("blkfile_do_copy: no source\n");
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+
+    // check permission
+    if (!blkfile_write_allowed(stat_get(fss, req->ino), src)) {
+        printf("blkfile_do_copy: permission denied: %u\n", req->ino);
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+
+    // within the server the amount to copy is known now
+    bool_t local = cs->server == sys_getpid();
+    if (!local && (cs->server == 0 || cs->server != blkfile_ramfile)) {
+        printf("blkfile_do_copy: can't copy from server %u\n", cs->server);
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+    unsigned long n = req->size;
+    if (local) {
+        if (!inode_allocated(fss, cs->ino) || cs->ino == req->ino ||
+                            !blkfile_read_allowed(stat_get(fss, cs->ino), src)) {
+            printf("blkfile_do_copy: can't copy from %u\n", cs->ino);
+            blkfile_respond(req, FILE_ERROR, 0, 0, src);
+            return;
+        }
+        struct file_stat *st = stat_get(fss, cs->ino);
+        n = cs->offset < st->st_size ? st->st_size - cs->offset : 0;
+        if (n > req->size) {
+            n = req->size;
+        }
+    }
+
+    if (inode_busy(fss, req->ino) || (local && inode_busy(fss, cs->ino))) {
+        blkfile_defer(fss, req, sizeof(*req) + sizeof(*cs), src);
+        return;
+    }
+
+    if (!blkfile_check(fss, req->ino)) {
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
+
+    if (n == 0) {
+        struct file_reply rep;
+        memset(&rep, 0, sizeof(rep));
+        rep.status = FILE_OK;
+        rep.op = FILE_COPY;
+        sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+        return;
+    }
+
+    // the size changes once the data has been copied
+    struct blkfile_job job;
+    memset(&job, 0, sizeof(job));
+    job.type = JOB_COPY;
+    job.ino = req->ino;
+    job.offset = req->offset;
+    job.size = n;
+    job.file_size = stat_get(fss, req->ino)->st_size;
+    job.src_server = cs->server;
+    job.src_ino = cs->ino;
+    job.src_offset = cs->offset;
+    job.uid = proc_find(src)->uid;
+    ra_drop(fss, req->ino, req->offset / BLOCK_SIZE,
+                (req->offset + n - 1) / BLOCK_SIZE - req->offset / BLOCK_SIZE + 1);
+    if (local) {
+        fss->busy[cs->ino / 8] |= 1 << (cs->ino % 8);
+    }
+
+    struct blkfile_cont *cont = new_alloc(struct blkfile_cont);
+    cont->src = src;
+    cont->req = *req;
+    blkfile_submit(fss, &job, cont, 0, 0);
+}
+
+/* Finish a copy.  The size covers whatever was copied, even if the copy
+ * did not complete, as data beyond the size has to be zero.
+ */
+static void blkfile_copy_done(struct file_server_state *fss, struct blkfile_job *job) {
+    struct blkfile_cont *cont = job->cont;
+
+    if (job->src_server == sys_getpid()) {
+        fss->busy[job->src_ino / 8] &= ~(1 << (job->src_ino % 8));
+    }
+    struct file_stat *st = stat_get(fss, job->ino);
+    if (job->file_size > st->st_size) {
+        st->st_size = job->file_size;
+        stat_update(fss, job->ino);
+    }
+    if (!job->ok) {
+        printf("blkfile_do_copy: copy error, offset: %lu, size: %u\n", cont->req.offset, cont->req.size);
+        blkfile_respond(&cont->req, FILE_ERROR, 0, 0, cont->src);
+        return;
+    }
+
+    struct file_reply rep;
+    memset(&rep, 0, sizeof(rep));
+    rep.status = FILE_OK;
+    rep.op = FILE_COPY;
+    rep.stat.st_size = job->size;
+    sys_send(cont->src, MSG_REPLY, &rep, sizeof(rep));
+}
+
+/* Finish a request once its job is back.
+ */
+static void blkfile_job_done(struct file_server_state *fss, struct blkfile_job *job, unsigned int size) {
+    struct blkfile_cont *cont = job->cont;
+
+    assert(size >= sizeof(*job));
+    fss->busy[job->ino / 8] &= ~(1 << (job->ino % 8));
+    switch (cont->req.type) {
+    case FILE_CREATE:
+        blkfile_create_done(fss, job);
+        break;
+    case FILE_READ:
+        blkfile_read_done(fss, job);
+        break;
+    case FILE_WRITE:
+        blkfile_write_done(fss, job);
+        break;
+    case FILE_COPY:
+        blkfile_copy_done(fss, job);
+        break;
+    case FILE_DELETE:
+    case FILE_SETSIZE:
+        blkfile_respond(&cont->req, job->ok ? FILE_OK : FILE_ERROR, 0, 0, cont->src);
+        break;
+    default:
+        assert(0);
     }
+    free(cont);
+}
 
-    fss->stat_cache[req->ino].st_size = req->offset;
+/* Respond to a sync request by writing out the stat table now, and then
+ * having the block server write out what it buffers.
+ */
+static void blkfile_do_sync(struct file_server_state *fss, struct file_request *req, gpid_t src){
     flush_stat_cache(fss);
+    if (!block_sync(fss->block_svr)) {
+        printf("blkfile_do_sync: error\n");
+        blkfile_respond(req, FILE_ERROR, 0, 0, src);
+        return;
+    }
     blkfile_respond(req, FILE_OK, 0, 0, src);
 }
 
@@ -511,42 +1533,311 @@ static void blkfile_respond(struct file_request *req, enum file_status status,
     free(rep);
 }
 
+/* Note that a block of the stat table changed.
+ */
+static void stat_dirty(struct file_server_state *fss, bool_t *dirty) {
+    if (!*dirty) {
+        if (fss->stat_ndirty++ == 0) {
+            fss->stat_dirty_since = sys_gettime();
+        }
+        *dirty = True;
+    }
+}
+
+/* Write a cached page of the stat table back if it is dirty.
+ */
+static void stat_writeback(struct file_server_state *fss, unsigned int slot) {
+    if (fss->page_dirty[slot]) {
+        if (!block_write(fss->block_svr, 0, fss->page_no[slot], fss->pages[slot])) {
+            printf("stat_writeback: error\n");
+        }
+        fss->page_dirty[slot] = False;
+        fss->stat_ndirty--;
+    }
+}
+
+/* Return the stat entry of the given inode, paging it in if needed.  The
+ * pointer is good until the next call.
+ */
+static struct file_stat *stat_get(struct file_server_state *fss, unsigned int ino) {
+    unsigned int b = 1 + fss->nbitmap + ino / STATS_PER_BLOCK;
+    unsigned int slot = b % STAT_NPAGES;
+
+    if (fss->page_no[slot] != b) {
+        stat_writeback(fss, slot);
+        if (!block_read(fss->block_svr, 0, b, fss->pages[slot])) {
+            /* A zeroed page would later be written over the real entries.
+             */
+            panic("stat_get: can't read stat block");
+        }
+        fss->page_no[slot] = b;
+    }
+    return &((struct file_stat *) fss->pages[slot])[ino % STATS_PER_BLOCK];
+}
+
+/* Note that the stat of the given inode changed.  It must be paged in.
+ */
+static void stat_update(struct file_server_state *fss, unsigned int ino) {
+    unsigned int b = 1 + fss->nbitmap + ino / STATS_PER_BLOCK;
+    unsigned int slot = b % STAT_NPAGES;
+
+    assert(fss->page_no[slot] == b);
+    stat_dirty(fss, &fss->page_dirty[slot]);
+}
+
+static bool_t inode_allocated(struct file_server_state *fss, unsigned int ino) {
+    return ino < fss->n_inodes && (fss->bitmap[ino / 8] & (1 << (ino % 8)));
+}
+
+static void inode_set(struct file_server_state *fss, unsigned int ino, bool_t alloc) {
+    if (alloc) {
+        fss->bitmap[ino / 8] |= 1 << (ino % 8);
+    }
+    else {
+        fss->bitmap[ino / 8] &= ~(1 << (ino % 8));
+    }
+    stat_dirty(fss, &fss->bitmap_dirty[ino / BITS_PER_BLOCK]);
+}
+
+/* Write the dirty blocks of the stat table: the stat entries first, then
+ * the bitmap, a run of blocks at a time.
+ */
 static void flush_stat_cache(struct file_server_state *fss) {
-    unsigned int size = sizeof(fss->stat_cache);
-    unsigned int end_block_no = (size - 1) / BLOCK_SIZE;
+    unsigned int b, n;
+
+    for (b = 0; b < STAT_NPAGES; b++) {
+        stat_writeback(fss, b);
+    }
+    for (b = 0; b < fss->nbitmap; b += n) {
+        for (n = 0; b + n < fss->nbitmap && fss->bitmap_dirty[b + n]; n++) {
+            fss->bitmap_dirty[b + n] = False;
+        }
+        if (n == 0) {
+            n = 1;
+        }
+        else if (!multiblock_write(fss->block_svr, 0, 1 + b,
+                            &fss->bitmap[b * BLOCK_SIZE], n)) {
+            printf("flush_stat_cache: error\n");
+        }
+    }
+    fss->stat_ndirty = 0;
+}
 
-    if (!multiblock_write(fss->block_svr, 0, 0, fss->stat_cache, end_block_no + 1)) {
-        printf("flush_stat_cache: error\n");
+/* After a crash a file may have data beyond its size on disk, as its size
+ * is written some time after the data.  That data was never acknowledged
+ * as part of the file, and blkfile_put relies on it being zero, so clear
+ * it.  This is done the first time the file is changed after booting.
+ */
+static bool_t blkfile_check(struct file_server_state *fss, unsigned int ino) {
+    if (fss->checked[ino / 8] & (1 << (ino % 8))) {
+        return True;
+    }
+
+    unsigned int nblock = 0;
+    if (!block_getsize(fss->block_svr, ino, &nblock)) {
+        printf("blkfile_check: can't get size of %u\n", ino);
+        return False;
     }
+    unsigned long size = stat_get(fss, ino)->st_size;
+    if (nblock > (size + BLOCK_SIZE - 1) / BLOCK_SIZE || size % BLOCK_SIZE != 0) {
+        ra_drop(fss, ino, size / BLOCK_SIZE, ~0U);
+        if (!blkfile_truncate(fss->block_svr, ino, size, (unsigned long) nblock * BLOCK_SIZE)) {
+            return False;
+        }
+    }
+    fss->checked[ino / 8] |= 1 << (ino % 8);
+    return True;
 }
 
+/* Allocate the in-memory state of a stat table of n_inodes inodes.
+ */
+static void stat_cache_alloc(struct file_server_state *fss, unsigned int n_inodes) {
+    fss->n_inodes = n_inodes;
+    fss->nbitmap = (n_inodes + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    fss->bitmap = calloc(fss->nbitmap, BLOCK_SIZE);
+    fss->bitmap_dirty = calloc(fss->nbitmap, sizeof(*fss->bitmap_dirty));
+    fss->checked = calloc((n_inodes + 7) / 8, 1);
+    fss->busy = calloc((n_inodes + 7) / 8, 1);
+    fss->hint = 1;
+}
+
+/* Return the number of blocks of the stat table of the current size.
+ */
+static unsigned int stat_table_nblock(struct file_server_state *fss) {
+    return 1 + fss->nbitmap + (fss->n_inodes + STATS_PER_BLOCK - 1) / STATS_PER_BLOCK;
+}
+
+/* Install a new stat table in inode 0, for a new disk (old is 0) or with
+ * the n_old entries of a stat table in the old format (a plain array).
+ * The header, which makes the new table valid, is written last.
+ */
+static void format_stat_cache(struct file_server_state *fss, struct file_stat *old, unsigned int n_old) {
+    unsigned int n_inodes, ino, b, i;
+
+    if (fss->bitmap == 0) {
+        if (!block_ninodes(fss->block_svr, &n_inodes)) {
+            panic("format_stat_cache: can't get number of inodes");
+        }
+        stat_cache_alloc(fss, n_inodes);
+    }
+    n_inodes = fss->n_inodes;
+    if (old == 0) {
+        block_setsize(fss->block_svr, 0, 0);
+    }
+
+    // inode 0 is the stat table itself, and inodes past the end are never free
+    for (ino = 0; ino < n_old; ino++) {
+        if (old[ino].st_alloc) {
+            fss->bitmap[ino / 8] |= 1 << (ino % 8);
+        }
+    }
+    fss->bitmap[0] |= 1;
+    for (ino = n_inodes; ino < fss->nbitmap * BITS_PER_BLOCK; ino++) {
+        fss->bitmap[ino / 8] |= 1 << (ino % 8);
+    }
+
+    // the entries; of a new table only the last block, to set the size
+    union {
+        struct stat_header hdr;
+        struct file_stat stats[STATS_PER_BLOCK];
+        char block[BLOCK_SIZE];
+    } u;
+    unsigned int first = 1 + fss->nbitmap, last = stat_table_nblock(fss) - 1;
+    for (b = first; b <= last; b++) {
+        bool_t any = False;
+        memset(&u, 0, sizeof(u));
+        for (i = 0; i < STATS_PER_BLOCK; i++) {
+            ino = (b - first) * STATS_PER_BLOCK + i;
+            if (inode_allocated(fss, ino)) {
+                if (ino < n_old) {
+                    u.stats[i] = old[ino];
+                }
+                u.stats[i].st_alloc = True;
+                any = True;
+            }
+        }
+        if ((any || old != 0 || b == last) && !block_write(fss->block_svr, 0, b, u.block)) {
+            panic("format_stat_cache: can't write stat entries");
+        }
+    }
+    if (!multiblock_write(fss->block_svr, 0, 1, fss->bitmap, fss->nbitmap)) {
+        panic("format_stat_cache: can't write inode bitmap");
+    }
+
+    memset(&u, 0, sizeof(u));
+    u.hdr.magic = STAT_MAGIC;
+    u.hdr.n_inodes = n_inodes;
+    if (!block_write(fss->block_svr, 0, 0, u.block)) {
+        panic("format_stat_cache: can't write header");
+    }
+}
+
+/* Read nblock blocks of a stat table in the old format at the given
+ * offset, and return the number of entries up to the last one in use.
+ */
+static struct file_stat *old_stat_read(struct file_server_state *fss, unsigned int offset,
+                                        unsigned int nblock, unsigned int *pn_old) {
+    struct file_stat *old = malloc(nblock * BLOCK_SIZE);
+    unsigned int n = nblock;
+
+    if (!multiblock_read(fss->block_svr, 0, offset, old, &n) || n != nblock) {
+        panic("load_stat_cache: can't read old stat table");
+    }
+    n = nblock * BLOCK_SIZE / sizeof(struct file_stat);
+    while (n > 0 && !old[n - 1].st_alloc) {
+        n--;
+    }
+    *pn_old = n;
+    return old;
+}
+
+/* Load the stat table, or return False if the disk is new.  The number of
+ * inodes in the header is the one the table was made with, and is kept
+ * even if the block server's file system has a different number now.
+ */
 static bool_t load_stat_cache(struct file_server_state *fss) {
-    unsigned int size = sizeof(fss->stat_cache);
-    unsigned int psize_nblock = 0;
+    unsigned int psize_nblock = 0, n_inodes, n_old;
 
-    block_getsize(fss->block_svr, 0, &psize_nblock);
+    if (!block_ninodes(fss->block_svr, &n_inodes)) {
+        panic("load_stat_cache: can't get number of inodes");
+    }
+    if (!block_getsize(fss->block_svr, 0, &psize_nblock)) {
+        panic("load_stat_cache: can't get size of stat table");
+    }
     if (psize_nblock == 0) {
         printf("Init new disk: installing stat array at inode0\n\r");
         return False;
-    } else if (psize_nblock != (size - 1) / BLOCK_SIZE + 1) {
-        printf("load_stat_cache: error, reinstalling stat array inode0\n");
-        return False;
     }
 
-    psize_nblock = (size - 1) / BLOCK_SIZE + 1;
-    multiblock_read(fss->block_svr, 0, 0, &fss->stat_cache, &psize_nblock);
+    union {
+        struct stat_header hdr;
+        char block[BLOCK_SIZE];
+    } u;
+    if (!block_read(fss->block_svr, 0, 0, u.block)) {
+        panic("load_stat_cache: can't read header");
+    }
+
+    /* A table in the old format is a plain array of entries.  It is first
+     * copied past the end of the new table, and a header that says so is
+     * written over it, so that the conversion is redone after a crash.
+     */
+    if (u.hdr.magic != STAT_MAGIC) {
+        struct file_stat *old = old_stat_read(fss, 0, psize_nblock, &n_old);
+        if (n_old > n_inodes) {
+            panic("load_stat_cache: old stat table has more inodes than the file system");
+        }
+        printf("load_stat_cache: converting stat array of %u inodes\n\r", n_old);
+        stat_cache_alloc(fss, n_inodes);
+        if (!multiblock_write(fss->block_svr, 0, stat_table_nblock(fss), old, psize_nblock)) {
+            panic("load_stat_cache: can't copy old stat table");
+        }
+        free(old);
+
+        memset(&u, 0, sizeof(u));
+        u.hdr.magic = STAT_MAGIC;
+        u.hdr.n_inodes = n_inodes;
+        u.hdr.n_staged = psize_nblock;
+        if (!block_write(fss->block_svr, 0, 0, u.block)) {
+            panic("load_stat_cache: can't write header");
+        }
+    }
+
+    if (u.hdr.n_inodes > n_inodes) {
+        panic("load_stat_cache: stat table has more inodes than the file system");
+    }
+    if (u.hdr.n_inodes != n_inodes) {
+        printf("load_stat_cache: using %u of %u inodes\n\r", u.hdr.n_inodes, n_inodes);
+    }
+    if (fss->bitmap == 0) {
+        stat_cache_alloc(fss, u.hdr.n_inodes);
+    }
+
+    if (u.hdr.n_staged != 0) {
+        unsigned int staged = stat_table_nblock(fss);
+        struct file_stat *old = old_stat_read(fss, staged, u.hdr.n_staged, &n_old);
+        format_stat_cache(fss, old, n_old);
+        free(old);
+        if (!block_discard(fss->block_svr, 0, staged, u.hdr.n_staged)) {
+            printf("load_stat_cache: can't discard old stat table\n\r");
+        }
+        return True;
+    }
+
+    unsigned int nbitmap = fss->nbitmap;
+    if (!multiblock_read(fss->block_svr, 0, 1, fss->bitmap, &nbitmap) ||
+                                            nbitmap != fss->nbitmap) {
+        panic("load_stat_cache: can't read inode bitmap");
+    }
     return True;
 }
 
-static bool_t blkfile_read_allowed(struct file_stat *stat, gpid_t src) {
-    struct process *p = proc_find(src);
+static bool_t blkfile_may_read(struct file_stat *stat, unsigned int uid) {
+    //printf("%u is trying to read file owned by %u, other: %u\n", uid, stat->st_uid, stat->st_mode & P_FILE_OTHER_READ);
 
-    //printf("%u is trying to read file owned by %u, other: %u\n", p->uid, stat->st_uid, stat->st_mode & P_FILE_OTHER_READ);
-
-    if (p->uid == 0) {
+    if (uid == 0) {
         // read from root user
         return True;
-    } else if (p->uid == stat->st_uid) {
+    } else if (uid == stat->st_uid) {
         // read from owner
         return stat->st_mode & P_FILE_OWNER_READ;
     } else {
@@ -555,6 +1846,10 @@ static bool_t blkfile_read_allowed(struct file_stat *stat, gpid_t src) {
     }
 }
 
+static bool_t blkfile_read_allowed(struct file_stat *stat, gpid_t src) {
+    return blkfile_may_read(stat, proc_find(src)->uid);
+}
+
 static bool_t blkfile_write_allowed(struct file_stat *stat, gpid_t src) {
     struct process *p = proc_find(src);
 
@@ -0,0 +1,390 @@
+/* This block store module mirrors the underlying block store but contains
+ * a write-through cache.  The caching strategy is ARC (Megiddo and Modha,
+ * "ARC: A Self-Tuning, Low Overhead Replacement Cache", FAST '03), which
+ * balances recency and frequency, so that a scan through many blocks
+ * does not flush the blocks that are used over and over again.
+ * The interface is as follows:
+ *
+ *		block_if arcdisk_init(block_if below,
+ *									block_t *blocks, block_no nblocks)
+ *			'below' is the underlying block store.  'blocks' points to
+ *			a chunk of memory wth 'nblocks' blocks for caching.
+ *
+ *		void arcdisk_dump_stats(block_if bi)
+ *			Prints the cache statistics.
+ *
+ * ARC keeps the cached blocks in two LRU lists: T1 holds blocks that
+ * were accessed once recently, and T2 blocks that were accessed at least
+ * twice.  It also remembers the numbers of blocks recently evicted from
+ * either list in the "ghost" lists B1 and B2.  A miss on a block in B1
+ * means T1 should have been larger, and a miss on B2 that T2 should have
+ * been larger.  The target size of T1 is adjusted accordingly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "grass.h"
+#include "block_store.h"
+
+enum arc_list { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_NLISTS };
+
+/* Per block in the cache or in a ghost list we keep track of the
+ * following info:
+ */
+struct arc_entry {
+	struct arc_entry *prev, *next;	// in list, most recently used first
+	struct arc_entry *chain;		// in hash bucket
+	enum arc_list list;				// list it's on
+	block_no offset;				// block number
+	block_no slot;					// where in the cache, if in T1 or T2
+};
+
+struct arc_queue {
+	struct arc_entry *mru;			// head of circular list
+	block_no size;
+};
+
+struct arcdisk_state {
+	block_if below;				// block store below
+	block_t *blocks;			// memory for caching blocks
+	block_no nblocks;			// size of cache (not size of block store!)
+	block_no target;			// target size of T1 ("p" in the paper)
+	struct arc_queue lists[ARC_NLISTS];
+
+	struct arc_entry *entries;	// 2 * nblocks entries
+	struct arc_entry *free;		// free entries
+	block_no *free_slots;		// stack of unused slots
+	block_no nfree_slots;
+	struct arc_entry **buckets;	// hash table of entries in use
+	block_no nbuckets;
+
+	/* Stats.
+	 */
+	unsigned int read_hit, read_miss, write_hit, write_miss;
+	unsigned int ghost_hit[2];	// misses on B1, B2
+};
+
+static void arc_remove(struct arcdisk_state *as, struct arc_entry *ae){
+	struct arc_queue *q = &as->lists[ae->list];
+
+	if (ae->next == ae) {
+		q->mru = 0;
+	}
+	else {
+		ae->prev->next = ae->next;
+		ae->next->prev = ae->prev;
+		if (q->mru == ae) {
+			q->mru = ae->next;
+		}
+	}
+	q->size--;
+}
+
+static void arc_push(struct arcdisk_state *as, struct arc_entry *ae, enum arc_list list){
+	struct arc_queue *q = &as->lists[list];
+
+	if (q->mru == 0) {
+		ae->prev = ae->next = ae;
+	}
+	else {
+		ae->next = q->mru;
+		ae->prev = q->mru->prev;
+		ae->prev->next = ae;
+		ae->next->prev = ae;
+	}
+	q->mru = ae;
+	q->size++;
+	ae->list = list;
+}
+
+static struct arc_entry *arc_lru(struct arcdisk_state *as, enum arc_list list){
+	struct arc_queue *q = &as->lists[list];
+
+	return q->mru == 0 ? 0 : q->mru->prev;
+}
+
+static struct arc_entry *arc_lookup(struct arcdisk_state *as, block_no offset){
+	struct arc_entry *ae;
+
+	for (ae = as->buckets[offset % as->nbuckets]; ae != 0; ae = ae->chain) {
+		if (ae->offset == offset) {
+			break;
+		}
+	}
+	return ae;
+}
+
+/* Forget about an entry altogether.
+ */
+static void arc_delete(struct arcdisk_state *as, struct arc_entry *ae){
+	struct arc_entry **pae;
+
+	for (pae = &as->buckets[ae->offset % as->nbuckets]; *pae != ae; pae = &(*pae)->chain)
+		;
+	*pae = ae->chain;
+	arc_remove(as, ae);
+	if (ae->list == ARC_T1 || ae->list == ARC_T2) {
+		as->free_slots[as->nfree_slots++] = ae->slot;
+	}
+	ae->next = as->free;
+	as->free = ae;
+}
+
+/* If the cache is full, evict the LRU block of T1 or T2 to the
+ * corresponding ghost list.  'in_b2' is set if the block being brought
+ * in is in B2.  The cache is only not full at the start, or after blocks
+ * were dropped by setsize or a failed write.
+ */
+static void arc_replace(struct arcdisk_state *as, bool_t in_b2){
+	block_no t1 = as->lists[ARC_T1].size;
+	struct arc_entry *ae;
+
+	if (as->nfree_slots > 0) {
+		return;
+	}
+
+	if (t1 > 0 && (t1 > as->target || (in_b2 && t1 == as->target) ||
+								as->lists[ARC_T2].size == 0)) {
+		ae = arc_lru(as, ARC_T1);
+		arc_remove(as, ae);
+		arc_push(as, ae, ARC_B1);
+	}
+	else {
+		ae = arc_lru(as, ARC_T2);
+		arc_remove(as, ae);
+		arc_push(as, ae, ARC_B2);
+	}
+	as->free_slots[as->nfree_slots++] = ae->slot;
+}
+
+/* The given block was just read or written.  Returns its entry, which is
+ * in T1 or T2.  Sets *hit if it was in the cache already.
+ */
+static struct arc_entry *arc_access(struct arcdisk_state *as, block_no offset, bool_t *hit){
+	struct arc_queue *lists = as->lists;
+	block_no c = as->nblocks, delta;
+	struct arc_entry *ae = arc_lookup(as, offset);
+
+	/* A hit: it's now frequently used.
+	 */
+	if (ae != 0 && (ae->list == ARC_T1 || ae->list == ARC_T2)) {
+		arc_remove(as, ae);
+		arc_push(as, ae, ARC_T2);
+		*hit = True;
+		return ae;
+	}
+	*hit = False;
+
+	/* A miss on a block in a ghost list.  Adapt the target size of T1,
+	 * make room and move the block to T2.
+	 */
+	if (ae != 0) {
+		if (ae->list == ARC_B1) {
+			as->ghost_hit[0]++;
+			delta = lists[ARC_B2].size > lists[ARC_B1].size ?
+							lists[ARC_B2].size / lists[ARC_B1].size : 1;
+			as->target = as->target + delta > c ? c : as->target + delta;
+			arc_replace(as, False);
+		}
+		else {
+			as->ghost_hit[1]++;
+			delta = lists[ARC_B1].size > lists[ARC_B2].size ?
+							lists[ARC_B1].size / lists[ARC_B2].size : 1;
+			as->target = as->target > delta ? as->target - delta : 0;
+			arc_replace(as, True);
+		}
+		arc_remove(as, ae);
+		ae->slot = as->free_slots[--as->nfree_slots];
+		arc_push(as, ae, ARC_T2);
+		return ae;
+	}
+
+	/* A block not seen recently.  Make room for it in T1, keeping the
+	 * ghost lists bounded.
+	 */
+	block_no l1 = lists[ARC_T1].size + lists[ARC_B1].size;
+	block_no total = l1 + lists[ARC_T2].size + lists[ARC_B2].size;
+	if (l1 == c) {
+		if (lists[ARC_T1].size < c) {
+			arc_delete(as, arc_lru(as, ARC_B1));
+			arc_replace(as, False);
+		}
+		else {
+			arc_delete(as, arc_lru(as, ARC_T1));
+		}
+	}
+	else if (total >= c) {
+		if (total == 2 * c) {
+			arc_delete(as, arc_lru(as, ARC_B2));
+		}
+		arc_replace(as, False);
+	}
+
+	ae = as->free;
+	as->free = ae->next;
+	ae->offset = offset;
+	ae->slot = as->free_slots[--as->nfree_slots];
+	ae->chain = as->buckets[offset % as->nbuckets];
+	as->buckets[offset % as->nbuckets] = ae;
+	arc_push(as, ae, ARC_T1);
+	return ae;
+}
+
+static int arcdisk_nblocks(block_if bi){
+	struct arcdisk_state *as = bi->state;
+
+	return (*as->below->nblocks)(as->below);
+}
+
+static int arcdisk_setsize(block_if bi, block_no nblocks){
+	struct arcdisk_state *as = bi->state;
+	block_no i;
+
+	for (i = 0; i < as->nbuckets; i++) {
+		struct arc_entry *ae = as->buckets[i], *next;
+		for (; ae != 0; ae = next) {
+			next = ae->chain;
+			if (ae->offset >= nblocks) {
+				arc_delete(as, ae);
+			}
+		}
+	}
+	return (*as->below->setsize)(as->below, nblocks);
+}
+
+static int arcdisk_read(block_if bi, block_no offset, block_t *block){
+	struct arcdisk_state *as = bi->state;
+	struct arc_entry *ae = arc_lookup(as, offset);
+
+	if (ae != 0 && (ae->list == ARC_T1 || ae->list == ARC_T2)) {
+		bool_t hit;
+		(void) arc_access(as, offset, &hit);
+		memcpy(block, &as->blocks[ae->slot], BLOCK_SIZE);
+		as->read_hit++;
+		return 0;
+	}
+
+	as->read_miss++;
+	int r = (*as->below->read)(as->below, offset, block);
+	if (r < 0) {
+		return r;
+	}
+	bool_t hit;
+	ae = arc_access(as, offset, &hit);
+	memcpy(&as->blocks[ae->slot], block, BLOCK_SIZE);
+	return r;
+}
+
+static int arcdisk_write(block_if bi, block_no offset, block_t *block){
+	struct arcdisk_state *as = bi->state;
+
+	int r = (*as->below->write)(as->below, offset, block);
+	if (r < 0) {
+		/* Don't know what's on the store now.
+		 */
+		struct arc_entry *ae = arc_lookup(as, offset);
+		if (ae != 0) {
+			arc_delete(as, ae);
+		}
+		return r;
+	}
+
+	bool_t hit;
+	struct arc_entry *ae = arc_access(as, offset, &hit);
+	memcpy(&as->blocks[ae->slot], block, BLOCK_SIZE);
+	if (hit) {
+		as->write_hit++;
+	}
+	else {
+		as->write_miss++;
+	}
+	return r;
+}
+
+static int arcdisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct arcdisk_state *as = bi->state;
+	block_no i;
+
+	/* Look up short ranges block by block, and scan the table otherwise.
+	 */
+	if (nblocks < as->nbuckets) {
+		for (i = 0; i < nblocks; i++) {
+			struct arc_entry *ae = arc_lookup(as, offset + i);
+			if (ae != 0) {
+				arc_delete(as, ae);
+			}
+		}
+	}
+	else {
+		for (i = 0; i < as->nbuckets; i++) {
+			struct arc_entry *ae = as->buckets[i], *next;
+			for (; ae != 0; ae = next) {
+				next = ae->chain;
+				if (ae->offset >= offset && ae->offset - offset < nblocks) {
+					arc_delete(as, ae);
+				}
+			}
+		}
+	}
+	return block_range_discard(as->below, offset, nblocks);
+}
+
+static void arcdisk_destroy(block_if bi){
+	struct arcdisk_state *as = bi->state;
+
+	free(as->entries);
+	free(as->free_slots);
+	free(as->buckets);
+	free(as);
+	free(bi);
+}
+
+void arcdisk_dump_stats(block_if bi){
+	struct arcdisk_state *as = bi->state;
+
+	printf("!$ARC: #read hits:    %u\n", as->read_hit);
+	printf("!$ARC: #read misses:  %u\n", as->read_miss);
+	printf("!$ARC: #write hits:   %u\n", as->write_hit);
+	printf("!$ARC: #write misses: %u\n", as->write_miss);
+	printf("!$ARC: #B1, B2 hits:  %u, %u\n", as->ghost_hit[0], as->ghost_hit[1]);
+	printf("!$ARC: T1 target:     %u of %u\n", as->target, as->nblocks);
+}
+
+/* Create a new block store module on top of the specified module below.
+ * blocks points to a chunk of memory of nblocks blocks that can be used
+ * for caching.
+ */
+block_if arcdisk_init(block_if below, block_t *blocks, block_no nblocks){
+	block_no i;
+
+	/* Create the block store state structure.
+	 */
+	struct arcdisk_state *as = new_alloc(struct arcdisk_state);
+	as->below = below;
+	as->blocks = blocks;
+	as->nblocks = nblocks;
+	as->entries = calloc(2 * nblocks, sizeof(*as->entries));
+	for (i = 2 * nblocks; i-- > 0;) {
+		as->entries[i].next = as->free;
+		as->free = &as->entries[i];
+	}
+	as->free_slots = calloc(nblocks, sizeof(*as->free_slots));
+	for (i = 0; i < nblocks; i++) {
+		as->free_slots[as->nfree_slots++] = nblocks - 1 - i;
+	}
+	as->nbuckets = 2 * nblocks + 1;
+	as->buckets = calloc(as->nbuckets, sizeof(*as->buckets));
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = new_alloc(block_store_t);
+	bi->state = as;
+	bi->nblocks = arcdisk_nblocks;
+	bi->setsize = arcdisk_setsize;
+	bi->read = arcdisk_read;
+	bi->write = arcdisk_write;
+	bi->destroy = arcdisk_destroy;
+	bi->discard = arcdisk_discard;
+	return bi;
+}
@@ -0,0 +1,90 @@
+/* Helper functions shared by the block store modules.
+ *
+ *		int block_range_read(block_if bi, block_no offset,
+ *										block_no nblocks, block_t *blocks)
+ *			read nblocks consecutive blocks from bi, using its read_range
+ *			method if it has one and single block reads otherwise
+ *
+ *		int block_range_write(block_if bi, block_no offset,
+ *										block_no nblocks, block_t *blocks)
+ *			likewise for writes
+ *
+ *		int block_range_discard(block_if bi, block_no offset, block_no nblocks)
+ *			discard nblocks consecutive blocks from bi, using its discard
+ *			method if it has one and writing zeroes otherwise
+ *
+ *		int block_range_copy(block_if bi, block_no offset, block_if src,
+ *										block_no src_offset, block_no nblocks)
+ *			copy nblocks blocks of src to bi, using the copy method of bi
+ *			if it has one and reading and writing a block at a time
+ *			otherwise
+ *
+ * All return 0, or -1 upon error.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "grass.h"
+#include "block_store.h"
+
+int block_range_read(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	if (bi->read_range != 0) {
+		return (*bi->read_range)(bi, offset, nblocks, blocks);
+	}
+
+	block_no i;
+	for (i = 0; i < nblocks; i++) {
+		if ((*bi->read)(bi, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int block_range_write(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	if (bi->write_range != 0) {
+		return (*bi->write_range)(bi, offset, nblocks, blocks);
+	}
+
+	block_no i;
+	for (i = 0; i < nblocks; i++) {
+		if ((*bi->write)(bi, offset + i, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int block_range_discard(block_if bi, block_no offset, block_no nblocks){
+	if (bi->discard != 0) {
+		return (*bi->discard)(bi, offset, nblocks);
+	}
+
+	block_t null_block;
+	memset(&null_block, 0, sizeof(null_block));
+	block_no i;
+	for (i = 0; i < nblocks; i++) {
+		if ((*bi->write)(bi, offset + i, &null_block) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int block_range_copy(block_if bi, block_no offset, block_if src,
+										block_no src_offset, block_no nblocks){
+	if (bi->copy != 0) {
+		return (*bi->copy)(bi, offset, src, src_offset, nblocks);
+	}
+
+	block_t block;
+	block_no i;
+	for (i = 0; i < nblocks; i++) {
+		if ((*src->read)(src, src_offset + i, &block) < 0 ||
+						(*bi->write)(bi, offset + i, &block) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
@@ -17,7 +17,9 @@
  *
  *		int read(block_store_t *this_bs, block_no offset, block_t *block)
  *			read the block at offset and return in *block
- *			returns 0
+ *			returns 0, or 1 if the block is a hole in a file (never
+ *			written, so it reads as zeroes).  Only file systems such
+ *			as treedisk, and modules that forward their reads, return 1.
  *
  *		int write(block_store_t *this_bs, block_no offset, block_t *block)
  *			write *block to the block at the given offset
@@ -26,6 +28,35 @@
  *		void destroy(block_store_t *this_bs)
  *			clean up the block store interface;	returns 0
  *
+ * In addition, a module may provide the following four methods.  They are
+ * optional and left 0 by modules that do not implement them, in which case
+ * callers fall back to the single block methods:
+ *
+ *		int read_range(block_store_t *this_bs, block_no offset,
+ *										block_no nblocks, block_t *blocks)
+ *			read nblocks consecutive blocks starting at offset
+ *			returns 0
+ *
+ *		int write_range(block_store_t *this_bs, block_no offset,
+ *										block_no nblocks, block_t *blocks)
+ *			write nblocks consecutive blocks starting at offset
+ *			returns 0
+ *
+ *		int discard(block_store_t *this_bs, block_no offset, block_no nblocks)
+ *			the nblocks blocks starting at offset are no longer in use, so
+ *			the block store need not keep them; afterwards they read as
+ *			zeroes until written again.  The fallback writes zeroes.
+ *			returns 0
+ *
+ *		int copy(block_store_t *this_bs, block_no offset, block_store_t *src,
+ *										block_no src_offset, block_no nblocks)
+ *			make the nblocks blocks starting at offset hold the contents
+ *			of those of src starting at src_offset, which must not overlap
+ *			them.  Modules that can share blocks (dedupdisk) do so instead
+ *			of moving the data, and modules stacked on those forward the
+ *			copy if src is of the same kind.  The fallback reads and writes.
+ *			returns 0
+ *
  * All these return -1 upon error (typically after printing the
  * reason for the error).
  *
@@ -49,10 +80,32 @@ typedef struct block_store {
 	int (*write)(struct block_store *this_bs, block_no offset, block_t *block);
 	int (*setsize)(struct block_store *this_bs, block_no size);
 	void (*destroy)(struct block_store *this_bs);
+	int (*read_range)(struct block_store *this_bs, block_no offset,
+									block_no nblocks, block_t *blocks);
+	int (*write_range)(struct block_store *this_bs, block_no offset,
+									block_no nblocks, block_t *blocks);
+	int (*discard)(struct block_store *this_bs, block_no offset, block_no nblocks);
+	int (*copy)(struct block_store *this_bs, block_no offset,
+					struct block_store *src, block_no src_offset, block_no nblocks);
 } block_store_t;
 
 typedef block_store_t *block_if;			// block store interface
 
+/* A single range operation in a batch (see protdisk_batch()).
+ */
+struct block_io {
+	block_if bi;				// block store to operate on
+	enum { BIO_READ, BIO_WRITE } op;
+	block_no offset;			// first block
+	block_no nblocks;			// number of blocks
+	block_t *blocks;			// buffer of nblocks blocks
+	int result;					// 0 on success, -1 on error
+};
+
+/* A cache of file blocks shared by icachedisks.
+ */
+struct icache;
+
 /* Each block store module has an 'init' function that returns a
  * 'block_store_t *' type.  Here are the 'init' functions of various
  * available block store types.
@@ -66,13 +119,42 @@ block_store_t *fatdisk_init(block_store_t *below, unsigned int inode_no);
 block_store_t *debugdisk_init(block_store_t *below, const char *descr);
 block_store_t *cachedisk_init(block_store_t *below, block_t *blocks, block_no nblocks);
 block_store_t *clockdisk_init(block_if below, block_t *blocks, block_no nblocks);
+block_store_t *arcdisk_init(block_if below, block_t *blocks, block_no nblocks);
+block_store_t *icachedisk_init(block_if below, struct icache *ic, unsigned int inode);
+block_store_t *logdisk_init(block_store_t *below);
 block_store_t *statdisk_init(block_store_t *below);
 block_store_t *checkdisk_init(block_store_t *below, const char *descr);
-block_store_t *tracedisk_init(block_store_t *below, char *trace, unsigned int n_inodes);
+block_store_t *raid0disk_init(block_if *below, unsigned int nbelow, block_no stripe_unit);
+block_store_t *raid1disk_init(block_if *below, unsigned int nbelow);
+block_store_t *raid5disk_init(block_if *below, unsigned int nbelow);
+block_store_t *compdisk_init(block_store_t *below);
+block_store_t *dedupdisk_init(block_store_t *below);
+block_store_t *tracedisk_init(block_store_t *below, char *trace, unsigned int inode);
 
 /* Some useful functions on some block store types.
  */
 int treedisk_create(block_store_t *below, unsigned int n_inodes);
+int treedisk_ninodes(block_store_t *below);
 int treedisk_check(block_store_t *below);
 void statdisk_dump_stats(block_store_t *this_bs);
+void arcdisk_dump_stats(block_store_t *this_bs);
+struct icache *icache_create(block_t *blocks, block_no nblocks);
+void icache_dump_stats(struct icache *ic);
+int logdisk_idle(block_store_t *this_bs);
+int logdisk_sync(block_store_t *this_bs);
+void logdisk_dump_stats(block_store_t *this_bs);
+void statdisk_get_stats(block_store_t *this_bs, unsigned int *nread, unsigned int *nwrite);
+void compdisk_dump_stats(block_store_t *this_bs);
+void dedupdisk_dump_stats(block_store_t *this_bs);
+int tracedisk_replay(block_store_t **inodes, unsigned int n_inodes, char *trace, bool_t timed);
 int fatdisk_create(block_store_t *below, unsigned int n_inodes);
+int block_range_read(block_if bi, block_no offset, block_no nblocks, block_t *blocks);
+int block_range_write(block_if bi, block_no offset, block_no nblocks, block_t *blocks);
+int block_range_discard(block_if bi, block_no offset, block_no nblocks);
+int block_range_copy(block_if bi, block_no offset, block_if src,
+										block_no src_offset, block_no nblocks);
+int protdisk_batch(struct block_io *ios, unsigned int nios);
+void raid1disk_resync(block_store_t *this_bs, unsigned int member);
+int raid1disk_resync_step(block_store_t *this_bs);
+void raid5disk_rebuild(block_store_t *this_bs, unsigned int member);
+int raid5disk_rebuild_step(block_store_t *this_bs);
@@ -113,6 +113,25 @@ static int checkdisk_write(block_store_t *this_bs, block_no offset, block_t *blo
 	return result;
 }
 
+static int checkdisk_discard(block_store_t *this_bs, block_no offset, block_no nblocks){
+	struct checkdisk_state *cs = this_bs->state;
+
+	int result = block_range_discard(cs->below, offset, nblocks);
+	if (result < 0) {
+		return result;
+	}
+
+	/* The blocks should read as zeroes now.
+	 */
+	struct block_list *bl;
+	for (bl = cs->bl; bl != 0; bl = bl->next) {
+		if (bl->offset >= offset && bl->offset - offset < nblocks) {
+			memset(&bl->block, 0, BLOCK_SIZE);
+		}
+	}
+	return result;
+}
+
 static void checkdisk_destroy(block_store_t *this_bs){
 	struct checkdisk_state *cs = this_bs->state;
 	struct block_list *bl;
@@ -141,5 +160,6 @@ block_store_t *checkdisk_init(block_store_t *below, const char *descr){
 	this_bs->read = checkdisk_read;
 	this_bs->write = checkdisk_write;
 	this_bs->destroy = checkdisk_destroy;
+	this_bs->discard = checkdisk_discard;
 	return this_bs;
 }
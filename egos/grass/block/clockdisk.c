@@ -90,6 +90,19 @@ static int clockdisk_write(block_if bi, block_no offset, block_t *block){
 	return (*cs->below->write)(cs->below, offset, block);
 }
 
+static int clockdisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct clockdisk_state *cs = bi->state;
+	unsigned int i;
+
+	for (i = 0; i < cs->nblocks; i++) {
+		if (cs->binfo[i].status != BI_EMPTY && cs->binfo[i].offset >= offset &&
+								cs->binfo[i].offset - offset < nblocks) {
+			cs->binfo[i].status = BI_EMPTY;
+		}
+	}
+	return block_range_discard(cs->below, offset, nblocks);
+}
+
 static void clockdisk_destroy(block_if bi){
 	struct clockdisk_state *cs = bi->state;
 
@@ -135,5 +148,6 @@ block_if clockdisk_init(block_if below, block_t *blocks, block_no nblocks){
 	bi->read = clockdisk_read;
 	bi->write = clockdisk_write;
 	bi->destroy = clockdisk_destroy;
+	bi->discard = clockdisk_discard;
 	return bi;
 }
@@ -0,0 +1,596 @@
+/* This block store module compresses blocks before storing them on the
+ * underlying block store.
+ *
+ *		block_if compdisk_init(block_if below)
+ *			'below' is the underlying block store.  If it is empty (block 0
+ *			is all zeroes), it is formatted.  If it holds a compdisk, the
+ *			existing one is used.  Otherwise it holds something that was
+ *			not written by compdisk, and 0 is returned.
+ *
+ *		void compdisk_dump_stats(block_if bi)
+ *			Prints the compression statistics.
+ *
+ * Blocks are compressed with an LZ4-style compressor (the LZ4 block format
+ * without the frame).  A compressed block occupies a few consecutive
+ * slots of COMPDISK_SLOT_SIZE bytes in a physical block, so that several
+ * compressed blocks share a physical block.  Blocks that do not compress
+ * well enough are stored as is in a physical block of their own, and
+ * blocks that are all zeroes are not stored at all.
+ *
+ * The layout of the underlying block store is as follows:
+ *
+ *		block 0:				header (magic number and sizes)
+ *		blocks 1 .. nmap:		mapping table, one entry per logical block
+ *		the remaining blocks:	compressed data
+ *
+ * The mapping table is kept in memory and written through.  A block is
+ * written to free slots first, and the slots it used before are released
+ * only after its map entry has been updated, so that the block store is
+ * consistent at all times.  The free slots are not stored on disk but
+ * determined from the mapping table when the block store is opened.
+ * Physical blocks whose slots all become free are discarded below.
+ *
+ * The block store offers COMPDISK_RATIO times as many logical blocks as
+ * there are physical data blocks, less one.  A block never takes more
+ * than one physical block, so with a ratio of 1 the spare block ensures
+ * that there is always room to write a block before its old slots are
+ * released.  The file systems above treat a failed write as fatal, so a
+ * higher ratio, with writes that fail when the data does not compress
+ * well enough, is only for data known to compress.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "grass.h"
+#include "block_store.h"
+
+#define COMPDISK_MAGIC		0x434d5052		// "CMPR"
+#define COMPDISK_RATIO		1				// logical per physical data block
+#define COMPDISK_SLOT_SIZE	128
+#define COMPDISK_NSLOTS		(BLOCK_SIZE / COMPDISK_SLOT_SIZE)
+#define COMPDISK_ENTRIES	(BLOCK_SIZE / sizeof(uint32_t))	// per map block
+
+/* A map entry is 0 for an unmapped (all zeroes) block.  Otherwise it
+ * holds the location of the compressed block.  The compressed data is
+ * preceded by its size in two bytes.
+ */
+#define ENTRY_BLOCK(e)		((e) & 0xFFFFFF)
+#define ENTRY_SLOT(e)		(((e) >> 24) & 0x7)
+#define ENTRY_NSLOTS(e)		((((e) >> 27) & 0x7) + 1)
+#define ENTRY_RAW			(1 << 30)		// stored uncompressed
+#define ENTRY(b, s, n)		((b) | ((s) << 24) | (((n) - 1) << 27))
+
+struct compdisk_header {
+	uint32_t magic;
+	uint32_t nlogical;			// #logical blocks
+	uint32_t nmap;				// #blocks in the mapping table
+};
+
+struct compdisk_state {
+	block_if below;				// block store below
+	block_no nlogical;			// #logical blocks
+	block_no nmap;				// #map blocks
+	block_no nphys;				// #physical blocks below
+	uint32_t *map;				// mapping table
+	unsigned char *used;		// used slots per physical block (bit mask)
+	block_no hint;				// where to look for free blocks next
+
+	/* The physical block that new compressed blocks are packed into.
+	 */
+	block_no fill;				// 0 if none
+	block_t fill_buf;			// its contents
+
+	/* Stats.
+	 */
+	unsigned long nwrites, nraw, nzero, bytes_in, bytes_out;
+};
+
+static uint32_t compdisk_read32(const unsigned char *p){
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Append a length in LZ4 style: 255s followed by the remainder.
+ */
+static int compdisk_putlen(unsigned char *dst, int op, int cap, unsigned int len){
+	while (len >= 255) {
+		if (op >= cap) {
+			return -1;
+		}
+		dst[op++] = 255;
+		len -= 255;
+	}
+	if (op >= cap) {
+		return -1;
+	}
+	dst[op++] = len;
+	return op;
+}
+
+/* Append a sequence: literals src[anchor .. anchor + nlit), followed by
+ * a match of mlen bytes at the given offset (none if mlen is 0).
+ */
+static int compdisk_sequence(unsigned char *dst, int op, int cap, const unsigned char *lit,
+						unsigned int nlit, unsigned int offset, unsigned int mlen){
+	if (op >= cap) {
+		return -1;
+	}
+	int token = op++;
+	dst[token] = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15 && (op = compdisk_putlen(dst, op, cap, nlit - 15)) < 0) {
+		return -1;
+	}
+	if (op + (int) nlit > cap) {
+		return -1;
+	}
+	memcpy(&dst[op], lit, nlit);
+	op += nlit;
+	if (mlen == 0) {
+		return op;
+	}
+
+	if (op + 2 > cap) {
+		return -1;
+	}
+	dst[op++] = offset & 0xFF;
+	dst[op++] = offset >> 8;
+	mlen -= 4;
+	dst[token] |= mlen < 15 ? mlen : 15;
+	if (mlen >= 15 && (op = compdisk_putlen(dst, op, cap, mlen - 15)) < 0) {
+		return -1;
+	}
+	return op;
+}
+
+/* Compress a block into at most cap bytes.  Returns the compressed size,
+ * or -1 if it does not fit.
+ */
+static int compdisk_compress(const block_t *block, unsigned char *dst, int cap){
+	const unsigned char *src = (const unsigned char *) block->bytes;
+	unsigned short table[1 << 10];		// position + 1 per hash
+	unsigned int ip = 0, anchor = 0;
+	int op = 0;
+
+	memset(table, 0, sizeof(table));
+
+	/* As in LZ4, the last 12 bytes do not start a match and the last 5
+	 * bytes are always literals.
+	 */
+	while (ip + 12 < BLOCK_SIZE) {
+		uint32_t seq = compdisk_read32(&src[ip]);
+		unsigned int h = (seq * 2654435761U) >> 22;
+		unsigned int ref = table[h];
+		table[h] = ip + 1;
+		if (ref == 0 || compdisk_read32(&src[ref - 1]) != seq) {
+			ip++;
+			continue;
+		}
+		ref--;
+
+		unsigned int mlen = 4;
+		while (ip + mlen < BLOCK_SIZE - 5 && src[ref + mlen] == src[ip + mlen]) {
+			mlen++;
+		}
+		op = compdisk_sequence(dst, op, cap, &src[anchor], ip - anchor, ip - ref, mlen);
+		if (op < 0) {
+			return -1;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+	return compdisk_sequence(dst, op, cap, &src[anchor], BLOCK_SIZE - anchor, 0, 0);
+}
+
+/* Read a length in LZ4 style.
+ */
+static int compdisk_getlen(const unsigned char *src, int *ip, int size, unsigned int *len){
+	unsigned char b;
+
+	do {
+		if (*ip >= size) {
+			return -1;
+		}
+		b = src[(*ip)++];
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+/* Decompress size bytes into a block.  Returns 0, or -1 if the data are
+ * corrupt.
+ */
+static int compdisk_decompress(const unsigned char *src, int size, block_t *block){
+	unsigned char *dst = (unsigned char *) block->bytes;
+	unsigned int op = 0;
+	int ip = 0;
+
+	while (ip < size) {
+		unsigned int token = src[ip++];
+		unsigned int nlit = token >> 4;
+		if (nlit == 15 && compdisk_getlen(src, &ip, size, &nlit) < 0) {
+			return -1;
+		}
+		if (ip + (int) nlit > size || op + nlit > BLOCK_SIZE) {
+			return -1;
+		}
+		memcpy(&dst[op], &src[ip], nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == size) {
+			break;
+		}
+
+		if (ip + 2 > size) {
+			return -1;
+		}
+		unsigned int offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		unsigned int mlen = token & 0xF;
+		if (mlen == 15 && compdisk_getlen(src, &ip, size, &mlen) < 0) {
+			return -1;
+		}
+		mlen += 4;
+		if (offset == 0 || offset > op || op + mlen > BLOCK_SIZE) {
+			return -1;
+		}
+		while (mlen-- > 0) {			// may overlap
+			dst[op] = dst[op - offset];
+			op++;
+		}
+	}
+	return op == BLOCK_SIZE ? 0 : -1;
+}
+
+static int compdisk_nblocks(block_if bi){
+	struct compdisk_state *cs = bi->state;
+
+	return cs->nlogical;
+}
+
+static int compdisk_setsize(block_if bi, block_no nblocks){
+	fprintf(stderr, "compdisk_setsize: not supported\n");
+	return -1;
+}
+
+/* Read a physical block, from the fill buffer if possible.
+ */
+static int compdisk_read_phys(struct compdisk_state *cs, block_no b, block_t *block){
+	if (b == cs->fill) {
+		*block = cs->fill_buf;
+		return 0;
+	}
+	return (*cs->below->read)(cs->below, b, block);
+}
+
+static int compdisk_read(block_if bi, block_no offset, block_t *block){
+	struct compdisk_state *cs = bi->state;
+
+	if (offset >= cs->nlogical) {
+		fprintf(stderr, "compdisk_read: offset too large\n");
+		return -1;
+	}
+	uint32_t e = cs->map[offset];
+	if (e == 0) {
+		memset(block, 0, BLOCK_SIZE);
+		return 0;
+	}
+	if (e & ENTRY_RAW) {
+		return compdisk_read_phys(cs, ENTRY_BLOCK(e), block);
+	}
+
+	block_t phys;
+	if (compdisk_read_phys(cs, ENTRY_BLOCK(e), &phys) < 0) {
+		return -1;
+	}
+	unsigned char *data = (unsigned char *) &phys.bytes[ENTRY_SLOT(e) * COMPDISK_SLOT_SIZE];
+	unsigned int size = data[0] | (data[1] << 8);
+	if (size + 2 > ENTRY_NSLOTS(e) * COMPDISK_SLOT_SIZE ||
+							compdisk_decompress(&data[2], size, block) < 0) {
+		fprintf(stderr, "compdisk_read: block %u is corrupt\n", offset);
+		return -1;
+	}
+	return 0;
+}
+
+/* Find n consecutive free slots in the given mask, or return -1.
+ */
+static int compdisk_find_slots(unsigned char used, unsigned int n){
+	unsigned int s;
+
+	for (s = 0; s + n <= COMPDISK_NSLOTS; s++) {
+		unsigned char mask = ((1 << n) - 1) << s;
+		if ((used & mask) == 0) {
+			return s;
+		}
+	}
+	return -1;
+}
+
+/* Pick a physical block with n consecutive free slots, preferring the one
+ * being filled, then empty blocks, then partially used ones.  The chosen
+ * block becomes the one being filled.  Returns its first free slot, or -1.
+ */
+static int compdisk_alloc(struct compdisk_state *cs, unsigned int n){
+	block_no first = cs->nmap + 1, i, b;
+	int s;
+
+	if (cs->fill != 0 && (s = compdisk_find_slots(cs->used[cs->fill], n)) >= 0) {
+		return s;
+	}
+	for (i = 0; i < cs->nphys - first; i++) {
+		b = first + (cs->hint - first + i) % (cs->nphys - first);
+		if (cs->used[b] == 0) {
+			cs->fill = b;
+			cs->hint = b + 1 < cs->nphys ? b + 1 : first;
+			memset(&cs->fill_buf, 0, BLOCK_SIZE);
+			return 0;
+		}
+	}
+	for (b = first; b < cs->nphys; b++) {
+		if ((s = compdisk_find_slots(cs->used[b], n)) >= 0 &&
+						(*cs->below->read)(cs->below, b, &cs->fill_buf) == 0) {
+			cs->fill = b;
+			return s;
+		}
+	}
+	return -1;
+}
+
+/* Write the map block that holds the entry of the given logical block.
+ */
+static int compdisk_write_map(struct compdisk_state *cs, block_no offset){
+	block_no mb = offset / COMPDISK_ENTRIES;
+
+	return (*cs->below->write)(cs->below, 1 + mb,
+					(block_t *) &cs->map[mb * COMPDISK_ENTRIES]);
+}
+
+/* Release the slots of a map entry that is no longer in use.  If that
+ * frees up the whole physical block, the block below is discarded.
+ */
+static void compdisk_release(struct compdisk_state *cs, uint32_t e){
+	block_no b = ENTRY_BLOCK(e);
+
+	cs->used[b] &= ~(((1 << ENTRY_NSLOTS(e)) - 1) << ENTRY_SLOT(e));
+	if (cs->used[b] == 0 && b != cs->fill) {
+		(void) block_range_discard(cs->below, b, 1);
+	}
+}
+
+static int compdisk_write(block_if bi, block_no offset, block_t *block){
+	struct compdisk_state *cs = bi->state;
+	unsigned char data[BLOCK_SIZE];
+	uint32_t e;
+
+	if (offset >= cs->nlogical) {
+		fprintf(stderr, "compdisk_write: offset too large\n");
+		return -1;
+	}
+	cs->nwrites++;
+	cs->bytes_in += BLOCK_SIZE;
+
+	/* See if the block is all zeroes.
+	 */
+	unsigned int i;
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		if (block->bytes[i] != 0) {
+			break;
+		}
+	}
+
+	if (i == BLOCK_SIZE) {
+		cs->nzero++;
+		e = 0;
+	}
+	else {
+		/* Compress it.  If it takes all slots anyway, store it as is.
+		 */
+		int size = compdisk_compress(block, &data[2],
+							(COMPDISK_NSLOTS - 1) * COMPDISK_SLOT_SIZE - 2);
+		if (size < 0) {
+			cs->nraw++;
+			size = BLOCK_SIZE;
+		}
+		else {
+			data[0] = size & 0xFF;
+			data[1] = size >> 8;
+			size += 2;
+		}
+		unsigned int n = (size + COMPDISK_SLOT_SIZE - 1) / COMPDISK_SLOT_SIZE;
+		int s = compdisk_alloc(cs, n);
+		if (s < 0) {
+			fprintf(stderr, "compdisk_write: out of space\n");
+			return -1;
+		}
+		cs->bytes_out += n * COMPDISK_SLOT_SIZE;
+
+		/* Write the data.
+		 */
+		if (n == COMPDISK_NSLOTS) {
+			cs->fill_buf = *block;
+			e = ENTRY(cs->fill, 0, n) | ENTRY_RAW;
+		}
+		else {
+			memcpy(&cs->fill_buf.bytes[s * COMPDISK_SLOT_SIZE], data, size);
+			e = ENTRY(cs->fill, s, n);
+		}
+		if ((*cs->below->write)(cs->below, cs->fill, &cs->fill_buf) < 0) {
+			return -1;
+		}
+		cs->used[cs->fill] |= ((1 << n) - 1) << s;
+	}
+
+	/* Update the map and then free the old slots.
+	 */
+	uint32_t old = cs->map[offset];
+	cs->map[offset] = e;
+	if (compdisk_write_map(cs, offset) < 0) {
+		cs->map[offset] = old;
+		return -1;
+	}
+	if (old != 0) {
+		compdisk_release(cs, old);
+	}
+	return 0;
+}
+
+/* Unmap the given blocks, writing each affected map block once.
+ */
+static int compdisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct compdisk_state *cs = bi->state;
+
+	if (offset > cs->nlogical || nblocks > cs->nlogical - offset) {
+		fprintf(stderr, "compdisk_discard: offset too large\n");
+		return -1;
+	}
+	while (nblocks > 0) {
+		block_no n = COMPDISK_ENTRIES - offset % COMPDISK_ENTRIES, i;
+		if (n > nblocks) {
+			n = nblocks;
+		}
+
+		/* Update this map block, and free the slots only once it is
+		 * written.
+		 */
+		uint32_t old[COMPDISK_ENTRIES];
+		bool_t dirty = False;
+		for (i = 0; i < n; i++) {
+			old[i] = cs->map[offset + i];
+			if (old[i] != 0) {
+				cs->map[offset + i] = 0;
+				dirty = True;
+			}
+		}
+		if (dirty) {
+			if (compdisk_write_map(cs, offset) < 0) {
+				memcpy(&cs->map[offset], old, n * sizeof(old[0]));
+				return -1;
+			}
+			for (i = 0; i < n; i++) {
+				if (old[i] != 0) {
+					compdisk_release(cs, old[i]);
+				}
+			}
+		}
+		offset += n;
+		nblocks -= n;
+	}
+	return 0;
+}
+
+void compdisk_dump_stats(block_if bi){
+	struct compdisk_state *cs = bi->state;
+
+	printf("!$COMP: #writes:        %lu\n", cs->nwrites);
+	printf("!$COMP: #zero blocks:   %lu\n", cs->nzero);
+	printf("!$COMP: #uncompressed:  %lu\n", cs->nraw);
+	printf("!$COMP: bytes in:       %lu\n", cs->bytes_in);
+	printf("!$COMP: bytes out:      %lu\n", cs->bytes_out);
+}
+
+static void compdisk_destroy(block_if bi){
+	struct compdisk_state *cs = bi->state;
+
+	free(cs->map);
+	free(cs->used);
+	free(cs);
+	free(bi);
+}
+
+/* Set up a new compdisk on an empty block store.
+ */
+static int compdisk_format(block_if below, block_no nphys){
+	union {
+		struct compdisk_header hdr;
+		block_t block;
+	} u;
+	memset(&u, 0, sizeof(u));
+	u.hdr.magic = COMPDISK_MAGIC;
+	u.hdr.nmap = (COMPDISK_RATIO * nphys + COMPDISK_ENTRIES - 1) / COMPDISK_ENTRIES;
+	if (nphys < u.hdr.nmap + 3) {
+		fprintf(stderr, "compdisk_format: too few blocks\n");
+		return -1;
+	}
+	u.hdr.nlogical = COMPDISK_RATIO * (nphys - 2 - u.hdr.nmap);
+
+	/* The map starts out empty.
+	 */
+	block_t null_block;
+	memset(&null_block, 0, sizeof(null_block));
+	block_no b;
+	for (b = 1; b <= u.hdr.nmap; b++) {
+		if ((*below->write)(below, b, &null_block) < 0) {
+			return -1;
+		}
+	}
+	return (*below->write)(below, 0, &u.block);
+}
+
+block_if compdisk_init(block_if below){
+	union {
+		struct compdisk_header hdr;
+		block_t block;
+	} u;
+
+	int nphys = (*below->nblocks)(below);
+	if (nphys < 0 || (*below->read)(below, 0, &u.block) < 0) {
+		return 0;
+	}
+
+	/* Format the block store if it is empty.
+	 */
+	if (u.hdr.magic != COMPDISK_MAGIC) {
+		unsigned int i;
+		for (i = 0; i < BLOCK_SIZE; i++) {
+			if (u.block.bytes[i] != 0) {
+				return 0;
+			}
+		}
+		if (compdisk_format(below, nphys) < 0 ||
+						(*below->read)(below, 0, &u.block) < 0) {
+			return 0;
+		}
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct compdisk_state *cs = new_alloc(struct compdisk_state);
+	cs->below = below;
+	cs->nlogical = u.hdr.nlogical;
+	cs->nmap = u.hdr.nmap;
+	cs->nphys = nphys;
+	cs->hint = cs->nmap + 1;
+	cs->map = calloc(cs->nmap, BLOCK_SIZE);
+	cs->used = calloc(cs->nphys, 1);
+
+	/* Read the mapping table and find out which slots are in use.
+	 */
+	block_no b;
+	for (b = 0; b < cs->nmap; b++) {
+		if ((*below->read)(below, 1 + b, (block_t *) &cs->map[b * COMPDISK_ENTRIES]) < 0) {
+			free(cs->map);
+			free(cs->used);
+			free(cs);
+			return 0;
+		}
+	}
+	for (b = 0; b < cs->nlogical; b++) {
+		uint32_t e = cs->map[b];
+		if (e != 0) {
+			cs->used[ENTRY_BLOCK(e)] |= ((1 << ENTRY_NSLOTS(e)) - 1) << ENTRY_SLOT(e);
+		}
+	}
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = new_alloc(block_store_t);
+	bi->state = cs;
+	bi->nblocks = compdisk_nblocks;
+	bi->setsize = compdisk_setsize;
+	bi->read = compdisk_read;
+	bi->write = compdisk_write;
+	bi->destroy = compdisk_destroy;
+	bi->discard = compdisk_discard;
+	return bi;
+}
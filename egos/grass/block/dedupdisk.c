@@ -0,0 +1,528 @@
+/* This block store module stores identical blocks only once.
+ *
+ *		block_if dedupdisk_init(block_if below)
+ *			'below' is the underlying block store.  If it is empty (block 0
+ *			is all zeroes), it is formatted.  If it holds a dedupdisk, the
+ *			existing one is used.  Otherwise it holds something that was
+ *			not written by dedupdisk, and 0 is returned.
+ *
+ *		void dedupdisk_dump_stats(block_if bi)
+ *			Prints the deduplication statistics.
+ *
+ * Each logical block maps to a physical block, which may be shared by
+ * several logical blocks.  Blocks are fingerprinted with SHA-256.  An index
+ * from fingerprint to physical block finds earlier copies of a block that
+ * is written, and a copy is shared only after comparing the contents, so
+ * fingerprint collisions do no harm.  A reference count per physical block
+ * keeps track of the sharing.  Blocks that are all zeroes are not stored.
+ *
+ * The layout of the underlying block store is as follows:
+ *
+ *		block 0:					header (magic number and sizes)
+ *		blocks 1 .. nmap:			mapping table, one entry per logical block
+ *		the next nfp blocks:		fingerprint per physical block
+ *		the remaining blocks:		data
+ *
+ * The mapping and fingerprint tables are kept in memory and written
+ * through.  The reference counts and the index are determined from them
+ * when the block store is opened.  A block that is not shared is
+ * overwritten in place.  Otherwise the new contents go to a free block
+ * before the map entry is changed, so the block store is consistent at
+ * all times.  A fingerprint may be out of date after a crash, which only
+ * means that the block will not be found for sharing.  Physical blocks
+ * that are no longer referenced are discarded below.
+ *
+ * Copying blocks within the block store only shares the physical blocks.
+ * As they are then no longer overwritten in place, a later write to either
+ * copy goes to a block of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "grass.h"
+#include "block_store.h"
+#include "../../lib/sha256.h"
+
+#define DEDUPDISK_MAGIC		0x44445550		// "DDUP"
+#define DEDUPDISK_MAPENT	(BLOCK_SIZE / sizeof(uint32_t))	// per map block
+#define DEDUPDISK_FPENT		(BLOCK_SIZE / sizeof(uint64_t))	// per fp block
+
+struct dedupdisk_header {
+	uint32_t magic;
+	uint32_t nlogical;			// #logical blocks
+	uint32_t nmap;				// #blocks in the mapping table
+	uint32_t nfp;				// #blocks in the fingerprint table
+};
+
+struct dedupdisk_state {
+	block_if below;				// block store below
+	block_no nlogical;			// #logical blocks
+	block_no nmap, nfp;			// #blocks in the tables
+	block_no nphys;				// #physical blocks below
+	block_no first;				// first data block
+	uint32_t *map;				// logical to physical block (0 if zeroes)
+	uint64_t *fp;				// fingerprint per physical block
+	uint32_t *refcnt;			// reference count per physical block
+	block_no hint;				// where to look for free blocks next
+
+	/* The index is a hash table with chaining through the physical blocks.
+	 */
+	block_no *buckets;
+	block_no *next;
+	unsigned int nbuckets;		// power of 2
+
+	/* Stats.
+	 */
+	unsigned long nwrites, nzero, nshared, ninplace, ncopied;
+};
+
+static uint64_t dedupdisk_fingerprint(block_t *block){
+	sha256_context sc;
+	uint8 digest[SHA256_SIZE];
+	uint64_t fp;
+
+	sha256_starts(&sc);
+	sha256_update(&sc, (const uint8 *) block->bytes, BLOCK_SIZE);
+	sha256_finish(&sc, digest);
+	memcpy(&fp, digest, sizeof(fp));
+	return fp;
+}
+
+static unsigned int dedupdisk_bucket(struct dedupdisk_state *ds, uint64_t fp){
+	return (unsigned int) fp & (ds->nbuckets - 1);
+}
+
+static void dedupdisk_index_add(struct dedupdisk_state *ds, block_no p){
+	unsigned int h = dedupdisk_bucket(ds, ds->fp[p]);
+
+	ds->next[p] = ds->buckets[h];
+	ds->buckets[h] = p;
+}
+
+static void dedupdisk_index_remove(struct dedupdisk_state *ds, block_no p){
+	block_no *pp = &ds->buckets[dedupdisk_bucket(ds, ds->fp[p])];
+
+	while (*pp != 0) {
+		if (*pp == p) {
+			*pp = ds->next[p];
+			return;
+		}
+		pp = &ds->next[*pp];
+	}
+}
+
+/* Find a physical block with the same contents, or return 0.
+ */
+static block_no dedupdisk_lookup(struct dedupdisk_state *ds, uint64_t fp, block_t *block){
+	block_no p;
+	block_t copy;
+
+	for (p = ds->buckets[dedupdisk_bucket(ds, fp)]; p != 0; p = ds->next[p]) {
+		if (ds->fp[p] == fp && (*ds->below->read)(ds->below, p, &copy) == 0 &&
+								memcmp(&copy, block, BLOCK_SIZE) == 0) {
+			return p;
+		}
+	}
+	return 0;
+}
+
+static int dedupdisk_nblocks(block_if bi){
+	struct dedupdisk_state *ds = bi->state;
+
+	return ds->nlogical;
+}
+
+static int dedupdisk_setsize(block_if bi, block_no nblocks){
+	fprintf(stderr, "dedupdisk_setsize: not supported\n");
+	return -1;
+}
+
+static int dedupdisk_read(block_if bi, block_no offset, block_t *block){
+	struct dedupdisk_state *ds = bi->state;
+
+	if (offset >= ds->nlogical) {
+		fprintf(stderr, "dedupdisk_read: offset too large\n");
+		return -1;
+	}
+	if (ds->map[offset] == 0) {
+		memset(block, 0, BLOCK_SIZE);
+		return 0;
+	}
+	return (*ds->below->read)(ds->below, ds->map[offset], block);
+}
+
+/* Write the map or fingerprint table block that holds the given entry.
+ */
+static int dedupdisk_write_map(struct dedupdisk_state *ds, block_no offset){
+	block_no mb = offset / DEDUPDISK_MAPENT;
+
+	return (*ds->below->write)(ds->below, 1 + mb,
+					(block_t *) &ds->map[mb * DEDUPDISK_MAPENT]);
+}
+
+static int dedupdisk_write_fp(struct dedupdisk_state *ds, block_no p){
+	block_no fb = p / DEDUPDISK_FPENT;
+
+	return (*ds->below->write)(ds->below, 1 + ds->nmap + fb,
+					(block_t *) &ds->fp[fb * DEDUPDISK_FPENT]);
+}
+
+/* Find a free physical block, or return 0.
+ */
+static block_no dedupdisk_alloc(struct dedupdisk_state *ds){
+	block_no n = ds->nphys - ds->first, i;
+
+	for (i = 0; i < n; i++) {
+		block_no p = ds->first + (ds->hint - ds->first + i) % n;
+		if (ds->refcnt[p] == 0) {
+			ds->hint = p + 1 < ds->nphys ? p + 1 : ds->first;
+			return p;
+		}
+	}
+	return 0;
+}
+
+/* Drop a reference to a physical block.  The last one discards it.
+ */
+static void dedupdisk_release(struct dedupdisk_state *ds, block_no p){
+	if (p != 0 && --ds->refcnt[p] == 0) {
+		dedupdisk_index_remove(ds, p);
+		(void) block_range_discard(ds->below, p, 1);
+	}
+}
+
+static int dedupdisk_write(block_if bi, block_no offset, block_t *block){
+	struct dedupdisk_state *ds = bi->state;
+	block_no old, p;
+
+	if (offset >= ds->nlogical) {
+		fprintf(stderr, "dedupdisk_write: offset too large\n");
+		return -1;
+	}
+	ds->nwrites++;
+	old = ds->map[offset];
+
+	/* See if the block is all zeroes.
+	 */
+	unsigned int i;
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		if (block->bytes[i] != 0) {
+			break;
+		}
+	}
+	if (i == BLOCK_SIZE) {
+		ds->nzero++;
+		p = 0;
+	}
+	else {
+		uint64_t fp = dedupdisk_fingerprint(block);
+
+		if ((p = dedupdisk_lookup(ds, fp, block)) != 0) {
+			/* Share an existing copy.
+			 */
+			if (p == old) {
+				return 0;
+			}
+			ds->nshared++;
+			ds->refcnt[p]++;
+		}
+		else if (old != 0 && ds->refcnt[old] == 1) {
+			/* Not shared, so overwrite in place.
+			 */
+			ds->ninplace++;
+			dedupdisk_index_remove(ds, old);
+			ds->fp[old] = fp;
+			dedupdisk_index_add(ds, old);
+			if ((*ds->below->write)(ds->below, old, block) < 0) {
+				return -1;
+			}
+			return dedupdisk_write_fp(ds, old);
+		}
+		else {
+			/* Store a new copy.
+			 */
+			if ((p = dedupdisk_alloc(ds)) == 0) {
+				fprintf(stderr, "dedupdisk_write: out of space\n");
+				return -1;
+			}
+			if ((*ds->below->write)(ds->below, p, block) < 0) {
+				return -1;
+			}
+			ds->fp[p] = fp;
+			if (dedupdisk_write_fp(ds, p) < 0) {
+				return -1;
+			}
+			ds->refcnt[p] = 1;
+			dedupdisk_index_add(ds, p);
+		}
+	}
+
+	/* Update the map and then release the old block.
+	 */
+	ds->map[offset] = p;
+	if (dedupdisk_write_map(ds, offset) < 0) {
+		ds->map[offset] = old;
+		dedupdisk_release(ds, p);
+		return -1;
+	}
+	dedupdisk_release(ds, old);
+	return 0;
+}
+
+/* Unmap the given blocks, writing each affected map block once.
+ */
+static int dedupdisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct dedupdisk_state *ds = bi->state;
+
+	if (offset > ds->nlogical || nblocks > ds->nlogical - offset) {
+		fprintf(stderr, "dedupdisk_discard: offset too large\n");
+		return -1;
+	}
+	while (nblocks > 0) {
+		block_no n = DEDUPDISK_MAPENT - offset % DEDUPDISK_MAPENT, i;
+		if (n > nblocks) {
+			n = nblocks;
+		}
+
+		/* Update this map block, and drop the references only once it
+		 * is written.
+		 */
+		uint32_t old[DEDUPDISK_MAPENT];
+		bool_t dirty = False;
+		for (i = 0; i < n; i++) {
+			old[i] = ds->map[offset + i];
+			if (old[i] != 0) {
+				ds->map[offset + i] = 0;
+				dirty = True;
+			}
+		}
+		if (dirty) {
+			if (dedupdisk_write_map(ds, offset) < 0) {
+				memcpy(&ds->map[offset], old, n * sizeof(old[0]));
+				return -1;
+			}
+			for (i = 0; i < n; i++) {
+				dedupdisk_release(ds, old[i]);
+			}
+		}
+		offset += n;
+		nblocks -= n;
+	}
+	return 0;
+}
+
+/* Copy blocks by sharing the physical blocks, writing each affected map
+ * block once.  Blocks of another block store are read and written.
+ */
+static int dedupdisk_copy(block_if bi, block_no offset, block_if src,
+										block_no src_offset, block_no nblocks){
+	struct dedupdisk_state *ds = bi->state;
+
+	if (src->state != ds) {
+		block_t block;
+		block_no i;
+		for (i = 0; i < nblocks; i++) {
+			if ((*src->read)(src, src_offset + i, &block) < 0 ||
+							dedupdisk_write(bi, offset + i, &block) < 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	if (offset > ds->nlogical || nblocks > ds->nlogical - offset ||
+			src_offset > ds->nlogical || nblocks > ds->nlogical - src_offset) {
+		fprintf(stderr, "dedupdisk_copy: offset too large\n");
+		return -1;
+	}
+	while (nblocks > 0) {
+		block_no n = DEDUPDISK_MAPENT - offset % DEDUPDISK_MAPENT, i;
+		if (n > nblocks) {
+			n = nblocks;
+		}
+
+		/* Take the new references first, and drop the old ones only once
+		 * the map block is written.
+		 */
+		uint32_t old[DEDUPDISK_MAPENT];
+		bool_t dirty = False;
+		for (i = 0; i < n; i++) {
+			block_no p = ds->map[src_offset + i];
+			old[i] = ds->map[offset + i];
+			if (p != old[i]) {
+				if (p != 0) {
+					ds->refcnt[p]++;
+				}
+				ds->map[offset + i] = p;
+				dirty = True;
+			}
+		}
+		if (dirty) {
+			if (dedupdisk_write_map(ds, offset) < 0) {
+				for (i = 0; i < n; i++) {
+					if (ds->map[offset + i] != old[i]) {
+						dedupdisk_release(ds, ds->map[offset + i]);
+						ds->map[offset + i] = old[i];
+					}
+				}
+				return -1;
+			}
+			for (i = 0; i < n; i++) {
+				if (ds->map[offset + i] != old[i]) {
+					dedupdisk_release(ds, old[i]);
+				}
+			}
+		}
+		ds->ncopied += n;
+		offset += n;
+		src_offset += n;
+		nblocks -= n;
+	}
+	return 0;
+}
+
+void dedupdisk_dump_stats(block_if bi){
+	struct dedupdisk_state *ds = bi->state;
+	block_no p, nused = 0;
+
+	for (p = ds->first; p < ds->nphys; p++) {
+		if (ds->refcnt[p] != 0) {
+			nused++;
+		}
+	}
+	printf("!$DEDUP: #writes:        %lu\n", ds->nwrites);
+	printf("!$DEDUP: #zero blocks:   %lu\n", ds->nzero);
+	printf("!$DEDUP: #shared:        %lu\n", ds->nshared);
+	printf("!$DEDUP: #in place:      %lu\n", ds->ninplace);
+	printf("!$DEDUP: #copied:        %lu\n", ds->ncopied);
+	printf("!$DEDUP: #blocks in use: %u\n", nused);
+}
+
+static void dedupdisk_destroy(block_if bi){
+	struct dedupdisk_state *ds = bi->state;
+
+	free(ds->map);
+	free(ds->fp);
+	free(ds->refcnt);
+	free(ds->buckets);
+	free(ds->next);
+	free(ds);
+	free(bi);
+}
+
+/* Set up a new dedupdisk on an empty block store.
+ */
+static int dedupdisk_format(block_if below, block_no nphys){
+	union {
+		struct dedupdisk_header hdr;
+		block_t block;
+	} u;
+	memset(&u, 0, sizeof(u));
+	u.hdr.magic = DEDUPDISK_MAGIC;
+	u.hdr.nfp = (nphys + DEDUPDISK_FPENT - 1) / DEDUPDISK_FPENT;
+	u.hdr.nmap = (nphys + DEDUPDISK_MAPENT - 1) / DEDUPDISK_MAPENT;
+	if (nphys < 2 + u.hdr.nmap + u.hdr.nfp) {
+		fprintf(stderr, "dedupdisk_format: too few blocks\n");
+		return -1;
+	}
+	u.hdr.nlogical = nphys - 1 - u.hdr.nmap - u.hdr.nfp;
+
+	/* The tables start out empty.
+	 */
+	block_t null_block;
+	memset(&null_block, 0, sizeof(null_block));
+	block_no b;
+	for (b = 1; b <= u.hdr.nmap + u.hdr.nfp; b++) {
+		if ((*below->write)(below, b, &null_block) < 0) {
+			return -1;
+		}
+	}
+	return (*below->write)(below, 0, &u.block);
+}
+
+block_if dedupdisk_init(block_if below){
+	union {
+		struct dedupdisk_header hdr;
+		block_t block;
+	} u;
+
+	int nphys = (*below->nblocks)(below);
+	if (nphys < 0 || (*below->read)(below, 0, &u.block) < 0) {
+		return 0;
+	}
+
+	/* Format the block store if it is empty.
+	 */
+	if (u.hdr.magic != DEDUPDISK_MAGIC) {
+		unsigned int i;
+		for (i = 0; i < BLOCK_SIZE; i++) {
+			if (u.block.bytes[i] != 0) {
+				return 0;
+			}
+		}
+		if (dedupdisk_format(below, nphys) < 0 ||
+						(*below->read)(below, 0, &u.block) < 0) {
+			return 0;
+		}
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct dedupdisk_state *ds = new_alloc(struct dedupdisk_state);
+	ds->below = below;
+	ds->nlogical = u.hdr.nlogical;
+	ds->nmap = u.hdr.nmap;
+	ds->nfp = u.hdr.nfp;
+	ds->nphys = nphys;
+	ds->first = 1 + ds->nmap + ds->nfp;
+	ds->hint = ds->first;
+	ds->map = calloc(ds->nmap, BLOCK_SIZE);
+	ds->fp = calloc(ds->nfp, BLOCK_SIZE);
+	ds->refcnt = calloc(ds->nphys, sizeof(*ds->refcnt));
+	for (ds->nbuckets = 1; ds->nbuckets < ds->nphys; ds->nbuckets <<= 1)
+		;
+	ds->buckets = calloc(ds->nbuckets, sizeof(*ds->buckets));
+	ds->next = calloc(ds->nphys, sizeof(*ds->next));
+
+	/* Read the tables (which are adjacent), count the references, and
+	 * build the index.
+	 */
+	block_no b;
+	for (b = 0; b < ds->nmap + ds->nfp; b++) {
+		block_t *dst = b < ds->nmap ? (block_t *) &ds->map[b * DEDUPDISK_MAPENT] :
+						(block_t *) &ds->fp[(b - ds->nmap) * DEDUPDISK_FPENT];
+		if ((*below->read)(below, 1 + b, dst) < 0) {
+			free(ds->map);
+			free(ds->fp);
+			free(ds->refcnt);
+			free(ds->buckets);
+			free(ds->next);
+			free(ds);
+			return 0;
+		}
+	}
+	for (b = 0; b < ds->nlogical; b++) {
+		if (ds->map[b] != 0) {
+			ds->refcnt[ds->map[b]]++;
+		}
+	}
+	for (b = ds->first; b < ds->nphys; b++) {
+		if (ds->refcnt[b] != 0) {
+			dedupdisk_index_add(ds, b);
+		}
+	}
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ds;
+	bi->nblocks = dedupdisk_nblocks;
+	bi->setsize = dedupdisk_setsize;
+	bi->read = dedupdisk_read;
+	bi->write = dedupdisk_write;
+	bi->destroy = dedupdisk_destroy;
+	bi->discard = dedupdisk_discard;
+	bi->copy = dedupdisk_copy;
+	return bi;
+}
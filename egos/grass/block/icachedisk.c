@@ -0,0 +1,290 @@
+/* This block store module caches the blocks of a file, above the file
+ * system rather than below it, so that a hit does not require walking
+ * the file system's data structures.  One cache of blocks, keyed by
+ * inode and block number, is shared by the files of a file system.  The
+ * cache is write-through and uses LRU replacement.
+ *
+ *		struct icache *icache_create(block_t *blocks, block_no nblocks)
+ *			Create a cache in the given chunk of memory of 'nblocks'
+ *			blocks.
+ *
+ *		block_if icachedisk_init(block_if below, struct icache *ic,
+ *												unsigned int inode)
+ *			'below' is the block store of file 'inode', which is cached
+ *			in 'ic'.  Blocks are dropped from the cache when the file
+ *			shrinks or they are discarded or copied over, and updated
+ *			when written.  Holes are cached too, and reported as such on
+ *			a hit.
+ *
+ *		void icache_dump_stats(struct icache *ic)
+ *			Prints the cache statistics.
+ *
+ * Nothing else may write the files below while they are cached.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "grass.h"
+#include "block_store.h"
+
+/* Per block in the cache we keep track of the following info:
+ */
+struct icache_entry {
+	struct icache_entry *prev, *next;	// LRU list, most recent first
+	struct icache_entry *chain;			// hash bucket
+	bool_t used;						// whether it holds a block
+	bool_t hole;						// whether the block is a hole
+	unsigned int inode;
+	block_no offset;
+};
+
+struct icache {
+	block_t *blocks;				// memory for caching blocks
+	block_no nblocks;				// size of cache
+	struct icache_entry *entries;	// one per block in the cache
+	struct icache_entry *lru;		// most recently used entry
+	struct icache_entry **buckets;	// hash table of used entries
+	block_no nbuckets;
+
+	/* Stats.
+	 */
+	unsigned int read_hit, read_miss, write_hit, write_miss, dropped;
+};
+
+struct icachedisk_state {
+	block_if below;				// block store below
+	struct icache *ic;			// shared cache
+	unsigned int inode;			// inode number of this file
+};
+
+static unsigned int icache_hash(struct icache *ic, unsigned int inode, block_no offset){
+	return (inode * 0x9E3779B1 + offset) % ic->nbuckets;
+}
+
+static struct icache_entry *icache_lookup(struct icache *ic, unsigned int inode, block_no offset){
+	struct icache_entry *ie;
+
+	for (ie = ic->buckets[icache_hash(ic, inode, offset)]; ie != 0; ie = ie->chain) {
+		if (ie->inode == inode && ie->offset == offset) {
+			break;
+		}
+	}
+	return ie;
+}
+
+/* Make the given entry the most recently used one.
+ */
+static void icache_touch(struct icache *ic, struct icache_entry *ie){
+	if (ic->lru == ie) {
+		return;
+	}
+	ie->prev->next = ie->next;
+	ie->next->prev = ie->prev;
+	ie->next = ic->lru;
+	ie->prev = ic->lru->prev;
+	ie->prev->next = ie;
+	ie->next->prev = ie;
+	ic->lru = ie;
+}
+
+static void icache_drop(struct icache *ic, struct icache_entry *ie){
+	struct icache_entry **pie;
+
+	for (pie = &ic->buckets[icache_hash(ic, ie->inode, ie->offset)]; *pie != ie; pie = &(*pie)->chain)
+		;
+	*pie = ie->chain;
+	ie->used = False;
+
+	/* Make it the least recently used, so it is reused first.
+	 */
+	icache_touch(ic, ie);
+	ic->lru = ie->next;
+}
+
+/* Put a copy of the given block in the cache.
+ */
+static void icache_put(struct icache *ic, unsigned int inode, block_no offset,
+											block_t *block, bool_t hole){
+	struct icache_entry *ie = icache_lookup(ic, inode, offset);
+
+	if (ie == 0) {
+		ie = ic->lru->prev;
+		if (ie->used) {
+			icache_drop(ic, ie);
+		}
+		ie->used = True;
+		ie->inode = inode;
+		ie->offset = offset;
+		unsigned int h = icache_hash(ic, inode, offset);
+		ie->chain = ic->buckets[h];
+		ic->buckets[h] = ie;
+	}
+	icache_touch(ic, ie);
+	ie->hole = hole;
+	memcpy(&ic->blocks[ie - ic->entries], block, BLOCK_SIZE);
+}
+
+static int icachedisk_nblocks(block_if bi){
+	struct icachedisk_state *is = bi->state;
+
+	return (*is->below->nblocks)(is->below);
+}
+
+static int icachedisk_setsize(block_if bi, block_no nblocks){
+	struct icachedisk_state *is = bi->state;
+	struct icache *ic = is->ic;
+	block_no i;
+
+	for (i = 0; i < ic->nblocks; i++) {
+		struct icache_entry *ie = &ic->entries[i];
+		if (ie->used && ie->inode == is->inode && ie->offset >= nblocks) {
+			icache_drop(ic, ie);
+			ic->dropped++;
+		}
+	}
+	return (*is->below->setsize)(is->below, nblocks);
+}
+
+/* Drop the cached blocks of the given range of the file.
+ */
+static void icachedisk_drop_range(struct icachedisk_state *is, block_no offset,
+														block_no nblocks){
+	struct icache *ic = is->ic;
+	block_no i;
+
+	if (nblocks < ic->nblocks) {
+		for (i = 0; i < nblocks; i++) {
+			struct icache_entry *ie = icache_lookup(ic, is->inode, offset + i);
+			if (ie != 0) {
+				icache_drop(ic, ie);
+				ic->dropped++;
+			}
+		}
+	}
+	else {
+		for (i = 0; i < ic->nblocks; i++) {
+			struct icache_entry *ie = &ic->entries[i];
+			if (ie->used && ie->inode == is->inode && ie->offset >= offset &&
+										ie->offset - offset < nblocks) {
+				icache_drop(ic, ie);
+				ic->dropped++;
+			}
+		}
+	}
+}
+
+static int icachedisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct icachedisk_state *is = bi->state;
+
+	icachedisk_drop_range(is, offset, nblocks);
+	return block_range_discard(is->below, offset, nblocks);
+}
+
+/* Copying is done by the file system below, so that it can share blocks.
+ * The blocks of a cached source are the same below, as the cache is
+ * write-through.
+ */
+static int icachedisk_copy(block_if bi, block_no offset, block_if src,
+										block_no src_offset, block_no nblocks){
+	struct icachedisk_state *is = bi->state;
+
+	icachedisk_drop_range(is, offset, nblocks);
+	if (src->copy == icachedisk_copy) {
+		src = ((struct icachedisk_state *) src->state)->below;
+	}
+	return block_range_copy(is->below, offset, src, src_offset, nblocks);
+}
+
+static int icachedisk_read(block_if bi, block_no offset, block_t *block){
+	struct icachedisk_state *is = bi->state;
+	struct icache *ic = is->ic;
+	struct icache_entry *ie = icache_lookup(ic, is->inode, offset);
+
+	if (ie != 0) {
+		icache_touch(ic, ie);
+		memcpy(block, &ic->blocks[ie - ic->entries], BLOCK_SIZE);
+		ic->read_hit++;
+		return ie->hole ? 1 : 0;
+	}
+	ic->read_miss++;
+	int r = (*is->below->read)(is->below, offset, block);
+	if (r >= 0) {
+		icache_put(ic, is->inode, offset, block, r == 1);
+	}
+	return r;
+}
+
+static int icachedisk_write(block_if bi, block_no offset, block_t *block){
+	struct icachedisk_state *is = bi->state;
+	struct icache *ic = is->ic;
+	struct icache_entry *ie = icache_lookup(ic, is->inode, offset);
+
+	if (ie != 0) {
+		ic->write_hit++;
+	}
+	else {
+		ic->write_miss++;
+	}
+	int r = (*is->below->write)(is->below, offset, block);
+	if (r < 0) {
+		if (ie != 0) {
+			icache_drop(ic, ie);
+		}
+		return r;
+	}
+	icache_put(ic, is->inode, offset, block, False);
+	return r;
+}
+
+static void icachedisk_destroy(block_if bi){
+	free(bi->state);
+	free(bi);
+}
+
+void icache_dump_stats(struct icache *ic){
+	printf("!$ICACHE: #read hits:    %u\n", ic->read_hit);
+	printf("!$ICACHE: #read misses:  %u\n", ic->read_miss);
+	printf("!$ICACHE: #write hits:   %u\n", ic->write_hit);
+	printf("!$ICACHE: #write misses: %u\n", ic->write_miss);
+	printf("!$ICACHE: #dropped:      %u\n", ic->dropped);
+}
+
+struct icache *icache_create(block_t *blocks, block_no nblocks){
+	struct icache *ic = new_alloc(struct icache);
+	block_no i;
+
+	ic->blocks = blocks;
+	ic->nblocks = nblocks;
+	ic->entries = calloc(nblocks, sizeof(*ic->entries));
+	for (i = 0; i < nblocks; i++) {
+		ic->entries[i].next = &ic->entries[(i + 1) % nblocks];
+		ic->entries[i].prev = &ic->entries[(i + nblocks - 1) % nblocks];
+	}
+	ic->lru = &ic->entries[0];
+	ic->nbuckets = 2 * nblocks + 1;
+	ic->buckets = calloc(ic->nbuckets, sizeof(*ic->buckets));
+	return ic;
+}
+
+block_if icachedisk_init(block_if below, struct icache *ic, unsigned int inode){
+	/* Create the block store state structure.
+	 */
+	struct icachedisk_state *is = new_alloc(struct icachedisk_state);
+	is->below = below;
+	is->ic = ic;
+	is->inode = inode;
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = new_alloc(block_store_t);
+	bi->state = is;
+	bi->nblocks = icachedisk_nblocks;
+	bi->setsize = icachedisk_setsize;
+	bi->read = icachedisk_read;
+	bi->write = icachedisk_write;
+	bi->destroy = icachedisk_destroy;
+	bi->discard = icachedisk_discard;
+	bi->copy = icachedisk_copy;
+	return bi;
+}
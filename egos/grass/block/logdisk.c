@@ -0,0 +1,789 @@
+/* This block store module turns writes into sequential writes on the
+ * underlying block store, as in a log-structured file system (Rosenblum
+ * and Ousterhout, "The Design and Implementation of a Log-Structured File
+ * System", SOSP '91).
+ *
+ *		block_if logdisk_init(block_if below)
+ *			'below' is the underlying block store.  If it is empty (block 0
+ *			is all zeroes), it is formatted.  If it holds a logdisk, the
+ *			existing one is recovered.  Otherwise it holds something that
+ *			was not written by logdisk, and 0 is returned.
+ *
+ *		int logdisk_idle(block_if bi)
+ *			Does a step of background work: writing out buffered blocks,
+ *			cleaning a segment, or writing a checkpoint.  To be invoked
+ *			when the block store is otherwise idle.  Returns 1 if there
+ *			is more work to do, and 0 if not.
+ *
+ *		int logdisk_sync(block_if bi)
+ *			Writes out the buffered blocks now, so that they survive a
+ *			crash.  Returns 0 on success and -1 on failure.
+ *
+ *		void logdisk_dump_stats(block_if bi)
+ *			Prints the statistics.
+ *
+ * The layout of the underlying block store is as follows:
+ *
+ *		block 0:				header (magic number, sizes and checkpoint)
+ *		blocks 1 .. nmap:		checkpoint of the map, one entry per block
+ *		the remaining blocks:	the log, in segments of LOGDISK_SEGSIZE blocks
+ *
+ * A write does not overwrite a block in place but appends it to the log,
+ * and the map, which is kept in memory, is updated to point to the new
+ * copy.  Blocks are collected in memory and written as a "partial
+ * segment": a summary block, which holds the logical block numbers, a
+ * sequence number and a checksum, followed by the blocks themselves.  A
+ * partial segment is written when a segment is full or the block store
+ * is idle, with a single range write, so that many small writes become
+ * few large sequential ones.  Until then, the blocks are lost on a crash.
+ *
+ * Once in a while, the map blocks that have changed and then the header
+ * are written (a checkpoint).  On recovery the checkpoint is read and the
+ * partial segments written after it are applied in order ("roll
+ * forward").  A segment that no longer holds any blocks the map refers to
+ * is reused once a checkpoint has been written, as the roll forward may
+ * need it until then.  The cleaner makes free segments by copying the
+ * blocks that are still in use in the segment that has fewest of them to
+ * the head of the log.  It runs when the block store is idle and there
+ * are few free segments, and when a write finds the log about to run out
+ * of them.
+ *
+ * A discarded block is unmapped, and the discard is recorded in the
+ * summary of the partial segment being collected, after the logical
+ * block numbers of the blocks, so that the roll forward applies it too.
+ * Free segments are in turn discarded below when a checkpoint is written.
+ *
+ * The block store offers LOGDISK_UTIL percent of the log as logical
+ * blocks, so that the cleaner can always find segments worth cleaning.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "grass.h"
+#include "block_store.h"
+
+#define LOGDISK_MAGIC		0x4c4f4744		// "LOGD"
+#define LOGDISK_SEGSIZE		32				// blocks per segment
+#define LOGDISK_UTIL		80				// % of the log offered
+#define LOGDISK_RESERVE		2				// free segments kept for cleaning
+#define LOGDISK_IDLE_FREE	8				// free segments the idle cleaner aims for
+#define LOGDISK_CKPT_SEGS	8				// segments filled between checkpoints
+#define LOGDISK_ENTRIES		(BLOCK_SIZE / sizeof(uint32_t))	// per map block
+#define LOGDISK_SUMENT		(LOGDISK_ENTRIES - 5)			// per summary
+#define LOGDISK_NOSEG		((block_no) -1)
+
+struct logdisk_header {
+	uint32_t magic;
+	uint32_t nlogical;			// #logical blocks
+	uint32_t nmap;				// #blocks in the map
+	uint32_t nsegs;				// #segments in the log
+	uint32_t seq;				// seq. number of the next partial segment
+	uint32_t seg, off;			// where it goes (seg is ~0 if not known)
+};
+
+/* The summary block at the start of a partial segment.  The logical
+ * block numbers of the n blocks that follow are followed by those of
+ * ndiscard discarded blocks.
+ */
+struct logdisk_summary {
+	uint32_t magic;
+	uint32_t seq;				// sequence number
+	uint32_t n;					// #blocks that follow
+	uint32_t checksum;			// of those blocks and the discards
+	uint32_t logical[LOGDISK_SUMENT];	// logical block numbers
+	uint32_t ndiscard;			// #discarded blocks
+};
+
+struct logdisk_state {
+	block_if below;				// block store below
+	block_no nlogical;			// #logical blocks
+	block_no nmap;				// #map blocks
+	block_no nsegs;				// #segments
+	uint32_t *map;				// logical to physical block, 0 if unwritten
+	unsigned char *dirty;		// map blocks changed since the checkpoint
+	block_no *live;				// per segment, #blocks the map refers to
+	uint32_t *last_seq;			// per segment, seq. of its last partial segment
+	unsigned char *trimmed;		// per segment, discarded below since last used
+
+	uint32_t seq;				// seq. number of the next partial segment
+	uint32_t ckpt_seq;			// seq. number at the last checkpoint
+	block_no seg, off;			// head of the log (seg may be LOGDISK_NOSEG)
+	unsigned int nfilled;		// segments filled since the checkpoint
+
+	/* The partial segment being collected, summary first.
+	 */
+	block_t *pending;
+	block_no npending;
+	uint32_t *discards;			// blocks discarded since
+	block_no ndiscards;
+
+	block_t *segbuf;			// a segment being cleaned
+
+	/* Stats.
+	 */
+	unsigned long nwrites, nabsorbed, npartials, nwritten, ncleaned, nmoved;
+	unsigned long ncheckpoints, nrolled, ndiscarded;
+};
+
+/* The checksum of a partial segment covers its blocks and, if there are
+ * any, the discards in its summary.
+ */
+static uint32_t logdisk_checksum(struct logdisk_summary *summary, block_t *blocks){
+	uint32_t *p = (uint32_t *) blocks, sum = 0;
+	unsigned long i;
+
+	for (i = 0; i < summary->n * LOGDISK_ENTRIES; i++) {
+		sum = (sum << 5) + (sum >> 27) + p[i];
+	}
+	for (i = 0; i < summary->ndiscard; i++) {
+		sum = (sum << 5) + (sum >> 27) + summary->logical[summary->n + i];
+	}
+	return sum;
+}
+
+static block_no logdisk_phys(struct logdisk_state *ls, block_no seg, block_no off){
+	return 1 + ls->nmap + seg * LOGDISK_SEGSIZE + off;
+}
+
+static block_no logdisk_seg(struct logdisk_state *ls, block_no phys){
+	return (phys - 1 - ls->nmap) / LOGDISK_SEGSIZE;
+}
+
+/* See if the given physical block is in the partial segment being
+ * collected, and if so return its index in ls->pending.
+ */
+static block_no logdisk_pending(struct logdisk_state *ls, block_no phys){
+	if (ls->npending == 0) {
+		return 0;
+	}
+	block_no start = logdisk_phys(ls, ls->seg, ls->off);
+	return phys > start && phys <= start + ls->npending ? phys - start : 0;
+}
+
+/* Make logical block 'offset' refer to the given physical block.
+ */
+static void logdisk_map(struct logdisk_state *ls, block_no offset, block_no phys){
+	uint32_t old = ls->map[offset];
+
+	if (old != 0) {
+		ls->live[logdisk_seg(ls, old)]--;
+	}
+	ls->map[offset] = phys;
+	ls->live[logdisk_seg(ls, phys)]++;
+	ls->dirty[offset / LOGDISK_ENTRIES] = 1;
+}
+
+/* Count the segments without blocks in use, other than the head.
+ */
+static block_no logdisk_nfree(struct logdisk_state *ls){
+	block_no s, n = 0;
+
+	for (s = 0; s < ls->nsegs; s++) {
+		if (ls->live[s] == 0 && s != ls->seg) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Write the partial segment being collected.
+ */
+static int logdisk_flush(struct logdisk_state *ls){
+	if (ls->npending == 0 && ls->ndiscards == 0) {
+		return 0;
+	}
+
+	struct logdisk_summary *sum = (struct logdisk_summary *) &ls->pending[0];
+	sum->magic = LOGDISK_MAGIC;
+	sum->seq = ls->seq;
+	sum->n = ls->npending;
+	memcpy(&sum->logical[ls->npending], ls->discards, ls->ndiscards * sizeof(uint32_t));
+	sum->ndiscard = ls->ndiscards;
+	sum->checksum = logdisk_checksum(sum, &ls->pending[1]);
+	if (block_range_write(ls->below, logdisk_phys(ls, ls->seg, ls->off),
+										1 + ls->npending, ls->pending) < 0) {
+		fprintf(stderr, "logdisk_flush: can't write the log\n");
+		return -1;
+	}
+	ls->npartials++;
+	ls->nwritten += ls->npending;
+	ls->last_seq[ls->seg] = ls->seq++;
+	ls->off += 1 + ls->npending;
+	ls->npending = 0;
+	ls->ndiscards = 0;
+	memset(&ls->pending[0], 0, BLOCK_SIZE);
+
+	/* See if the segment is full.
+	 */
+	if (ls->off >= LOGDISK_SEGSIZE - 1) {
+		ls->seg = LOGDISK_NOSEG;
+		ls->nfilled++;
+	}
+	return 0;
+}
+
+/* Write the partial segment being collected, the map blocks that have
+ * changed, and then the header.
+ */
+static int logdisk_checkpoint(struct logdisk_state *ls){
+	if (logdisk_flush(ls) < 0) {
+		return -1;
+	}
+
+	/* Write runs of changed map blocks.  They are written in place, which
+	 * is safe because the roll forward from the previous checkpoint
+	 * applies all the changes again if the header is not written.
+	 */
+	block_no b, n;
+	for (b = 0; b < ls->nmap; b += n) {
+		for (n = 0; b + n < ls->nmap && ls->dirty[b + n]; n++) {
+			ls->dirty[b + n] = 0;
+		}
+		if (n == 0) {
+			n = 1;
+		}
+		else if (block_range_write(ls->below, 1 + b, n,
+							(block_t *) &ls->map[b * LOGDISK_ENTRIES]) < 0) {
+			memset(&ls->dirty[b], 1, n);
+			return -1;
+		}
+	}
+
+	union {
+		struct logdisk_header hdr;
+		block_t block;
+	} u;
+	memset(&u, 0, sizeof(u));
+	u.hdr.magic = LOGDISK_MAGIC;
+	u.hdr.nlogical = ls->nlogical;
+	u.hdr.nmap = ls->nmap;
+	u.hdr.nsegs = ls->nsegs;
+	u.hdr.seq = ls->seq;
+	u.hdr.seg = ls->seg;
+	u.hdr.off = ls->off;
+	if ((*ls->below->write)(ls->below, 0, &u.block) < 0) {
+		return -1;
+	}
+	ls->ckpt_seq = ls->seq;
+	ls->nfilled = 0;
+	ls->ncheckpoints++;
+
+	/* The segments that are free now are no longer needed for roll
+	 * forward either, so discard runs of them below.
+	 */
+	block_no s;
+	for (s = 0; s < ls->nsegs; s += n) {
+		for (n = 0; s + n < ls->nsegs && !ls->trimmed[s + n] && s + n != ls->seg &&
+									ls->live[s + n] == 0; n++) {
+			ls->trimmed[s + n] = 1;
+		}
+		if (n == 0) {
+			n = 1;
+		}
+		else {
+			(void) block_range_discard(ls->below, logdisk_phys(ls, s, 0),
+													n * LOGDISK_SEGSIZE);
+		}
+	}
+	return 0;
+}
+
+/* Make sure there is a segment at the head of the log to append to.
+ */
+static int logdisk_head(struct logdisk_state *ls){
+	if (ls->seg != LOGDISK_NOSEG) {
+		return 0;
+	}
+	if (ls->nfilled >= LOGDISK_CKPT_SEGS && logdisk_checkpoint(ls) < 0) {
+		return -1;
+	}
+
+	/* Look for a free segment that is not needed for roll forward, and
+	 * if there is none, write a checkpoint so there may be.
+	 */
+	unsigned int attempt;
+	for (attempt = 0; attempt < 2; attempt++) {
+		block_no s;
+		for (s = 0; s < ls->nsegs; s++) {
+			if (ls->live[s] == 0 && ls->last_seq[s] < ls->ckpt_seq) {
+				ls->seg = s;
+				ls->off = 0;
+				ls->trimmed[s] = 0;
+				return 0;
+			}
+		}
+		if (attempt == 0 && logdisk_checkpoint(ls) < 0) {
+			return -1;
+		}
+	}
+	fprintf(stderr, "logdisk: the log is full\n");
+	return -1;
+}
+
+/* Append a block to the partial segment being collected.  If the block
+ * was discarded in it, the discard no longer applies.
+ */
+static int logdisk_append(struct logdisk_state *ls, block_no offset, block_t *block){
+	block_no i;
+
+	for (i = 0; i < ls->ndiscards; i++) {
+		if (ls->discards[i] == offset) {
+			ls->discards[i] = ls->discards[--ls->ndiscards];
+			break;
+		}
+	}
+	if (ls->npending + ls->ndiscards == LOGDISK_SUMENT && logdisk_flush(ls) < 0) {
+		return -1;
+	}
+	if (logdisk_head(ls) < 0) {
+		return -1;
+	}
+	struct logdisk_summary *sum = (struct logdisk_summary *) &ls->pending[0];
+	sum->logical[ls->npending] = offset;
+	ls->pending[++ls->npending] = *block;
+	logdisk_map(ls, offset, logdisk_phys(ls, ls->seg, ls->off) + ls->npending);
+
+	if (ls->off + 1 + ls->npending == LOGDISK_SEGSIZE) {
+		return logdisk_flush(ls);
+	}
+	return 0;
+}
+
+/* Clean the segment with the fewest blocks in use, if it has no more
+ * than 'max_live' of them.  Returns 1 if a segment was cleaned, 0 if
+ * there is none worth cleaning, and -1 upon error.
+ */
+static int logdisk_clean(struct logdisk_state *ls, block_no max_live){
+	block_no s, victim = LOGDISK_NOSEG;
+
+	for (s = 0; s < ls->nsegs; s++) {
+		if (s != ls->seg && ls->live[s] > 0 && ls->live[s] <= max_live &&
+				(victim == LOGDISK_NOSEG || ls->live[s] < ls->live[victim])) {
+			victim = s;
+		}
+	}
+	if (victim == LOGDISK_NOSEG) {
+		return 0;
+	}
+
+	/* Read the segment and copy the blocks the map still refers to.  The
+	 * summaries say which logical blocks they are.
+	 */
+	block_no start = logdisk_phys(ls, victim, 0), off = 0, i;
+	if (block_range_read(ls->below, start, LOGDISK_SEGSIZE, ls->segbuf) < 0) {
+		return -1;
+	}
+	while (off < LOGDISK_SEGSIZE - 1 && ls->live[victim] > 0) {
+		struct logdisk_summary *sum = (struct logdisk_summary *) &ls->segbuf[off];
+		if (sum->magic != LOGDISK_MAGIC || (sum->n == 0 && sum->ndiscard == 0) ||
+							off + 1 + sum->n > LOGDISK_SEGSIZE) {
+			break;
+		}
+		for (i = 0; i < sum->n; i++) {
+			block_no offset = sum->logical[i];
+			if (offset < ls->nlogical && ls->map[offset] == start + off + 1 + i) {
+				if (logdisk_append(ls, offset, &ls->segbuf[off + 1 + i]) < 0) {
+					return -1;
+				}
+				ls->nmoved++;
+			}
+		}
+		off += 1 + sum->n;
+	}
+	if (ls->live[victim] != 0) {
+		fprintf(stderr, "logdisk_clean: segment %u has unknown blocks\n", victim);
+		return -1;
+	}
+	if (logdisk_flush(ls) < 0) {
+		return -1;
+	}
+	ls->ncleaned++;
+	return 1;
+}
+
+static int logdisk_nblocks(block_if bi){
+	struct logdisk_state *ls = bi->state;
+
+	return ls->nlogical;
+}
+
+static int logdisk_setsize(block_if bi, block_no nblocks){
+	fprintf(stderr, "logdisk_setsize: not supported\n");
+	return -1;
+}
+
+static int logdisk_read(block_if bi, block_no offset, block_t *block){
+	struct logdisk_state *ls = bi->state;
+
+	if (offset >= ls->nlogical) {
+		fprintf(stderr, "logdisk_read: offset too large\n");
+		return -1;
+	}
+	uint32_t phys = ls->map[offset];
+	if (phys == 0) {
+		memset(block, 0, BLOCK_SIZE);
+		return 0;
+	}
+	block_no i = logdisk_pending(ls, phys);
+	if (i != 0) {
+		*block = ls->pending[i];
+		return 0;
+	}
+	return (*ls->below->read)(ls->below, phys, block);
+}
+
+/* Blocks that were written together are likely to be next to each other
+ * in the log, so read runs of them with a single range read.
+ */
+static int logdisk_read_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct logdisk_state *ls = bi->state;
+	block_no i, n;
+
+	if (offset >= ls->nlogical || nblocks > ls->nlogical - offset) {
+		fprintf(stderr, "logdisk_read_range: offset too large\n");
+		return -1;
+	}
+	for (i = 0; i < nblocks; i += n) {
+		uint32_t phys = ls->map[offset + i];
+		n = 1;
+		if (phys == 0 || logdisk_pending(ls, phys) != 0) {
+			if (logdisk_read(bi, offset + i, &blocks[i]) < 0) {
+				return -1;
+			}
+			continue;
+		}
+		while (i + n < nblocks && ls->map[offset + i + n] == phys + n &&
+								logdisk_pending(ls, phys + n) == 0) {
+			n++;
+		}
+		if (block_range_read(ls->below, phys, n, &blocks[i]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int logdisk_write(block_if bi, block_no offset, block_t *block){
+	struct logdisk_state *ls = bi->state;
+
+	if (offset >= ls->nlogical) {
+		fprintf(stderr, "logdisk_write: offset too large\n");
+		return -1;
+	}
+	ls->nwrites++;
+
+	/* A block that has not been written out yet is simply updated.
+	 */
+	block_no i = logdisk_pending(ls, ls->map[offset]);
+	if (i != 0) {
+		ls->pending[i] = *block;
+		ls->nabsorbed++;
+		return 0;
+	}
+
+	/* When starting a new partial segment, make sure the log doesn't run
+	 * out of segments.
+	 */
+	if (ls->npending == 0 && logdisk_nfree(ls) <= LOGDISK_RESERVE) {
+		while (logdisk_nfree(ls) <= LOGDISK_RESERVE) {
+			int r = logdisk_clean(ls, LOGDISK_SEGSIZE - 3);
+			if (r < 0) {
+				return -1;
+			}
+			if (r == 0) {
+				break;
+			}
+		}
+	}
+	return logdisk_append(ls, offset, block);
+}
+
+/* Unmap the given blocks and record the discards in the partial segment
+ * being collected.
+ */
+static int logdisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct logdisk_state *ls = bi->state;
+	block_no i;
+
+	if (offset > ls->nlogical || nblocks > ls->nlogical - offset) {
+		fprintf(stderr, "logdisk_discard: offset too large\n");
+		return -1;
+	}
+	for (i = 0; i < nblocks; i++) {
+		uint32_t phys = ls->map[offset + i];
+		if (phys == 0) {
+			continue;
+		}
+		if (ls->npending + ls->ndiscards == LOGDISK_SUMENT && logdisk_flush(ls) < 0) {
+			return -1;
+		}
+		if (logdisk_head(ls) < 0) {
+			return -1;
+		}
+		ls->live[logdisk_seg(ls, phys)]--;
+		ls->map[offset + i] = 0;
+		ls->dirty[(offset + i) / LOGDISK_ENTRIES] = 1;
+		ls->discards[ls->ndiscards++] = offset + i;
+		ls->ndiscarded++;
+	}
+	return 0;
+}
+
+int logdisk_idle(block_if bi){
+	struct logdisk_state *ls = bi->state;
+
+	if (ls->npending != 0 || ls->ndiscards != 0) {
+		return logdisk_flush(ls) < 0 ? 0 : 1;
+	}
+	if (logdisk_nfree(ls) < LOGDISK_IDLE_FREE &&
+						logdisk_clean(ls, LOGDISK_SEGSIZE / 2) > 0) {
+		return 1;
+	}
+	if (ls->seq != ls->ckpt_seq) {
+		(void) logdisk_checkpoint(ls);
+	}
+	return 0;
+}
+
+int logdisk_sync(block_if bi){
+	return logdisk_flush(bi->state);
+}
+
+void logdisk_dump_stats(block_if bi){
+	struct logdisk_state *ls = bi->state;
+
+	printf("!$LOG: #writes:          %lu\n", ls->nwrites);
+	printf("!$LOG: #absorbed:        %lu\n", ls->nabsorbed);
+	printf("!$LOG: #partial segments: %lu (%.1f blocks each)\n", ls->npartials,
+				ls->npartials == 0 ? 0.0 : (double) ls->nwritten / ls->npartials);
+	printf("!$LOG: #cleaned:         %lu (%lu blocks moved)\n", ls->ncleaned, ls->nmoved);
+	printf("!$LOG: #discarded:       %lu\n", ls->ndiscarded);
+	printf("!$LOG: #checkpoints:     %lu\n", ls->ncheckpoints);
+	printf("!$LOG: #rolled forward:  %lu\n", ls->nrolled);
+	printf("!$LOG: free segments:    %u of %u\n", logdisk_nfree(ls), ls->nsegs);
+}
+
+static void logdisk_free(struct logdisk_state *ls){
+	free(ls->map);
+	free(ls->dirty);
+	free(ls->live);
+	free(ls->last_seq);
+	free(ls->trimmed);
+	free(ls->pending);
+	free(ls->discards);
+	free(ls->segbuf);
+	free(ls);
+}
+
+/* Buffered blocks are not written here, as the block store below may
+ * not be able to take requests any more.  Use logdisk_idle() first.
+ */
+static void logdisk_destroy(block_if bi){
+	logdisk_free(bi->state);
+	free(bi);
+}
+
+/* Set up a new logdisk on an empty block store.
+ */
+static int logdisk_format(block_if below, block_no nphys){
+	union {
+		struct logdisk_header hdr;
+		block_t block;
+	} u;
+	memset(&u, 0, sizeof(u));
+	u.hdr.magic = LOGDISK_MAGIC;
+	u.hdr.nsegs = nphys / LOGDISK_SEGSIZE;
+	u.hdr.nmap = (u.hdr.nsegs * (LOGDISK_SEGSIZE - 1) + LOGDISK_ENTRIES - 1) / LOGDISK_ENTRIES;
+	u.hdr.nsegs = nphys < 1 + u.hdr.nmap ? 0 : (nphys - 1 - u.hdr.nmap) / LOGDISK_SEGSIZE;
+	if (u.hdr.nsegs <= 2 * LOGDISK_RESERVE) {
+		fprintf(stderr, "logdisk_format: too few blocks\n");
+		return -1;
+	}
+	u.hdr.nlogical = (u.hdr.nsegs - LOGDISK_RESERVE) * (LOGDISK_SEGSIZE - 1) *
+													LOGDISK_UTIL / 100;
+	u.hdr.seq = 1;
+
+	/* The map starts out empty.
+	 */
+	block_t null_block;
+	memset(&null_block, 0, sizeof(null_block));
+	block_no b;
+	for (b = 1; b <= u.hdr.nmap; b++) {
+		if ((*below->write)(below, b, &null_block) < 0) {
+			return -1;
+		}
+	}
+	return (*below->write)(below, 0, &u.block);
+}
+
+/* Apply the partial segments written after the checkpoint.  Returns the
+ * highest sequence number seen in any summary.
+ */
+static uint32_t logdisk_roll_forward(struct logdisk_state *ls){
+	uint32_t *first = calloc(ls->nsegs, sizeof(*first)), max = 0;
+	block_no s, i;
+
+	/* Find the sequence number of the first partial segment in each
+	 * segment, to know where the log continues when a segment is full.
+	 */
+	for (s = 0; s < ls->nsegs; s++) {
+		struct logdisk_summary *sum = (struct logdisk_summary *) &ls->segbuf[0];
+		if ((*ls->below->read)(ls->below, logdisk_phys(ls, s, 0), &ls->segbuf[0]) == 0 &&
+											sum->magic == LOGDISK_MAGIC) {
+			first[s] = sum->seq;
+			if (sum->seq > max) {
+				max = sum->seq;
+			}
+		}
+	}
+
+	for (;;) {
+		if (ls->seg == LOGDISK_NOSEG) {
+			for (s = 0; s < ls->nsegs; s++) {
+				if (first[s] == ls->seq) {
+					break;
+				}
+			}
+			if (s == ls->nsegs) {
+				break;
+			}
+			ls->seg = s;
+			ls->off = 0;
+		}
+
+		/* Read the summary and the blocks, and check them.
+		 */
+		block_no start = logdisk_phys(ls, ls->seg, ls->off);
+		struct logdisk_summary *sum = (struct logdisk_summary *) &ls->segbuf[0];
+		if ((*ls->below->read)(ls->below, start, &ls->segbuf[0]) < 0 ||
+											sum->magic != LOGDISK_MAGIC) {
+			break;
+		}
+		if (sum->seq > max) {
+			max = sum->seq;
+		}
+		if (sum->seq != ls->seq || (sum->n == 0 && sum->ndiscard == 0) ||
+							ls->off + 1 + sum->n > LOGDISK_SEGSIZE ||
+							sum->n + sum->ndiscard > LOGDISK_SUMENT ||
+							(sum->n != 0 && block_range_read(ls->below, start + 1,
+												sum->n, &ls->segbuf[1]) < 0) ||
+							logdisk_checksum(sum, &ls->segbuf[1]) != sum->checksum) {
+			break;
+		}
+
+		/* Apply the blocks, and then the discards.
+		 */
+		for (i = 0; i < sum->n + sum->ndiscard; i++) {
+			uint32_t offset = sum->logical[i];
+			if (offset < ls->nlogical) {
+				ls->map[offset] = i < sum->n ? start + 1 + i : 0;
+				ls->dirty[offset / LOGDISK_ENTRIES] = 1;
+			}
+		}
+		ls->nrolled++;
+		ls->seq++;
+		ls->off += 1 + sum->n;
+		if (ls->off >= LOGDISK_SEGSIZE - 1) {
+			ls->seg = LOGDISK_NOSEG;
+		}
+	}
+	free(first);
+	return max;
+}
+
+block_if logdisk_init(block_if below){
+	union {
+		struct logdisk_header hdr;
+		block_t block;
+	} u;
+
+	int nphys = (*below->nblocks)(below);
+	if (nphys < 0 || (*below->read)(below, 0, &u.block) < 0) {
+		return 0;
+	}
+
+	/* Format the block store if it is empty.
+	 */
+	if (u.hdr.magic != LOGDISK_MAGIC) {
+		unsigned int i;
+		for (i = 0; i < BLOCK_SIZE; i++) {
+			if (u.block.bytes[i] != 0) {
+				return 0;
+			}
+		}
+		if (logdisk_format(below, nphys) < 0 ||
+						(*below->read)(below, 0, &u.block) < 0) {
+			return 0;
+		}
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct logdisk_state *ls = new_alloc(struct logdisk_state);
+	ls->below = below;
+	ls->nlogical = u.hdr.nlogical;
+	ls->nmap = u.hdr.nmap;
+	ls->nsegs = u.hdr.nsegs;
+	ls->map = calloc(ls->nmap, BLOCK_SIZE);
+	ls->dirty = calloc(ls->nmap, 1);
+	ls->live = calloc(ls->nsegs, sizeof(*ls->live));
+	ls->last_seq = calloc(ls->nsegs, sizeof(*ls->last_seq));
+	ls->trimmed = calloc(ls->nsegs, 1);
+	ls->pending = calloc(LOGDISK_SEGSIZE, BLOCK_SIZE);
+	ls->discards = calloc(LOGDISK_SUMENT, sizeof(*ls->discards));
+	ls->segbuf = calloc(LOGDISK_SEGSIZE, BLOCK_SIZE);
+	ls->seq = u.hdr.seq;
+	ls->seg = u.hdr.seg;
+	ls->off = u.hdr.off;
+
+	/* Read the checkpoint and roll forward.
+	 */
+	block_t *mapblocks = (block_t *) ls->map;
+	if (block_range_read(below, 1, ls->nmap, mapblocks) < 0) {
+		logdisk_free(ls);
+		return 0;
+	}
+	uint32_t max = logdisk_roll_forward(ls);
+
+	/* Count the blocks in use in each segment.
+	 */
+	block_no b;
+	for (b = 0; b < ls->nlogical; b++) {
+		if (ls->map[b] != 0) {
+			ls->live[logdisk_seg(ls, ls->map[b])]++;
+		}
+	}
+
+	/* Partial segments may have been written after the last one that
+	 * was rolled forward, and their sequence numbers must not be used
+	 * again.  The checkpoint makes sure the log continues from here.
+	 */
+	if (ls->seg != LOGDISK_NOSEG && ls->off >= LOGDISK_SEGSIZE - 1) {
+		ls->seg = LOGDISK_NOSEG;
+	}
+	if (max >= ls->seq) {
+		ls->seq = max + 1;
+	}
+	if (logdisk_checkpoint(ls) < 0) {
+		logdisk_free(ls);
+		return 0;
+	}
+	if (ls->nrolled != 0) {
+		printf("logdisk_init: rolled forward %lu partial segments\n\r", ls->nrolled);
+	}
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ls;
+	bi->nblocks = logdisk_nblocks;
+	bi->setsize = logdisk_setsize;
+	bi->read = logdisk_read;
+	bi->write = logdisk_write;
+	bi->destroy = logdisk_destroy;
+	bi->read_range = logdisk_read_range;
+	bi->discard = logdisk_discard;
+	return bi;
+}
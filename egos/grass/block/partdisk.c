@@ -57,6 +57,36 @@ static int partdisk_write(block_if bi, block_no offset, block_t *block){
 	return (*ps->below->write)(ps->below, ps->delta + offset, block);
 }
 
+static int partdisk_read_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct partdisk_state *ps = bi->state;
+
+	if (offset + nblocks > ps->nblocks) {
+		fprintf(stderr, "partdisk_read_range: offset too large\n");
+		return -1;
+	}
+	return block_range_read(ps->below, ps->delta + offset, nblocks, blocks);
+}
+
+static int partdisk_write_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct partdisk_state *ps = bi->state;
+
+	if (offset + nblocks > ps->nblocks) {
+		fprintf(stderr, "partdisk_write_range: offset too large\n");
+		return -1;
+	}
+	return block_range_write(ps->below, ps->delta + offset, nblocks, blocks);
+}
+
+static int partdisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct partdisk_state *ps = bi->state;
+
+	if (offset + nblocks > ps->nblocks) {
+		fprintf(stderr, "partdisk_discard: offset too large\n");
+		return -1;
+	}
+	return block_range_discard(ps->below, ps->delta + offset, nblocks);
+}
+
 static void partdisk_destroy(block_if bi){
 	free(bi->state);
 	free(bi);
@@ -79,5 +109,8 @@ block_if partdisk_init(block_if below, block_no delta, block_no nblocks){
 	bi->read = partdisk_read;
 	bi->write = partdisk_write;
 	bi->destroy = partdisk_destroy;
+	bi->read_range = partdisk_read_range;
+	bi->write_range = partdisk_write_range;
+	bi->discard = partdisk_discard;
 	return bi;
 }
@@ -5,6 +5,13 @@
  *		block_if protdisk_init(gpid_t below, unsigned int ino);
  *			'below' is the process identifier of the remote block store.
  *			'ino' is the inode number of the remote disk
+ *
+ *		int protdisk_batch(struct block_io *ios, unsigned int nios)
+ *			perform a batch of range operations.  Operations on protdisk
+ *			block stores are all sent before any reply is awaited, so that
+ *			different block servers work on them in parallel.  Other
+ *			operations are performed one at a time.  Returns 0 if all
+ *			operations succeeded and -1 otherwise.
  */
 
 #include <stdio.h>
@@ -49,6 +56,48 @@ static int protdisk_write(block_if bi, block_no offset, block_t *block){
 	return r ? 0 : -1;
 }
 
+static int protdisk_read_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct protdisk_state *ps = bi->state;
+
+	while (nblocks > 0) {
+		block_no n = nblocks < BLOCK_MAX_NBLOCK ? nblocks : BLOCK_MAX_NBLOCK;
+		if (!block_read_range(ps->below, ps->ino, offset, n, blocks)) {
+			return -1;
+		}
+		offset += n;
+		nblocks -= n;
+		blocks += n;
+	}
+	return 0;
+}
+
+static int protdisk_write_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct protdisk_state *ps = bi->state;
+
+	while (nblocks > 0) {
+		block_no n = nblocks < BLOCK_MAX_NBLOCK ? nblocks : BLOCK_MAX_NBLOCK;
+		if (!block_write_range(ps->below, ps->ino, offset, n, blocks)) {
+			return -1;
+		}
+		offset += n;
+		nblocks -= n;
+		blocks += n;
+	}
+	return 0;
+}
+
+/* Discards are not limited in size, so a range is a single RPC.
+ */
+static int protdisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct protdisk_state *ps = bi->state;
+
+	if (nblocks == 0) {
+		return 0;
+	}
+	bool_t r = block_discard(ps->below, ps->ino, offset, nblocks);
+	return r ? 0 : -1;
+}
+
 static void protdisk_destroy(block_if bi){
 	// struct protdisk_state *ps = bi->state;
 
@@ -72,5 +121,110 @@ block_if protdisk_init(gpid_t below, unsigned int ino){
 	bi->read = protdisk_read;
 	bi->write = protdisk_write;
 	bi->destroy = protdisk_destroy;
+	bi->read_range = protdisk_read_range;
+	bi->write_range = protdisk_write_range;
+	bi->discard = protdisk_discard;
 	return bi;
 }
+
+/* One RPC of a batch.  An operation is split into chunks of at most
+ * BLOCK_MAX_NBLOCK blocks, each of which is a separate RPC.
+ */
+struct protdisk_chunk {
+	struct block_io *io;		// operation this chunk is part of
+	block_t *blocks;			// where the data of this chunk goes
+	block_no nblocks;			// #blocks in this chunk
+	struct block_request *req;
+	struct block_reply *rep;
+};
+
+int protdisk_batch(struct block_io *ios, unsigned int nios){
+	unsigned int i, nchunks = 0;
+	int result = 0;
+
+	/* Count the RPCs needed, and do the other operations right away.
+	 */
+	for (i = 0; i < nios; i++) {
+		struct block_io *io = &ios[i];
+		if (io->bi->read == protdisk_read) {
+			nchunks += (io->nblocks + BLOCK_MAX_NBLOCK - 1) / BLOCK_MAX_NBLOCK;
+			io->result = 0;
+		}
+		else {
+			io->result = io->op == BIO_READ ?
+				block_range_read(io->bi, io->offset, io->nblocks, io->blocks) :
+				block_range_write(io->bi, io->offset, io->nblocks, io->blocks);
+			if (io->result < 0) {
+				result = -1;
+			}
+		}
+	}
+	if (nchunks == 0) {
+		return result;
+	}
+
+	/* Prepare all the requests.
+	 */
+	struct protdisk_chunk *chunks = calloc(nchunks, sizeof(*chunks));
+	struct rpc_call *calls = calloc(nchunks, sizeof(*calls));
+	unsigned int c = 0;
+	for (i = 0; i < nios; i++) {
+		struct block_io *io = &ios[i];
+		if (io->bi->read != protdisk_read) {
+			continue;
+		}
+		struct protdisk_state *ps = io->bi->state;
+		struct protdisk_chunk *pc;
+		block_no done;
+		for (done = 0; done < io->nblocks; done += pc->nblocks, c++) {
+			struct rpc_call *rc = &calls[c];
+			block_no n = io->nblocks - done;
+			if (n > BLOCK_MAX_NBLOCK) {
+				n = BLOCK_MAX_NBLOCK;
+			}
+			pc = &chunks[c];
+			pc->io = io;
+			pc->blocks = &io->blocks[done];
+			pc->nblocks = n;
+
+			unsigned int data = io->op == BIO_WRITE ? n * BLOCK_SIZE : 0;
+			pc->req = malloc(sizeof(*pc->req) + data);
+			memset(pc->req, 0, sizeof(*pc->req));
+			pc->req->type = io->op == BIO_WRITE ? BLOCK_WRITE : BLOCK_READ;
+			pc->req->ino = ps->ino;
+			pc->req->offset_nblock = io->offset + done;
+			pc->req->nblock = n;
+			memcpy(&pc->req[1], pc->blocks, data);
+
+			unsigned int rdata = io->op == BIO_READ ? n * BLOCK_SIZE : 0;
+			pc->rep = malloc(sizeof(*pc->rep) + rdata);
+
+			rc->pid = ps->below;
+			rc->request = pc->req;
+			rc->reqsize = sizeof(*pc->req) + data;
+			rc->reply = pc->rep;
+			rc->repsize = sizeof(*pc->rep) + rdata;
+		}
+	}
+	assert(c == nchunks);
+
+	/* Send them all and wait for the replies.
+	 */
+	(void) sys_rpc_multi(calls, nchunks);
+
+	for (c = 0; c < nchunks; c++) {
+		struct protdisk_chunk *pc = &chunks[c];
+		struct rpc_call *rc = &calls[c];
+		if (rc->result < (int) sizeof(*pc->rep) || pc->rep->status != BLOCK_OK ||
+				(pc->io->op == BIO_READ &&
+					!block_unpack(pc->rep, rc->result, pc->nblocks, pc->blocks))) {
+			pc->io->result = -1;
+			result = -1;
+		}
+		free(pc->req);
+		free(pc->rep);
+	}
+	free(chunks);
+	free(calls);
+	return result;
+}
@@ -2,9 +2,17 @@
  *
  * This block store module implements RAID0.
  *
- *		block_if raid0disk_init(block_if *below, unsigned int nbelow){
- *			'below' is an array of underlying block stores, all of which
- *			are assumed to be of the same size.
+ *		block_if raid0disk_init(block_if *below, unsigned int nbelow,
+ *												block_no stripe_unit){
+ *			'below' is an array of underlying block stores.  The blocks
+ *			are striped over them in units of 'stripe_unit' consecutive
+ *			blocks (0 is taken as 1).  The size of the RAID0 block store
+ *			is determined by the smallest of the underlying block stores.
+ *
+ * Ranges of blocks are split into one contiguous range per underlying
+ * block store, and these are issued together with protdisk_batch() so
+ * that, if the underlying block stores are served by different block
+ * servers, the transfers proceed in parallel.
  */
 
 #include <stdio.h>
@@ -16,21 +24,37 @@
 struct raid0disk_state {
 	block_if *below;		// block stores below
 	unsigned int nbelow;	// #block stores
+	block_no stripe_unit;	// #consecutive blocks on one block store
 };
 
+/* Map a block to an underlying block store and the offset in it.
+ */
+static unsigned int raid0disk_map(struct raid0disk_state *rds, block_no offset, block_no *poff){
+	block_no stripe = offset / rds->stripe_unit;
+
+	*poff = (stripe / rds->nbelow) * rds->stripe_unit + offset % rds->stripe_unit;
+	return stripe % rds->nbelow;
+}
+
 static int raid0disk_nblocks(block_if bi){
 	struct raid0disk_state *rds = bi->state;
-	int total = 0;
+	int min = -1;
 	unsigned int i;
 
 	for (i = 0; i < rds->nbelow; i++) {
-		int r = (*rds->below[0]->nblocks)(rds->below[0]);
+		int r = (*rds->below[i]->nblocks)(rds->below[i]);
 		if (r < 0) {
 			return r;
 		}
-		total += r;
+		if (min < 0 || r < min) {
+			min = r;
+		}
 	}
-	return total;
+
+	/* Only full stripe units count.
+	 */
+	min -= min % rds->stripe_unit;
+	return min * rds->nbelow;
 }
 
 static int raid0disk_setsize(block_if bi, block_no nblocks){
@@ -41,30 +65,103 @@ static int raid0disk_setsize(block_if bi, block_no nblocks){
 static int raid0disk_read(block_if bi, block_no offset, block_t *block){
 	struct raid0disk_state *rds = bi->state;
 
-	int i = offset % rds->nbelow;
-	offset /= rds->nbelow;
+	unsigned int i = raid0disk_map(rds, offset, &offset);
 	return (*rds->below[i]->read)(rds->below[i], offset, block);
 }
 
 static int raid0disk_write(block_if bi, block_no offset, block_t *block){
 	struct raid0disk_state *rds = bi->state;
 
-	int i = offset % rds->nbelow;
-	offset /= rds->nbelow;
+	unsigned int i = raid0disk_map(rds, offset, &offset);
 	return (*rds->below[i]->write)(rds->below[i], offset, block);
 }
 
+/* Read or write a range of blocks.  Consecutive stripe units on the same
+ * underlying block store are adjacent there, so the range maps to at most
+ * one contiguous range per block store.  The blocks are gathered into (or
+ * scattered from) a buffer per block store.
+ */
+static int raid0disk_range(block_if bi, int op, block_no offset, block_no nblocks, block_t *blocks){
+	struct raid0disk_state *rds = bi->state;
+	struct block_io *ios = calloc(rds->nbelow, sizeof(*ios));
+	unsigned int i;
+	block_no b;
+
+	/* Find the range on each block store.
+	 */
+	for (b = 0; b < nblocks; b++) {
+		block_no off;
+		i = raid0disk_map(rds, offset + b, &off);
+		if (ios[i].nblocks == 0) {
+			ios[i].offset = off;
+		}
+		ios[i].nblocks++;
+	}
+	for (i = 0; i < rds->nbelow; i++) {
+		ios[i].bi = rds->below[i];
+		ios[i].op = op;
+		ios[i].blocks = malloc(ios[i].nblocks * BLOCK_SIZE);
+	}
+
+	/* Gather the blocks to write.
+	 */
+	if (op == BIO_WRITE) {
+		for (b = 0; b < nblocks; b++) {
+			block_no off;
+			i = raid0disk_map(rds, offset + b, &off);
+			ios[i].blocks[off - ios[i].offset] = blocks[b];
+		}
+	}
+
+	/* Do the transfers, skipping the block stores that are not involved.
+	 */
+	struct block_io *batch = calloc(rds->nbelow, sizeof(*batch));
+	unsigned int n = 0;
+	for (i = 0; i < rds->nbelow; i++) {
+		if (ios[i].nblocks > 0) {
+			batch[n++] = ios[i];
+		}
+	}
+	int result = protdisk_batch(batch, n);
+	free(batch);
+
+	/* Scatter the blocks that were read.
+	 */
+	if (result == 0 && op == BIO_READ) {
+		for (b = 0; b < nblocks; b++) {
+			block_no off;
+			i = raid0disk_map(rds, offset + b, &off);
+			blocks[b] = ios[i].blocks[off - ios[i].offset];
+		}
+	}
+
+	for (i = 0; i < rds->nbelow; i++) {
+		free(ios[i].blocks);
+	}
+	free(ios);
+	return result;
+}
+
+static int raid0disk_read_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	return raid0disk_range(bi, BIO_READ, offset, nblocks, blocks);
+}
+
+static int raid0disk_write_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	return raid0disk_range(bi, BIO_WRITE, offset, nblocks, blocks);
+}
+
 static void raid0disk_destroy(block_if bi){
 	free(bi->state);
 	free(bi);
 }
 
-block_if raid0disk_init(block_if *below, unsigned int nbelow){
+block_if raid0disk_init(block_if *below, unsigned int nbelow, block_no stripe_unit){
 	/* Create the block store state structure.
 	 */
 	struct raid0disk_state *rds = new_alloc(struct raid0disk_state);
 	rds->below = below;
 	rds->nbelow = nbelow;
+	rds->stripe_unit = stripe_unit == 0 ? 1 : stripe_unit;
 
 	/* Return a block interface to this inode.
 	 */
@@ -75,5 +172,7 @@ block_if raid0disk_init(block_if *below, unsigned int nbelow){
 	bi->read = raid0disk_read;
 	bi->write = raid0disk_write;
 	bi->destroy = raid0disk_destroy;
+	bi->read_range = raid0disk_read_range;
+	bi->write_range = raid0disk_write_range;
 	return bi;
 }
@@ -5,6 +5,30 @@
  *		block_if raid1disk_init(block_if *below, unsigned int nbelow){
  *			'below' is an array of underlying block stores, all of which
  *			are assumed to be of the same size.
+ *
+ *		void raid1disk_resync(block_if bi, unsigned int member)
+ *			mark the given store as out-of-date, for example because it
+ *			has been replaced by an empty one.  It no longer serves reads
+ *			and will be resynchronized by raid1disk_resync_step().
+ *
+ *		int raid1disk_resync_step(block_if bi)
+ *			do a bit of the work of bringing a broken mirror back.  If no
+ *			mirror is being resynchronized, the broken mirrors are probed
+ *			and the first that responds again is resynchronized.  Each
+ *			call then copies the next RAID1_RESYNC_CHUNK blocks from a good
+ *			mirror.  Returns the number of blocks still to be copied (0 if
+ *			there is nothing to do), or -1 upon error.  This is intended
+ *			to be called periodically by a background process.
+ *
+ * Reads go to a single mirror.  A mirror whose last access ended right
+ * before the requested block is preferred, so sequential streams stay on
+ * one mirror; other reads are spread round-robin.  Ranges of blocks are
+ * split over the mirrors, and the pieces read in parallel.  Writes are
+ * sent to all mirrors in parallel and complete when all have responded.
+ *
+ * While a mirror is being resynchronized, it receives all writes but
+ * serves only reads of blocks that have already been copied.  A write to
+ * the chunk that is being copied causes the chunk to be copied again.
  */
 
 #include <stdio.h>
@@ -13,10 +37,22 @@
 #include "grass.h"
 #include "block_store.h"
 
+#define RAID1_RESYNC_CHUNK	64		// #blocks copied per resync step
+#define RAID1_MIN_SPLIT		4		// don't split reads into smaller pieces
+
 struct raid1disk_state {
 	block_if *below;		// block stores below
 	unsigned int nbelow;	// #block stores
 	char *broken;			// keeps track of which stores are broken
+	block_no *next;			// block following the last access of each store
+	unsigned int rr;		// next store for round-robin reads
+
+	/* Resynchronization state.
+	 */
+	int rs_member;			// store being resynchronized or -1
+	block_no rs_cursor;		// blocks below this have been copied
+	block_no rs_inflight;	// #blocks at rs_cursor being copied
+	bool_t rs_redo;			// a write hit the blocks being copied
 };
 
 static int raid1disk_nblocks(block_if bi){
@@ -27,7 +63,7 @@ static int raid1disk_nblocks(block_if bi){
 	 */
 	for (i = 0; i < rds->nbelow; i++) {
 		if (!rds->broken[i]) {
-			int nblocks = (*rds->below[0]->nblocks)(rds->below[0]);
+			int nblocks = (*rds->below[i]->nblocks)(rds->below[i]);
 			if (nblocks < 0) {
 				rds->broken[i] = 1;
 			}
@@ -39,6 +75,51 @@ static int raid1disk_nblocks(block_if bi){
 	return -1;
 }
 
+/* Mark a store as broken, giving up on its resynchronization if needed.
+ */
+static void raid1disk_fail(struct raid1disk_state *rds, unsigned int i){
+	rds->broken[i] = 1;
+	if (rds->rs_member == (int) i) {
+		rds->rs_member = -1;
+	}
+}
+
+/* See if store i has the given range of blocks.
+ */
+static bool_t raid1disk_readable(struct raid1disk_state *rds, unsigned int i,
+												block_no offset, block_no nblocks){
+	if (rds->broken[i]) {
+		return False;
+	}
+	return rds->rs_member != (int) i || offset + nblocks <= rds->rs_cursor;
+}
+
+/* See if store i is up-to-date for the purpose of completing a write.
+ */
+static bool_t raid1disk_synced(struct raid1disk_state *rds, unsigned int i){
+	return !rds->broken[i] && rds->rs_member != (int) i;
+}
+
+/* Pick a store to read the given blocks from, or return -1 if none has it.
+ */
+static int raid1disk_pick(struct raid1disk_state *rds, block_no offset, block_no nblocks){
+	unsigned int i, j;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->next[i] == offset && raid1disk_readable(rds, i, offset, nblocks)) {
+			return i;
+		}
+	}
+	for (j = 0; j < rds->nbelow; j++) {
+		i = (rds->rr + j) % rds->nbelow;
+		if (raid1disk_readable(rds, i, offset, nblocks)) {
+			rds->rr = (i + 1) % rds->nbelow;
+			return i;
+		}
+	}
+	return -1;
+}
+
 static int raid1disk_setsize(block_if bi, block_no nblocks){
 	struct raid1disk_state *rds = bi->state;
 	int oldsize = -1;
@@ -50,7 +131,7 @@ static int raid1disk_setsize(block_if bi, block_no nblocks){
 	for (i = 0; i < rds->nbelow; i++) {
 		int r = (*rds->below[i]->setsize)(rds->below[i], nblocks);
 		if (r < 0) {
-			rds->broken[i] = 1;
+			raid1disk_fail(rds, i);
 		}
 		else {
 			oldsize = r;
@@ -64,45 +145,254 @@ static int raid1disk_read(block_if bi, block_no offset, block_t *block){
 	struct raid1disk_state *rds = bi->state;
 	unsigned int i;
 
-	/* Simply try all of them.  If reading fails it is not necessary
+	/* First try the preferred store.
+	 */
+	int first = raid1disk_pick(rds, offset, 1);
+	if (first < 0) {
+		return -1;
+	}
+	if ((*rds->below[first]->read)(rds->below[first], offset, block) >= 0) {
+		rds->next[first] = offset + 1;
+		return 0;
+	}
+
+	/* Then simply try the others.  If reading fails it is not necessary
 	 * to mark them as broken.
 	 */
 	for (i = 0; i < rds->nbelow; i++) {
-		if (rds->broken[i]) {
+		if (i == (unsigned int) first || !raid1disk_readable(rds, i, offset, 1)) {
 			continue;
 		}
 		if ((*rds->below[i]->read)(rds->below[i], offset, block) >= 0) {
+			rds->next[i] = offset + 1;
 			return 0;
 		}
 	}
 	return -1;
 }
 
-static int raid1disk_write(block_if bi, block_no offset, block_t *block){
+/* Read a range by splitting it into a piece per store that has it, and
+ * reading the pieces in parallel.  Pieces that fail are retried one block
+ * at a time, which tries the other stores.
+ */
+static int raid1disk_read_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
 	struct raid1disk_state *rds = bi->state;
-	unsigned int i;
-	int result = -1;
+	struct block_io *ios = calloc(rds->nbelow, sizeof(*ios));
+	unsigned int i, nios = 0, nreadable = 0;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (raid1disk_readable(rds, i, offset, nblocks)) {
+			nreadable++;
+		}
+	}
+	if (nreadable > nblocks / RAID1_MIN_SPLIT) {
+		nreadable = nblocks / RAID1_MIN_SPLIT;
+	}
+	if (nreadable <= 1) {
+		free(ios);
+		int first = raid1disk_pick(rds, offset, nblocks);
+		if (first >= 0 && block_range_read(rds->below[first], offset, nblocks, blocks) == 0) {
+			rds->next[first] = offset + nblocks;
+			return 0;
+		}
+		for (i = 0; i < nblocks; i++) {
+			if (raid1disk_read(bi, offset + i, &blocks[i]) < 0) {
+				return -1;
+			}
+		}
+		return 0;
+	}
 
-	/* Try to write all of the underlying stores.
+	/* Divide the range in nreadable pieces.
 	 */
+	block_no done = 0;
+	for (i = 0; i < rds->nbelow && nios < nreadable; i++) {
+		if (!raid1disk_readable(rds, i, offset, nblocks)) {
+			continue;
+		}
+		block_no n = (nblocks - done) / (nreadable - nios);
+		ios[nios].bi = rds->below[i];
+		ios[nios].op = BIO_READ;
+		ios[nios].offset = offset + done;
+		ios[nios].nblocks = n;
+		ios[nios].blocks = &blocks[done];
+		rds->next[i] = offset + done + n;
+		nios++;
+		done += n;
+	}
+	(void) protdisk_batch(ios, nios);
+
+	int result = 0;
+	for (i = 0; i < nios && result == 0; i++) {
+		if (ios[i].result < 0) {
+			block_no b;
+			for (b = 0; b < ios[i].nblocks; b++) {
+				if (raid1disk_read(bi, ios[i].offset + b, &ios[i].blocks[b]) < 0) {
+					result = -1;
+					break;
+				}
+			}
+		}
+	}
+	free(ios);
+	return result;
+}
+
+/* Write a range to all stores in parallel.  Succeeds if at least one
+ * up-to-date store took the write.
+ */
+static int raid1disk_write_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct raid1disk_state *rds = bi->state;
+	struct block_io *ios = calloc(rds->nbelow, sizeof(*ios));
+	unsigned int *which = calloc(rds->nbelow, sizeof(*which));
+	unsigned int i, nios = 0;
+
 	for (i = 0; i < rds->nbelow; i++) {
 		if (rds->broken[i]) {
 			continue;
 		}
-		if ((*rds->below[i]->write)(rds->below[i], offset, block) < 0) {
-			rds->broken[i] = 1;
+		ios[nios].bi = rds->below[i];
+		ios[nios].op = BIO_WRITE;
+		ios[nios].offset = offset;
+		ios[nios].nblocks = nblocks;
+		ios[nios].blocks = blocks;
+		which[nios++] = i;
+	}
+
+	/* If this overlaps with blocks being copied by the resync, the copy
+	 * may be stale and has to be done again.
+	 */
+	if (rds->rs_inflight > 0 && offset < rds->rs_cursor + rds->rs_inflight &&
+										offset + nblocks > rds->rs_cursor) {
+		rds->rs_redo = True;
+	}
+
+	(void) protdisk_batch(ios, nios);
+
+	int result = -1;
+	for (i = 0; i < nios; i++) {
+		if (ios[i].result < 0) {
+			raid1disk_fail(rds, which[i]);
 		}
-		else {
+		else if (raid1disk_synced(rds, which[i])) {
 			result = 0;
 		}
 	}
+	free(ios);
+	free(which);
 	return result;
 }
 
+static int raid1disk_write(block_if bi, block_no offset, block_t *block){
+	return raid1disk_write_range(bi, offset, 1, block);
+}
+
+/* Find a broken store that works again, and start resynchronizing it.
+ */
+static bool_t raid1disk_resync_probe(struct raid1disk_state *rds){
+	unsigned int i;
+	block_t block;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->broken[i] && (*rds->below[i]->read)(rds->below[i], 0, &block) == 0) {
+			rds->broken[i] = 0;
+			rds->rs_member = i;
+			rds->rs_cursor = 0;
+			rds->rs_inflight = 0;
+			printf("raid1disk: resynchronizing store %u\n\r", i);
+			return True;
+		}
+	}
+	return False;
+}
+
+void raid1disk_resync(block_if bi, unsigned int member){
+	struct raid1disk_state *rds = bi->state;
+
+	raid1disk_fail(rds, member);
+}
+
+int raid1disk_resync_step(block_if bi){
+	struct raid1disk_state *rds = bi->state;
+	unsigned int i;
+
+	if (rds->rs_member < 0 && !raid1disk_resync_probe(rds)) {
+		return 0;
+	}
+
+	/* Find a store to copy from.
+	 */
+	int src = -1;
+	for (i = 0; i < rds->nbelow; i++) {
+		if (raid1disk_synced(rds, i)) {
+			src = i;
+			break;
+		}
+	}
+	int size = src < 0 ? -1 : (*rds->below[src]->nblocks)(rds->below[src]);
+	if (size < 0) {
+		return -1;
+	}
+
+	/* Copy the next chunk.
+	 */
+	unsigned int dst = rds->rs_member;
+	block_no n = size - rds->rs_cursor;
+	if (n > RAID1_RESYNC_CHUNK) {
+		n = RAID1_RESYNC_CHUNK;
+	}
+	block_t *buf = malloc(n * BLOCK_SIZE);
+	struct block_io io;
+	memset(&io, 0, sizeof(io));
+	io.bi = rds->below[src];
+	io.op = BIO_READ;
+	io.offset = rds->rs_cursor;
+	io.nblocks = n;
+	io.blocks = buf;
+	rds->rs_inflight = n;
+	rds->rs_redo = False;
+	if (protdisk_batch(&io, 1) < 0) {
+		rds->rs_inflight = 0;
+		free(buf);
+		return -1;
+	}
+	if (rds->rs_member != (int) dst) {		// gave up in the meantime
+		rds->rs_inflight = 0;
+		free(buf);
+		return -1;
+	}
+	io.bi = rds->below[dst];
+	io.op = BIO_WRITE;
+	if (protdisk_batch(&io, 1) < 0) {
+		raid1disk_fail(rds, dst);
+		rds->rs_inflight = 0;
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	rds->rs_inflight = 0;
+	if (rds->rs_member != (int) dst) {
+		return -1;
+	}
+
+	/* Move on unless a write came in while copying.
+	 */
+	if (!rds->rs_redo) {
+		rds->rs_cursor += n;
+	}
+	if (rds->rs_cursor >= (block_no) size) {
+		printf("raid1disk: store %u resynchronized\n\r", dst);
+		rds->rs_member = -1;
+		return 0;
+	}
+	return size - rds->rs_cursor;
+}
+
 static void raid1disk_destroy(block_if bi){
 	struct raid1disk_state *rds = bi->state;
 
 	free(rds->broken);
+	free(rds->next);
 	free(rds);
 	free(bi);
 }
@@ -114,6 +404,8 @@ block_if raid1disk_init(block_if *below, unsigned int nbelow){
 	rds->below = below;
 	rds->nbelow = nbelow;
 	rds->broken = calloc(1, nbelow);
+	rds->next = calloc(nbelow, sizeof(*rds->next));
+	rds->rs_member = -1;
 
 	/* Return a block interface to this inode.
 	 */
@@ -124,5 +416,7 @@ block_if raid1disk_init(block_if *below, unsigned int nbelow){
 	bi->read = raid1disk_read;
 	bi->write = raid1disk_write;
 	bi->destroy = raid1disk_destroy;
+	bi->read_range = raid1disk_read_range;
+	bi->write_range = raid1disk_write_range;
 	return bi;
 }
@@ -0,0 +1,634 @@
+/* This block store module implements RAID5 (striping with rotating parity)
+ *
+ *		block_if raid5disk_init(block_if *below, unsigned int nbelow)
+ *			'below' is an array of at least three underlying block stores.
+ *			Each stripe consists of one block on each of them: nbelow - 1
+ *			data blocks and a parity block, which is the exclusive or of
+ *			the data blocks.  The parity rotates over the block stores
+ *			from stripe to stripe.  The size of the RAID5 block store is
+ *			nbelow - 1 times the size of the smallest underlying store.
+ *
+ *		void raid5disk_rebuild(block_if bi, unsigned int member)
+ *			mark the given store as out-of-date, for example because it
+ *			has been replaced by an empty one.  Its blocks are recomputed
+ *			from the other stores until raid5disk_rebuild_step() has
+ *			rebuilt it.
+ *
+ *		int raid5disk_rebuild_step(block_if bi)
+ *			do a bit of the work of rebuilding a store.  If no store is
+ *			being rebuilt, the broken stores are probed and the first that
+ *			responds again is rebuilt.  Each call recomputes the next
+ *			RAID5_REBUILD_CHUNK stripes of that store.  Returns the number
+ *			of stripes still to be rebuilt (0 if there is nothing to do),
+ *			or -1 upon error.  This is intended to be called periodically
+ *			by a background process.
+ *
+ * A write that covers whole stripes computes the parity from the new data
+ * without reading anything.  A write that covers only part of a stripe
+ * needs the rest of the stripe.  Recently written partial stripes are kept
+ * in a small write-through cache so that a series of small writes to the
+ * same stripe reads it only once.  Otherwise the stripe is read in full,
+ * which also works if one of the stores is missing.
+ *
+ * One store may be broken (or being rebuilt) at a time.  Its blocks are
+ * then reconstructed from the other blocks in the stripe.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "grass.h"
+#include "block_store.h"
+
+#define RAID5_NCACHE			8		// #partial stripes cached
+#define RAID5_REBUILD_CHUNK		32		// #stripes rebuilt per step
+
+/* A cached stripe.  Blocks are indexed by store, including the parity.
+ */
+struct raid5disk_stripe {
+	bool_t valid;
+	block_no stripe;
+	unsigned long last_used;
+	block_t *blocks;
+};
+
+struct raid5disk_state {
+	block_if *below;		// block stores below
+	unsigned int nbelow;	// #block stores
+	char *broken;			// keeps track of which stores are broken
+
+	struct raid5disk_stripe cache[RAID5_NCACHE];
+	unsigned long clock;	// for LRU replacement in the cache
+
+	/* Rebuild state.
+	 */
+	int rb_member;			// store being rebuilt or -1
+	block_no rb_cursor;		// stripes below this have been rebuilt
+	block_no rb_inflight;	// #stripes at rb_cursor being rebuilt
+	bool_t rb_redo;			// a write hit the stripes being rebuilt
+};
+
+/* Which store holds the parity of the given stripe.
+ */
+static unsigned int raid5disk_parity(struct raid5disk_state *rds, block_no stripe){
+	return (rds->nbelow - 1) - stripe % rds->nbelow;
+}
+
+/* Which store holds data block k of the given stripe.
+ */
+static unsigned int raid5disk_data(struct raid5disk_state *rds, block_no stripe, unsigned int k){
+	return (raid5disk_parity(rds, stripe) + 1 + k) % rds->nbelow;
+}
+
+/* See if store i has up-to-date contents for the given stripe.
+ */
+static bool_t raid5disk_avail(struct raid5disk_state *rds, unsigned int i, block_no stripe){
+	if (rds->broken[i]) {
+		return False;
+	}
+	return rds->rb_member != (int) i || stripe < rds->rb_cursor;
+}
+
+/* Return the number of stores that are broken or being rebuilt.
+ */
+static unsigned int raid5disk_nmissing(struct raid5disk_state *rds){
+	unsigned int i, n = 0;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->broken[i] || rds->rb_member == (int) i) {
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Mark a store as broken, giving up on rebuilding it if needed.
+ */
+static void raid5disk_fail(struct raid5disk_state *rds, unsigned int i){
+	if (!rds->broken[i]) {
+		fprintf(stderr, "raid5disk: store %u failed\n", i);
+	}
+	rds->broken[i] = 1;
+	if (rds->rb_member == (int) i) {
+		rds->rb_member = -1;
+	}
+}
+
+static void raid5disk_xor(block_t *dst, block_t *src){
+	unsigned int i;
+
+	for (i = 0; i < BLOCK_SIZE; i++) {
+		dst->bytes[i] ^= src->bytes[i];
+	}
+}
+
+static int raid5disk_nblocks(block_if bi){
+	struct raid5disk_state *rds = bi->state;
+	int min = -1;
+	unsigned int i;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->broken[i]) {
+			continue;
+		}
+		int r = (*rds->below[i]->nblocks)(rds->below[i]);
+		if (r < 0) {
+			raid5disk_fail(rds, i);
+			continue;
+		}
+		if (min < 0 || r < min) {
+			min = r;
+		}
+	}
+	return min < 0 ? -1 : min * (int) (rds->nbelow - 1);
+}
+
+static int raid5disk_setsize(block_if bi, block_no nblocks){
+	fprintf(stderr, "raid5disk_setsize: not yet implemented\n");
+	return -1;
+}
+
+/* Find the cached copy of a stripe, if any.
+ */
+static struct raid5disk_stripe *raid5disk_lookup(struct raid5disk_state *rds, block_no stripe){
+	unsigned int i;
+
+	for (i = 0; i < RAID5_NCACHE; i++) {
+		struct raid5disk_stripe *rs = &rds->cache[i];
+		if (rs->valid && rs->stripe == stripe) {
+			rs->last_used = ++rds->clock;
+			return rs;
+		}
+	}
+	return 0;
+}
+
+/* Get a cache entry for the given stripe, evicting the least recently
+ * used one if necessary.  The contents are left to the caller.
+ */
+static struct raid5disk_stripe *raid5disk_alloc(struct raid5disk_state *rds, block_no stripe){
+	struct raid5disk_stripe *victim = &rds->cache[0];
+	unsigned int i;
+
+	for (i = 0; i < RAID5_NCACHE; i++) {
+		struct raid5disk_stripe *rs = &rds->cache[i];
+		if (!rs->valid) {
+			victim = rs;
+			break;
+		}
+		if (rs->last_used < victim->last_used) {
+			victim = rs;
+		}
+	}
+	victim->valid = True;
+	victim->stripe = stripe;
+	victim->last_used = ++rds->clock;
+	return victim;
+}
+
+/* Stripes s0 up to s0 + ns are being read or written.  bufs[i] holds the
+ * blocks of store i for these stripes.
+ */
+struct raid5disk_window {
+	block_no s0, ns;
+	block_t **bufs;
+};
+
+static void raid5disk_window_init(struct raid5disk_state *rds, struct raid5disk_window *w,
+												block_no offset, block_no nblocks){
+	unsigned int i;
+
+	w->s0 = offset / (rds->nbelow - 1);
+	w->ns = (offset + nblocks - 1) / (rds->nbelow - 1) - w->s0 + 1;
+	w->bufs = calloc(rds->nbelow, sizeof(*w->bufs));
+	for (i = 0; i < rds->nbelow; i++) {
+		w->bufs[i] = calloc(w->ns, BLOCK_SIZE);
+	}
+}
+
+static void raid5disk_window_free(struct raid5disk_state *rds, struct raid5disk_window *w){
+	unsigned int i;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		free(w->bufs[i]);
+	}
+	free(w->bufs);
+}
+
+/* Read or write, for each store, the stripes in [lo[i], hi[i]) of the window.
+ * Stores that fail are marked broken.  Returns -1 if any failed.
+ */
+static int raid5disk_window_io(struct raid5disk_state *rds, struct raid5disk_window *w,
+											int op, block_no *lo, block_no *hi){
+	struct block_io *ios = calloc(rds->nbelow, sizeof(*ios));
+	unsigned int *which = calloc(rds->nbelow, sizeof(*which));
+	unsigned int i, nios = 0;
+	int result = 0;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		if (lo[i] >= hi[i] || rds->broken[i]) {
+			continue;
+		}
+		ios[nios].bi = rds->below[i];
+		ios[nios].op = op;
+		ios[nios].offset = lo[i];
+		ios[nios].nblocks = hi[i] - lo[i];
+		ios[nios].blocks = &w->bufs[i][lo[i] - w->s0];
+		which[nios++] = i;
+	}
+	(void) protdisk_batch(ios, nios);
+	for (i = 0; i < nios; i++) {
+		if (ios[i].result < 0) {
+			raid5disk_fail(rds, which[i]);
+			result = -1;
+		}
+	}
+	free(ios);
+	free(which);
+	return result;
+}
+
+/* Reconstruct the block of the store that is missing in the given stripe
+ * of the window, if any, from the others.
+ */
+static void raid5disk_reconstruct(struct raid5disk_state *rds, struct raid5disk_window *w,
+															block_no stripe){
+	unsigned int i, missing;
+
+	for (missing = 0; missing < rds->nbelow; missing++) {
+		if (!raid5disk_avail(rds, missing, stripe)) {
+			break;
+		}
+	}
+	if (missing == rds->nbelow) {
+		return;
+	}
+	block_t *dst = &w->bufs[missing][stripe - w->s0];
+	memset(dst, 0, BLOCK_SIZE);
+	for (i = 0; i < rds->nbelow; i++) {
+		if (i != missing) {
+			raid5disk_xor(dst, &w->bufs[i][stripe - w->s0]);
+		}
+	}
+}
+
+/* Read all of the stripes in the window from the stores that have them,
+ * and reconstruct the missing blocks.
+ */
+static int raid5disk_read_stripes(struct raid5disk_state *rds, struct raid5disk_window *w,
+												block_no first, block_no nstripes){
+	block_no *lo = calloc(rds->nbelow, sizeof(*lo));
+	block_no *hi = calloc(rds->nbelow, sizeof(*hi));
+	unsigned int i;
+	block_no s;
+
+	for (i = 0; i < rds->nbelow; i++) {
+		lo[i] = first;
+		hi[i] = first + nstripes;
+
+		/* A store being rebuilt only has the stripes below the cursor.
+		 */
+		if (rds->rb_member == (int) i && hi[i] > rds->rb_cursor) {
+			hi[i] = rds->rb_cursor;
+		}
+	}
+	int result = raid5disk_window_io(rds, w, BIO_READ, lo, hi);
+	free(lo);
+	free(hi);
+	if (result < 0 && raid5disk_nmissing(rds) > 1) {
+		return -1;
+	}
+	if (result < 0) {
+		return raid5disk_read_stripes(rds, w, first, nstripes);
+	}
+	for (s = first; s < first + nstripes; s++) {
+		raid5disk_reconstruct(rds, w, s);
+	}
+	return 0;
+}
+
+static int raid5disk_read_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct raid5disk_state *rds = bi->state;
+	unsigned int ndata = rds->nbelow - 1;
+	struct raid5disk_window w;
+	block_no b, s;
+	unsigned int i;
+	int result;
+
+	if (raid5disk_nmissing(rds) > 1) {
+		return -1;
+	}
+	raid5disk_window_init(rds, &w, offset, nblocks);
+
+	/* If all stores are fine, read just the data blocks.  For each store
+	 * these are consecutive, possibly including a few parity blocks.
+	 * Otherwise read the stripes in full so missing blocks can be
+	 * reconstructed.
+	 */
+	bool_t degraded = False;
+	for (s = w.s0; s < w.s0 + w.ns; s++) {
+		for (i = 0; i < rds->nbelow; i++) {
+			if (!raid5disk_avail(rds, i, s)) {
+				degraded = True;
+			}
+		}
+	}
+	if (degraded) {
+		result = raid5disk_read_stripes(rds, &w, w.s0, w.ns);
+	}
+	else {
+		block_no *lo = calloc(rds->nbelow, sizeof(*lo));
+		block_no *hi = calloc(rds->nbelow, sizeof(*hi));
+		for (b = offset; b < offset + nblocks; b++) {
+			s = b / ndata;
+			i = raid5disk_data(rds, s, b % ndata);
+			if (lo[i] == hi[i]) {
+				lo[i] = s;
+			}
+			hi[i] = s + 1;
+		}
+		result = raid5disk_window_io(rds, &w, BIO_READ, lo, hi);
+		free(lo);
+		free(hi);
+
+		/* If a store failed, try again the degraded way.
+		 */
+		if (result < 0 && raid5disk_nmissing(rds) <= 1) {
+			result = raid5disk_read_stripes(rds, &w, w.s0, w.ns);
+		}
+	}
+
+	if (result == 0) {
+		for (b = offset; b < offset + nblocks; b++) {
+			s = b / ndata;
+			i = raid5disk_data(rds, s, b % ndata);
+			blocks[b - offset] = w.bufs[i][s - w.s0];
+		}
+	}
+	raid5disk_window_free(rds, &w);
+	return result;
+}
+
+static int raid5disk_read(block_if bi, block_no offset, block_t *block){
+	return raid5disk_read_range(bi, offset, 1, block);
+}
+
+/* Get the contents of a partially written stripe into the window, from
+ * the cache if possible.
+ */
+static int raid5disk_load(struct raid5disk_state *rds, struct raid5disk_window *w, block_no stripe){
+	struct raid5disk_stripe *rs = raid5disk_lookup(rds, stripe);
+	unsigned int i;
+
+	if (rs != 0) {
+		for (i = 0; i < rds->nbelow; i++) {
+			w->bufs[i][stripe - w->s0] = rs->blocks[i];
+		}
+		return 0;
+	}
+	return raid5disk_read_stripes(rds, w, stripe, 1);
+}
+
+/* Remember a partially written stripe in the cache, and keep cached
+ * stripes up-to-date.
+ */
+static void raid5disk_store(struct raid5disk_state *rds, struct raid5disk_window *w,
+										block_no stripe, bool_t partial){
+	struct raid5disk_stripe *rs = raid5disk_lookup(rds, stripe);
+	unsigned int i;
+
+	if (rs == 0) {
+		if (!partial) {
+			return;
+		}
+		rs = raid5disk_alloc(rds, stripe);
+	}
+	for (i = 0; i < rds->nbelow; i++) {
+		rs->blocks[i] = w->bufs[i][stripe - w->s0];
+	}
+}
+
+static int raid5disk_write_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct raid5disk_state *rds = bi->state;
+	unsigned int ndata = rds->nbelow - 1;
+	struct raid5disk_window w;
+	block_no b, s;
+	unsigned int i;
+
+	if (raid5disk_nmissing(rds) > 1) {
+		return -1;
+	}
+	raid5disk_window_init(rds, &w, offset, nblocks);
+
+	/* Only the first and last stripe can be partially written.  Get the
+	 * rest of their contents.
+	 */
+	block_no s_last = w.s0 + w.ns - 1;
+	bool_t first_partial = offset % ndata != 0 || offset + nblocks < (w.s0 + 1) * ndata;
+	bool_t last_partial = (offset + nblocks) % ndata != 0;
+	if (first_partial && raid5disk_load(rds, &w, w.s0) < 0) {
+		raid5disk_window_free(rds, &w);
+		return -1;
+	}
+	if (last_partial && s_last != w.s0 && raid5disk_load(rds, &w, s_last) < 0) {
+		raid5disk_window_free(rds, &w);
+		return -1;
+	}
+
+	/* Put in the new data and compute the parity.
+	 */
+	for (b = offset; b < offset + nblocks; b++) {
+		s = b / ndata;
+		w.bufs[raid5disk_data(rds, s, b % ndata)][s - w.s0] = blocks[b - offset];
+	}
+	for (s = w.s0; s <= s_last; s++) {
+		unsigned int p = raid5disk_parity(rds, s);
+		block_t *parity = &w.bufs[p][s - w.s0];
+		memset(parity, 0, BLOCK_SIZE);
+		for (i = 0; i < rds->nbelow; i++) {
+			if (i != p) {
+				raid5disk_xor(parity, &w.bufs[i][s - w.s0]);
+			}
+		}
+	}
+
+	/* Write the blocks that changed.  All blocks in the stripes between
+	 * the first and the last change, so these are consecutive on each
+	 * store.
+	 */
+	block_no *lo = calloc(rds->nbelow, sizeof(*lo));
+	block_no *hi = calloc(rds->nbelow, sizeof(*hi));
+	for (s = w.s0; s <= s_last; s++) {
+		for (i = 0; i < rds->nbelow; i++) {
+			bool_t changed = i == raid5disk_parity(rds, s);
+			if (!changed) {
+				unsigned int k = (i + rds->nbelow - raid5disk_parity(rds, s) - 1) % rds->nbelow;
+				b = s * ndata + k;
+				changed = b >= offset && b < offset + nblocks;
+			}
+			if (changed) {
+				if (lo[i] == hi[i]) {
+					lo[i] = s;
+				}
+				hi[i] = s + 1;
+			}
+		}
+	}
+
+	/* If this overlaps with stripes being rebuilt, the rebuilt blocks may
+	 * be stale and have to be computed again.
+	 */
+	if (rds->rb_inflight > 0 && w.s0 < rds->rb_cursor + rds->rb_inflight &&
+										s_last >= rds->rb_cursor) {
+		rds->rb_redo = True;
+	}
+	(void) raid5disk_window_io(rds, &w, BIO_WRITE, lo, hi);
+	free(lo);
+	free(hi);
+
+	int result = raid5disk_nmissing(rds) > 1 ? -1 : 0;
+	if (result == 0) {
+		raid5disk_store(rds, &w, w.s0, first_partial);
+		if (s_last != w.s0) {
+			raid5disk_store(rds, &w, s_last, last_partial);
+		}
+		for (s = w.s0 + 1; s < s_last; s++) {
+			raid5disk_store(rds, &w, s, False);
+		}
+	}
+	raid5disk_window_free(rds, &w);
+	return result;
+}
+
+static int raid5disk_write(block_if bi, block_no offset, block_t *block){
+	return raid5disk_write_range(bi, offset, 1, block);
+}
+
+void raid5disk_rebuild(block_if bi, unsigned int member){
+	struct raid5disk_state *rds = bi->state;
+
+	raid5disk_fail(rds, member);
+}
+
+/* Find a broken store that works again, and start rebuilding it.  Only
+ * possible if it is the only one missing.
+ */
+static bool_t raid5disk_rebuild_probe(struct raid5disk_state *rds){
+	unsigned int i;
+	block_t block;
+
+	if (raid5disk_nmissing(rds) != 1) {
+		return False;
+	}
+	for (i = 0; i < rds->nbelow; i++) {
+		if (rds->broken[i] && (*rds->below[i]->read)(rds->below[i], 0, &block) == 0) {
+			rds->broken[i] = 0;
+			rds->rb_member = i;
+			rds->rb_cursor = 0;
+			rds->rb_inflight = 0;
+			printf("raid5disk: rebuilding store %u\n\r", i);
+			return True;
+		}
+	}
+	return False;
+}
+
+int raid5disk_rebuild_step(block_if bi){
+	struct raid5disk_state *rds = bi->state;
+
+	if (rds->rb_member < 0 && !raid5disk_rebuild_probe(rds)) {
+		return 0;
+	}
+
+	int size = raid5disk_nblocks(bi);
+	if (size < 0 || rds->rb_member < 0) {
+		return -1;
+	}
+	block_no nstripes = size / (rds->nbelow - 1);
+
+	/* Recompute the next chunk from the other stores.
+	 */
+	unsigned int dst = rds->rb_member;
+	block_no n = nstripes - rds->rb_cursor;
+	if (n > RAID5_REBUILD_CHUNK) {
+		n = RAID5_REBUILD_CHUNK;
+	}
+	struct raid5disk_window w;
+	raid5disk_window_init(rds, &w, rds->rb_cursor * (rds->nbelow - 1),
+											n * (rds->nbelow - 1));
+	rds->rb_inflight = n;
+	rds->rb_redo = False;
+	if (raid5disk_read_stripes(rds, &w, w.s0, n) < 0 || rds->rb_member != (int) dst) {
+		rds->rb_inflight = 0;
+		raid5disk_window_free(rds, &w);
+		return -1;
+	}
+	block_no *lo = calloc(rds->nbelow, sizeof(*lo));
+	block_no *hi = calloc(rds->nbelow, sizeof(*hi));
+	lo[dst] = w.s0;
+	hi[dst] = w.s0 + n;
+	int result = raid5disk_window_io(rds, &w, BIO_WRITE, lo, hi);
+	free(lo);
+	free(hi);
+	raid5disk_window_free(rds, &w);
+	rds->rb_inflight = 0;
+	if (result < 0 || rds->rb_member != (int) dst) {
+		return -1;
+	}
+
+	/* Move on unless a write came in while rebuilding.
+	 */
+	if (!rds->rb_redo) {
+		rds->rb_cursor += n;
+	}
+	if (rds->rb_cursor >= nstripes) {
+		printf("raid5disk: store %u rebuilt\n\r", dst);
+		rds->rb_member = -1;
+		return 0;
+	}
+	return nstripes - rds->rb_cursor;
+}
+
+static void raid5disk_destroy(block_if bi){
+	struct raid5disk_state *rds = bi->state;
+	unsigned int i;
+
+	for (i = 0; i < RAID5_NCACHE; i++) {
+		free(rds->cache[i].blocks);
+	}
+	free(rds->broken);
+	free(rds);
+	free(bi);
+}
+
+block_if raid5disk_init(block_if *below, unsigned int nbelow){
+	if (nbelow < 3) {
+		fprintf(stderr, "raid5disk_init: need at least 3 block stores\n");
+		return 0;
+	}
+
+	/* Create the block store state structure.
+	 */
+	struct raid5disk_state *rds = new_alloc(struct raid5disk_state);
+	rds->below = below;
+	rds->nbelow = nbelow;
+	rds->broken = calloc(1, nbelow);
+	rds->rb_member = -1;
+	unsigned int i;
+	for (i = 0; i < RAID5_NCACHE; i++) {
+		rds->cache[i].blocks = calloc(nbelow, BLOCK_SIZE);
+	}
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = new_alloc(block_store_t);
+	bi->state = rds;
+	bi->nblocks = raid5disk_nblocks;
+	bi->setsize = raid5disk_setsize;
+	bi->read = raid5disk_read;
+	bi->write = raid5disk_write;
+	bi->destroy = raid5disk_destroy;
+	bi->read_range = raid5disk_read_range;
+	bi->write_range = raid5disk_write_range;
+	return bi;
+}
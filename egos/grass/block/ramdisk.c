@@ -61,6 +61,17 @@ static int ramdisk_write(block_store_t *this_bs, block_no offset, block_t *block
 	return 0;
 }
 
+static int ramdisk_discard(block_store_t *this_bs, block_no offset, block_no nblocks){
+	struct ramdisk_state *rs = this_bs->state;
+
+	if (offset + nblocks > rs->nblocks) {
+		fprintf(stderr, "ramdisk_discard: bad offset\n");
+		return -1;
+	}
+	memset(&rs->blocks[offset], 0, nblocks * BLOCK_SIZE);
+	return 0;
+}
+
 static void ramdisk_destroy(block_store_t *this_bs){
 	free(this_bs->state);
 	free(this_bs);
@@ -79,5 +90,6 @@ block_store_t *ramdisk_init(block_t *blocks, block_no nblocks){
 	this_bs->read = ramdisk_read;
 	this_bs->write = ramdisk_write;
 	this_bs->destroy = ramdisk_destroy;
+	this_bs->discard = ramdisk_discard;
 	return this_bs;
 }
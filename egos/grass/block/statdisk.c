@@ -10,22 +10,182 @@
  *
  *		block_store_t *statdisk_init(block_store_t *below){
  *			'below' is the underlying block store.
+ *
+ *		void statdisk_dump_stats(block_store_t *this_bs)
+ *			Prints the statistics, including the miss ratio curve.
+ *
+ *		void statdisk_get_stats(block_store_t *this_bs,
+ *								unsigned int *nread, unsigned int *nwrite)
+ *			Returns the number of read and write operations so far.
+ *
+ * statdisk also estimates the miss ratio curve of the reads and writes,
+ * that is, the hit ratio that an LRU cache of a given size on top of the
+ * block store below would have.  This is done by keeping track of the
+ * reuse distance, the number of other blocks accessed in between two
+ * accesses to the same block.  To keep the cost bounded only a sample
+ * of the blocks is tracked, as in SHARDS (Waldspurger et al., "Efficient
+ * MRC Construction with SHARDS", FAST '15): a block is sampled if a hash
+ * of its number is below a threshold, and the distances measured among
+ * the sampled blocks are scaled up by the sampling rate.  At most
+ * SHARDS_MAX blocks are tracked; when there are more, the block with the
+ * largest hash is dropped and the threshold lowered to its hash.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include "grass.h"
 #include "block_store.h"
 
+#define SHARDS_P		(1 << 24)	// range of the hash
+#define SHARDS_MAX		512			// max #sampled blocks tracked
+#define SHARDS_NHASH	64			// #buckets in the table of those
+#define MRC_MAX			4096		// largest cache size in the curve
+
+/* A sampled block, in LRU order and in a hash bucket.
+ */
+struct shards_entry {
+	struct shards_entry *prev, *next;	// LRU list, most recent first
+	struct shards_entry *chain;			// hash bucket
+	block_no offset;
+	uint32_t hash;
+};
+
 struct statdisk_state {
 	block_store_t *below;			// block store below
 	unsigned int nnblocks;	// #nblocks operations
 	unsigned int nsetsize;	// #nblocks operations
 	unsigned int nread;		// #read operations
 	unsigned int nwrite;	// #write operations
+	unsigned int ndiscard;	// #blocks discarded
+
+	/* Miss ratio curve.  The counts are weighted by the inverse of the
+	 * sampling rate at the time.
+	 */
+	struct shards_entry *lru;		// most recently accessed sampled block
+	struct shards_entry *buckets[SHARDS_NHASH];
+	unsigned int nsampled;			// #blocks tracked
+	uint32_t threshold;				// sample if hash < threshold
+	double *dist;					// dist[d]: #accesses at reuse distance d
+	double ncold;					// #accesses at larger distances or first
+	double naccess;					// #accesses in total
 };
 
+static uint32_t shards_hash(block_no offset){
+	uint32_t h = offset + 0x9E3779B9;	// or block 0 would always be sampled
+
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35;
+	h ^= h >> 16;
+	return h & (SHARDS_P - 1);
+}
+
+static void shards_unlink(struct statdisk_state *sds, struct shards_entry *se){
+	if (se->next == se) {
+		sds->lru = 0;
+	}
+	else {
+		se->prev->next = se->next;
+		se->next->prev = se->prev;
+		if (sds->lru == se) {
+			sds->lru = se->next;
+		}
+	}
+}
+
+static void shards_push(struct statdisk_state *sds, struct shards_entry *se){
+	if (sds->lru == 0) {
+		se->prev = se->next = se;
+	}
+	else {
+		se->next = sds->lru;
+		se->prev = sds->lru->prev;
+		se->prev->next = se;
+		se->next->prev = se;
+	}
+	sds->lru = se;
+}
+
+/* Stop tracking the sampled block with the largest hash, and lower the
+ * threshold so it and blocks with larger hashes are no longer sampled.
+ */
+static void shards_evict(struct statdisk_state *sds){
+	struct shards_entry *se = sds->lru, *max = se, **pse;
+
+	do {
+		if (se->hash > max->hash) {
+			max = se;
+		}
+		se = se->next;
+	} while (se != sds->lru);
+
+	for (pse = &sds->buckets[max->hash % SHARDS_NHASH]; *pse != max; pse = &(*pse)->chain)
+		;
+	*pse = max->chain;
+	shards_unlink(sds, max);
+	sds->threshold = max->hash;
+	sds->nsampled--;
+	free(max);
+}
+
+/* Account for an access to the given block.
+ */
+static void shards_access(struct statdisk_state *sds, block_no offset){
+	uint32_t hash = shards_hash(offset);
+	if (hash >= sds->threshold) {
+		return;
+	}
+	double scale = (double) SHARDS_P / sds->threshold;
+	sds->naccess += scale;
+
+	/* See if the block is tracked already.
+	 */
+	struct shards_entry *se;
+	for (se = sds->buckets[hash % SHARDS_NHASH]; se != 0; se = se->chain) {
+		if (se->offset == offset) {
+			break;
+		}
+	}
+
+	/* If so, its position in the LRU list is the reuse distance among
+	 * the sampled blocks.  Scaled up, that stands for a distance
+	 * anywhere in [pos * scale, (pos + 1) * scale), so take the middle.
+	 */
+	if (se != 0) {
+		struct shards_entry *p;
+		unsigned int pos = 0;
+		for (p = sds->lru; p != se; p = p->next) {
+			pos++;
+		}
+		double d = (pos + 0.5) * scale;
+		if (d < MRC_MAX) {
+			sds->dist[(unsigned int) d] += scale;
+		}
+		else {
+			sds->ncold += scale;
+		}
+		shards_unlink(sds, se);
+		shards_push(sds, se);
+		return;
+	}
+
+	/* Start tracking the block.
+	 */
+	sds->ncold += scale;
+	se = new_alloc(struct shards_entry);
+	se->offset = offset;
+	se->hash = hash;
+	se->chain = sds->buckets[hash % SHARDS_NHASH];
+	sds->buckets[hash % SHARDS_NHASH] = se;
+	shards_push(sds, se);
+	if (++sds->nsampled > SHARDS_MAX) {
+		shards_evict(sds);
+	}
+}
+
 static int statdisk_nblocks(block_store_t *this_bs){
 	struct statdisk_state *sds = this_bs->state;
 
@@ -44,6 +204,7 @@ static int statdisk_read(block_store_t *this_bs, block_no offset, block_t *block
 	struct statdisk_state *sds = this_bs->state;
 
 	sds->nread++;
+	shards_access(sds, offset);
 	return (*sds->below->read)(sds->below, offset, block);
 }
 
@@ -51,11 +212,49 @@ static int statdisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
 	struct statdisk_state *sds = this_bs->state;
 
 	sds->nwrite++;
+	shards_access(sds, offset);
 	return (*sds->below->write)(sds->below, offset, block);
 }
 
+static int statdisk_read_range(block_store_t *this_bs, block_no offset, block_no nblocks, block_t *blocks){
+	struct statdisk_state *sds = this_bs->state;
+	block_no i;
+
+	sds->nread += nblocks;
+	for (i = 0; i < nblocks; i++) {
+		shards_access(sds, offset + i);
+	}
+	return block_range_read(sds->below, offset, nblocks, blocks);
+}
+
+static int statdisk_write_range(block_store_t *this_bs, block_no offset, block_no nblocks, block_t *blocks){
+	struct statdisk_state *sds = this_bs->state;
+	block_no i;
+
+	sds->nwrite += nblocks;
+	for (i = 0; i < nblocks; i++) {
+		shards_access(sds, offset + i);
+	}
+	return block_range_write(sds->below, offset, nblocks, blocks);
+}
+
+static int statdisk_discard(block_store_t *this_bs, block_no offset, block_no nblocks){
+	struct statdisk_state *sds = this_bs->state;
+
+	sds->ndiscard += nblocks;
+	return block_range_discard(sds->below, offset, nblocks);
+}
+
 static void statdisk_destroy(block_store_t *this_bs){
-	free(this_bs->state);
+	struct statdisk_state *sds = this_bs->state;
+
+	while (sds->lru != 0) {
+		struct shards_entry *se = sds->lru;
+		shards_unlink(sds, se);
+		free(se);
+	}
+	free(sds->dist);
+	free(sds);
 	free(this_bs);
 }
 
@@ -66,6 +265,52 @@ void statdisk_dump_stats(block_store_t *this_bs){
 	printf("!$STAT: #nsetsize:  %u\n", sds->nsetsize);
 	printf("!$STAT: #nread:     %u\n", sds->nread);
 	printf("!$STAT: #nwrite:    %u\n", sds->nwrite);
+	printf("!$STAT: #ndiscard:  %u\n", sds->ndiscard);
+
+	/* Print the miss ratio curve at cache sizes 1, 2, 3, 4, 6, 8, 12, ...
+	 */
+	if (sds->naccess == 0) {
+		return;
+	}
+	double scale = (double) SHARDS_P / sds->threshold;
+	printf("!$STAT: sampling rate: %.3f\n", 1 / scale);
+
+	/* As in SHARDS_adj, the difference between the actual number of
+	 * accesses and the estimate from the sample is mostly due to popular
+	 * blocks being sampled or not, so it is put at the smallest distance.
+	 */
+	double ntotal = (double) sds->nread + sds->nwrite;
+	double nhit = ntotal - sds->naccess;
+	unsigned int d = 0, size = 1;
+	while (size <= MRC_MAX) {
+		for (; d < size; d++) {
+			nhit += sds->dist[d];
+		}
+
+		/* Smaller sizes can't be resolved at the sampling rate.
+		 */
+		if (size >= scale) {
+			double ratio = nhit < 0 ? 0 : nhit > ntotal ? 1 : nhit / ntotal;
+			printf("!$STAT: cache of %4u blocks: hit ratio %5.1f%%\n",
+								size, 100 * ratio);
+		}
+		if (size == 1) {
+			size = 2;
+		}
+		else if ((size & (size - 1)) == 0) {
+			size += size / 2;			// 2^k -> 3 * 2^(k-1)
+		}
+		else {
+			size += size / 3;			// 3 * 2^(k-1) -> 2^(k+1)
+		}
+	}
+}
+
+void statdisk_get_stats(block_store_t *this_bs, unsigned int *nread, unsigned int *nwrite){
+	struct statdisk_state *sds = this_bs->state;
+
+	*nread = sds->nread;
+	*nwrite = sds->nwrite;
 }
 
 block_store_t *statdisk_init(block_store_t *below){
@@ -73,6 +318,8 @@ block_store_t *statdisk_init(block_store_t *below){
 	 */
 	struct statdisk_state *sds = new_alloc(struct statdisk_state);
 	sds->below = below;
+	sds->threshold = SHARDS_P;
+	sds->dist = calloc(MRC_MAX, sizeof(*sds->dist));
 
 	/* Return a block interface to this inode.
 	 */
@@ -83,5 +330,8 @@ block_store_t *statdisk_init(block_store_t *below){
 	this_bs->read = statdisk_read;
 	this_bs->write = statdisk_write;
 	this_bs->destroy = statdisk_destroy;
+	this_bs->read_range = statdisk_read_range;
+	this_bs->write_range = statdisk_write_range;
+	this_bs->discard = statdisk_discard;
 	return this_bs;
 }
@@ -0,0 +1,384 @@
+/* This block store module records a trace of the requests made to the
+ * block store below, and can replay such a trace against any stack of
+ * block stores.
+ *
+ *		block_if tracedisk_init(block_if below, char *trace, unsigned int inode)
+ *			record mode: 'below' is the underlying block store.  Every
+ *			read, write, setsize, discard and copy (including reads and
+ *			writes of ranges) is passed on to below and appended to the
+ *			trace file by the name 'trace', tagged with 'inode'.  Any
+ *			number of tracedisks (say, one per inode) can record into the
+ *			same trace file.  The file is created if needed and truncated
+ *			when the first tracedisk opens it, and flushed every second
+ *			and when the last tracedisk on it is destroyed.
+ *
+ *		int tracedisk_replay(block_if *inodes, unsigned int n_inodes,
+ *												char *trace, bool_t timed)
+ *			replay mode: issue the requests in the given trace file on
+ *			the block stores inodes[0 .. n_inodes), as fast as possible or,
+ *			if 'timed' is set, at the times they were recorded.  Writes
+ *			write a pattern derived from the inode and offset.  Prints the
+ *			throughput and latency of reads and writes.  Returns the
+ *			number of failed requests, or -1 if the trace can't be read.
+ *
+ * A trace is a sequence of fixed size binary records (see struct
+ * tracedisk_record), each holding the operation, the inode, the offset
+ * (the size for setsize), the number of blocks, and the time in
+ * microseconds since the trace was started.  A copy also records the
+ * inode and offset it copied from.  The source inode is only known if
+ * the source is a tracedisk as well; otherwise the copy is recorded as
+ * one within the same inode.
+ *
+ * Ranges are only read if the store below reads them itself.  A read of
+ * a range can't tell holes apart, and a tracedisk on an inode (which may
+ * have holes) must let the block server read it a block at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "grass.h"
+#include "block_store.h"
+
+#define TRACE_FLUSH_INTERVAL	1000000		// usec between flushes of the trace
+
+enum tracedisk_op {
+	TRACE_READ, TRACE_WRITE, TRACE_SETSIZE, TRACE_DISCARD, TRACE_COPY, TRACE_NOPS
+};
+
+struct tracedisk_record {
+	uint8_t op;					// enum tracedisk_op
+	uint8_t unused;
+	uint16_t inode;
+	uint32_t offset;			// block number or size
+	uint32_t nblocks;			// #blocks read, written, discarded or copied
+	uint32_t src_offset;		// block number copied from
+	uint64_t time;				// usec since start of trace
+	uint16_t src_inode;			// inode copied from
+	uint16_t unused2[3];
+};
+
+/* Trace files are shared between the tracedisks that record into them.
+ */
+struct tracedisk_file {
+	struct tracedisk_file *next;
+	char *name;
+	FILE *fp;
+	unsigned int refcnt;
+	uint64_t start;				// time the trace was started
+	uint64_t flushed;			// time of the last flush since start
+};
+static struct tracedisk_file *tracedisk_files;
+
+struct tracedisk_state {
+	block_if below;				// block store below
+	struct tracedisk_file *tf;	// trace file
+	unsigned int inode;			// inode number to record
+};
+
+static uint64_t tracedisk_now(void){
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void tracedisk_record(struct tracedisk_state *ts, enum tracedisk_op op, block_no offset,
+									block_no nblocks, unsigned int src_inode, block_no src_offset){
+	struct tracedisk_record tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.op = op;
+	tr.inode = ts->inode;
+	tr.offset = offset;
+	tr.nblocks = nblocks;
+	tr.src_inode = src_inode;
+	tr.src_offset = src_offset;
+	tr.time = tracedisk_now() - ts->tf->start;
+	if (fwrite(&tr, sizeof(tr), 1, ts->tf->fp) != 1) {
+		fprintf(stderr, "tracedisk: can't write trace %s\n", ts->tf->name);
+	}
+
+	/* The kernel may well be killed rather than shut down, so don't keep
+	 * records buffered for long.
+	 */
+	if (tr.time - ts->tf->flushed >= TRACE_FLUSH_INTERVAL) {
+		fflush(ts->tf->fp);
+		ts->tf->flushed = tr.time;
+	}
+}
+
+static int tracedisk_nblocks(block_if bi){
+	struct tracedisk_state *ts = bi->state;
+
+	return (*ts->below->nblocks)(ts->below);
+}
+
+static int tracedisk_setsize(block_if bi, block_no nblocks){
+	struct tracedisk_state *ts = bi->state;
+
+	tracedisk_record(ts, TRACE_SETSIZE, nblocks, 0, 0, 0);
+	return (*ts->below->setsize)(ts->below, nblocks);
+}
+
+static int tracedisk_read(block_if bi, block_no offset, block_t *block){
+	struct tracedisk_state *ts = bi->state;
+
+	tracedisk_record(ts, TRACE_READ, offset, 1, 0, 0);
+	return (*ts->below->read)(ts->below, offset, block);
+}
+
+static int tracedisk_write(block_if bi, block_no offset, block_t *block){
+	struct tracedisk_state *ts = bi->state;
+
+	tracedisk_record(ts, TRACE_WRITE, offset, 1, 0, 0);
+	return (*ts->below->write)(ts->below, offset, block);
+}
+
+static int tracedisk_read_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct tracedisk_state *ts = bi->state;
+
+	tracedisk_record(ts, TRACE_READ, offset, nblocks, 0, 0);
+	return (*ts->below->read_range)(ts->below, offset, nblocks, blocks);
+}
+
+static int tracedisk_write_range(block_if bi, block_no offset, block_no nblocks, block_t *blocks){
+	struct tracedisk_state *ts = bi->state;
+
+	tracedisk_record(ts, TRACE_WRITE, offset, nblocks, 0, 0);
+	return block_range_write(ts->below, offset, nblocks, blocks);
+}
+
+static int tracedisk_discard(block_if bi, block_no offset, block_no nblocks){
+	struct tracedisk_state *ts = bi->state;
+
+	tracedisk_record(ts, TRACE_DISCARD, offset, nblocks, 0, 0);
+	return block_range_discard(ts->below, offset, nblocks);
+}
+
+/* A traced source is copied from the store below it, so that the stores
+ * below see a source of their own kind and can share the blocks.
+ */
+static int tracedisk_copy(block_if bi, block_no offset, block_if src,
+										block_no src_offset, block_no nblocks){
+	struct tracedisk_state *ts = bi->state;
+	unsigned int src_inode = ts->inode;
+
+	if (src->copy == tracedisk_copy) {
+		struct tracedisk_state *ss = src->state;
+		src_inode = ss->inode;
+		src = ss->below;
+	}
+	tracedisk_record(ts, TRACE_COPY, offset, nblocks, src_inode, src_offset);
+	return block_range_copy(ts->below, offset, src, src_offset, nblocks);
+}
+
+static void tracedisk_destroy(block_if bi){
+	struct tracedisk_state *ts = bi->state;
+	struct tracedisk_file *tf = ts->tf, **ptf;
+
+	if (--tf->refcnt == 0) {
+		for (ptf = &tracedisk_files; *ptf != tf; ptf = &(*ptf)->next)
+			;
+		*ptf = tf->next;
+		fclose(tf->fp);
+		free(tf->name);
+		free(tf);
+	}
+	free(ts);
+	free(bi);
+}
+
+block_if tracedisk_init(block_if below, char *trace, unsigned int inode){
+	/* Find or open the trace file.
+	 */
+	struct tracedisk_file *tf;
+	for (tf = tracedisk_files; tf != 0; tf = tf->next) {
+		if (strcmp(tf->name, trace) == 0) {
+			break;
+		}
+	}
+	if (tf == 0) {
+		FILE *fp = fopen(trace, "w");
+		if (fp == 0) {
+			perror(trace);
+			return 0;
+		}
+		tf = new_alloc(struct tracedisk_file);
+		tf->name = malloc(strlen(trace) + 1);
+		strcpy(tf->name, trace);
+		tf->fp = fp;
+		tf->start = tracedisk_now();
+		tf->next = tracedisk_files;
+		tracedisk_files = tf;
+	}
+	tf->refcnt++;
+
+	/* Create the block store state structure.
+	 */
+	struct tracedisk_state *ts = new_alloc(struct tracedisk_state);
+	ts->below = below;
+	ts->tf = tf;
+	ts->inode = inode;
+
+	/* Return a block interface to this inode.
+	 */
+	block_if bi = new_alloc(block_store_t);
+	bi->state = ts;
+	bi->nblocks = tracedisk_nblocks;
+	bi->setsize = tracedisk_setsize;
+	bi->read = tracedisk_read;
+	bi->write = tracedisk_write;
+	bi->destroy = tracedisk_destroy;
+	if (below->read_range != 0) {
+		bi->read_range = tracedisk_read_range;
+	}
+	bi->write_range = tracedisk_write_range;
+	bi->discard = tracedisk_discard;
+	bi->copy = tracedisk_copy;
+	return bi;
+}
+
+/* Latencies are kept in a histogram with buckets of powers of 2 usec.
+ */
+#define TRACE_NBUCKETS		32
+
+struct tracedisk_stats {
+	unsigned long count, failed;
+	uint64_t total, max;		// latencies in usec
+	unsigned long hist[TRACE_NBUCKETS];
+};
+
+static void tracedisk_stats_add(struct tracedisk_stats *st, uint64_t latency){
+	unsigned int b = 0;
+
+	st->count++;
+	st->total += latency;
+	if (latency > st->max) {
+		st->max = latency;
+	}
+	while (b < TRACE_NBUCKETS - 1 && ((uint64_t) 1 << b) <= latency) {
+		b++;
+	}
+	st->hist[b]++;
+}
+
+/* Return an upper bound on the given percentile of the latency.
+ */
+static uint64_t tracedisk_percentile(struct tracedisk_stats *st, unsigned int pct){
+	unsigned long n = 0;
+	unsigned int b;
+
+	for (b = 0; b < TRACE_NBUCKETS; b++) {
+		n += st->hist[b];
+		if (n * 100 >= st->count * pct) {
+			break;
+		}
+	}
+	return (uint64_t) 1 << b;
+}
+
+static void tracedisk_stats_print(const char *descr, struct tracedisk_stats *st, uint64_t elapsed){
+	if (st->count == 0) {
+		return;
+	}
+	printf("!$TRACE: %-8s %8lu ops %8.0f ops/sec  avg %6lu us  p50 <%6lu us  p99 <%6lu us  max %6lu us",
+			descr, st->count, st->count * 1e6 / (elapsed == 0 ? 1 : elapsed),
+			(unsigned long) (st->total / st->count),
+			(unsigned long) tracedisk_percentile(st, 50),
+			(unsigned long) tracedisk_percentile(st, 99),
+			(unsigned long) st->max);
+	if (st->failed != 0) {
+		printf("  (%lu failed)", st->failed);
+	}
+	printf("\n");
+}
+
+int tracedisk_replay(block_if *inodes, unsigned int n_inodes, char *trace, bool_t timed){
+	FILE *fp = fopen(trace, "r");
+	if (fp == 0) {
+		perror(trace);
+		return -1;
+	}
+
+	static const char *descr[TRACE_NOPS] = { "read", "write", "setsize", "discard", "copy" };
+	struct tracedisk_stats stats[TRACE_NOPS];
+	memset(stats, 0, sizeof(stats));
+
+	struct tracedisk_record tr;
+	block_t *blocks = 0;
+	unsigned long nfailed = 0, nbad = 0, nblocks = 0;
+	block_no nalloc = 0, i;
+	uint64_t start = tracedisk_now();
+	while (fread(&tr, sizeof(tr), 1, fp) == 1) {
+		if (tr.op >= TRACE_NOPS || tr.inode >= n_inodes ||
+				(tr.op == TRACE_COPY && tr.src_inode >= n_inodes)) {
+			nbad++;
+			continue;
+		}
+
+		/* Make room for the blocks of a range.
+		 */
+		if ((tr.op == TRACE_READ || tr.op == TRACE_WRITE) && tr.nblocks > nalloc) {
+			free(blocks);
+			nalloc = tr.nblocks;
+			blocks = malloc(nalloc * BLOCK_SIZE);
+		}
+		if (timed) {
+			uint64_t now = tracedisk_now() - start;
+			if (now < tr.time) {
+				usleep(tr.time - now);
+			}
+		}
+
+		block_if bi = inodes[tr.inode];
+		uint64_t before = tracedisk_now();
+		int r;
+		switch (tr.op) {
+		case TRACE_READ:
+			r = block_range_read(bi, tr.offset, tr.nblocks, blocks);
+			nblocks += tr.nblocks;
+			break;
+		case TRACE_WRITE:
+			memset(blocks, 0, tr.nblocks * BLOCK_SIZE);
+			for (i = 0; i < tr.nblocks; i++) {
+				sprintf(blocks[i].bytes, "inode %u block %u", tr.inode, tr.offset + i);
+			}
+			r = block_range_write(bi, tr.offset, tr.nblocks, blocks);
+			nblocks += tr.nblocks;
+			break;
+		case TRACE_DISCARD:
+			r = block_range_discard(bi, tr.offset, tr.nblocks);
+			break;
+		case TRACE_COPY:
+			r = block_range_copy(bi, tr.offset, inodes[tr.src_inode],
+										tr.src_offset, tr.nblocks);
+			break;
+		default:
+			r = (*bi->setsize)(bi, tr.offset);
+		}
+		tracedisk_stats_add(&stats[tr.op], tracedisk_now() - before);
+		if (r < 0) {
+			stats[tr.op].failed++;
+			nfailed++;
+		}
+	}
+	fclose(fp);
+	free(blocks);
+	if (nbad != 0) {
+		fprintf(stderr, "tracedisk_replay: skipped %lu bad records in %s\n", nbad, trace);
+	}
+
+	uint64_t elapsed = tracedisk_now() - start;
+	unsigned int op;
+	printf("!$TRACE: replayed %s in %lu ms%s, %.1f KB/sec\n", trace,
+			(unsigned long) (elapsed / 1000), timed ? " (timed)" : "",
+			nblocks * (BLOCK_SIZE / 1024.0) * 1e6 / (elapsed == 0 ? 1 : elapsed));
+	for (op = 0; op < TRACE_NOPS; op++) {
+		tracedisk_stats_print(descr[op], &stats[op], elapsed);
+	}
+	return nfailed + nbad;
+}
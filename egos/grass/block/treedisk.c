@@ -14,7 +14,13 @@
  *			Initializes the underlying block store "below" with a
  *			file system.  The file system consists of one "superblock",
  *			a number of blocks containing inodes, and the remaining
- *			blocks explained below.
+ *			blocks explained below.  The inodes are created in the
+ *			inline format, so small files need no data block.  The
+ *			number of inodes is fixed when the file system is created;
+ *			an existing file system keeps the number it has.
+ *
+ *		int treedisk_ninodes(block_store_t *below)
+ *			Returns the number of inodes of the file system on "below".
  *
  *		block_store_t *treedisk_init(block_store_t *below, unsigned int inode_no)
  *			Opens a virtual block store at the given inode number.
@@ -73,21 +79,48 @@ static int treedisk_get_snapshot(struct treedisk_snapshot *snapshot,
 
 	/* Check the inode number.
 	 */
-	if (inode_no >= snapshot->superblock.superblock.n_inodeblocks * INODES_PER_BLOCK) {
+	struct treedisk_superblock *sb = &snapshot->superblock.superblock;
+	if (inode_no >= sb->n_inodeblocks * INODES_PER_BLOCK_SB(sb)) {
 		fprintf(stderr, "!!TDERR: inode number too large %u %u\n", inode_no, snapshot->superblock.superblock.n_inodeblocks);
 		return -1;
 	}
 
 	/* Find the inode.
 	 */
-	snapshot->inode_blockno = 1 + inode_no / INODES_PER_BLOCK;
+	snapshot->inode_blockno = 1 + inode_no / INODES_PER_BLOCK_SB(sb);
 	if ((*below->read)(below, snapshot->inode_blockno, (block_t *) &snapshot->inodeblock) < 0) {
 		return -1;
 	}
-	snapshot->inode = &snapshot->inodeblock.inodeblock.inodes[inode_no % INODES_PER_BLOCK];
+	snapshot->inode = (struct treedisk_inode *) &snapshot->inodeblock.datablock.bytes[
+						(inode_no % INODES_PER_BLOCK_SB(sb)) * INODE_SIZE(sb)];
 	return 0;
 }
 
+/* Return the number of bytes of inline data in the inode of the snapshot
+ * (0 if the file system is in the classic format), and a pointer to the data.
+ */
+static unsigned int treedisk_inline(struct treedisk_snapshot *snapshot, char **pdata){
+	*pdata = (char *) &snapshot->inode[1];
+	return INODE_INLINE_SIZE(&snapshot->superblock.superblock);
+}
+
+/* See if the given block can be stored in an inline area of the given size,
+ * that is, if all bytes beyond that size are null bytes.
+ */
+static int treedisk_fits_inline(block_t *block, unsigned int inline_size){
+	unsigned int i;
+
+	if (inline_size == 0) {
+		return 0;
+	}
+	for (i = inline_size; i < BLOCK_SIZE; i++) {
+		if (block->bytes[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
 /* Allocate a block from the free list.
  */
 static block_no treedisk_alloc_block(block_store_t *below, struct treedisk_snapshot *snapshot){
@@ -138,16 +171,16 @@ static block_no treedisk_alloc_block(block_store_t *below, struct treedisk_snaps
 static void treedisk_free_block(block_store_t *below, struct treedisk_snapshot *snapshot,
 	                                block_no target){
 	//fprintf(stdout, "### free: %d\n", target);
-	// write 0s to target block
 	char zeros[BLOCK_SIZE];
 	memset(zeros, 0, sizeof(zeros));
-	if ((*below->write)(below, target, (block_t*) zeros) < 0) {
-		panic("treedisk_free_block: target block");
-	}
 
 	// get the head of free list
 	block_no b;
 	if ((b = snapshot->superblock.superblock.free_list) == 0) {
+		// target becomes an empty freelist block
+		if ((*below->write)(below, target, (block_t*) zeros) < 0) {
+			panic("treedisk_free_block: target block");
+		}
 		snapshot->superblock.superblock.free_list = target;
 		if ((*below->write)(below, 0, (block_t*) &snapshot->superblock) < 0) {
 			panic("treedisk_free_block: superblock");
@@ -169,7 +202,11 @@ static void treedisk_free_block(block_store_t *below, struct treedisk_snapshot *
 	}
 
 	if (i != REFS_PER_BLOCK) {
-		// add target to existing slot
+		// add target to existing slot.  Its contents are no longer needed,
+		// so let the layers below reclaim the space
+		if (block_range_discard(below, target, 1) < 0) {
+			panic("treedisk_free_block: target block");
+		}
 		freelistblock.freelistblock.refs[i] = target;
 		if ((*below->write)(below, b, (block_t *) &freelistblock) < 0) {
 			panic("treedisk_alloc_block: freelistblock");
@@ -218,9 +255,11 @@ static void treedisk_free_file(block_store_t *below, struct treedisk_snapshot *s
 		return;
 	}
 
-	// direct
+	// direct (or inline if the root is 0)
 	if (snapshot->inode->nblocks == 1) {
-		treedisk_free_block(below, snapshot, snapshot->inode->root);
+		if (snapshot->inode->root != 0) {
+			treedisk_free_block(below, snapshot, snapshot->inode->root);
+		}
 		return;
 	}
 
@@ -269,6 +308,9 @@ static int treedisk_setsize(block_store_t *this_bs, block_no nblocks){
 	// TODO.  Release all the blocks used by this inode.
 	treedisk_free_file(ts->below, &snapshot);
 
+	char *inline_data;
+	unsigned int inline_size = treedisk_inline(&snapshot, &inline_data);
+	memset(inline_data, 0, inline_size);
 	snapshot.inode->nblocks = 0;
 	snapshot.inode->root = 0;
 	if ((*ts->below->write)(ts->below, snapshot.inode_blockno, (block_t*) &snapshot.inodeblock) < 0) {
@@ -280,6 +322,39 @@ static int treedisk_setsize(block_store_t *this_bs, block_no nblocks){
 	return -1;
 }
 
+/* Find the data block at the given offset of the inode in the snapshot,
+ * which does not hold inline data, and return it in *pb (0 for a hole).
+ */
+static int treedisk_lookup(block_store_t *below, struct treedisk_snapshot *snapshot,
+											block_no offset, block_no *pb){
+	/* Figure out how many levels there are in the tree.
+	 */
+	unsigned int nlevels = 0;
+	if (snapshot->inode->nblocks > 0) {
+		while (log_shift_r(snapshot->inode->nblocks - 1, nlevels * log_rpb) != 0) {
+			nlevels++;
+		}
+	}
+
+	/* Walk down from the root block until a hole or the last level.
+	 */
+	block_no b = snapshot->inode->root;
+	while (b != 0 && nlevels > 0) {
+		struct treedisk_indirblock tib;
+		if ((*below->read)(below, b, (block_t *) &tib) < 0) {
+			return -1;
+		}
+
+		/* Figure out the index into this block and get the block number.
+		 */
+		nlevels--;
+		unsigned int index = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
+		b = tib.refs[index];
+	}
+	*pb = b;
+	return 0;
+}
+
 /* Read a block at the given block number 'offset' and return in *block.
  */
 static int treedisk_read(block_store_t *this_bs, block_no offset, block_t *block){
@@ -299,65 +374,63 @@ static int treedisk_read(block_store_t *this_bs, block_no offset, block_t *block
 		return -1;
 	}
 
-	/* Figure out how many levels there are in the tree.
+	/* See if the data is inline.
 	 */
-	unsigned int nlevels = 0;
-	if (snapshot.inode->nblocks > 0) {
-		while (log_shift_r(snapshot.inode->nblocks - 1, nlevels * log_rpb) != 0) {
-			nlevels++;
-		}
+	char *inline_data;
+	unsigned int inline_size = treedisk_inline(&snapshot, &inline_data);
+	if (inline_size > 0 && snapshot.inode->nblocks == 1 && snapshot.inode->root == 0) {
+		memcpy(block, inline_data, inline_size);
+		memset(&block->bytes[inline_size], 0, BLOCK_SIZE - inline_size);
+		return 0;
 	}
 
-	/* Walk down from the root block.
-	 */
-	block_no b = snapshot.inode->root;
-	for (;;) {
-		/* If there's a hole, return the null block.
-		 */
-		if (b == 0) {
-			memset(block, 0, BLOCK_SIZE);
-			return 0;
-		}
-
-		/* Return the next level.  If the last level, we're done.
-		 */
-		int result = (*ts->below->read)(ts->below, b, block);
-		if (result < 0) {
-			return result;
-		}
-		if (nlevels == 0) {
-			return 0;
-		}
+	block_no b;
+	if (treedisk_lookup(ts->below, &snapshot, offset, &b) < 0) {
+		return -1;
+	}
 
-		/* The block is an indirect block.  Figure out the index into this
-		 * block and get the block number.
-		 */
-		nlevels--;
-		struct treedisk_indirblock *tib = (struct treedisk_indirblock *) block;
-		unsigned int index = log_shift_r(offset, nlevels * log_rpb) % REFS_PER_BLOCK;
-		b = tib->refs[index];
+	/* If there's a hole, return the null block and say so.
+	 */
+	if (b == 0) {
+		memset(block, 0, BLOCK_SIZE);
+		return 1;
 	}
-	return 0;
+	return (*ts->below->read)(ts->below, b, block);
 }
 
-/* Write *block at the given block number 'offset'.
+/* Return the data block at the given offset of the inode in the snapshot,
+ * allocating it (and indirect blocks) if necessary.  Inline data is moved
+ * out of the inode first.  The caller writes the data block.
  */
-static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *block){
-	struct treedisk_state *ts = this_bs->state;
+static block_no treedisk_map(struct treedisk_state *ts, struct treedisk_snapshot *snapshot,
+															block_no offset){
 	int dirty_inode = 0;
+	char *inline_data;
+	unsigned int inline_size = treedisk_inline(snapshot, &inline_data);
 
-	/* Get info from underlying file system.
+	/* Inline data has to move out of the inode.  If the block is
+	 * overwritten anyway it can simply be dropped, else it is copied to a
+	 * newly allocated data block.
 	 */
-	struct treedisk_snapshot snapshot;
-	if (treedisk_get_snapshot(&snapshot, ts->below, ts->inode_no) < 0) {
-		return -1;
+	if (inline_size > 0 && snapshot->inode->nblocks == 1 && snapshot->inode->root == 0) {
+		if (offset != 0) {
+			union treedisk_block data;
+			memcpy(&data, inline_data, inline_size);
+			memset(&data.datablock.bytes[inline_size], 0, BLOCK_SIZE - inline_size);
+			snapshot->inode->root = treedisk_alloc_block(ts->below, snapshot);
+			if ((*ts->below->write)(ts->below, snapshot->inode->root, (block_t *) &data) < 0) {
+				panic("treedisk_write: inline data block");
+			}
+		}
+		memset(inline_data, 0, inline_size);
+		dirty_inode = 1;
 	}
 
 	/* Figure out how many levels there are in the tree now.
 	 */
 	unsigned int nlevels = 0;
-	if (snapshot.inode->nblocks > 0) {
-		while (log_shift_r(snapshot.inode->nblocks - 1, nlevels * log_rpb) != 0) {
+	if (snapshot->inode->nblocks > 0) {
+		while (log_shift_r(snapshot->inode->nblocks - 1, nlevels * log_rpb) != 0) {
 			nlevels++;
 		}
 	}
@@ -366,8 +439,8 @@ static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
 	 * by writing.
 	 */
 	unsigned int nlevels_after;
-	if (offset >= snapshot.inode->nblocks) {
-		snapshot.inode->nblocks = offset + 1;
+	if (offset >= snapshot->inode->nblocks) {
+		snapshot->inode->nblocks = offset + 1;
 		dirty_inode = 1;
 		nlevels_after = 0;
 		while (log_shift_r(offset, nlevels_after * log_rpb) != 0) {
@@ -380,19 +453,19 @@ static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
 
 	/* Grow the number of levels as needed by inserting indirect blocks.
 	 */
-	if (snapshot.inode->nblocks == 0) {
+	if (snapshot->inode->nblocks == 0) {
 		nlevels = nlevels_after;
 	}
 	else if (nlevels_after > nlevels) {
 		while (nlevels_after > nlevels) {
-			block_no indir = treedisk_alloc_block(ts->below, &snapshot);
+			block_no indir = treedisk_alloc_block(ts->below, snapshot);
 
 			/* Insert the new indirect block into the inode.
 			 */
 			struct treedisk_indirblock tib;
 			memset(&tib, 0, BLOCK_SIZE);
-			tib.refs[0] = snapshot.inode->root;
-			snapshot.inode->root = indir;
+			tib.refs[0] = snapshot->inode->root;
+			snapshot->inode->root = indir;
 			dirty_inode = 1;
 			if ((*ts->below->write)(ts->below, indir, (block_t *) &tib) < 0) {
 				panic("treedisk_write: indirect block");
@@ -405,7 +478,7 @@ static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
 	/* If the inode block was updated, write it back now.
 	 */
 	if (dirty_inode) {
-		if ((*ts->below->write)(ts->below, snapshot.inode_blockno, (block_t *) &snapshot.inodeblock) < 0) {
+		if ((*ts->below->write)(ts->below, snapshot->inode_blockno, (block_t *) &snapshot->inodeblock) < 0) {
 			panic("treedisk_write: inode block");
 		}
 	}
@@ -414,15 +487,15 @@ static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
 	 * (and indirect blocks) if necessary.
 	 */
 	block_no b;
-	block_no *parent_no = &snapshot.inode->root;
-	block_no parent_off = snapshot.inode_blockno;
-	block_t *parent_block = (block_t *) &snapshot.inodeblock;
+	block_no *parent_no = &snapshot->inode->root;
+	block_no parent_off = snapshot->inode_blockno;
+	block_t *parent_block = (block_t *) &snapshot->inodeblock;
 	for (;;) {
 		/* Get or allocate the next block.
 		 */
 		struct treedisk_indirblock tib;
 		if ((b = *parent_no) == 0) {
-			b = *parent_no = treedisk_alloc_block(ts->below, &snapshot);
+			b = *parent_no = treedisk_alloc_block(ts->below, snapshot);
 			if ((*ts->below->write)(ts->below, parent_off, parent_block) < 0) {
 				panic("treedisk_write: parent");
 			}
@@ -448,12 +521,166 @@ static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *bloc
 		parent_block = (block_t *) &tib;
 		parent_off = b;
 	}
+	return b;
+}
+
+/* Write *block at the given block number 'offset'.
+ */
+static int treedisk_write(block_store_t *this_bs, block_no offset, block_t *block){
+	struct treedisk_state *ts = this_bs->state;
+
+	/* Get info from underlying file system.
+	 */
+	struct treedisk_snapshot snapshot;
+	if (treedisk_get_snapshot(&snapshot, ts->below, ts->inode_no) < 0) {
+		return -1;
+	}
+
+	/* A file of one block that fits in the inode is stored inline, releasing
+	 * its data block if it had one.
+	 */
+	char *inline_data;
+	unsigned int inline_size = treedisk_inline(&snapshot, &inline_data);
+	if (offset == 0 && snapshot.inode->nblocks <= 1 &&
+								treedisk_fits_inline(block, inline_size)) {
+		if (snapshot.inode->nblocks == 1 && snapshot.inode->root != 0) {
+			treedisk_free_block(ts->below, &snapshot, snapshot.inode->root);
+			snapshot.inode->root = 0;
+		}
+		snapshot.inode->nblocks = 1;
+		memcpy(inline_data, block, inline_size);
+		if ((*ts->below->write)(ts->below, snapshot.inode_blockno, (block_t *) &snapshot.inodeblock) < 0) {
+			panic("treedisk_write: inode block");
+		}
+		return 0;
+	}
+
+	block_no b = treedisk_map(ts, &snapshot, offset);
 	if ((*ts->below->write)(ts->below, b, block) < 0) {
 		panic("treedisk_write: data block");
 	}
 	return 0;
 }
 
+/* Copy blocks of another file of the same file system by copying the data
+ * blocks below, which a block store that shares blocks (dedupdisk) does
+ * without moving the data.  Holes and inline data are read and written.
+ */
+static int treedisk_copy(block_store_t *this_bs, block_no offset, block_store_t *src,
+										block_no src_offset, block_no nblocks){
+	struct treedisk_state *ts = this_bs->state;
+	struct treedisk_state *ss = src->state;
+	int share = src->copy == treedisk_copy && ss->below == ts->below;
+	block_no i;
+
+	/* The source does not change, and the snapshot of the destination is
+	 * kept up to date by treedisk_map().
+	 */
+	struct treedisk_snapshot from, to;
+	if ((share && treedisk_get_snapshot(&from, ss->below, ss->inode_no) < 0) ||
+				treedisk_get_snapshot(&to, ts->below, ts->inode_no) < 0) {
+		return -1;
+	}
+	for (i = 0; i < nblocks; i++) {
+		block_no sb = 0;
+		if (share) {
+			if (src_offset + i >= from.inode->nblocks) {
+				fprintf(stderr, "!!TDERR: offset too large\n");
+				return -1;
+			}
+			if ((from.inode->nblocks > 1 || from.inode->root != 0) &&
+					treedisk_lookup(ss->below, &from, src_offset + i, &sb) < 0) {
+				return -1;
+			}
+		}
+		if (sb == 0) {
+			block_t block;
+			if ((*src->read)(src, src_offset + i, &block) < 0 ||
+						treedisk_write(this_bs, offset + i, &block) < 0 ||
+						treedisk_get_snapshot(&to, ts->below, ts->inode_no) < 0) {
+				return -1;
+			}
+			continue;
+		}
+
+		block_no b = treedisk_map(ts, &to, offset + i);
+		if (block_range_copy(ts->below, b, ts->below, sb, 1) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Release the data blocks in the given range, which then read as holes.
+ * The size of the file and its indirect blocks stay as they are.
+ */
+static int treedisk_discard(block_store_t *this_bs, block_no offset, block_no nblocks){
+	struct treedisk_state *ts = this_bs->state;
+	block_no i;
+
+	struct treedisk_snapshot snapshot;
+	if (treedisk_get_snapshot(&snapshot, ts->below, ts->inode_no) < 0) {
+		return -1;
+	}
+	if (offset >= snapshot.inode->nblocks) {
+		return 0;
+	}
+	if (nblocks > snapshot.inode->nblocks - offset) {
+		nblocks = snapshot.inode->nblocks - offset;
+	}
+
+	/* Inline data is simply cleared.
+	 */
+	char *inline_data;
+	unsigned int inline_size = treedisk_inline(&snapshot, &inline_data);
+	if (inline_size > 0 && snapshot.inode->nblocks == 1 && snapshot.inode->root == 0) {
+		memset(inline_data, 0, inline_size);
+		if ((*ts->below->write)(ts->below, snapshot.inode_blockno, (block_t *) &snapshot.inodeblock) < 0) {
+			panic("treedisk_discard: inode block");
+		}
+		return 0;
+	}
+
+	unsigned int nlevels = 0;
+	while (log_shift_r(snapshot.inode->nblocks - 1, nlevels * log_rpb) != 0) {
+		nlevels++;
+	}
+
+	for (i = offset; i < offset + nblocks; i++) {
+		/* Walk down to the reference to the data block, like
+		 * treedisk_lookup(), remembering the block that holds it.
+		 */
+		block_no parent_off = snapshot.inode_blockno;
+		block_t *parent_block = (block_t *) &snapshot.inodeblock;
+		block_no *parent_no = &snapshot.inode->root;
+		struct treedisk_indirblock tib;
+		unsigned int level = nlevels;
+		while (*parent_no != 0 && level > 0) {
+			parent_off = *parent_no;
+			if ((*ts->below->read)(ts->below, parent_off, (block_t *) &tib) < 0) {
+				return -1;
+			}
+			level--;
+			unsigned int index = log_shift_r(i, level * log_rpb) % REFS_PER_BLOCK;
+			parent_no = &tib.refs[index];
+			parent_block = (block_t *) &tib;
+		}
+
+		/* Drop the reference and free the data block.
+		 */
+		block_no b = *parent_no;
+		if (b == 0) {
+			continue;
+		}
+		*parent_no = 0;
+		if ((*ts->below->write)(ts->below, parent_off, parent_block) < 0) {
+			panic("treedisk_discard: parent");
+		}
+		treedisk_free_block(ts->below, &snapshot, b);
+	}
+	return 0;
+}
+
 static void treedisk_destroy(block_store_t *this_bs){
 	free(this_bs->state);
 	free(this_bs);
@@ -492,6 +719,8 @@ block_store_t *treedisk_init(block_store_t *below, unsigned int inode_no){
 	this_bs->read = treedisk_read;
 	this_bs->write = treedisk_write;
 	this_bs->destroy = treedisk_destroy;
+	this_bs->copy = treedisk_copy;
+	this_bs->discard = treedisk_discard;
 	return this_bs;
 }
 
@@ -532,9 +761,13 @@ int treedisk_create(block_store_t *below, unsigned int n_inodes){
 	}
 
 	/* Compute the number of inode blocks needed to store the inodes.
+	 * New file systems use the inline format.
 	 */
+	struct treedisk_superblock sb;
+	memset(&sb, 0, sizeof(sb));
+	sb.inode_size = TREEDISK_INODE_SIZE;
 	unsigned int n_inodeblocks =
-					(n_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+			(n_inodes + INODES_PER_BLOCK_SB(&sb) - 1) / INODES_PER_BLOCK_SB(&sb);
 
 	/* Get the size of the underlying disk and see if it's large enough.
 	 */
@@ -556,6 +789,7 @@ int treedisk_create(block_store_t *below, unsigned int n_inodes){
 		union treedisk_block superblock;
 		memset(&superblock, 0, BLOCK_SIZE);
 		superblock.superblock.n_inodeblocks = n_inodeblocks;
+		superblock.superblock.inode_size = sb.inode_size;
 		superblock.superblock.free_list =
 					setup_freelist(below, n_inodeblocks + 1, nblocks);
 		if ((*below->write)(below, 0, (block_t *) &superblock) < 0) {
@@ -571,9 +805,19 @@ int treedisk_create(block_store_t *below, unsigned int n_inodes){
 			}
 		}
 	}
-	else {
-		assert(superblock.superblock.n_inodeblocks == n_inodeblocks);
-	}
 
 	return 0;
 }
+
+/* Return the number of inodes of the file system.  Existing file systems
+ * may be in the classic format.
+ */
+int treedisk_ninodes(block_store_t *below){
+	union treedisk_block superblock;
+
+	if ((*below->read)(below, 0, (block_t *) &superblock) < 0) {
+		return -1;
+	}
+	struct treedisk_superblock *sb = &superblock.superblock;
+	return sb->n_inodeblocks * INODES_PER_BLOCK_SB(sb);
+}
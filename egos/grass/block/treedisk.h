@@ -9,12 +9,18 @@
  * a virtualized block store.  Each virtualized file is identified by a
  * so-called "inode number", which indexes into an array of inodes.
  *
- * The superblock maintains the number of inode blocks and a pointer
- * to the free list structure.
+ * The superblock maintains the number of inode blocks, a pointer
+ * to the free list structure, and the size of an inode slot.
  *
- * An inode block is filled with INODES_PER_BLOCK inodes.  Data in the
- * inode is stored in a complete tree, with the branching vector determined
- * by the number of block indices that fit in a block (REFS_PER_BLOCK).
+ * An inode block is filled with inode slots.  In the classic format a slot
+ * is just a struct treedisk_inode, so there are INODES_PER_BLOCK of them.
+ * In the "inline" format (created by treedisk_create) each slot is
+ * TREEDISK_INODE_SIZE bytes: the struct treedisk_inode is followed by
+ * an area for inline data.
+ *
+ * Data in the inode is stored in a complete tree, with the branching vector
+ * determined by the number of block indices that fit in a block
+ * (REFS_PER_BLOCK).
  * All data blocks are at the bottom level.  Each inode contains the number
  * of blocks in the virtual block store, and block index of the "root block".
  * If the number of blocks in the virtual store is exactly one, this root
@@ -25,6 +31,11 @@
  * exist both for data and indirect blocks.  Reading from a hole returns
  * null bytes.
  *
+ * In the inline format, a file of exactly one block whose root is 0 has
+ * its contents in the inline area of its inode slot.  The remaining bytes
+ * of the block are null bytes.  Small files, such as most directories,
+ * can thus be read without accessing a data block.
+ *
  * The free list is a linked list of blocks.  Each block is filled with
  * block indices, the first of which is either 0 to indicate the end of
  * the list, or otherwise a pointer to the next block on the list.  The
@@ -33,14 +44,24 @@
 
 #define INODES_PER_BLOCK	(BLOCK_SIZE / sizeof(struct treedisk_inode))
 #define REFS_PER_BLOCK		(BLOCK_SIZE / sizeof(block_no))
+#define TREEDISK_INODE_SIZE	256		// size of an inode slot in inline format
 
 /* Contents of the "superblock".  There is only one of these.
  */
 struct treedisk_superblock {
 	block_no n_inodeblocks;		// # blocks with inodes
 	block_no free_list;			// pointer to first block on free list
+	block_no inode_size;		// size of inode slot (0 = classic format)
 };
 
+/* Size of an inode slot, #inode slots per inode block, and #bytes of inline
+ * data per inode, given the superblock.
+ */
+#define INODE_SIZE(sb)			((sb)->inode_size == 0 ? \
+						sizeof(struct treedisk_inode) : (sb)->inode_size)
+#define INODES_PER_BLOCK_SB(sb)	(BLOCK_SIZE / INODE_SIZE(sb))
+#define INODE_INLINE_SIZE(sb)	(INODE_SIZE(sb) - sizeof(struct treedisk_inode))
+
 /* An inode describes a file (= virtual block store).  "nblocks" contains
  * the number of blocks in the file, while "root" is the top most block in
  * the tree of blocks.  Note that initially "all files exist" but are of
@@ -52,7 +73,8 @@ struct treedisk_inode {
 	block_no nblocks;			// total size of the file
 };
 
-/* An inode block is filled with inodes.
+/* An inode block is filled with inodes.  This is the classic format; see
+ * INODE_SIZE() for the general case.
  */
 struct treedisk_inodeblock {
 	struct treedisk_inode inodes[INODES_PER_BLOCK];
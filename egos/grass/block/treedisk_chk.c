@@ -123,15 +123,18 @@ int treedisk_check(block_store_t *below){
 
 	/* Scan the inode blocks.
 	 */
-	struct treedisk_inodeblock tib;
+	struct treedisk_superblock *sb = &superblock.superblock;
+	union treedisk_block tib;
 	for (b = 1; b <= superblock.superblock.n_inodeblocks; b++) {
 		(*below->read)(below, b, (block_t *) &tib);
 
-		/* Scan the inodes in the block.
+		/* Scan the inodes in the block.  Inline data (root 0 in the inline
+		 * format) does not use any blocks.
 		 */
 		unsigned int i;
-		for (i = 0; i < INODES_PER_BLOCK; i++) {
-			struct treedisk_inode *ti = &tib.inodes[i];
+		for (i = 0; i < INODES_PER_BLOCK_SB(sb); i++) {
+			struct treedisk_inode *ti = (struct treedisk_inode *)
+								&tib.datablock.bytes[i * INODE_SIZE(sb)];
 			if (ti->nblocks != 0) {
 				unsigned int nlevels = 0;
 				while (log_shift_r(ti->nblocks - 1, nlevels * log_rpb) != 0) {
@@ -26,14 +26,44 @@
 #include "block/block_store.h"
 
 #define DISK_SIZE		(16 * 1024)     // size of "physical" disk in blocks
-#define NCACHE_BLOCKS	20				// size of cache
+
+/* Size of the cache of the virtual block server.  The statistics printed
+ * when the server cleans up include the hit ratio for other sizes.
+ */
+#ifndef NCACHE_BLOCKS
+#define NCACHE_BLOCKS	20
+#endif
+
+/* Size of the cache of file blocks above the file system of the virtual
+ * block server, or 0 for none.
+ */
+#ifndef NICACHE_BLOCKS
+#define NICACHE_BLOCKS	32
+#endif
+
+#define IDLE_DELAY		10		// ms without requests before background work
+
+/* Number of inodes of the file system that are kept open.  The block
+ * stores of the inodes are created when they are first used, and closed
+ * again when another inode takes their slot.
+ */
+#define NOPEN_INODES	64
 
 /* State of the block server.
  */
 struct block_server_state {
 	char *type;
 	unsigned int n_inodes;
-	block_store_t **inodes;
+	block_store_t **inodes;			// open inodes, indexed by ino % n_open
+	unsigned int *inode_nos;		// inode number of each open inode
+	unsigned int n_open;
+	block_store_t *fs;				// store with the file system, if any
+	block_store_t *stats;			// statdisk in the stack
+	struct icache *icache;			// cache of file blocks, if any
+	block_store_t *logdisk;			// log-structured store, if any
+	block_store_t *compdisk;		// compressing store, if any
+	block_store_t *dedupdisk;		// deduplicating store, if any
+	block_store_t *arcdisk;			// ARC cache, if that is the policy
 };
 
 // these helper functions are declared here and defined later
@@ -41,16 +71,38 @@ static void block_do_read(struct block_server_state *bss, struct block_request *
 static void block_do_write(struct block_server_state *bss, struct block_request *req, void *data, unsigned int nblock, gpid_t src);
 static void block_do_getsize(struct block_server_state *bss, struct block_request *req, gpid_t src);
 static void block_do_setsize(struct block_server_state *bss, struct block_request *req, gpid_t src);
+static void block_do_discard(struct block_server_state *bss, struct block_request *req, gpid_t src);
+static void block_do_ninodes(struct block_server_state *bss, struct block_request *req, gpid_t src);
+static void block_do_copy(struct block_server_state *bss, struct block_request *req, int req_size, gpid_t src);
+static void block_do_sync(struct block_server_state *bss, struct block_request *req, gpid_t src);
 
 static void block_cleanup(void *arg){
 	struct block_server_state *bss = arg;
 
-	printf("block server: cleaning up\n\r");
+	printf("%s block server: cleaning up\n\r", bss->type);
+	statdisk_dump_stats(bss->stats);
+	if (bss->icache != 0) {
+		icache_dump_stats(bss->icache);
+	}
+	if (bss->logdisk != 0) {
+		logdisk_dump_stats(bss->logdisk);
+	}
+	if (bss->compdisk != 0) {
+		compdisk_dump_stats(bss->compdisk);
+	}
+	if (bss->dedupdisk != 0) {
+		dedupdisk_dump_stats(bss->dedupdisk);
+	}
+	if (bss->arcdisk != 0) {
+		arcdisk_dump_stats(bss->arcdisk);
+	}
 
 	unsigned int i;
-	for (i = 0; i < bss->n_inodes; i++) {
+	for (i = 0; i < bss->n_open; i++) {
 		block_store_t *bs = bss->inodes[i];
-		(*bs->destroy)(bs);
+		if (bs != 0) {
+			(*bs->destroy)(bs);
+		}
 	}
 
 	free(bss);
@@ -63,13 +115,31 @@ static void block_proc(void *arg){
 
 	proc_current->finish = block_cleanup;
 
+	/* If there is a log-structured store, it does its background work
+	 * (writing out buffered blocks, cleaning and checkpointing) when no
+	 * requests have come in for IDLE_DELAY ms.
+	 */
+	bool_t idle_work = False;
+
     struct block_request *req = new_alloc_ext(struct block_request, PAGESIZE);
     for (;;) {
         gpid_t src;
-        int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(req) + PAGESIZE, &src);
+        int req_size = sys_recv(MSG_REQUEST, idle_work ? IDLE_DELAY : 0,
+								req, sizeof(*req) + PAGESIZE, &src);
+		if (req_size < 0 && idle_work) {
+			idle_work = logdisk_idle(bss->logdisk);
+			continue;
+		}
 		if (req_size < 0) {
+			/* Stopped when shutting down.  Write out the buffered blocks
+			 * while the server below is still there; block_cleanup()
+			 * runs too late for that.
+			 */
 			printf("%s block server shutting down\n\r", bss->type);
-			free(bss);
+			if (bss->logdisk != 0) {
+				while (logdisk_idle(bss->logdisk))
+					;
+			}
 			free(req);
 			break;
 		}
@@ -92,68 +162,302 @@ static void block_proc(void *arg){
             case BLOCK_SETSIZE:
                 //fprintf(stderr, "!!DEBUG: calling block setsize\n");
                 block_do_setsize(bss, req, src);
+                break;
+            case BLOCK_DISCARD:
+                block_do_discard(bss, req, src);
+                break;
+            case BLOCK_NINODES:
+                block_do_ninodes(bss, req, src);
+                break;
+            case BLOCK_COPY:
+                block_do_copy(bss, req, req_size, src);
+                break;
+            case BLOCK_SYNC:
+                block_do_sync(bss, req, src);
                 break;
 			default:
 				assert(0);
 		}
+		idle_work = bss->logdisk != 0;
     }
 }
 
 // Size of paging partition on disk
 #define PG_DEV_BLOCKS		((PG_DEV_SIZE * PAGESIZE) / BLOCK_SIZE)
 
-/* Create a new block device.
+/* The "physical" disk is partitioned into a paging partition (inode 0)
+ * and the file system partition (inode 1).
  */
-gpid_t block_init(char *type, gpid_t below){
+static gpid_t block_init_phys(block_store_t *physdisk, block_no nblocks){
 	struct block_server_state *bss = new_alloc(struct block_server_state);
 
-	/* The "physical" disk is partitioned into a paging partition (inode 0)
-	 * and the file system partition (inode 1).
-	 */
+	bss->type = "PHYS";
+	bss->n_inodes = bss->n_open = 2;
+	bss->inodes = calloc(bss->n_open, sizeof(*bss->inodes));
+	bss->inode_nos = calloc(bss->n_open, sizeof(*bss->inode_nos));
+	bss->inode_nos[FILE_PARTITION] = FILE_PARTITION;
+	bss->stats = statdisk_init(physdisk);
+	bss->inodes[PAGE_PARTITION] = partdisk_init(bss->stats, 0, PG_DEV_BLOCKS);
+	bss->inodes[FILE_PARTITION] = partdisk_init(bss->stats, PG_DEV_BLOCKS,
+											nblocks - PG_DEV_BLOCKS);
+	return proc_create(1, "phys block", block_proc, bss);
+}
+
+/* Create a "physical" block device that stripes over nbelow disk servers,
+ * each of DISK_SIZE / nbelow blocks, in units of stripe_unit blocks.
+ */
+gpid_t block_init_raid0(gpid_t *below, unsigned int nbelow, block_no stripe_unit){
+	block_if *disks = calloc(nbelow, sizeof(*disks));
+	unsigned int i;
+
+	for (i = 0; i < nbelow; i++) {
+		disks[i] = protdisk_init(below[i], 0);
+	}
+	if (stripe_unit == 0) {
+		stripe_unit = 1;
+	}
+	block_no per_disk = DISK_SIZE / nbelow;
+	per_disk -= per_disk % stripe_unit;
+	return block_init_phys(raid0disk_init(disks, nbelow, stripe_unit),
+												per_disk * nbelow);
+}
+
+#define REPAIR_DELAY			10		// ms between repair steps
+#define REPAIR_PROBE_INTERVAL	1000	// ms between probes of broken disks
+
+/* A RAID block store and its function to do a step of repair work.
+ */
+struct block_repair {
+	block_store_t *bs;
+	int (*step)(block_store_t *bs);
+};
+
+/* Background process that brings broken disks of a RAID block store
+ * back.  It sleeps between steps so as not to take the disks away from
+ * the block server.
+ */
+static void block_repair_proc(void *arg){
+	struct block_repair *br = arg;
+
+	for (;;) {
+		int left = (*br->step)(br->bs);
+		if (sys_recv(MSG_EVENT, left > 0 ? REPAIR_DELAY :
+									REPAIR_PROBE_INTERVAL, 0, 0, 0) < 0 &&
+												proc_current->stopping) {
+			free(br);
+			break;
+		}
+	}
+}
+
+/* Create a "physical" block device that mirrors over nbelow disk servers,
+ * each of DISK_SIZE blocks.  The disks in 'stale' (a bit mask) are out of
+ * date and are brought up to date in the background.
+ */
+gpid_t block_init_raid1(gpid_t *below, unsigned int nbelow, unsigned int stale){
+	block_if *disks = calloc(nbelow, sizeof(*disks));
+	unsigned int i;
+
+	for (i = 0; i < nbelow; i++) {
+		disks[i] = protdisk_init(below[i], 0);
+	}
+	block_store_t *raid1 = raid1disk_init(disks, nbelow);
+	for (i = 0; i < nbelow; i++) {
+		if (stale & (1 << i)) {
+			raid1disk_resync(raid1, i);
+		}
+	}
+	struct block_repair *br = new_alloc(struct block_repair);
+	br->bs = raid1;
+	br->step = raid1disk_resync_step;
+	// created after the server, so that it is stopped first
+	gpid_t pid = block_init_phys(raid1, DISK_SIZE);
+	proc_create(1, "raid1 resync", block_repair_proc, br);
+	return pid;
+}
+
+/* Create a "physical" block device that stripes with parity over nbelow
+ * disk servers, each of RAID5_DISK_SIZE(nbelow) blocks.  The disk in
+ * 'stale' (a bit mask) is out of date and is rebuilt in the background.
+ */
+gpid_t block_init_raid5(gpid_t *below, unsigned int nbelow, unsigned int stale){
+	block_if *disks = calloc(nbelow, sizeof(*disks));
+	unsigned int i;
+
+	for (i = 0; i < nbelow; i++) {
+		disks[i] = protdisk_init(below[i], 0);
+	}
+	block_store_t *raid5 = raid5disk_init(disks, nbelow);
+	if (raid5 == 0) {
+		panic("block_init_raid5: can't create RAID5 block store");
+	}
+	for (i = 0; i < nbelow; i++) {
+		if (stale & (1 << i)) {
+			raid5disk_rebuild(raid5, i);
+		}
+	}
+	struct block_repair *br = new_alloc(struct block_repair);
+	br->bs = raid5;
+	br->step = raid5disk_rebuild_step;
+	// created after the server, so that it is stopped first
+	gpid_t pid = block_init_phys(raid5, DISK_SIZE);
+	proc_create(1, "raid5 rebuild", block_repair_proc, br);
+	return pid;
+}
+
+/* Create a new block device.  'type' is "phys", or "virt" possibly
+ * followed by the cache policy, as in "virt:arc".
+ */
+gpid_t block_init(char *type, gpid_t below){
 	if (strcmp(type, "phys") == 0) {
-		bss->type = "PHYS";
-		block_store_t *physdisk = protdisk_init(below, 0);
-		bss->n_inodes = 2;
-		bss->inodes = calloc(bss->n_inodes, sizeof(*bss->inodes));
-		bss->inodes[PAGE_PARTITION] = partdisk_init(physdisk, 0, PG_DEV_BLOCKS);
-		bss->inodes[FILE_PARTITION] = partdisk_init(physdisk, PG_DEV_BLOCKS,
-												DISK_SIZE - PG_DEV_BLOCKS);
-		return proc_create(1, "phys block", block_proc, bss);
+		return block_init_phys(protdisk_init(below, 0), DISK_SIZE);
 	}
-	if (strcmp(type, "virt") == 0) {
+
+	struct block_server_state *bss = new_alloc(struct block_server_state);
+	if (strncmp(type, "virt", 4) == 0 && (type[4] == 0 || type[4] == ':')) {
 		bss->type = "VIRT";
-		bss->n_inodes = MAX_INODES;
-		bss->inodes = calloc(bss->n_inodes, sizeof(*bss->inodes));
 		block_store_t *physdisk = protdisk_init(below, FILE_PARTITION);
 
+		/* Write the partition as a log, so that writes are sequential,
+		 * unless it holds a file system from before.
+		 */
+		bss->logdisk = logdisk_init(physdisk);
+		block_store_t *logdisk = bss->logdisk;
+		if (logdisk == 0) {
+			printf("block_init: file system is not log-structured\n\r");
+			logdisk = physdisk;
+		}
+
+		/* Compress the blocks of the file system, unless the partition
+		 * holds an uncompressed one from before.
+		 */
+		bss->compdisk = compdisk_init(logdisk);
+		block_store_t *compdisk = bss->compdisk;
+		if (compdisk == 0) {
+			printf("block_init: file system is not compressed\n\r");
+			compdisk = logdisk;
+		}
+
+		/* Cache the blocks.  The replacement policy is CLOCK, unless
+		 * another is given as in "virt:arc".
+		 */
 		block_t *cache = malloc(NCACHE_BLOCKS * BLOCK_SIZE);
-		block_store_t *cachedisk = clockdisk_init(physdisk, cache, NCACHE_BLOCKS);
+		char *policy = type[4] == ':' ? &type[5] : "clock";
+		block_store_t *cachingdisk;
+		if (strcmp(policy, "clock") == 0) {
+			cachingdisk = clockdisk_init(compdisk, cache, NCACHE_BLOCKS);
+		}
+		else if (strcmp(policy, "arc") == 0) {
+			cachingdisk = bss->arcdisk = arcdisk_init(compdisk, cache, NCACHE_BLOCKS);
+		}
+		else {
+			panic("block_init: unknown cache policy");
+		}
+		printf("block_init: %s cache of %u blocks\n\r", policy, NCACHE_BLOCKS);
+
+		/* Measure the requests on the cache, so its size can be chosen
+		 * from the miss ratio curve.
+		 */
+		bss->stats = statdisk_init(cachingdisk);
 
+		/* Store identical blocks once.  This is above the cache so that
+		 * shared blocks are cached once.  Again, a file system from before
+		 * is used as it is.
+		 */
+		bss->dedupdisk = dedupdisk_init(bss->stats);
+		block_store_t *cachedisk = bss->dedupdisk;
+		if (cachedisk == 0) {
+			printf("block_init: file system is not deduplicated\n\r");
+			cachedisk = bss->stats;
+		}
 
-		/* Virtualize the store, creating a collection of MAX_INODES virtual stores.
+		/* Virtualize the store, creating a file system of NINODES virtual
+		 * stores unless it has one already.  The virtual stores are opened
+		 * on demand; see block_inode().
 		 */
 #ifdef HW_FS
-		if (fatdisk_create(cachedisk, MAX_INODES) < 0) {
+		if (fatdisk_create(cachedisk, NINODES) < 0) {
 			panic("block_init: can't create fatdisk file system");
 		}
-		unsigned int inode;
-		for (inode = 0; inode < MAX_INODES; inode++) {
-			bss->inodes[inode] = fatdisk_init(cachedisk, inode);
-		}
+		bss->n_inodes = NINODES;
 #else
-		if (treedisk_create(cachedisk, MAX_INODES) < 0) {
+		if (treedisk_create(cachedisk, NINODES) < 0) {
 			panic("block_init: can't create treedisk file system");
 		}
-		unsigned int inode;
-		for (inode = 0; inode < MAX_INODES; inode++) {
-			bss->inodes[inode] = treedisk_init(cachedisk, inode);
-		}
+		bss->n_inodes = treedisk_ninodes(cachedisk);
 #endif
+		bss->fs = cachedisk;
+		bss->n_open = NOPEN_INODES;
+		bss->inodes = calloc(bss->n_open, sizeof(*bss->inodes));
+		bss->inode_nos = calloc(bss->n_open, sizeof(*bss->inode_nos));
+		printf("block_init: file system of %u inodes\n\r", bss->n_inodes);
+
+		/* Cache the blocks of the files, so that reading a block that is
+		 * in the cache does not involve the file system.
+		 */
+		if (NICACHE_BLOCKS > 0) {
+			bss->icache = icache_create(malloc(NICACHE_BLOCKS * BLOCK_SIZE), NICACHE_BLOCKS);
+		}
 		return proc_create(1, "virt block", block_proc, bss);
 	}
 	assert(0);
 }
 
+/* Create the stack of block stores of the given inode of the file system.
+ */
+static block_store_t *block_open(struct block_server_state *bss, unsigned int ino){
+#ifdef HW_FS
+	block_store_t *bs = fatdisk_init(bss->fs, ino);
+#else
+	block_store_t *bs = treedisk_init(bss->fs, ino);
+#endif
+	if (bs == 0) {
+		return 0;
+	}
+	if (bss->icache != 0) {
+		bs = icachedisk_init(bs, bss->icache, ino);
+	}
+#ifdef BLOCK_TRACE
+	/* Record the requests on the virtual stores in the trace file
+	 * BLOCK_TRACE, to be replayed later with tracedisk_replay().
+	 */
+	block_store_t *tracedisk = tracedisk_init(bs, BLOCK_TRACE, ino);
+	if (tracedisk == 0) {
+		panic("block_open: can't record trace");
+	}
+	bs = tracedisk;
+#endif
+	return bs;
+}
+
+/* Return the block store of the given inode, opening it if needed, or 0
+ * if there is no such inode.
+ */
+static block_store_t *block_inode(struct block_server_state *bss, unsigned int ino){
+	if (ino >= bss->n_inodes) {
+		return 0;
+	}
+	unsigned int slot = ino % bss->n_open;
+	block_store_t *old = bss->inodes[slot];
+	if (old != 0 && bss->inode_nos[slot] == ino) {
+		return old;
+	}
+
+	/* Open the new one before closing the old one, so that a trace file
+	 * shared by the two stays open.
+	 */
+	block_store_t *bs = block_open(bss, ino);
+	if (bs == 0) {
+		return 0;
+	}
+	if (old != 0) {
+		(*old->destroy)(old);
+	}
+	bss->inodes[slot] = bs;
+	bss->inode_nos[slot] = ino;
+	return bs;
+}
+
 static void block_respond(struct block_request *req, enum block_status status,
                 void *data, unsigned int nblock, gpid_t src){
     struct block_reply *rep = new_alloc_ext(struct block_reply, nblock * BLOCK_SIZE);
@@ -168,31 +472,57 @@ static void block_respond(struct block_request *req, enum block_status status,
 static void block_do_read(struct block_server_state *bss, struct block_request *req, gpid_t src){
     // req->ino
     // req->offset_nblock
-    if (req->ino >= MAX_INODES) {
+    // req->nblock
+    block_store_t *virt = block_inode(bss, req->ino);
+    if (virt == 0) {
         printf("block_do_read: bad inode: %u\n", req->ino);
         block_respond(req, BLOCK_ERROR, 0, 0, src);
         return;
     }
 
+    unsigned int nblock = req->nblock == 0 ? 1 : req->nblock;
+    if (nblock > BLOCK_MAX_NBLOCK) {
+        printf("block_do_read: too many blocks: %u\n", nblock);
+        block_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+
     /* Allocate room for the reply.
      */
-    struct block_reply *rep = new_alloc_ext(struct block_reply, BLOCK_SIZE);
+    struct block_reply *rep = new_alloc_ext(struct block_reply, nblock * BLOCK_SIZE);
 
-    /* Read the block from block store
+    /* Read the blocks from block store.  Holes are left out of the reply.
+     * A read of a range doesn't report holes, so only the stores below the
+     * file system read ranges; those have no holes.  The stores of inodes
+     * (tracedisk included) are read a block at a time.
      */
-    int result;
+    int result = 0;
     block_t *buffer = (block_t*)(&rep[1]);
-    block_store_t *virt = bss->inodes[req->ino];
+    unsigned int i, ndata = 0;
 
-    result = (*virt->read)(virt, req->offset_nblock, buffer);
+    if (virt->read_range != 0) {
+        result = (*virt->read_range)(virt, req->offset_nblock, nblock, buffer);
+        ndata = nblock;
+    }
+    else {
+        for (i = 0; i < nblock && result >= 0; i++) {
+            result = (*virt->read)(virt, req->offset_nblock + i, &buffer[ndata]);
+            if (result == 1) {
+                rep->holes |= 1 << i;
+            }
+            else {
+                ndata++;
+            }
+        }
+    }
     if (result < 0) {
         printf("block_do_read: bad offset: %u in inode %u\n", req->offset_nblock, req->ino);
         block_respond(req, BLOCK_ERROR, 0, 0, src);
     }
 	else {
 		rep->status = BLOCK_OK;
-		rep->size_nblock = 1;
-		sys_send(src, MSG_REPLY, rep, sizeof(*rep) + BLOCK_SIZE);
+		rep->size_nblock = nblock;
+		sys_send(src, MSG_REPLY, rep, sizeof(*rep) + ndata * BLOCK_SIZE);
 	}
 	free(rep);
 }
@@ -202,13 +532,14 @@ static void block_do_read(struct block_server_state *bss, struct block_request *
 static void block_do_write(struct block_server_state *bss, struct block_request *req, void *data, unsigned int nblock, gpid_t src){
     // req->ino
     // req->offset_nblock
-    if (req->ino >= MAX_INODES) {
+    block_store_t *virt = block_inode(bss, req->ino);
+    if (virt == 0) {
         printf("block_do_write: bad inode %u\n", req->ino);
         block_respond(req, BLOCK_ERROR, 0, 0, src);
         return;
     }
 
-    if (nblock != 1) {
+    if (nblock == 0 || nblock > BLOCK_MAX_NBLOCK) {
         printf("block_do_write: size mismatch %u %u\n", 1, nblock);
         block_respond(req, BLOCK_ERROR, 0, 0, src);
         return;
@@ -216,9 +547,8 @@ static void block_do_write(struct block_server_state *bss, struct block_request
 
     int result;
     block_t *buffer = (block_t*)(data);
-    block_store_t *virt = bss->inodes[req->ino];
 
-    result = (*virt->write)(virt, req->offset_nblock, buffer);
+    result = block_range_write(virt, req->offset_nblock, nblock, buffer);
     if (result < 0) {
         printf("block_do_write: bad offset: %u in inode %u\n", req->offset_nblock, req->ino);
         block_respond(req, BLOCK_ERROR, 0, 0, src);
@@ -233,7 +563,8 @@ static void block_do_write(struct block_server_state *bss, struct block_request
 static void block_do_getsize(struct block_server_state *bss, struct block_request *req, gpid_t src){
     // req->ino
     // req->offset_nblock
-    if (req->ino >= MAX_INODES) {
+    block_store_t *virt = block_inode(bss, req->ino);
+    if (virt == 0) {
         printf("block_do_getsize: bad inode %u\n", req->ino);
         block_respond(req, BLOCK_ERROR, 0, 0, src);
         return;
@@ -241,7 +572,6 @@ static void block_do_getsize(struct block_server_state *bss, struct block_reques
 
     /* Get size of block store.
      */
-    block_store_t *virt = bss->inodes[req->ino];
     unsigned int size = (*virt->nblocks)(virt);
 
     /* Send size of block store.
@@ -259,13 +589,13 @@ static void block_do_getsize(struct block_server_state *bss, struct block_reques
 static void block_do_setsize(struct block_server_state *bss, struct block_request *req, gpid_t src){
     // req->ino
     // req->offset_nblock
-    if (req->ino >= MAX_INODES) {
+    block_store_t *virt = block_inode(bss, req->ino);
+    if (virt == 0) {
         printf("block_do_setsize: bad inode %u\n", req->ino);
         block_respond(req, BLOCK_ERROR, 0, 0, src);
         return;
     }
 
-    block_store_t *virt = bss->inodes[req->ino];
     int result = (*virt->setsize)(virt, req->offset_nblock);
 
     if (result < 0) {
@@ -276,3 +606,82 @@ static void block_do_setsize(struct block_server_state *bss, struct block_reques
 
     block_respond(req, BLOCK_OK, 0, 0, src);
 }
+
+static void block_do_discard(struct block_server_state *bss, struct block_request *req, gpid_t src){
+    block_store_t *virt = block_inode(bss, req->ino);
+    if (virt == 0) {
+        printf("block_do_discard: bad inode %u\n", req->ino);
+        block_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+
+    if (block_range_discard(virt, req->offset_nblock, req->nblock) < 0) {
+        printf("block_do_discard: bad range ino: %u, %u %u\n", req->ino, req->offset_nblock, req->nblock);
+        block_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+
+    block_respond(req, BLOCK_OK, 0, 0, src);
+}
+
+/* Respond to a request for the number of inodes.
+ */
+static void block_do_ninodes(struct block_server_state *bss, struct block_request *req, gpid_t src){
+    struct block_reply rep;
+    memset(&rep, 0, sizeof(rep));
+    rep.status = BLOCK_OK;
+    rep.size_nblock = bss->n_inodes;
+    sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+}
+
+/* Respond to a sync request by writing out the blocks the log buffers.
+ */
+static void block_do_sync(struct block_server_state *bss, struct block_request *req, gpid_t src){
+    if (bss->logdisk != 0 && logdisk_sync(bss->logdisk) < 0) {
+        printf("block_do_sync: can't write the log\n");
+        block_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+    block_respond(req, BLOCK_OK, 0, 0, src);
+}
+
+/* Respond to a copy request.  The source is opened separately if it
+ * would otherwise take the slot of the destination.
+ */
+static void block_do_copy(struct block_server_state *bss, struct block_request *req, int req_size, gpid_t src){
+    struct block_copy_source *cs = (struct block_copy_source *) &req[1];
+    if (req_size < (int) (sizeof(*req) + sizeof(*cs)) || cs->ino == req->ino) {
+        printf("block_do_copy: bad request\n");
+        block_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+
+    block_store_t *virt = block_inode(bss, req->ino), *from = 0;
+    bool_t opened = False;
+    if (virt != 0 && cs->ino < bss->n_inodes) {
+        if (cs->ino % bss->n_open == req->ino % bss->n_open) {
+            from = block_open(bss, cs->ino);
+            opened = True;
+        }
+        else {
+            from = block_inode(bss, cs->ino);
+        }
+    }
+    if (virt == 0 || from == 0) {
+        printf("block_do_copy: bad inode %u or %u\n", req->ino, cs->ino);
+        block_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+
+    int result = block_range_copy(virt, req->offset_nblock, from, cs->offset_nblock, req->nblock);
+    if (opened) {
+        (*from->destroy)(from);
+    }
+    if (result < 0) {
+        printf("block_do_copy: bad range ino: %u, %u %u\n", req->ino, req->offset_nblock, req->nblock);
+        block_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+
+    block_respond(req, BLOCK_OK, 0, 0, src);
+}
@@ -1,3 +1,11 @@
-#define MAX_INODES      128
+/* Number of inodes of a newly created file system.  An existing file
+ * system keeps the number it was created with.
+ */
+#ifndef NINODES
+#define NINODES         1024
+#endif
 
 enum { PAGE_PARTITION, FILE_PARTITION };
+
+// Size of each disk of a RAID5 "physical" disk of n disks
+#define RAID5_DISK_SIZE(n)	((16 * 1024 + (n) - 2) / ((n) - 1))
@@ -22,8 +22,45 @@
 #include "exec.h"
 #include "process.h"
 
-#define MAX_PATH_NAME	1024
+#define MAX_PATH_NAME	DIR_MAX_PATH
 #define NENTRIES		(PAGESIZE / DIR_ENTRY_SIZE)
+#define DIR_NINDEXES	16			// #directories with a cached index
+
+/* The server keeps an index of the directories it recently used, so a
+ * lookup does not have to read and scan the directory file.  An index
+ * has the entries of the directory in a hash table by name, and a list
+ * of the free slots in the directory file.  It is built when the
+ * directory is first used and updated when entries are inserted or
+ * removed, which assumes that only the directory server writes to a
+ * directory once it is in the name space.  A new directory is written
+ * by its creator before it is inserted, so an insert drops the index of
+ * the file being inserted, in case its inode was used before.
+ */
+struct dir_name {
+	struct dir_name *next;			// next in hash chain
+	unsigned long offset;			// of the entry in the directory
+	struct dir_entry de;
+};
+
+struct dir_slot {
+	struct dir_slot *next;			// next free slot
+	unsigned long offset;			// of the slot in the directory
+};
+
+struct dir_index {
+	struct dir_index *next;			// next in LRU list
+	fid_t dir;						// the directory
+	unsigned long size;				// size of the directory file
+	struct dir_name **buckets;		// hash table of entries
+	unsigned int nbuckets;			// size of hash table (power of 2)
+	unsigned int nnames;			// #entries
+	struct dir_slot *free_slots;	// free entries in the directory
+};
+
+struct dir_server {
+	struct dir_index *indexes;		// most recently used first
+	unsigned int nindexes;			// #indexes
+};
 
 /* See if the name in de->name is the same as in s for the given size.
  */
@@ -34,6 +71,166 @@ static bool_t name_cmp(struct dir_entry *de, char *s, unsigned int size){
 	return strncmp(de->name, s, size) == 0;
 }
 
+/* FNV-1a hash of a name.
+ */
+static unsigned int name_hash(const char *s, unsigned int size){
+	unsigned int h = 2166136261u, i;
+
+	for (i = 0; i < size; i++) {
+		h = (h ^ (unsigned char) s[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* Add an entry to the hash table of an index.  The table doubles when it
+ * gets more than two entries per bucket.
+ */
+static void dir_index_add(struct dir_index *di, struct dir_entry *de, unsigned long offset){
+	if (di->nnames >= 2 * di->nbuckets) {
+		unsigned int n = 2 * di->nbuckets, i;
+		struct dir_name **buckets = calloc(n, sizeof(*buckets));
+		for (i = 0; i < di->nbuckets; i++) {
+			struct dir_name *dn;
+			while ((dn = di->buckets[i]) != 0) {
+				di->buckets[i] = dn->next;
+				unsigned int h = name_hash(dn->de.name,
+								strnlen(dn->de.name, DIR_NAME_SIZE)) & (n - 1);
+				dn->next = buckets[h];
+				buckets[h] = dn;
+			}
+		}
+		free(di->buckets);
+		di->buckets = buckets;
+		di->nbuckets = n;
+	}
+
+	struct dir_name *dn = new_alloc(struct dir_name);
+	dn->de = *de;
+	dn->offset = offset;
+	unsigned int h = name_hash(de->name, strnlen(de->name, DIR_NAME_SIZE)) &
+															(di->nbuckets - 1);
+	dn->next = di->buckets[h];
+	di->buckets[h] = dn;
+	di->nnames++;
+}
+
+/* Find the hash chain link that points to the entry with the given name,
+ * or to 0 at the end of the chain if there is none.
+ */
+static struct dir_name **dir_index_find(struct dir_index *di, char *name, unsigned int size){
+	struct dir_name **pdn = &di->buckets[name_hash(name, size) & (di->nbuckets - 1)];
+
+	while (*pdn != 0 && !name_cmp(&(*pdn)->de, name, size)) {
+		pdn = &(*pdn)->next;
+	}
+	return pdn;
+}
+
+static void dir_index_add_slot(struct dir_index *di, unsigned long offset){
+	struct dir_slot *ds = new_alloc(struct dir_slot);
+	ds->offset = offset;
+	ds->next = di->free_slots;
+	di->free_slots = ds;
+}
+
+static void dir_index_free(struct dir_index *di){
+	unsigned int i;
+
+	for (i = 0; i < di->nbuckets; i++) {
+		struct dir_name *dn;
+		while ((dn = di->buckets[i]) != 0) {
+			di->buckets[i] = dn->next;
+			free(dn);
+		}
+	}
+	free(di->buckets);
+	struct dir_slot *ds;
+	while ((ds = di->free_slots) != 0) {
+		di->free_slots = ds->next;
+		free(ds);
+	}
+	free(di);
+}
+
+/* Remove the index of a directory, if there is one.
+ */
+static void dir_index_drop(struct dir_server *ds, fid_t dir){
+	struct dir_index **pdi;
+
+	for (pdi = &ds->indexes; *pdi != 0; pdi = &(*pdi)->next) {
+		struct dir_index *di = *pdi;
+		if (fid_eq(di->dir, dir)) {
+			*pdi = di->next;
+			ds->nindexes--;
+			dir_index_free(di);
+			return;
+		}
+	}
+}
+
+/* Return the index of a directory, reading the directory if it has
+ * none.  Returns 0 if the directory cannot be read.
+ */
+static struct dir_index *dir_index_get(struct dir_server *ds, fid_t dir){
+	struct dir_index **pdi, *di;
+
+	/* See if it's there, and if so move it to the front.
+	 */
+	for (pdi = &ds->indexes; (di = *pdi) != 0; pdi = &di->next) {
+		if (fid_eq(di->dir, dir)) {
+			*pdi = di->next;
+			di->next = ds->indexes;
+			ds->indexes = di;
+			return di;
+		}
+	}
+
+	/* Read the directory.
+	 */
+	di = new_alloc(struct dir_index);
+	di->dir = dir;
+	di->nbuckets = 8;
+	di->buckets = calloc(di->nbuckets, sizeof(*di->buckets));
+	char *buf = malloc(FILE_MAX_XFER);
+	for (;;) {
+		unsigned int n = FILE_MAX_XFER;
+		if (!file_read(dir.server, dir.ino, di->size, buf, &n)) {
+			free(buf);
+			dir_index_free(di);
+			return 0;
+		}
+		if (n == 0) {
+			break;
+		}
+		assert(n % DIR_ENTRY_SIZE == 0);
+		unsigned int i;
+		for (i = 0; i < n; i += DIR_ENTRY_SIZE, di->size += DIR_ENTRY_SIZE) {
+			struct dir_entry *de = (struct dir_entry *) &buf[i];
+			if (de->name[0] == 0) {
+				dir_index_add_slot(di, di->size);
+			}
+			else {
+				dir_index_add(di, de, di->size);
+			}
+		}
+	}
+	free(buf);
+
+	/* Make room and put it in front.
+	 */
+	if (ds->nindexes == DIR_NINDEXES) {
+		for (pdi = &ds->indexes; (*pdi)->next != 0; pdi = &(*pdi)->next)
+			;
+		dir_index_free(*pdi);
+		*pdi = 0;
+		ds->nindexes--;
+	}
+	di->next = ds->indexes;
+	ds->indexes = di;
+	ds->nindexes++;
+	return di;
+}
+
 static void dir_respond(gpid_t src, enum dir_status status, fid_t *fid){
 	struct dir_reply rep;
 	memset(&rep, 0, sizeof(rep));
@@ -46,99 +243,167 @@ static void dir_respond(gpid_t src, enum dir_status status, fid_t *fid){
 
 /* Respond to a lookup request.
  */
-static void dir_do_lookup(struct dir_request *req, gpid_t src, char *name, unsigned int size){
+static void dir_do_lookup(struct dir_server *ds, struct dir_request *req, gpid_t src,
+										char *name, unsigned int size){
 	if (size > DIR_NAME_SIZE) {
 		dir_respond(src, DIR_ERROR, 0);
 		return;
 	}
 
-	/* Read the directory one page at a time.
-	 */
-	char *buf = malloc(PAGESIZE);
-	unsigned long offset;
-	for (offset = 0;;) {
-		unsigned int n = PAGESIZE;
-		bool_t status = file_read(req->dir.server, req->dir.ino,
-					offset, buf, &n);
-		if (!status) {
-			dir_respond(src, DIR_ERROR, 0);			// file error
-			free(buf);
-			return;
-		}
-		if (n == 0) {
-			dir_respond(src, DIR_ERROR, 0);			// not found
-			free(buf);
-			return;
+	struct dir_index *di = dir_index_get(ds, req->dir);
+	if (di == 0) {
+		dir_respond(src, DIR_ERROR, 0);			// file error
+		return;
+	}
+	struct dir_name *dn = *dir_index_find(di, name, size);
+	if (dn == 0) {
+		dir_respond(src, DIR_ERROR, 0);			// not found
+		return;
+	}
+	dir_respond(src, DIR_OK, &dn->de.fid);
+}
+
+/* Respond to a request to look up a path.  Each name is looked up in
+ * the index of the directory found for the name before it.
+ */
+static void dir_do_lookup_path(struct dir_server *ds, struct dir_request *req, gpid_t src,
+										char *path, unsigned int size){
+	struct dir_reply rep;
+	memset(&rep, 0, sizeof(rep));
+	rep.status = DIR_ERROR;
+
+	fid_t dir = req->dir, fid = dir;
+	unsigned int i = 0;
+	while (i < size) {
+		/* Find the next name, and add ".dir" if it's a directory.
+		 */
+		char *e = memchr(&path[i], '/', size - i);
+		unsigned int n = e == 0 ? size - i : e - &path[i];
+		bool_t is_dir = e != 0 || req->is_dir;
+		struct dir_name *dn = 0;
+		if (n + (is_dir ? 4 : 0) <= DIR_NAME_SIZE) {
+			char name[DIR_NAME_SIZE];
+			memcpy(name, &path[i], n);
+			if (is_dir) {
+				memcpy(&name[n], ".dir", 4);
+				n += 4;
+			}
+			struct dir_index *di = dir_index_get(ds, dir);
+			if (di != 0) {
+				dn = *dir_index_find(di, name, n);
+			}
 		}
-		assert(n % DIR_ENTRY_SIZE == 0);
-		unsigned int i;
-		for (i = 0; i < n; i += DIR_ENTRY_SIZE, offset += DIR_ENTRY_SIZE) {
-			struct dir_entry *de = (struct dir_entry *) &buf[i];
-			if (name_cmp(de, name, size)) {
-				dir_respond(src, DIR_OK, &de->fid);
-				free(buf);
+
+		if (e == 0) {
+			rep.dir = dir;
+			if (dn == 0) {
+				sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 				return;
 			}
+			fid = dn->de.fid;
+			break;
+		}
+		if (dn == 0) {
+			sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+			return;
 		}
+		fid = dn->de.fid;
+		i = e - path + 1;
+		dir = fid;
 	}
+
+	rep.status = DIR_OK;
+	rep.dir = dir;
+	rep.fid = fid;
+	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 }
 
 /* Respond to an insert request.
  */
-static void dir_do_insert(struct dir_request *req, gpid_t src, char *name, unsigned int size){
-	if (size > DIR_NAME_SIZE) {
+static void dir_do_insert(struct dir_server *ds, struct dir_request *req, gpid_t src,
+										char *name, unsigned int size){
+	if (size == 0 || size > DIR_NAME_SIZE) {
 		dir_respond(src, DIR_ERROR, 0);
 		return;
 	}
 
-	/* Read the directory one page at a time.
-	 */
-	char *buf = malloc(PAGESIZE);
-	bool_t found_free_entry = False;
-	unsigned long offset, free_offset;
-	for (offset = 0;;) {
-		unsigned int n = PAGESIZE;
-		bool_t status = file_read(req->dir.server, req->dir.ino,
-					offset, buf, &n);
-		if (!status) {
-			free(buf);
-			dir_respond(src, DIR_ERROR, 0);			// file error
-			return;
-		}
-		if (n == 0) {
-			break;
-		}
-		assert(n % DIR_ENTRY_SIZE == 0);
-		unsigned int i;
-		for (i = 0; i < n; i += DIR_ENTRY_SIZE, offset += DIR_ENTRY_SIZE) {
-			struct dir_entry *de = (struct dir_entry *) &buf[i];
-			if (de->name[0] == 0) {
-				if (!found_free_entry) {
-					free_offset = offset;
-					found_free_entry = True;
-				}
-			}
-			else if (name_cmp(de, name, size)) {
-				free(buf);
-				dir_respond(src, DIR_ERROR, 0);			// already exists
-				return;
-			}
-		}
+	dir_index_drop(ds, req->fid);
+	struct dir_index *di = dir_index_get(ds, req->dir);
+	if (di == 0) {
+		dir_respond(src, DIR_ERROR, 0);			// file error
+		return;
+	}
+	if (*dir_index_find(di, name, size) != 0) {
+		dir_respond(src, DIR_ERROR, 0);			// already exists
+		return;
 	}
 
-	/* Add the new entry.
+	/* Add the new entry in a free slot or at the end.
 	 */
-	if (found_free_entry) {
-		offset = free_offset;
-	}
+	struct dir_slot *slot = di->free_slots;
+	unsigned long offset = slot != 0 ? slot->offset : di->size;
 	struct dir_entry nde;
 	memset(&nde, 0, sizeof(nde));
 	strncpy(nde.name, name, size);
 	nde.fid = req->fid;
-	bool_t wstatus = file_write(req->dir.server, req->dir.ino,
-											offset, &nde, sizeof(nde));
-	free(buf);
-	dir_respond(src, wstatus ? DIR_OK : DIR_ERROR, &req->fid);
+	if (!file_write(req->dir.server, req->dir.ino, offset, &nde, sizeof(nde))) {
+		dir_index_drop(ds, req->dir);
+		dir_respond(src, DIR_ERROR, 0);
+		return;
+	}
+	if (slot != 0) {
+		di->free_slots = slot->next;
+		free(slot);
+	}
+	else {
+		di->size += DIR_ENTRY_SIZE;
+	}
+	dir_index_add(di, &nde, offset);
+	dir_respond(src, DIR_OK, &req->fid);
+}
+
+/* Respond to a remove request.  The entry is cleared, but the file it
+ * refers to is left alone.
+ */
+static void dir_do_remove(struct dir_server *ds, struct dir_request *req, gpid_t src,
+										char *name, unsigned int size){
+	if (size > DIR_NAME_SIZE) {
+		dir_respond(src, DIR_ERROR, 0);
+		return;
+	}
+
+	struct dir_index *di = dir_index_get(ds, req->dir);
+	if (di == 0) {
+		dir_respond(src, DIR_ERROR, 0);			// file error
+		return;
+	}
+	struct dir_name **pdn = dir_index_find(di, name, size), *dn = *pdn;
+	if (dn == 0) {
+		dir_respond(src, DIR_ERROR, 0);			// not found
+		return;
+	}
+
+	struct dir_entry nde;
+	memset(&nde, 0, sizeof(nde));
+	if (!file_write(req->dir.server, req->dir.ino, dn->offset, &nde, sizeof(nde))) {
+		dir_index_drop(ds, req->dir);
+		dir_respond(src, DIR_ERROR, 0);
+		return;
+	}
+	*pdn = dn->next;
+	di->nnames--;
+	dir_index_add_slot(di, dn->offset);
+	dir_respond(src, DIR_OK, &dn->de.fid);
+	free(dn);
+}
+
+static void dir_cleanup(void *arg){
+	struct dir_server *ds = arg;
+
+	while (ds->indexes != 0) {
+		dir_index_drop(ds, ds->indexes->dir);
+	}
+	free(ds);
 }
 
 /* The directory server.
@@ -146,12 +411,16 @@ static void dir_do_insert(struct dir_request *req, gpid_t src, char *name, unsig
 static void dir_proc(void *arg){
 	printf("DIRECTORY SERVER: %u\n\r", sys_getpid());
 
+	proc_current->finish = dir_cleanup;
+
+	struct dir_server *ds = arg;
+
 	struct dir_request *req = new_alloc_ext(struct dir_request, MAX_PATH_NAME);
 	for (;;) {
 		gpid_t src;
 
 		int req_size = sys_recv(MSG_REQUEST, 0,
-								req, sizeof(req) + MAX_PATH_NAME, &src);
+								req, sizeof(*req) + MAX_PATH_NAME, &src);
 		if (req_size < 0) {
 			printf("directory server terminating\n\r");
 			free(req);
@@ -161,13 +430,16 @@ static void dir_proc(void *arg){
 		assert(req_size >= (int) sizeof(*req));
 		switch (req->type) {
 		case DIR_LOOKUP:
-			dir_do_lookup(req, src, (char *) &req[1], req_size - sizeof(*req));
+			dir_do_lookup(ds, req, src, (char *) &req[1], req_size - sizeof(*req));
 			break;
 		case DIR_INSERT:
-			dir_do_insert(req, src, (char *) &req[1], req_size - sizeof(*req));
+			dir_do_insert(ds, req, src, (char *) &req[1], req_size - sizeof(*req));
 			break;
 		case DIR_REMOVE:
-			// dir_do_remove(req, src, (char *) &req[1], req_size - sizeof(*req));
+			dir_do_remove(ds, req, src, (char *) &req[1], req_size - sizeof(*req));
+			break;
+		case DIR_LOOKUP_PATH:
+			dir_do_lookup_path(ds, req, src, (char *) &req[1], req_size - sizeof(*req));
 			break;
 		default:
 			assert(0);
@@ -177,5 +449,6 @@ static void dir_proc(void *arg){
 
 gpid_t dir_init(void){
 	assert(sizeof(struct dir_entry) == DIR_ENTRY_SIZE);
-	return proc_create(1, "dir", dir_proc, 0);
+	struct dir_server *ds = new_alloc(struct dir_server);
+	return proc_create(1, "dir", dir_proc, ds);
 }
@@ -31,9 +31,16 @@ struct disk_server_state {
 	unsigned int nblocks;
 };
 
+/* A request may cover multiple blocks.  A read of each is a separate disk
+ * operation, and the reply is sent when the last one completes.  A write
+ * of all of them is a single operation.
+ */
 struct disk_request {
 	gpid_t pid, src;
 	struct block_reply *rep;
+	unsigned int nblock;		// #blocks in the request
+	unsigned int npending;		// #disk operations not yet completed
+	bool_t success;				// False if any of them failed
 };
 
 static void disk_respond(struct block_request *req, enum block_status status,
@@ -50,10 +57,18 @@ static void disk_respond(struct block_request *req, enum block_status status,
 static void disk_read_complete(void *arg, bool_t success){
 	struct disk_request *dr = arg;
 
-	dr->rep->size_nblock = 1;
-	if (success) {
+	if (!success) {
+		dr->success = False;
+	}
+	if (--dr->npending > 0) {
+		return;
+	}
+
+	dr->rep->size_nblock = dr->nblock;
+	if (dr->success) {
 		dr->rep->status = BLOCK_OK;
-		proc_send(dr->pid, dr->src, MSG_REPLY, dr->rep, sizeof(*dr->rep) + BLOCK_SIZE);
+		proc_send(dr->pid, dr->src, MSG_REPLY, dr->rep,
+								sizeof(*dr->rep) + dr->nblock * BLOCK_SIZE);
 	}
 	else {
 		dr->rep->status = BLOCK_ERROR;
@@ -63,6 +78,15 @@ static void disk_read_complete(void *arg, bool_t success){
 	free(dr);
 }
 
+/* Check that a request of nblock blocks is within the disk.
+ */
+static bool_t disk_check_range(struct disk_server_state *dss,
+							struct block_request *req, unsigned int nblock){
+	return nblock > 0 && nblock <= BLOCK_MAX_NBLOCK &&
+				req->offset_nblock < dss->nblocks &&
+				nblock <= dss->nblocks - req->offset_nblock;
+}
+
 /* Respond to a read block request.
  */
 static void disk_do_read(struct disk_server_state *dss, struct block_request *req, gpid_t src){
@@ -71,18 +95,30 @@ static void disk_do_read(struct disk_server_state *dss, struct block_request *re
         disk_respond(req, BLOCK_ERROR, 0, 0, src);
         return;
     }
+    unsigned int nblock = req->nblock == 0 ? 1 : req->nblock;
+    if (!disk_check_range(dss, req, nblock)) {
+        printf("disk_do_read: bad range: %u %u\n", req->offset_nblock, nblock);
+        disk_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
 
     /* Allocate room for the reply.
      */
-    struct block_reply *rep = new_alloc_ext(struct block_reply, BLOCK_SIZE);
+    struct block_reply *rep = new_alloc_ext(struct block_reply, nblock * BLOCK_SIZE);
 
-	/* Schedule the disk read operation.
+	/* Schedule the disk read operations.
 	 */
 	struct disk_request *dr = new_alloc(struct disk_request);
 	dr->pid = sys_getpid();
 	dr->src = src;
 	dr->rep = rep;
-	dev_disk_read(dss->dd, req->offset_nblock, (char *) &rep[1], disk_read_complete, dr);
+	dr->nblock = dr->npending = nblock;
+	dr->success = True;
+	unsigned int i;
+	for (i = 0; i < nblock; i++) {
+		dev_disk_read(dss->dd, req->offset_nblock + i,
+					(char *) &rep[1] + i * BLOCK_SIZE, disk_read_complete, dr);
+	}
 }
 
 /* This is an interrupt handler, invoked when the write has completed.
@@ -90,8 +126,15 @@ static void disk_do_read(struct disk_server_state *dss, struct block_request *re
 static void disk_write_complete(void *arg, bool_t success){
 	struct disk_request *dr = arg;
 
-	dr->rep->status = success ? BLOCK_OK : BLOCK_ERROR;
-	dr->rep->size_nblock = 1;
+	if (!success) {
+		dr->success = False;
+	}
+	if (--dr->npending > 0) {
+		return;
+	}
+
+	dr->rep->status = dr->success ? BLOCK_OK : BLOCK_ERROR;
+	dr->rep->size_nblock = dr->nblock;
 	proc_send(dr->pid, dr->src, MSG_REPLY, dr->rep, sizeof(*dr->rep));
 	free(dr->rep);
 	free(dr);
@@ -101,24 +144,59 @@ static void disk_write_complete(void *arg, bool_t success){
  */
 static void disk_do_write(struct disk_server_state *dss, struct block_request *req,
 														unsigned int size, gpid_t src){
-	assert(size == BLOCK_SIZE);
     if (req->ino != 0) {
         printf("disk_do_write: bad inode: %u\n", req->ino);
         disk_respond(req, BLOCK_ERROR, 0, 0, src);
         return;
     }
+    unsigned int nblock = size / BLOCK_SIZE;
+    if (size % BLOCK_SIZE != 0 || !disk_check_range(dss, req, nblock)) {
+        printf("disk_do_write: bad range: %u %u\n", req->offset_nblock, size);
+        disk_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
 
     /* Allocate room for the reply.
      */
     struct block_reply *rep = new_alloc(struct block_reply);
 
-	/* Schedule the disk read operation.
+	/* Schedule the disk write operation.  The blocks are consecutive, so
+	 * they are written in one go.
 	 */
 	struct disk_request *dr = new_alloc(struct disk_request);
 	dr->pid = sys_getpid();
 	dr->src = src;
 	dr->rep = rep;
-	dev_disk_write(dss->dd, req->offset_nblock, (char *) &req[1], disk_write_complete, dr);
+	dr->nblock = nblock;
+	dr->npending = 1;
+	dr->success = True;
+	dev_disk_write(dss->dd, req->offset_nblock, nblock,
+					(char *) &req[1], disk_write_complete, dr);
+}
+
+/* Respond to a discard block request.  Unlike reads and writes, a discard
+ * carries no data, so its size is not limited.
+ */
+static void disk_do_discard(struct disk_server_state *dss, struct block_request *req, gpid_t src){
+    if (req->ino != 0) {
+        printf("disk_do_discard: bad inode: %u\n", req->ino);
+        disk_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+    if (req->offset_nblock > dss->nblocks || req->nblock > dss->nblocks - req->offset_nblock) {
+        printf("disk_do_discard: bad range: %u %u\n", req->offset_nblock, req->nblock);
+        disk_respond(req, BLOCK_ERROR, 0, 0, src);
+        return;
+    }
+
+	struct disk_request *dr = new_alloc(struct disk_request);
+	dr->pid = sys_getpid();
+	dr->src = src;
+	dr->rep = new_alloc(struct block_reply);
+	dr->nblock = req->nblock;
+	dr->npending = 1;
+	dr->success = True;
+	dev_disk_discard(dss->dd, req->offset_nblock, req->nblock, disk_write_complete, dr);
 }
 
 /* Respond to a getsize block request.
@@ -154,7 +232,7 @@ static void disk_proc(void *arg){
     struct block_request *req = new_alloc_ext(struct block_request, PAGESIZE);
     for (;;) {
         gpid_t src;
-        int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(req) + PAGESIZE, &src);
+        int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + PAGESIZE, &src);
 		if (req_size < 0) {
 			printf("disk server shutting down\n\r");
 			// free(dss);			-- events may still come in
@@ -176,6 +254,9 @@ static void disk_proc(void *arg){
                 break;
             case BLOCK_SETSIZE:
                 disk_do_setsize(dss, req, src);
+                break;
+            case BLOCK_DISCARD:
+                disk_do_discard(dss, req, src);
                 break;
 			default:
 				assert(0);
@@ -115,18 +115,94 @@ int main(int argc, char **argv){
 	ge.servers[GPID_TTY] = tty_init();
 
 	gpid_t disk_init(char *filename, unsigned int nblocks, bool_t sync);
-	ge.servers[GPID_DISK] = disk_init("disk.dev", 16 * 1024, False);
-
 	gpid_t block_init(char *type, gpid_t below);
+#ifdef RAID0_NDISKS
+	/* Stripe the "physical" disk over RAID0_NDISKS disk servers.
+	 */
+#ifndef RAID0_STRIPE_UNIT
+#define RAID0_STRIPE_UNIT	4		// #blocks in a stripe unit
+#endif
+	gpid_t block_init_raid0(gpid_t *below, unsigned int nbelow, unsigned int stripe_unit);
+	gpid_t raid0_disks[RAID0_NDISKS];
+	unsigned int disk;
+	for (disk = 0; disk < RAID0_NDISKS; disk++) {
+		char name[32];
+		sprintf(name, "disk%u.dev", disk);
+		raid0_disks[disk] = disk_init(name, 16 * 1024 / RAID0_NDISKS, False);
+	}
+	ge.servers[GPID_DISK] = raid0_disks[0];
+	ge.servers[GPID_BLOCK_PHYS] = block_init_raid0(raid0_disks, RAID0_NDISKS, RAID0_STRIPE_UNIT);
+#elif defined(RAID1_NDISKS)
+	/* Mirror the "physical" disk over RAID1_NDISKS disk servers.
+	 */
+	gpid_t block_init_raid1(gpid_t *below, unsigned int nbelow, unsigned int stale);
+	gpid_t raid1_disks[RAID1_NDISKS];
+	unsigned int disk, missing = 0;
+	for (disk = 0; disk < RAID1_NDISKS; disk++) {
+		char name[32];
+		sprintf(name, "mirror%u.dev", disk);
+		if (access(name, F_OK) != 0) {
+			missing |= 1 << disk;
+		}
+		raid1_disks[disk] = disk_init(name, 16 * 1024, False);
+	}
+
+	/* Mirrors that have been removed are rebuilt from the others.
+	 */
+	if (missing == (1 << RAID1_NDISKS) - 1) {
+		missing = 0;
+	}
+	ge.servers[GPID_DISK] = raid1_disks[0];
+	ge.servers[GPID_BLOCK_PHYS] = block_init_raid1(raid1_disks, RAID1_NDISKS, missing);
+#elif defined(RAID5_NDISKS)
+	/* Stripe the "physical" disk with parity over RAID5_NDISKS disk servers.
+	 */
+	gpid_t block_init_raid5(gpid_t *below, unsigned int nbelow, unsigned int stale);
+	gpid_t raid5_disks[RAID5_NDISKS];
+	unsigned int disk, missing = 0;
+	for (disk = 0; disk < RAID5_NDISKS; disk++) {
+		char name[32];
+		sprintf(name, "raid5_%u.dev", disk);
+		if (access(name, F_OK) != 0) {
+			missing |= 1 << disk;
+		}
+		raid5_disks[disk] = disk_init(name, RAID5_DISK_SIZE(RAID5_NDISKS), False);
+	}
+
+	/* A disk that has been removed is rebuilt from the others.
+	 */
+	if (missing == (1 << RAID5_NDISKS) - 1) {
+		missing = 0;
+	}
+	ge.servers[GPID_DISK] = raid5_disks[0];
+	ge.servers[GPID_BLOCK_PHYS] = block_init_raid5(raid5_disks, RAID5_NDISKS, missing);
+#else
+	ge.servers[GPID_DISK] = disk_init("disk.dev", 16 * 1024, False);
 	ge.servers[GPID_BLOCK_PHYS] = block_init("phys", ge.servers[GPID_DISK]);
-	ge.servers[GPID_BLOCK_VIRT] = block_init("virt", ge.servers[GPID_BLOCK_PHYS]);
+#endif
 
-	gpid_t ramfile_init(void);
-	ge.servers[GPID_FILE_RAM] = ramfile_init();
+	/* The cache policy of the virtual block server can be chosen when
+	 * starting, as in "./a.out cache=arc".
+	 */
+	char virt_type[32] = "virt";
+	int arg;
+	for (arg = 1; arg < argc; arg++) {
+		if (strncmp(argv[arg], "cache=", 6) == 0) {
+			snprintf(virt_type, sizeof(virt_type), "virt:%s", argv[arg] + 6);
+		}
+	}
+	ge.servers[GPID_BLOCK_VIRT] = block_init(virt_type, ge.servers[GPID_BLOCK_PHYS]);
 
 	gpid_t blkfile_init(gpid_t);
 	ge.servers[GPID_FILE_DISK] = blkfile_init(ge.servers[GPID_BLOCK_VIRT]);
 
+	/* The ram file server spills files it has no room for to disk.
+	 */
+	gpid_t ramfile_init(gpid_t);
+	ge.servers[GPID_FILE_RAM] = ramfile_init(ge.servers[GPID_FILE_DISK]);
+	void blkfile_set_ramfile(gpid_t);
+	blkfile_set_ramfile(ge.servers[GPID_FILE_RAM]);
+
 	/* Set the default file server.
 	 */
 	ge.servers[GPID_FILE] = ge.servers[GPID_FILE_DISK];
@@ -30,6 +30,15 @@
 #define TLB_SIZE		16			// #entries in TLB
 #define PHYS_FRAMES		128			// #physical frames
 
+/* Number of executable pages read at a time on a page fault.  Without
+ * paging, frames holding pages that are never touched cannot be reclaimed.
+ */
+#ifdef HW_PAGING
+#define EXEC_CLUSTER	8
+#else
+#define EXEC_CLUSTER	1
+#endif
+
 #define MAX_PROCS		100			// maximum #processes
 
 /* The process that is currently running.  This variable is external
@@ -197,6 +206,24 @@ struct process *proc_find(gpid_t pid){
 	return 0;
 }
 
+/* See if the given process expects a reply from the given server, either
+ * from a single RPC or as one of a set of RPCs.  In the latter case, the
+ * process need not be waiting as an earlier reply may have woken it up.
+ */
+static bool_t proc_awaits_reply(struct process *p, gpid_t server){
+	if (p->rpc_calls != 0) {
+		unsigned int i;
+		for (i = 0; i < p->rpc_ncalls; i++) {
+			if (p->rpc_calls[i].pending && p->rpc_calls[i].pid == server) {
+				return True;
+			}
+		}
+		return False;
+	}
+	return p->state == PROC_WAITING && p->mboxes[MSG_REPLY].waiting
+										&& p->server == server;
+}
+
 /* Current process wants to wait for a message on a particular queue
  * that it owns.
  */
@@ -206,9 +233,12 @@ bool_t proc_recv(enum msg_type mtype, unsigned int max_time,
 	struct msg_queue *mq = &proc_current->mboxes[mtype];
 	assert(!mq->waiting);
 
-	/* If there are no messages, wait.
+	/* If there are no messages, wait, unless the process is being stopped.
 	 */
 	if (queue_empty(&mq->messages)) {
+		if (proc_current->stopping && mtype != MSG_REPLY) {
+			return False;
+		}
 		mq->waiting = True;
 		proc_current->state = PROC_WAITING;
 		proc_nrunnable--;
@@ -220,9 +250,10 @@ bool_t proc_recv(enum msg_type mtype, unsigned int max_time,
 		assert(!mq->waiting);
 	}
 	else {
-		/* There shouldn't be a reply yet if this is part of an RPC.
+		/* There shouldn't be a reply yet if this is part of an RPC,
+		 * unless several RPCs are outstanding.
 		 */
-		assert(mtype != MSG_REPLY);
+		assert(mtype != MSG_REPLY || proc_current->rpc_calls != 0);
 	}
 
 	/* Get the message, if any.
@@ -267,8 +298,7 @@ bool_t proc_send(gpid_t src_pid, gpid_t dst_pid, enum msg_type mtype,
 	/* If it's a response, the process should be waiting for one.
 	 */
 	if (mtype == MSG_REPLY) {
-		if (dst->state != PROC_WAITING || !mq->waiting
-											|| dst->server != src_pid) {
+		if (!proc_awaits_reply(dst, src_pid)) {
 			fprintf(stderr, "%u: dst %u (%u) not waiting for reply (%d %d %u)\n",
 									src_pid, dst_pid, dst->pid,
 									dst->state, mq->waiting, dst->server);
@@ -360,7 +390,7 @@ void proc_term(struct process *proc, int status){
 		struct process *p;
 		for (p = proc_set; p < &proc_set[MAX_PROCS]; p++) {
 			if (p->state == PROC_WAITING &&
-					p->mboxes[MSG_REPLY].waiting && p->server == proc->pid) {
+					p->mboxes[MSG_REPLY].waiting && proc_awaits_reply(p, proc->pid)) {
 				printf("Process %u waiting for reply from %u\n\r", p->pid, proc->pid);
 				proc_wakeup(p);
 			}
@@ -467,6 +497,11 @@ void ctx_entry(void){
 	proc_current = proc_next;
 	(*proc_current->start)(proc_current->arg);
 
+	/* A server that was stopped returns when it is done.
+	 */
+	if (proc_current->stopping) {
+		sys_exit(STAT_SHUTDOWN);
+	}
 	printf("process %u terminated!!\n\r", proc_current->pid);
 	sys_exit(STAT_ILLMEM);
 }
@@ -573,6 +608,45 @@ gpid_t proc_create(gpid_t owner, char *descr, void (*start)(void *), void *arg){
 	return proc_create_uid(owner, descr, start, arg, 0);
 }
 
+/* When shutting down, the main process and user processes are killed
+ * right away.  The servers that the kernel started are stopped one at a
+ * time, from the highest process id down, so that each can still write
+ * out what it buffers through the servers started before it.  A server
+ * is stopped by failing its receives of requests and events, after which
+ * it is expected to clean up and return.
+ */
+static void proc_stop_next(void){
+	struct process *p, *next = 0;
+	bool_t busy = False;
+
+	for (p = proc_set; p < &proc_set[MAX_PROCS]; p++) {
+		if (p->state == PROC_FREE) {
+			continue;
+		}
+		if (p->pid == 1 || p->owner != 1) {
+			proc_zap(0, p, STAT_SHUTDOWN);
+		}
+		else if (p->state == PROC_ZOMBIE) {
+			continue;
+		}
+		else if (p->stopping) {
+			busy = True;
+		}
+		else if (next == 0 || p->pid > next->pid) {
+			next = p;
+		}
+	}
+
+	/* Stop the next server once the last one is gone.
+	 */
+	if (!busy && next != 0) {
+		next->stopping = True;
+		if (next->state == PROC_WAITING && !next->mboxes[MSG_REPLY].waiting) {
+			proc_wakeup(next);
+		}
+	}
+}
+
 /* Yield to another process.  This is basically the main scheduler.
  */
 void proc_yield(void){
@@ -596,11 +670,11 @@ void proc_yield(void){
 			proc_cleanup();
 			exit(0);
 		}
+		if (proc_shutting_down) {
+			proc_stop_next();
+		}
 		for (p = proc_set; p < &proc_set[MAX_PROCS]; p++) {
-			if (proc_shutting_down && p->state != PROC_FREE) {
-				proc_zap(0, p, STAT_SHUTDOWN);
-			}
-			else if (p->state == PROC_WAITING && p->alarm_set) {
+			if (p->state == PROC_WAITING && p->alarm_set) {
 				if (p->exptime <= now) {
 					proc_wakeup(p);
 				}
@@ -639,9 +713,13 @@ void proc_yield(void){
 		}
 
 		/* If this is the last process remaining when shutting down,
-		 * actually clean things up.
+		 * actually clean things up.  That may be the current process,
+		 * which was killed but not yet released.
 		 */
 		if (proc_nprocs == 1 && proc_shutting_down) {
+			if (proc_current->state == PROC_ZOMBIE) {
+				proc_release(proc_current);
+			}
 			proc_cleanup();
 			exit(0);
 		}
@@ -710,37 +788,31 @@ extern fid_t pgdev;
 #define BLOCKS_PER_PAGE			(PAGESIZE / BLOCK_SIZE)
 
 /* Write the given physical frame to disk.  "block" is actually measured in pages.
- * A page covers BLOCKS_PER_PAGE blocks.
+ * A page covers BLOCKS_PER_PAGE blocks, which are transferred in one request.
  */
 static void frame_write(unsigned int frame, unsigned int block) {
-	unsigned int i, offset = block * BLOCKS_PER_PAGE;
+	unsigned int offset = block * BLOCKS_PER_PAGE;
 	const char *mem = (char *) &proc_frames[frame];
 
-	for (i = 0; i < BLOCKS_PER_PAGE; i++, offset++) {
-		bool_t success = block_write(pgdev.server, pgdev.ino, offset, mem);
-		assert(success);
-		mem += BLOCK_SIZE;
-	}
+	bool_t success = block_write_range(pgdev.server, pgdev.ino, offset,
+												BLOCKS_PER_PAGE, mem);
+	assert(success);
 }
 
 static void frame_read(unsigned int frame, unsigned int block) {
-	unsigned int i, offset = block * BLOCKS_PER_PAGE;
+	unsigned int offset = block * BLOCKS_PER_PAGE;
 	char *mem = (char *) &proc_frames[frame];
 
-	for (i = 0; i < BLOCKS_PER_PAGE; i++, offset++) {
-		bool_t success = block_read(pgdev.server, pgdev.ino, offset, mem);
-		assert(success);
-		mem += BLOCK_SIZE;
-	}
+	bool_t success = block_read_range(pgdev.server, pgdev.ino, offset,
+												BLOCKS_PER_PAGE, mem);
+	assert(success);
 }
 #endif // PAGE_TO_FILE
 #endif //>>>>HW_PAGING
 
-/* Allocate a frame for the given page.
+/* Allocate a frame for the given page if there's one on the free list.
  */
-static void proc_frame_alloc(struct page_info *pi){
-	/* First check to see if there's a frame on the free list.
-	 */
+static bool_t proc_frame_alloc_free(struct page_info *pi){
 	unsigned int frame_no;
 	bool_t success = queue_get_uint(&proc_freeframes, &frame_no);
 	if (success) {
@@ -752,6 +824,16 @@ static void proc_frame_alloc(struct page_info *pi){
 		// printf("assign frame %u to process %u\n\r", frame_no, proc_current->pid);
 		pi->status = PI_VALID;
 		pi->u.frame = frame_no;
+	}
+	return success;
+}
+
+/* Allocate a frame for the given page.
+ */
+static void proc_frame_alloc(struct page_info *pi){
+	/* First check to see if there's a frame on the free list.
+	 */
+	if (proc_frame_alloc_free(pi)) {
 		return;
 	}
 
@@ -810,27 +892,46 @@ static void proc_frame_alloc(struct page_info *pi){
 }
 
 /* Initialize a newly allocated frame.  See if it's in the executable.
+ * Pages of the executable are read up to EXEC_CLUSTER at a time in a
+ * single request.  The ones following the faulting page are put in free
+ * frames, if there are any, so they need not be read when first touched.
  */
-static void frame_init(struct frame *frame, unsigned int abs_page){
+static void frame_init(struct frame *frame, unsigned int rel_page, unsigned int abs_page){
 	struct process *p = proc_current;
 
 	struct exec_header *eh = &p->hdr.eh;
 	if (eh->eh_base <= abs_page && abs_page < eh->eh_base + eh->eh_size) {
-		/* Read the page.
+		/* See how many of the following pages can be read along.
 		 */
-		unsigned int size = PAGESIZE;
+		unsigned int i, npages = 1;
+		while (npages < EXEC_CLUSTER && rel_page + npages < VIRT_PAGES &&
+				abs_page + npages < eh->eh_base + eh->eh_size &&
+				p->pages[rel_page + npages].status == PI_UNINIT) {
+			npages++;
+		}
+
+		/* Read the pages.
+		 */
+		char *buf = malloc(npages * PAGESIZE);
+		unsigned int size = npages * PAGESIZE;
 		bool_t success = file_read(p->executable.server,
 			p->executable.ino,
 			(eh->eh_offset + (abs_page - eh->eh_base)) * PAGESIZE,
-			frame, &size);
+			buf, &size);
 		if (!success) {
 			printf("--> %u %u\n", p->executable.server, p->executable.ino);
 		}
 		assert(success);
-		assert(size <= PAGESIZE);
-		if (size < PAGESIZE) {
-			memset((char *) frame + size, 0, PAGESIZE - size);
+		assert(size <= npages * PAGESIZE);
+		if (size < npages * PAGESIZE) {
+			memset(buf + size, 0, npages * PAGESIZE - size);
+		}
+		memcpy(frame, buf, PAGESIZE);
+		for (i = 1; i < npages && proc_frame_alloc_free(&p->pages[rel_page + i]); i++) {
+			memcpy(&proc_frames[p->pages[rel_page + i].u.frame],
+								buf + i * PAGESIZE, PAGESIZE);
 		}
+		free(buf);
 	}
 
 	/* Otherwise zero-init it.
@@ -874,7 +975,7 @@ void proc_pagefault(address_t virt){
 	switch (p->pages[rel_page].status) {
 	case PI_UNINIT:
 		proc_frame_alloc(&p->pages[rel_page]);
-		frame_init(&proc_frames[p->pages[rel_page].u.frame], abs_page);
+		frame_init(&proc_frames[p->pages[rel_page].u.frame], rel_page, abs_page);
 		break;
 	case PI_VALID:
 #ifdef HW_PAGING	//<<<<HW_PAGING
@@ -889,6 +990,7 @@ void proc_pagefault(address_t virt){
 			unsigned int block = p->pages[rel_page].u.block;
 			proc_frame_alloc(&p->pages[rel_page]);
 			frame_read(p->pages[rel_page].u.frame, block);
+			queue_add_uint(&proc_freeblocks, block);
 		}
 		break;
 #endif //>>>>HW_PAGING
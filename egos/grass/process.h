@@ -74,8 +74,12 @@ struct process {
 	char *msgbuf;
 
 	/* If the process is waiting for a response, this is the server.
+	 * If it is waiting for responses to several RPCs (sys_rpc_multi),
+	 * rpc_calls points to the outstanding calls instead.
 	 */
 	gpid_t server;
+	struct rpc_call *rpc_calls;
+	unsigned int rpc_ncalls;
 
 	/* If the process is waiting, it may have an alarm set.
 	 */
@@ -84,6 +88,7 @@ struct process {
 
 
 	bool_t interruptable;		// can be interrupted with <ctrl>C
+	bool_t stopping;			// server asked to stop; see proc_stop_next()
 
 	/* Interrupt information.
 	 */
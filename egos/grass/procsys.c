@@ -81,6 +81,89 @@ int sys_rpc(gpid_t pid, const void *request, unsigned int reqsize,
 	return r ? (int) repsize : -1;
 }
 
+/* Issue a set of RPCs at once and wait for all replies.  This is only
+ * available to kernel processes.  Returns the number of successful calls.
+ */
+int sys_rpc_multi(struct rpc_call *calls, unsigned int ncalls){
+	unsigned int i, npending = 0, maxsize = 0;
+	int nsuccess = 0;
+
+	log_p("sys_rpc_multi entry src=%u ncalls=%u", proc_current->pid, ncalls);
+	proc_current->rpc_calls = calls;
+	proc_current->rpc_ncalls = ncalls;
+
+	/* First send all the requests.
+	 */
+	for (i = 0; i < ncalls; i++) {
+		struct rpc_call *rc = &calls[i];
+
+		rc->result = -1;
+		rc->pending = False;
+		if (rc->pid == proc_current->pid ||
+				!proc_send(proc_current->pid, rc->pid, MSG_REQUEST,
+											rc->request, rc->reqsize)) {
+			continue;
+		}
+		rc->pending = True;
+		npending++;
+		if (rc->repsize > maxsize) {
+			maxsize = rc->repsize;
+		}
+	}
+
+	/* Collect the replies in whatever order they arrive.  Replies from
+	 * the same server arrive in the order of the requests.
+	 */
+	char *buf = malloc(maxsize);
+	while (npending > 0) {
+		unsigned int size = maxsize;
+		gpid_t src;
+		bool_t r = proc_recv(MSG_REPLY, 0, buf, &size, &src);
+		if (r) {
+			for (i = 0; i < ncalls; i++) {
+				struct rpc_call *rc = &calls[i];
+				if (rc->pending && rc->pid == src) {
+					rc->result = size < rc->repsize ? size : rc->repsize;
+					memcpy(rc->reply, buf, rc->result);
+					rc->pending = False;
+					npending--;
+					nsuccess++;
+					break;
+				}
+			}
+			continue;
+		}
+
+		/* Woken up without a reply, which happens if a server died.  Fail
+		 * the calls to servers that are gone.
+		 */
+		unsigned int nfailed = 0;
+		for (i = 0; i < ncalls; i++) {
+			struct rpc_call *rc = &calls[i];
+			if (rc->pending) {
+				struct process *p = proc_find(rc->pid);
+				if (p == 0 || p->state == PROC_ZOMBIE) {
+					rc->pending = False;
+					npending--;
+					nfailed++;
+				}
+			}
+		}
+		if (nfailed == 0) {
+			break;
+		}
+	}
+	free(buf);
+
+	for (i = 0; i < ncalls; i++) {
+		calls[i].pending = False;
+	}
+	proc_current->rpc_calls = 0;
+	proc_current->rpc_ncalls = 0;
+	log_p("sys_rpc_multi exit pid=%u nsuccess=%d", proc_current->pid, nsuccess);
+	return nsuccess;
+}
+
 /* Emulate the sys_getpid system call for kernel processes.
  */
 gpid_t sys_getpid(void){
@@ -106,10 +189,9 @@ unsigned long sys_gettime(void){
  */
 void copy_user(char *dst, const char *src, unsigned int size,
 									enum cu_dir dir){
-	/* This is really inefficient but for now it does the job.
+	/* Copy a page at a time.
 	 */
-	unsigned int i;
-	for (i = 0; i < size; i++) {
+	while (size > 0) {
 		/* First see if the page is mapped already.  If not, simulate
 		 * a page fault.
 		 */
@@ -117,7 +199,14 @@ void copy_user(char *dst, const char *src, unsigned int size,
 		if (tlb_get_entry(virt / PAGESIZE) < 0) {
 			proc_pagefault(virt);
 		}
-		*dst++ = *src++;
+		unsigned int n = PAGESIZE - virt % PAGESIZE;
+		if (n > size) {
+			n = size;
+		}
+		memcpy(dst, src, n);
+		dst += n;
+		src += n;
+		size -= n;
 	}
 }
 
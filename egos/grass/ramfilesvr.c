@@ -27,15 +27,36 @@
 #include "process.h"
 
 #define MAX_FILES	100
-#define BUF_SIZE	1024
-
-/* Contents of a file.
+#define RAMFILE_PAGE	4096		// size of a page of a file
+#define RAMFILE_BUDGET	1024		// #pages kept in memory
+
+/* Contents of a file.  The contents are kept in pages of RAMFILE_PAGE
+ * bytes, found through a table that doubles in size when the file grows
+ * past it, so that growing a file does not copy its contents.  Pages that
+ * were never written are holes, which read as zeroes.  The bytes of the
+ * pages beyond the end of the file are zero too.
  */
 struct file {
 	struct file_stat stat;
-	char *contents;			// contents of file
+	char **pages;			// contents of file, per page (0 for a hole)
+	unsigned long npages;	// size of the page table
+	unsigned long last_use;	// ramfile_clock when last accessed
+	bool_t spilled;			// contents are in inode 'backing'
+	unsigned int backing;	// inode on the backing file server
 };
 
+/* The server keeps at most RAMFILE_BUDGET pages of file contents in
+ * memory.  When there are more, the contents of the least recently used
+ * files are spilled to an inode of the backing file server, and read
+ * back the next time they are accessed.  The budget is not enforced on
+ * the file being accessed, so one large file can still exceed it.
+ */
+static gpid_t ramfile_backing;			// file server for spilled files
+static unsigned long ramfile_nresident;	// #pages in memory
+static unsigned long ramfile_clock;		// counts file accesses
+static unsigned int ramfile_nspilled;	// #files spilled
+static unsigned int ramfile_nrestored;	// #files read back
+
 static void ramfile_respond(gpid_t src, enum file_status status,
 				void *data, unsigned int size){
 	struct file_reply *rep = new_alloc_ext(struct file_reply, size);
@@ -45,21 +66,23 @@ static void ramfile_respond(gpid_t src, enum file_status status,
 	free(rep);
 }
 
-static bool_t ramfile_read_allowed(struct file *file, gpid_t src) {
-	struct process *p = proc_find(src);
-
-	if (p->uid == 0) {
+static bool_t ramfile_may_read(struct file_stat *stat, unsigned int uid) {
+	if (uid == 0) {
 		// read from root user
 		return True;
-	} else if (p->uid == file->stat.st_uid) {
+	} else if (uid == stat->st_uid) {
 		// read from owner
-		return file->stat.st_mode & P_FILE_OWNER_READ;
+		return stat->st_mode & P_FILE_OWNER_READ;
 	} else {
 		// read from other
-		return file->stat.st_mode & P_FILE_OTHER_READ;
+		return stat->st_mode & P_FILE_OTHER_READ;
 	}
 }
 
+static bool_t ramfile_read_allowed(struct file *file, gpid_t src) {
+	return ramfile_may_read(&file->stat, proc_find(src)->uid);
+}
+
 static bool_t ramfile_write_allowed(struct file *file, gpid_t src) {
 	struct process *p = proc_find(src);
 
@@ -107,6 +130,229 @@ static void ramfile_do_create(struct file *files, struct file_request *req, gpid
 	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 }
 
+/* Return page pno of a file, or 0 if it is a hole.
+ */
+static char *ramfile_page(struct file *file, unsigned long pno){
+	return pno < file->npages ? file->pages[pno] : 0;
+}
+
+/* Copy n bytes at the given offset of a file to buf.  Returns the number
+ * of bytes up to the end of the last page that is not a hole.
+ */
+static unsigned int ramfile_get(struct file *file, unsigned long offset,
+									char *buf, unsigned int n){
+	unsigned int done = 0, ndata = 0;
+
+	while (done < n) {
+		char *page = ramfile_page(file, (offset + done) / RAMFILE_PAGE);
+		unsigned int skip = (offset + done) % RAMFILE_PAGE;
+		unsigned int k = RAMFILE_PAGE - skip;
+		if (k > n - done) {
+			k = n - done;
+		}
+		if (page != 0) {
+			memcpy(&buf[done], &page[skip], k);
+			ndata = done + k;
+		}
+		else {
+			memset(&buf[done], 0, k);
+		}
+		done += k;
+	}
+	return ndata;
+}
+
+/* Code for adding content to a file.  If data is 0, zeroes are written,
+ * which leaves holes as they are.
+ */
+static void ramfile_put(struct file *file, unsigned long offset,
+									const char *data, unsigned int size){
+	unsigned int done = 0;
+
+	while (done < size) {
+		unsigned long pno = (offset + done) / RAMFILE_PAGE;
+		unsigned int skip = (offset + done) % RAMFILE_PAGE;
+		unsigned int k = RAMFILE_PAGE - skip;
+		if (k > size - done) {
+			k = size - done;
+		}
+
+		char *page = ramfile_page(file, pno);
+		if (page == 0 && data != 0) {
+			// make room in the page table, and clear what isn't written
+			if (pno >= file->npages) {
+				unsigned long n = file->npages == 0 ? 8 : file->npages;
+				while (n <= pno) {
+					n *= 2;
+				}
+				file->pages = realloc(file->pages, n * sizeof(*file->pages));
+				memset(&file->pages[file->npages], 0,
+								(n - file->npages) * sizeof(*file->pages));
+				file->npages = n;
+			}
+			page = file->pages[pno] = malloc(RAMFILE_PAGE);
+			ramfile_nresident++;
+			memset(page, 0, skip);
+			memset(&page[skip + k], 0, RAMFILE_PAGE - skip - k);
+		}
+		if (page != 0) {
+			if (data != 0) {
+				memcpy(&page[skip], &data[done], k);
+			}
+			else {
+				memset(&page[skip], 0, k);
+			}
+		}
+		done += k;
+	}
+	if (offset + size > file->stat.st_size) {
+		file->stat.st_size = offset + size;
+	}
+}
+
+/* Cut a file down to size bytes.  The pages past the end are freed, and
+ * the rest of the last page is cleared.
+ */
+static void ramfile_truncate(struct file *file, unsigned long size){
+	unsigned long pno;
+
+	for (pno = (size + RAMFILE_PAGE - 1) / RAMFILE_PAGE; pno < file->npages; pno++) {
+		if (file->pages[pno] != 0) {
+			free(file->pages[pno]);
+			file->pages[pno] = 0;
+			ramfile_nresident--;
+		}
+	}
+	char *page = ramfile_page(file, size / RAMFILE_PAGE);
+	if (page != 0) {
+		memset(&page[size % RAMFILE_PAGE], 0, RAMFILE_PAGE - size % RAMFILE_PAGE);
+	}
+	if (size == 0) {
+		free(file->pages);
+		file->pages = 0;
+		file->npages = 0;
+	}
+	file->stat.st_size = size;
+}
+
+/* Write the contents of a file to a new inode of the backing file server
+ * and release its pages.  Holes are not written.
+ */
+static bool_t ramfile_spill(struct file *file){
+	unsigned int ino;
+
+	if (ramfile_backing == 0 ||
+			!file_create(ramfile_backing, P_FILE_OWNER_READ | P_FILE_OWNER_WRITE, &ino)) {
+		return False;
+	}
+
+	/* Gather runs of pages and write them out.
+	 */
+	char *buf = malloc(FILE_MAX_XFER);
+	unsigned long pno, start = 0;
+	unsigned int n = 0;
+	bool_t ok = True;
+	for (pno = 0; ok && pno <= file->npages; pno++) {
+		char *page = ramfile_page(file, pno);
+		if (n > 0 && (page == 0 || n == FILE_MAX_XFER)) {
+			unsigned long offset = start * RAMFILE_PAGE;
+			if (offset + n > file->stat.st_size) {
+				n = file->stat.st_size - offset;
+			}
+			ok = file_write(ramfile_backing, ino, offset, buf, n);
+			n = 0;
+		}
+		if (page != 0) {
+			if (n == 0) {
+				start = pno;
+			}
+			memcpy(&buf[n], page, RAMFILE_PAGE);
+			n += RAMFILE_PAGE;
+		}
+	}
+	free(buf);
+	if (!ok) {
+		printf("ramfile_spill: can't write inode %u\n", ino);
+		(void) file_delete(ramfile_backing, ino);
+		return False;
+	}
+
+	unsigned long size = file->stat.st_size;
+	ramfile_truncate(file, 0);
+	file->stat.st_size = size;
+	file->spilled = True;
+	file->backing = ino;
+	ramfile_nspilled++;
+	return True;
+}
+
+/* Read the contents of a spilled file back into memory, leaving out pages
+ * of zeroes, and delete its backing inode.
+ */
+static bool_t ramfile_restore(struct file *file){
+	char *buf = malloc(FILE_MAX_XFER);
+	unsigned long offset;
+
+	for (offset = 0; offset < file->stat.st_size; offset += FILE_MAX_XFER) {
+		unsigned int n = FILE_MAX_XFER;
+		if (!file_read(ramfile_backing, file->backing, offset, buf, &n)) {
+			printf("ramfile_restore: can't read inode %u\n", file->backing);
+			unsigned long size = file->stat.st_size;
+			ramfile_truncate(file, 0);
+			file->stat.st_size = size;
+			free(buf);
+			return False;
+		}
+		unsigned int i, j;
+		for (i = 0; i < n; i += RAMFILE_PAGE) {
+			unsigned int k = n - i < RAMFILE_PAGE ? n - i : RAMFILE_PAGE;
+			for (j = 0; j < k && buf[i + j] == 0; j++)
+				;
+			if (j < k) {
+				ramfile_put(file, offset + i, &buf[i], k);
+			}
+		}
+		if (n < FILE_MAX_XFER) {
+			break;				// the rest is a hole
+		}
+	}
+	free(buf);
+
+	(void) file_delete(ramfile_backing, file->backing);
+	file->spilled = False;
+	ramfile_nrestored++;
+	return True;
+}
+
+/* Note that a file is accessed, and bring its contents back into memory
+ * if they were spilled.
+ */
+static bool_t ramfile_touch(struct file *file){
+	file->last_use = ++ramfile_clock;
+	return !file->spilled || ramfile_restore(file);
+}
+
+/* Spill the least recently used files until the pages in memory fit the
+ * budget again.  The file that is being accessed is kept.
+ */
+static void ramfile_balance(struct file *files, struct file *keep){
+	while (ramfile_nresident > RAMFILE_BUDGET) {
+		struct file *lru = 0;
+		unsigned int ino;
+
+		for (ino = 1; ino < MAX_FILES; ino++) {
+			struct file *f = &files[ino];
+			if (f->stat.st_alloc && f->pages != 0 && f != keep &&
+							(lru == 0 || f->last_use < lru->last_use)) {
+				lru = f;
+			}
+		}
+		if (lru == 0 || !ramfile_spill(lru)) {
+			break;
+		}
+	}
+}
+
 /* Respond to a read request.
  */
 static void ramfile_do_read(struct file *files, struct file_request *req, gpid_t src){
@@ -126,17 +372,27 @@ static void ramfile_do_read(struct file *files, struct file_request *req, gpid_t
 		return;
 	}
 
+	if (!ramfile_touch(file)) {
+		ramfile_respond(src, FILE_ERROR, 0, 0);
+		return;
+	}
+	ramfile_balance(files, file);
+
 	/* Allocate room for the reply.
 	 */
+	if (req->size > FILE_MAX_XFER) {
+		req->size = FILE_MAX_XFER;
+	}
 	struct file_reply *rep = new_alloc_ext(struct file_reply, req->size);
 
-	// try reading
+	// try reading.  Holes at the end are left for the client to fill in
+	unsigned int ndata = 0;
 	if (req->offset < file->stat.st_size) {
 		n = file->stat.st_size - req->offset;
 		if (n > req->size) {
 			n = req->size;
 		}
-		memcpy(&rep[1], &file->contents[req->offset], n);
+		ndata = ramfile_get(file, req->offset, (char *) &rep[1], n);
 	}
 	else {
 		n = 0;
@@ -145,21 +401,11 @@ static void ramfile_do_read(struct file *files, struct file_request *req, gpid_t
 	rep->status = FILE_OK;
 	rep->op = FILE_READ;
 	rep->stat.st_size = n;
-	sys_send(src, MSG_REPLY, rep, sizeof(*rep) + n);
+	rep->nzero = n - ndata;
+	sys_send(src, MSG_REPLY, rep, sizeof(*rep) + ndata);
 	free(rep);
 }
 
-/* Code for adding content to a file.
- */
-static void ramfile_put(struct file *file, unsigned long offset,
-									char *data, unsigned int size){
-	if (offset + size > file->stat.st_size) {
-		file->contents = realloc(file->contents, offset + size);
-		file->stat.st_size = offset + size;
-	}
-	memcpy(&file->contents[offset], data, size);
-}
-
 /* Respond to a write request.
  */
 static void ramfile_do_write(struct file *files,
@@ -181,10 +427,124 @@ static void ramfile_do_write(struct file *files,
 		return;
 	}
 
-	ramfile_put(&files[req->ino], req->offset, data, size);
+	struct file *file = &files[req->ino];
+	if (!ramfile_touch(file)) {
+		ramfile_respond(src, FILE_ERROR, 0, 0);
+		return;
+	}
+	ramfile_put(file, req->offset, data, size);
+	ramfile_balance(files, file);
 	ramfile_respond(src, FILE_OK, 0, 0);
 }
 
+/* Respond to a copy request.  A file of this server is copied in memory,
+ * and a file of another server is read from there, as the client may.
+ * The server waits for those reads, so the other server has to be one
+ * that is known to answer: only the backing file server is accepted,
+ * whose workers keep it from waiting on this server in turn.
+ */
+static void ramfile_do_copy(struct file *files,
+			struct file_request *req, gpid_t src, void *data, unsigned int size){
+	struct file_copy_source *cs = data;
+
+	if (req->ino >= MAX_FILES || !files[req->ino].stat.st_alloc) {
+		printf("ramfile_do_copy: bad inode %u\n", req->ino);
+		ramfile_respond(src, FILE_ERROR, 0, 0);
+		return;
+	}
+	if (size < sizeof(*cs)) {
+		printf("ramfile_do_copy: no source\n");
+		ramfile_respond(src, FILE_ERROR, 0, 0);
+		return;
+	}
+	// check permission
+	if (!ramfile_write_allowed(&files[req->ino], src)) {
+		printf("ramfile_do_copy: permission denied: %u\n", req->ino);
+		ramfile_respond(src, FILE_ERROR, 0, 0);
+		return;
+	}
+
+	struct file *file = &files[req->ino];
+	if (!ramfile_touch(file)) {
+		ramfile_respond(src, FILE_ERROR, 0, 0);
+		return;
+	}
+	unsigned int uid = proc_find(src)->uid;
+	unsigned long n = 0;
+	if (cs->server == sys_getpid()) {
+		if (cs->ino >= MAX_FILES || !files[cs->ino].stat.st_alloc || cs->ino == req->ino ||
+							!ramfile_may_read(&files[cs->ino].stat, uid)) {
+			printf("ramfile_do_copy: can't copy from %u\n", cs->ino);
+			ramfile_respond(src, FILE_ERROR, 0, 0);
+			return;
+		}
+		struct file *from = &files[cs->ino];
+		if (!ramfile_touch(from)) {
+			ramfile_respond(src, FILE_ERROR, 0, 0);
+			return;
+		}
+		if (cs->offset < from->stat.st_size) {
+			n = from->stat.st_size - cs->offset;
+			if (n > req->size) {
+				n = req->size;
+			}
+			unsigned long done = 0;
+			while (done < n) {
+				char *page = ramfile_page(from, (cs->offset + done) / RAMFILE_PAGE);
+				unsigned int skip = (cs->offset + done) % RAMFILE_PAGE;
+				unsigned int k = RAMFILE_PAGE - skip;
+				if (k > n - done) {
+					k = n - done;
+				}
+				ramfile_put(file, req->offset + done, page == 0 ? 0 : &page[skip], k);
+				done += k;
+			}
+		}
+	}
+	else {
+		struct file_stat stat;
+		if (cs->server == 0 || cs->server != ramfile_backing) {
+			printf("ramfile_do_copy: can't copy from server %u\n", cs->server);
+			ramfile_respond(src, FILE_ERROR, 0, 0);
+			return;
+		}
+		if (!file_stat(cs->server, cs->ino, &stat) || !stat.st_alloc ||
+										!ramfile_may_read(&stat, uid)) {
+			printf("ramfile_do_copy: can't copy from %u:%u\n", cs->server, cs->ino);
+			ramfile_respond(src, FILE_ERROR, 0, 0);
+			return;
+		}
+		char *buf = malloc(FILE_MAX_XFER);
+		while (n < req->size) {
+			unsigned int want = req->size - n < FILE_MAX_XFER ? req->size - n : FILE_MAX_XFER;
+			unsigned int got = want;
+			if (!file_read(cs->server, cs->ino, cs->offset + n, buf, &got)) {
+				printf("ramfile_do_copy: read error %u:%u\n", cs->server, cs->ino);
+				free(buf);
+				ramfile_respond(src, FILE_ERROR, 0, 0);
+				return;
+			}
+			if (got > 0) {
+				ramfile_put(file, req->offset + n, buf, got);
+				ramfile_balance(files, file);
+			}
+			n += got;
+			if (got < want) {
+				break;
+			}
+		}
+		free(buf);
+	}
+	ramfile_balance(files, file);
+
+	struct file_reply rep;
+	memset(&rep, 0, sizeof(rep));
+	rep.status = FILE_OK;
+	rep.op = FILE_COPY;
+	rep.stat.st_size = n;
+	sys_send(src, MSG_REPLY, &rep, sizeof(rep));
+}
+
 /* Respond to a stat request.
  */
 static void ramfile_do_stat(struct file *files, struct file_request *req, gpid_t src){
@@ -231,9 +591,12 @@ static void ramfile_do_setsize(struct file *files, struct file_request *req, gpi
 		return;
 	}
 
-	struct file *f = &files[req->ino];
-	f->stat.st_size = req->offset;
-	f->contents = realloc(f->contents, f->stat.st_size);
+	struct file *file = &files[req->ino];
+	if (!ramfile_touch(file)) {
+		ramfile_respond(src, FILE_ERROR, 0, 0);
+		return;
+	}
+	ramfile_truncate(file, req->offset);
 	ramfile_respond(src, FILE_OK, 0, 0);
 }
 
@@ -288,24 +651,44 @@ static void ramfile_do_chmod(struct file *files, struct file_request *req, gpid_
     sys_send(src, MSG_REPLY, &rep, sizeof(rep));
 }
 
+/* The contents of ram files do not outlive the server, so delete the
+ * inodes of the spilled ones while the backing file server is still up.
+ */
+static void ramfile_unspill(struct file *files){
+	unsigned int i;
+
+	for (i = 0; i < MAX_FILES; i++) {
+		struct file *f = &files[i];
+
+		if (f->stat.st_alloc && f->spilled) {
+			if (!file_delete(ramfile_backing, f->backing)) {
+				printf("ramfile_unspill: can't delete %u\n", f->backing);
+			}
+			f->spilled = False;
+		}
+	}
+}
+
 static void ramfile_cleanup(void *arg){
 	struct file *files = arg;
 	unsigned int i;
 
 	printf("ram file server: cleaning up\n\r");
+	printf("!$RAMFILE: #spilled:  %u\n", ramfile_nspilled);
+	printf("!$RAMFILE: #restored: %u\n", ramfile_nrestored);
 
 	for (i = 0; i < MAX_FILES; i++) {
 		struct file *f = &files[i];
 
 		if (f->stat.st_alloc) {
-			free(f->contents);
+			ramfile_truncate(f, 0);
 		}
 	}
 	free(files);
 }
 
-/* A simple in-memory file server.  All files are simply contiguous
- * memory regions.
+/* A simple in-memory file server.  Files are kept in pages of memory,
+ * and spilled to the backing file server when there are too many.
  */
 static void ramfile_proc(void *arg){
 	printf("RAM FILE SERVER: %u\n\r", sys_getpid());
@@ -314,13 +697,13 @@ static void ramfile_proc(void *arg){
 
 	struct file *files = arg;
 
-	struct file_request *req = new_alloc_ext(struct file_request, PAGESIZE);
+	struct file_request *req = new_alloc_ext(struct file_request, FILE_MAX_XFER);
 	for (;;) {
 		gpid_t src;
-		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + PAGESIZE, &src);
+		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + FILE_MAX_XFER, &src);
 		if (req_size < 0) {
 			printf("ram file server shutting down\n\r");
-			free(files);
+			ramfile_unspill(files);
 			free(req);
 			break;
 		}
@@ -348,15 +731,26 @@ static void ramfile_proc(void *arg){
 		case FILE_SETSIZE:
 			ramfile_do_setsize(files, req, src);
 			break;
+		case FILE_COPY:
+			ramfile_do_copy(files, req, src, &req[1], req_size - sizeof(*req));
+			break;
+		case FILE_SYNC:
+			// nothing is cached
+			ramfile_respond(src, FILE_OK, 0, 0);
+			break;
 		default:
 			assert(0);
 		}
 	}
 }
 
-gpid_t ramfile_init(void){
+/* Start the ram file server.  Files that do not fit in its memory budget
+ * are spilled to backing_server, if not 0.
+ */
+gpid_t ramfile_init(gpid_t backing_server){
 	struct file *files = calloc(MAX_FILES, sizeof(struct file));
 	files[0].stat.st_alloc = True;
+	ramfile_backing = backing_server;
 
 	return proc_create(1, "ramfile", ramfile_proc, files);
 }
@@ -367,14 +761,15 @@ void ramfile_load(fid_t fid, char *file){
 	FILE *fp = fopen(file, "r");
 	assert(fp != 0);
 
-	char buf[BUF_SIZE];
+	char *buf = malloc(FILE_MAX_XFER);
 
 	unsigned long offset = 0;
 	while (!feof(fp)) {
 		assert(!ferror(fp));
-		size_t n = fread(buf, 1, BUF_SIZE, fp);
+		size_t n = fread(buf, 1, FILE_MAX_XFER, fp);
 		bool_t status = file_write(fid.server, fid.ino, offset, buf, n);
 		assert(status);
 		offset += n;
 	}
+	free(buf);
 }
@@ -244,12 +244,12 @@ static void tty_proc(void *arg){
 	ts->buf = new_alloc(struct input);
 	dev_tty_create(0, tty_deliver, ts);
 
-	struct file_request *req = new_alloc_ext(struct file_request, PAGESIZE);
+	struct file_request *req = new_alloc_ext(struct file_request, FILE_MAX_XFER);
 	for (;;) {
 		/* Receive a request.
 		 */
 		gpid_t src;
-		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(req) + PAGESIZE, &src);
+		int req_size = sys_recv(MSG_REQUEST, 0, req, sizeof(*req) + FILE_MAX_XFER, &src);
 		if (req_size < 0) {
 			printf("tty server: terminating\n\r");
 			free(req);
@@ -271,9 +271,18 @@ static void tty_proc(void *arg){
 		case FILE_SET_FLAGS:
 			tty_set_flags(ts, req, src);
 			break;
+		case FILE_COPY:
+			// a terminal has no blocks to copy into
+			printf("tty_proc: can't copy to a terminal\n");
+			tty_respond(ts, src, FILE_ERROR, 0, 0);
+			break;
+		case FILE_SYNC:
+			// output is not buffered
+			tty_respond(ts, src, FILE_OK, 0, 0);
+			break;
 		default:
 			fprintf(stderr, "tty_proc: unknown command %d, src=%u\n", req->type, src);
-			assert(0);
+			tty_respond(ts, src, FILE_ERROR, 0, 0);
 		}
 	}
 }
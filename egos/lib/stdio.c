@@ -35,62 +35,10 @@ bool_t flookup(const char *restrict path, bool_t is_dir,
 		dir = GRASS_ENV->cwd;
 	}
 
-	/* Now walk the path until the final component.
+	/* The directory server walks the rest of the path.
 	 */
-	bool_t success = True;
-	fid_t fid = dir;
-	while (*path != 0) {
-		/* See if there's more.
-		 */
-		char *e = strchr(path, '/'), *next;
-		if (e == 0) {
-			if (is_dir) {
-				unsigned int n = strlen(path);
-				next = malloc(n + 5);
-				memcpy(next, path, n);
-				strcpy(&next[n], ".dir");
-			}
-			else {
-				next = (char *) path;
-			}
-		}
-		else {
-			next = malloc((e - path) + 5);
-			memcpy(next, path, e - path);
-			strcpy(&next[e - path], ".dir");
-		}
-
-		/* Take the next step.
-		 */
-		success = dir_lookup(GRASS_ENV->servers[GPID_DIR], dir, next, &fid);
-		if (e != 0 || is_dir) {
-			free(next);
-		}
-		if (e == 0) {
-			if (p_dir != 0) {
-				*p_dir = dir;
-			}
-			if (!success) {
-				return False;
-			}
-			break;
-		}
-
-		/* Go on to the remainder of the path.
-		 */
-		if (!success) {
-			return False;
-		}
-		path = e + 1;
-		dir = fid;
-	}
-	if (p_dir != 0) {
-		*p_dir = dir;
-	}
-	if (p_fid != 0) {
-		*p_fid = fid;
-	}
-	return True;
+	return dir_lookup_path(GRASS_ENV->servers[GPID_DIR], dir, path, is_dir,
+													p_dir, p_fid);
 }
 
 /* TODO.  Interpret mode.  Think about create, truncate, and append, and
@@ -7,56 +7,104 @@
 #include "block.h"
 
 bool_t block_read(gpid_t svr, unsigned int ino, unsigned int offset, void *addr){
+	return block_read_range(svr, ino, offset, 1, addr);
+}
+
+bool_t block_write(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr){
+	return block_write_range(svr, ino, offset, 1, addr);
+}
+
+/* Copy the blocks in a read reply of the given size to addr, and fill
+ * in the holes.  Returns False if the size does not match the reply.
+ */
+bool_t block_unpack(const struct block_reply *reply, int size,
+										unsigned int nblock, void *addr){
+	const char *data = (const char *) &reply[1];
+	unsigned int i;
+
+	for (i = 0; i < nblock; i++) {
+		char *dst = (char *) addr + i * BLOCK_SIZE;
+		if (reply->holes & (1 << i)) {
+			memset(dst, 0, BLOCK_SIZE);
+			continue;
+		}
+		if (data + BLOCK_SIZE > (const char *) reply + size) {
+			return False;
+		}
+		memcpy(dst, data, BLOCK_SIZE);
+		data += BLOCK_SIZE;
+	}
+	return data == (const char *) reply + size;
+}
+
+/* Read nblock consecutive blocks (at most BLOCK_MAX_NBLOCK) in one RPC.
+ */
+bool_t block_read_range(gpid_t svr, unsigned int ino, unsigned int offset,
+										unsigned int nblock, void *addr){
+	return block_read_sparse(svr, ino, offset, nblock, addr, 0);
+}
+
+/* Like block_read_range, but also return which blocks are holes in
+ * *pholes (bit i for block offset + i) if pholes is not null.
+ */
+bool_t block_read_sparse(gpid_t svr, unsigned int ino, unsigned int offset,
+						unsigned int nblock, void *addr, unsigned int *pholes){
+    assert(nblock > 0 && nblock <= BLOCK_MAX_NBLOCK);
+
     /* Prepare request.
      */
     struct block_request req;
     memset(&req, 0, sizeof(req));
     req.type = BLOCK_READ;
     req.ino = ino;
+    req.nblock = nblock;
 
     /* Allocate reply. psize in BLOCKs, not bytes
      */
-    struct block_reply *reply = (struct block_reply *) malloc(sizeof(*reply) + BLOCK_SIZE);
-    unsigned int reply_size = sizeof(*reply) + BLOCK_SIZE;
+    struct block_reply *reply = (struct block_reply *) malloc(sizeof(*reply) + nblock * BLOCK_SIZE);
+    unsigned int reply_size = sizeof(*reply) + nblock * BLOCK_SIZE;
 
     /* Do the RPC.
      */
 	req.offset_nblock = offset;
 
 	int n = sys_rpc(svr, &req, sizeof(req), reply, reply_size);
-	if (n < (int) reply_size) {
+	if (n < (int) sizeof(*reply) || reply->status != BLOCK_OK ||
+								!block_unpack(reply, n, nblock, addr)) {
 		free(reply);
 		return False;
 	}
-	if (reply->status != BLOCK_OK) {
-		free(reply);
-		return False;
+	if (pholes != 0) {
+		*pholes = reply->holes;
 	}
 
-	n -= sizeof(*reply);
-	memcpy(addr, &reply[1], BLOCK_SIZE);
-
     free(reply);
     return True;
 }
 
-bool_t block_write(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr){
+/* Write nblock consecutive blocks (at most BLOCK_MAX_NBLOCK) in one RPC.
+ */
+bool_t block_write_range(gpid_t svr, unsigned int ino, unsigned int offset,
+										unsigned int nblock, const void *addr){
+    assert(nblock > 0 && nblock <= BLOCK_MAX_NBLOCK);
+
     /* Prepare request.
      */
     struct block_request *req =
-                (struct block_request *) malloc(sizeof(*req) + BLOCK_SIZE);
+                (struct block_request *) malloc(sizeof(*req) + nblock * BLOCK_SIZE);
     memset(req, 0, sizeof(*req));
     req->type = BLOCK_WRITE;
     req->ino = ino;
+    req->nblock = nblock;
 
 	req->offset_nblock = offset + 0;
-	memcpy(&req[1], addr, BLOCK_SIZE);
+	memcpy(&req[1], addr, nblock * BLOCK_SIZE);
 
 	/* Do the RPC.
 	 */
 	struct block_reply reply;
 	// printf("BLK_WR %u %u\n", sizeof(*req) + size * BLOCK_SIZE, size);
-	int result = sys_rpc(svr, req, sizeof(*req) + BLOCK_SIZE, &reply, sizeof(reply));
+	int result = sys_rpc(svr, req, sizeof(*req) + nblock * BLOCK_SIZE, &reply, sizeof(reply));
 	if (result < (int) sizeof(reply) || reply.status != BLOCK_OK) {
 		free(req);
 		return False;
@@ -103,3 +151,89 @@ bool_t block_setsize(gpid_t svr, unsigned int ino, unsigned int size){
     }
     return reply.status == BLOCK_OK;
 }
+
+bool_t block_discard(gpid_t svr, unsigned int ino, unsigned int offset, unsigned int nblock){
+    /* Prepare request.
+     */
+    struct block_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = BLOCK_DISCARD;
+    req.ino = ino;
+    req.offset_nblock = offset;
+    req.nblock = nblock;
+
+    /* Do the RPC.
+     */
+    struct block_reply reply;
+    int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+    if (result < (int) sizeof(reply)) {
+        return False;
+    }
+    return reply.status == BLOCK_OK;
+}
+
+/* Make the blocks written so far durable, if the server buffers them.
+ */
+bool_t block_sync(gpid_t svr){
+    /* Prepare request.
+     */
+    struct block_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = BLOCK_SYNC;
+
+    /* Do the RPC.
+     */
+    struct block_reply reply;
+    int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+    if (result < (int) sizeof(reply)) {
+        return False;
+    }
+    return reply.status == BLOCK_OK;
+}
+
+bool_t block_ninodes(gpid_t svr, unsigned int *pninodes){
+    /* Prepare request.
+     */
+    struct block_request req;
+    memset(&req, 0, sizeof(req));
+    req.type = BLOCK_NINODES;
+
+    /* Do the RPC.
+     */
+    struct block_reply reply;
+    int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+    if (result < (int) sizeof(reply)) {
+        return False;
+    }
+    *pninodes = reply.size_nblock;
+    return reply.status == BLOCK_OK;
+}
+
+/* Copy nblock blocks of inode src_ino to inode ino within the server.  The
+ * server may share the blocks rather than copy the data.
+ */
+bool_t block_copy(gpid_t svr, unsigned int ino, unsigned int offset,
+			unsigned int src_ino, unsigned int src_offset, unsigned int nblock){
+    /* Prepare request.
+     */
+    struct {
+        struct block_request hdr;
+        struct block_copy_source src;
+    } req;
+    memset(&req, 0, sizeof(req));
+    req.hdr.type = BLOCK_COPY;
+    req.hdr.ino = ino;
+    req.hdr.offset_nblock = offset;
+    req.hdr.nblock = nblock;
+    req.src.ino = src_ino;
+    req.src.offset_nblock = src_offset;
+
+    /* Do the RPC.
+     */
+    struct block_reply reply;
+    int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+    if (result < (int) sizeof(reply)) {
+        return False;
+    }
+    return reply.status == BLOCK_OK;
+}
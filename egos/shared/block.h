@@ -1,3 +1,7 @@
+/* Maximum number of blocks in a single read or write request.
+ */
+#define BLOCK_MAX_NBLOCK	(PAGESIZE / BLOCK_SIZE)
+
 /* This data structure is actually the header of block request message
  */
 struct block_request {
@@ -8,9 +12,14 @@ struct block_request {
         BLOCK_WRITE,
         BLOCK_GETSIZE,
         BLOCK_SETSIZE,              // size is in field offset
+        BLOCK_DISCARD,              // discard nblock blocks (no limit)
+        BLOCK_NINODES,              // get the number of inodes
+        BLOCK_COPY,                 // copy nblock blocks (no limit)
+        BLOCK_SYNC,                 // write out buffered blocks
     } type;                         // type of request
     unsigned int ino;               // inode number
     unsigned int offset_nblock;     // offset in blocks (not bytes)
+    unsigned int nblock;            // #blocks to read (0 is taken as 1)
 };
 
 /* This data structure is actually the header of block reply message
@@ -18,9 +27,37 @@ struct block_request {
 struct block_reply {
     enum block_status { BLOCK_OK, BLOCK_ERROR } status;
     unsigned int size_nblock;       // size of device in case of GETSIZE request
+                                    // #inodes in case of NINODES request
+    unsigned int holes;             // READ: bit i set if block i is a hole
 };
 
+/* A copy request is followed by the source, a range of blocks of another
+ * inode of the same server.  The ranges must not overlap.
+ */
+struct block_copy_source {
+    unsigned int ino;               // inode number
+    unsigned int offset_nblock;     // offset in blocks (not bytes)
+};
+
+/* In the reply to a read, only the blocks that are not holes follow the
+ * header.  Holes are zero-filled by the client.
+ */
+
 bool_t block_read(gpid_t svr, unsigned int ino, unsigned int offset, void *addr);
 bool_t block_write(gpid_t svr, unsigned int ino, unsigned int offset, const void *addr);
+bool_t block_read_range(gpid_t svr, unsigned int ino, unsigned int offset,
+										unsigned int nblock, void *addr);
+bool_t block_read_sparse(gpid_t svr, unsigned int ino, unsigned int offset,
+						unsigned int nblock, void *addr, unsigned int *pholes);
+bool_t block_unpack(const struct block_reply *reply, int size,
+										unsigned int nblock, void *addr);
+bool_t block_write_range(gpid_t svr, unsigned int ino, unsigned int offset,
+										unsigned int nblock, const void *addr);
 bool_t block_getsize(gpid_t svr, unsigned int ino, unsigned int *psize_nblock);
 bool_t block_setsize(gpid_t svr, unsigned int ino, unsigned int size_nblock);
+bool_t block_discard(gpid_t svr, unsigned int ino, unsigned int offset,
+										unsigned int nblock);
+bool_t block_ninodes(gpid_t svr, unsigned int *pninodes);
+bool_t block_sync(gpid_t svr);
+bool_t block_copy(gpid_t svr, unsigned int ino, unsigned int offset,
+			unsigned int src_ino, unsigned int src_offset, unsigned int nblock);
@@ -31,6 +31,44 @@ bool_t dir_lookup(gpid_t svr, fid_t dir, const char *path, fid_t *pfid){
 	return True;
 }
 
+/* Look up a path of several names in one request.  See dir.h.
+ */
+bool_t dir_lookup_path(gpid_t svr, fid_t dir, const char *path, bool_t is_dir,
+												fid_t *p_dir, fid_t *p_fid){
+	/* Prepare request.
+	 */
+	int n = strlen(path);
+	if (n > DIR_MAX_PATH) {
+		return False;
+	}
+	struct dir_request *req = malloc(sizeof(*req) + n);
+	memset(req, 0, sizeof(*req));
+	req->type = DIR_LOOKUP_PATH;
+	req->dir = dir;
+	req->size = n;
+	req->is_dir = is_dir;
+	memcpy(req + 1, path, n);
+
+	/* Do the RPC.
+	 */
+	struct dir_reply reply;
+	int r = sys_rpc(svr, req, sizeof(*req) + n, &reply, sizeof(reply));
+	free(req);
+	if (r != sizeof(reply)) {
+		return False;
+	}
+	if (p_dir != 0 && reply.dir.server != 0) {
+		*p_dir = reply.dir;
+	}
+	if (reply.status != DIR_OK) {
+		return False;
+	}
+	if (p_fid != 0) {
+		*p_fid = reply.fid;
+	}
+	return True;
+}
+
 bool_t dir_insert(gpid_t svr, fid_t dir, const char *path, fid_t fid){
 	/* Prepare request.
 	 */
@@ -54,6 +92,28 @@ bool_t dir_insert(gpid_t svr, fid_t dir, const char *path, fid_t fid){
 	return True;
 }
 
+bool_t dir_remove(gpid_t svr, fid_t dir, const char *path){
+	/* Prepare request.
+	 */
+	int n = strlen(path);
+	struct dir_request *req = malloc(sizeof(*req) + n);
+	memset(req, 0, sizeof(*req));
+	req->type = DIR_REMOVE;
+	req->dir = dir;
+	req->size = n;
+	memcpy(req + 1, path, n);
+
+	/* Do the RPC.
+	 */
+	struct dir_reply reply;
+	int r = sys_rpc(svr, req, sizeof(*req) + n, &reply, sizeof(reply));
+	free(req);
+	if (r != sizeof(reply) || reply.status != DIR_OK) {
+		return False;
+	}
+	return True;
+}
+
 /* This is currently implemented just by creating a file.
  */
 bool_t dir_create2(gpid_t dirsvr, gpid_t filesvr, mode_t mode, fid_t dir, const char *path, fid_t *p_fid){
@@ -1,5 +1,6 @@
 #define DIR_ENTRY_SIZE		32
 #define DIR_NAME_SIZE		(DIR_ENTRY_SIZE - sizeof(fid_t))
+#define DIR_MAX_PATH		1024	// longest name or path in a request
 
 /* Entry in the directory.
  */
@@ -13,21 +14,34 @@ struct dir_request {
 		DIR_UNUSED,
 		DIR_LOOKUP,
 		DIR_INSERT,
-		DIR_REMOVE
+		DIR_REMOVE,
+		DIR_LOOKUP_PATH					// walk a path of several names
 	} type;	// type of request
 	fid_t dir;							// identifies directory
 	fid_t fid;							// to be inserted
 	unsigned int size;					// size of pathname that follows
+	bool_t is_dir;						// LOOKUP_PATH: last name is a directory
 };
 
 struct dir_reply {
 	enum dir_status { DIR_OK, DIR_ERROR } status;
 	fid_t fid;							// result of LOOKUP
+	fid_t dir;							// LOOKUP_PATH: directory of last name
 };
 
+/* A DIR_LOOKUP_PATH request resolves a path of names separated by '/',
+ * starting in the given directory, where each name but the last is that
+ * of a directory and gets the ".dir" suffix.  The last name gets it too if
+ * is_dir is set.  If the path cannot be resolved, but the directory that
+ * the last name is in can, that directory is still returned.  Otherwise
+ * the returned directory has server 0.
+ */
+
 /* Interface to directory service.
  */
 bool_t dir_lookup(gpid_t svr, fid_t dir, const char *path, fid_t *pfid);
+bool_t dir_lookup_path(gpid_t svr, fid_t dir, const char *path, bool_t is_dir,
+												fid_t *p_dir, fid_t *p_fid);
 bool_t dir_insert(gpid_t svr, fid_t dir, const char *path, fid_t fid);
 bool_t dir_remove(gpid_t svr, fid_t dir, const char *path);
 bool_t dir_create(gpid_t svr, fid_t dir, const char *path, fid_t *p_fid);
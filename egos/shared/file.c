@@ -63,7 +63,7 @@ bool_t file_chmod(gpid_t svr, unsigned int ino, mode_t mode) {
 	return reply.status == FILE_OK;
 }
 
-bool_t file_read(gpid_t svr, unsigned int ino, unsigned long offset,
+static bool_t file_read_xfer(gpid_t svr, unsigned int ino, unsigned long offset,
 										void *addr, unsigned int *psize){
 	/* Prepare request.
 	 */
@@ -91,13 +91,18 @@ bool_t file_read(gpid_t svr, unsigned int ino, unsigned long offset,
 		return False;
 	}
 	n -= sizeof(*reply);
+	if (reply->nzero > *psize - n) {
+		free(reply);
+		return False;
+	}
 	memcpy(addr, &reply[1], n);
-	*psize = n;
+	memset((char *) addr + n, 0, reply->nzero);
+	*psize = n + reply->nzero;
 	free(reply);
 	return True;
 }
 
-bool_t file_write(gpid_t svr, unsigned int ino, unsigned long offset,
+static bool_t file_write_xfer(gpid_t svr, unsigned int ino, unsigned long offset,
 										const void *addr, unsigned int size){
 	/* Prepare request.
 	 */
@@ -121,6 +126,40 @@ bool_t file_write(gpid_t svr, unsigned int ino, unsigned long offset,
 	return reply.status == FILE_OK;
 }
 
+/* Read up to *psize bytes, in requests of at most FILE_MAX_XFER bytes.
+ * Stops early at the end of the file.
+ */
+bool_t file_read(gpid_t svr, unsigned int ino, unsigned long offset,
+										void *addr, unsigned int *psize){
+	unsigned int total = 0, n, want;
+
+	do {
+		want = n = *psize - total < FILE_MAX_XFER ? *psize - total : FILE_MAX_XFER;
+		if (!file_read_xfer(svr, ino, offset + total, (char *) addr + total, &n)) {
+			return False;
+		}
+		total += n;
+	} while (n == want && total < *psize);
+	*psize = total;
+	return True;
+}
+
+/* Write size bytes, in requests of at most FILE_MAX_XFER bytes.
+ */
+bool_t file_write(gpid_t svr, unsigned int ino, unsigned long offset,
+										const void *addr, unsigned int size){
+	unsigned int total = 0, n;
+
+	do {
+		n = size - total < FILE_MAX_XFER ? size - total : FILE_MAX_XFER;
+		if (!file_write_xfer(svr, ino, offset + total, (const char *) addr + total, n)) {
+			return False;
+		}
+		total += n;
+	} while (total < size);
+	return True;
+}
+
 bool_t file_stat(gpid_t svr, unsigned int ino, struct file_stat *pstat){
 	/* Prepare request.
 	 */
@@ -177,6 +216,55 @@ bool_t file_delete(gpid_t svr, unsigned int ino){
 	return reply.status == FILE_OK;
 }
 
+bool_t file_sync(gpid_t svr){
+	/* Prepare request.
+	 */
+	struct file_request req;
+	memset(&req, 0, sizeof(req));
+	req.type = FILE_SYNC;
+
+	/* Do the RPC.
+	 */
+	struct file_reply reply;
+	int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+	if (result < (int) sizeof(reply)) {
+		return False;
+	}
+	return reply.status == FILE_OK;
+}
+
+/* Copy up to *psize bytes from file src_ino on server src_svr to file ino
+ * on server svr.  Returns the number of bytes copied in *psize.
+ */
+bool_t file_copy(gpid_t svr, unsigned int ino, unsigned long offset,
+					gpid_t src_svr, unsigned int src_ino, unsigned long src_offset,
+					unsigned int *psize){
+	/* Prepare request.
+	 */
+	struct {
+		struct file_request hdr;
+		struct file_copy_source src;
+	} req;
+	memset(&req, 0, sizeof(req));
+	req.hdr.type = FILE_COPY;
+	req.hdr.ino = ino;
+	req.hdr.offset = offset;
+	req.hdr.size = *psize;
+	req.src.server = src_svr;
+	req.src.ino = src_ino;
+	req.src.offset = src_offset;
+
+	/* Do the RPC.
+	 */
+	struct file_reply reply;
+	int result = sys_rpc(svr, &req, sizeof(req), &reply, sizeof(reply));
+	if (result < (int) sizeof(reply) || reply.status != FILE_OK) {
+		return False;
+	}
+	*psize = reply.stat.st_size;
+	return True;
+}
+
 bool_t file_set_flags(gpid_t svr, unsigned int ino, unsigned long flags){
 	/* Prepare request.
 	 */
@@ -30,6 +30,8 @@ struct file_request {
 		FILE_STAT,					// get status info
 		FILE_SETSIZE,				// size is in field offset
 		FILE_DELETE,
+		FILE_SYNC,					// write out cached metadata
+		FILE_COPY,					// copy from the file after the request
 
 		/* Special commands for tty server.
 		 */
@@ -47,8 +49,32 @@ struct file_reply {
 	unsigned int ino;				// for FILE_CREATE only
 	enum file_op op;				// operation type in request
 	struct file_stat stat;			// information about file
+	unsigned int nzero;				// FILE_READ: #zero bytes after the data
 };
 
+/* A read reply may leave out zero bytes at the end of the data, typically
+ * because they are in a hole in the file.  The client fills them in.
+ */
+
+/* A copy request is followed by the file to copy from, which is on the
+ * same server or on another file server.  'size' bytes at its offset are
+ * copied to the offset of the request, or fewer if the file ends first.
+ * The reply has the number of bytes copied in stat.st_size.  The data
+ * does not pass through the client, and within a server the blocks may
+ * be shared rather than copied.
+ */
+struct file_copy_source {
+	gpid_t server;					// file server of the file
+	unsigned int ino;				// inode number
+	unsigned long offset;			// offset
+};
+
+/* Maximum number of bytes moved by a single read or write request.
+ * file_read() and file_write() split larger transfers into requests of
+ * this size, and servers size their request buffers accordingly.
+ */
+#define FILE_MAX_XFER		(16 * PAGESIZE)
+
 
 bool_t file_exist(gpid_t svr, unsigned int ino);
 bool_t file_create(gpid_t svr, mode_t mode, unsigned int *p_ino);
@@ -61,4 +87,8 @@ bool_t file_write(gpid_t svr, unsigned int ino, unsigned long offset,
 bool_t file_stat(gpid_t svr, unsigned int ino, struct file_stat *pstat);
 bool_t file_setsize(gpid_t svr, unsigned int ino, unsigned long size);
 bool_t file_delete(gpid_t svr, unsigned int ino);
+bool_t file_sync(gpid_t svr);
+bool_t file_copy(gpid_t svr, unsigned int ino, unsigned long offset,
+					gpid_t src_svr, unsigned int src_ino, unsigned long src_offset,
+					unsigned int *psize);
 bool_t file_set_flags(gpid_t svr, unsigned int ino, unsigned long flags);
@@ -173,3 +173,20 @@ unsigned long sys_gettime(void);
 /* Not really a system call, but convenient.
  */
 gpid_t sys_getpid(void);
+
+/* One of a set of RPCs that a kernel process issues at once using
+ * sys_rpc_multi().  All requests are sent before any reply is awaited,
+ * so that different servers can work on them concurrently.  'result' is
+ * set as the return value of sys_rpc() would be.
+ */
+struct rpc_call {
+	gpid_t pid;					// server
+	const void *request;
+	unsigned int reqsize;
+	void *reply;
+	unsigned int repsize;
+	int result;					// size of reply or -1 upon error
+	bool_t pending;				// used internally
+};
+
+int sys_rpc_multi(struct rpc_call *calls, unsigned int ncalls);
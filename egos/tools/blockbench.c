@@ -0,0 +1,624 @@
+/* Host-side benchmark for stacks of block stores.  It links the block
+ * store modules in grass/block directly, so there is no need to boot
+ * the kernel.
+ *
+ *	Usage: blockbench [options] spec
+ *
+ * 'spec' describes a stack of block stores from the bottom up, with the
+ * layers separated by '|' and their arguments by ':', for example
+ *
+ *		ramdisk|clockdisk:64|treedisk:128
+ *
+ * The layers are:
+ *
+ *		ramdisk[:nblocks]			store in memory (default 16384 blocks)
+ *		filedisk:file[:nblocks]		store in a host file
+ *		partdisk:offset:nblocks		partition of the store below
+ *		raid0:n[:unit]				RAID 0, 1 or 5 over n instances of
+ *		raid1:n						the stack below
+ *		raid5:n
+ *		clockdisk:nblocks			write-through cache of nblocks blocks,
+ *		arcdisk:nblocks				with CLOCK or ARC replacement
+ *		icachedisk:nblocks			cache of nblocks file blocks shared by
+ *									all inodes (above a file system)
+ *		compdisk					compression
+ *		logdisk						log-structured writes
+ *		dedupdisk					deduplication
+ *		checkdisk					checks that reads return prior writes
+ *		tracedisk:file				records a trace in the given file
+ *		treedisk:n					file system with n inodes
+ *		fatdisk:n					(only if compiled with HW_FS)
+ *
+ * Layers above the file system are instantiated once for each inode.
+ *
+ * The options are:
+ *
+ *		-w workload		seq, random, zipf or mixed (default random), or
+ *						trace:file to replay a trace made by tracedisk
+ *		-n ops			number of operations (default 100000)
+ *		-f nblocks		size of each file (default 64, or the whole store
+ *						if there is no file system)
+ *		-i ninodes		number of files used (default all)
+ *		-r percent		percentage of reads (default 100, 70 for mixed)
+ *		-z theta		skew of zipf (default 0.99)
+ *		-s seed			random seed (default 1)
+ *
+ * 'seq' reads or writes the files one after the other from start to end,
+ * 'random' accesses blocks uniformly at random, 'zipf' accesses blocks
+ * with a Zipfian popularity, and 'mixed' picks one of these three for
+ * each operation.  The files are first written in full.  Every block
+ * holds its inode, offset and a version number, which reads check.
+ *
+ * Afterwards blockbench prints the ops/sec, and for each layer the
+ * number of reads and writes it received during the workload, the
+ * amplification relative to the requests on the top layer, and for
+ * caches the read hit ratio.  These are counted by a statdisk put on
+ * top of every layer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <assert.h>
+#include <math.h>
+#include <sys/time.h>
+#include "../grass/block/grass.h"
+#include "../grass/block/block_store.h"
+
+#define MAX_LAYERS		16
+#define MAX_ARGS		3
+
+#define DEFAULT_RAMDISK_SIZE	16384
+#define DEFAULT_FILE_SIZE		64
+
+enum layer_kind { LK_BOTTOM, LK_LAYER, LK_RAID, LK_FS };
+
+static struct layer_type {
+	char *name;
+	enum layer_kind kind;
+	unsigned int minargs, maxargs;
+	bool_t is_cache;
+} layer_types[] = {
+	{ "ramdisk",	LK_BOTTOM,	0, 1, False },
+	{ "filedisk",	LK_BOTTOM,	1, 2, False },
+	{ "partdisk",	LK_LAYER,	2, 2, False },
+	{ "raid0",		LK_RAID,	1, 2, False },
+	{ "raid1",		LK_RAID,	1, 1, False },
+	{ "raid5",		LK_RAID,	1, 1, False },
+	{ "clockdisk",	LK_LAYER,	1, 1, True },
+	{ "arcdisk",	LK_LAYER,	1, 1, True },
+	{ "icachedisk",	LK_LAYER,	1, 1, True },
+	{ "compdisk",	LK_LAYER,	0, 0, False },
+	{ "logdisk",	LK_LAYER,	0, 0, False },
+	{ "dedupdisk",	LK_LAYER,	0, 0, False },
+	{ "checkdisk",	LK_LAYER,	0, 0, False },
+	{ "tracedisk",	LK_LAYER,	1, 1, False },
+	{ "treedisk",	LK_FS,		1, 1, False },
+#ifdef HW_FS
+	{ "fatdisk",	LK_FS,		1, 1, False },
+#endif
+	{ 0 }
+};
+
+/* A layer in the stack.  There may be many instances of a layer, for
+ * example below a RAID layer or above a file system, and each has a
+ * statdisk on top of it.
+ */
+struct layer {
+	char *descr;					// as in the spec
+	struct layer_type *type;
+	char *args[MAX_ARGS];
+	unsigned int nargs;
+	block_if *stats;				// statdisks on the instances
+	unsigned int nstats;
+	struct icache *icache;			// shared by icachedisk instances
+	unsigned int nread, nwrite;		// totals at start of workload
+};
+
+static struct layer layers[MAX_LAYERS];
+static unsigned int nlayers;
+static bool_t has_fs;
+
+/* Every block store created, so they can be destroyed in reverse order.
+ */
+static block_if *stores;
+static unsigned int nstores;
+
+/* There are no block servers on the host, so the remote calls made by
+ * protdisk fail.  blockbench doesn't use protdisk.
+ */
+int sys_rpc(gpid_t pid, const void *request, unsigned int reqsize,
+								void *reply, unsigned int repsize){
+	return -1;
+}
+
+int sys_rpc_multi(struct rpc_call *calls, unsigned int ncalls){
+	unsigned int i;
+
+	for (i = 0; i < ncalls; i++) {
+		calls[i].result = -1;
+	}
+	return -1;
+}
+
+static void usage(char *prog){
+	fprintf(stderr, "Usage: %s [-w workload] [-n ops] [-f nblocks] [-i ninodes] [-r percent] [-z theta] [-s seed] spec\n", prog);
+	exit(1);
+}
+
+/* Parse the spec into layers[].
+ */
+static void parse_spec(char *spec){
+	char *descr, *rest = spec;
+
+	while ((descr = strsep(&rest, "|")) != 0) {
+		if (nlayers == MAX_LAYERS) {
+			fprintf(stderr, "blockbench: too many layers\n");
+			exit(1);
+		}
+		struct layer *l = &layers[nlayers++];
+		l->descr = strdup(descr);
+
+		char *name = strsep(&descr, ":");
+		for (l->type = layer_types; l->type->name != 0; l->type++) {
+			if (strcmp(l->type->name, name) == 0) {
+				break;
+			}
+		}
+		if (l->type->name == 0) {
+			fprintf(stderr, "blockbench: unknown layer '%s'\n", name);
+			exit(1);
+		}
+		while (descr != 0 && l->nargs < MAX_ARGS) {
+			l->args[l->nargs++] = strsep(&descr, ":");
+		}
+		if (l->nargs < l->type->minargs || l->nargs > l->type->maxargs) {
+			fprintf(stderr, "blockbench: wrong number of arguments in '%s'\n", l->descr);
+			exit(1);
+		}
+		if ((l->type->kind == LK_BOTTOM) != (nlayers == 1)) {
+			fprintf(stderr, "blockbench: '%s' can only be at the bottom\n",
+					nlayers == 1 ? l->descr : layers[0].descr);
+			exit(1);
+		}
+	}
+}
+
+static block_if keep(struct layer *l, block_if bi){
+	if (bi == 0) {
+		fprintf(stderr, "blockbench: can't create '%s'\n", l->descr);
+		exit(1);
+	}
+	stores = realloc(stores, (nstores + 1) * sizeof(*stores));
+	stores[nstores++] = bi;
+	return bi;
+}
+
+/* Put a statdisk on top of an instance of a layer.
+ */
+static block_if add_stats(struct layer *l, block_if bi){
+	bi = keep(l, statdisk_init(bi));
+	l->stats = realloc(l->stats, (l->nstats + 1) * sizeof(*l->stats));
+	l->stats[l->nstats++] = bi;
+	return bi;
+}
+
+/* Create an instance of a layer other than a RAID or file system layer.
+ */
+static block_if make_layer(struct layer *l, block_if below, unsigned int inode){
+	char *name = l->type->name;
+	block_no n;
+
+	if (strcmp(name, "ramdisk") == 0) {
+		n = l->nargs > 0 ? atoi(l->args[0]) : DEFAULT_RAMDISK_SIZE;
+		return keep(l, ramdisk_init(calloc(n, BLOCK_SIZE), n));
+	}
+	if (strcmp(name, "filedisk") == 0) {
+		n = l->nargs > 1 ? atoi(l->args[1]) : DEFAULT_RAMDISK_SIZE;
+		return keep(l, filedisk_init(l->args[0], n, False));
+	}
+	if (strcmp(name, "partdisk") == 0) {
+		return keep(l, partdisk_init(below, atoi(l->args[0]), atoi(l->args[1])));
+	}
+	if (strcmp(name, "clockdisk") == 0) {
+		n = atoi(l->args[0]);
+		return keep(l, clockdisk_init(below, calloc(n, BLOCK_SIZE), n));
+	}
+	if (strcmp(name, "arcdisk") == 0) {
+		n = atoi(l->args[0]);
+		return keep(l, arcdisk_init(below, calloc(n, BLOCK_SIZE), n));
+	}
+	if (strcmp(name, "icachedisk") == 0) {
+		if (l->icache == 0) {
+			n = atoi(l->args[0]);
+			l->icache = icache_create(calloc(n, BLOCK_SIZE), n);
+		}
+		return keep(l, icachedisk_init(below, l->icache, inode));
+	}
+	if (strcmp(name, "compdisk") == 0) {
+		return keep(l, compdisk_init(below));
+	}
+	if (strcmp(name, "logdisk") == 0) {
+		return keep(l, logdisk_init(below));
+	}
+	if (strcmp(name, "dedupdisk") == 0) {
+		return keep(l, dedupdisk_init(below));
+	}
+	if (strcmp(name, "checkdisk") == 0) {
+		return keep(l, checkdisk_init(below, l->descr));
+	}
+	if (strcmp(name, "tracedisk") == 0) {
+		return keep(l, tracedisk_init(below, l->args[0], inode));
+	}
+	assert(0);
+	return 0;
+}
+
+/* Build the stack of layers [0, n), none of which is a file system, and
+ * return the top.
+ */
+static block_if build(unsigned int n){
+	struct layer *l = &layers[n - 1];
+	block_if bi;
+
+	if (l->type->kind == LK_RAID) {
+		unsigned int i, nbelow = atoi(l->args[0]);
+		if (nbelow < 2) {
+			fprintf(stderr, "blockbench: '%s' needs at least 2 disks\n", l->descr);
+			exit(1);
+		}
+		block_if *below = calloc(nbelow, sizeof(*below));
+		for (i = 0; i < nbelow; i++) {
+			below[i] = build(n - 1);
+		}
+		if (strcmp(l->type->name, "raid0") == 0) {
+			bi = raid0disk_init(below, nbelow, l->nargs > 1 ? atoi(l->args[1]) : 1);
+		}
+		else if (strcmp(l->type->name, "raid1") == 0) {
+			bi = raid1disk_init(below, nbelow);
+		}
+		else {
+			bi = raid5disk_init(below, nbelow);
+		}
+		keep(l, bi);			// keeps below[]
+	}
+	else {
+		bi = make_layer(l, n > 1 ? build(n - 1) : 0, 0);
+	}
+	return add_stats(l, bi);
+}
+
+/* Build the whole stack.  Returns the number of inodes, whose stores are
+ * put in tops[].
+ */
+static unsigned int build_stack(block_if **tops){
+	unsigned int fs, i, inode, ninodes;
+
+	for (fs = 0; fs < nlayers; fs++) {
+		if (layers[fs].type->kind == LK_FS) {
+			break;
+		}
+	}
+	if (fs == nlayers) {
+		*tops = calloc(1, sizeof(**tops));
+		(*tops)[0] = build(nlayers);
+		return 1;
+	}
+	for (i = fs + 1; i < nlayers; i++) {
+		if (layers[i].type->kind != LK_LAYER) {
+			fprintf(stderr, "blockbench: '%s' can't be above a file system\n", layers[i].descr);
+			exit(1);
+		}
+	}
+
+	/* Create the file system and its inodes.
+	 */
+	has_fs = True;
+	struct layer *l = &layers[fs];
+	block_if below = build(fs);
+	ninodes = atoi(l->args[0]);
+#ifdef HW_FS
+	if (strcmp(l->type->name, "fatdisk") == 0) {
+		if (fatdisk_create(below, ninodes) < 0) {
+			fprintf(stderr, "blockbench: can't create '%s'\n", l->descr);
+			exit(1);
+		}
+	}
+	else
+#endif
+	if (treedisk_create(below, ninodes) < 0) {
+		fprintf(stderr, "blockbench: can't create '%s'\n", l->descr);
+		exit(1);
+	}
+	*tops = calloc(ninodes, sizeof(**tops));
+	for (inode = 0; inode < ninodes; inode++) {
+		block_if bi;
+#ifdef HW_FS
+		if (strcmp(l->type->name, "fatdisk") == 0) {
+			bi = keep(l, fatdisk_init(below, inode));
+		}
+		else
+#endif
+		bi = keep(l, treedisk_init(below, inode));
+		bi = add_stats(l, bi);
+		for (i = fs + 1; i < nlayers; i++) {
+			bi = add_stats(&layers[i], make_layer(&layers[i], bi, inode));
+		}
+		(*tops)[inode] = bi;
+	}
+	return ninodes;
+}
+
+static void layer_stats(struct layer *l, unsigned int *nread, unsigned int *nwrite){
+	unsigned int i, r, w;
+
+	*nread = *nwrite = 0;
+	for (i = 0; i < l->nstats; i++) {
+		statdisk_get_stats(l->stats[i], &r, &w);
+		*nread += r;
+		*nwrite += w;
+	}
+}
+
+/* Random numbers (xorshift64*), so runs are repeatable on any host.
+ */
+static uint64_t rand_state;
+
+static uint64_t rand_next(void){
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return rand_state * 2685821657736338717ULL;
+}
+
+static double rand_double(void){
+	return (rand_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Zipfian keys as generated by YCSB (Gray et al., "Quickly generating
+ * billion-record synthetic databases").  The ranks are spread over the
+ * key space by multiplying with a step that is coprime with the number
+ * of keys.
+ */
+static struct zipf {
+	uint64_t nkeys, step;
+	double theta, alpha, zetan, eta;
+} zipf;
+
+static void zipf_init(uint64_t nkeys, double theta){
+	uint64_t i, a, b, t;
+	double zeta2 = 1 + pow(0.5, theta);
+
+	zipf.nkeys = nkeys;
+	zipf.theta = theta;
+	zipf.alpha = 1 / (1 - theta);
+	zipf.zetan = 0;
+	for (i = 1; i <= nkeys; i++) {
+		zipf.zetan += 1 / pow(i, theta);
+	}
+	zipf.eta = (1 - pow(2.0 / nkeys, 1 - theta)) / (1 - zeta2 / zipf.zetan);
+
+	for (zipf.step = 2654435761ULL % nkeys;; zipf.step++) {
+		for (a = zipf.step, b = nkeys; b != 0; t = a % b, a = b, b = t)
+			;
+		if (a == 1) {
+			break;
+		}
+	}
+}
+
+static uint64_t zipf_next(void){
+	double u = rand_double(), uz = u * zipf.zetan;
+	uint64_t rank;
+
+	if (uz < 1) {
+		rank = 0;
+	}
+	else if (uz < 1 + pow(0.5, zipf.theta)) {
+		rank = 1;
+	}
+	else {
+		rank = zipf.nkeys * pow(zipf.eta * u - zipf.eta + 1, zipf.alpha);
+		if (rank >= zipf.nkeys) {
+			rank = zipf.nkeys - 1;
+		}
+	}
+	return rank * zipf.step % zipf.nkeys;
+}
+
+/* What a block holds.
+ */
+struct bench_block {
+	uint32_t inode, offset, version;
+};
+
+static void fill_block(block_t *block, unsigned int inode, block_no offset, uint32_t version){
+	struct bench_block *bb = (struct bench_block *) block;
+
+	memset(block, (inode + offset + version) & 0xFF, sizeof(*block));
+	bb->inode = inode;
+	bb->offset = offset;
+	bb->version = version;
+}
+
+static double now(void){
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv){
+	char *workload = "random";
+	unsigned long nops = 100000, seed = 1;
+	unsigned int fsize = 0, ninodes = 0;
+	int read_pct = -1;
+	double theta = 0.99;
+	int c;
+
+	while ((c = getopt(argc, argv, "w:n:f:i:r:z:s:")) != -1) {
+		switch (c) {
+		case 'w':	workload = optarg;			break;
+		case 'n':	nops = atol(optarg);		break;
+		case 'f':	fsize = atoi(optarg);		break;
+		case 'i':	ninodes = atoi(optarg);		break;
+		case 'r':	read_pct = atoi(optarg);	break;
+		case 'z':	theta = atof(optarg);		break;
+		case 's':	seed = atol(optarg);		break;
+		default:	usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	enum { W_SEQ, W_RANDOM, W_ZIPF, W_MIXED, W_TRACE } pattern;
+	if (strcmp(workload, "seq") == 0) {
+		pattern = W_SEQ;
+	}
+	else if (strcmp(workload, "random") == 0) {
+		pattern = W_RANDOM;
+	}
+	else if (strcmp(workload, "zipf") == 0) {
+		pattern = W_ZIPF;
+	}
+	else if (strcmp(workload, "mixed") == 0) {
+		pattern = W_MIXED;
+	}
+	else if (strncmp(workload, "trace:", 6) == 0) {
+		pattern = W_TRACE;
+	}
+	else {
+		usage(argv[0]);
+	}
+	if (read_pct < 0) {
+		read_pct = pattern == W_MIXED ? 70 : 100;
+	}
+	if (theta <= 0 || theta == 1) {
+		fprintf(stderr, "blockbench: theta must be positive and not 1\n");
+		return 1;
+	}
+
+	/* Build the stack of block stores.
+	 */
+	char *spec = argv[optind];
+	parse_spec(strdup(spec));
+	block_if *tops;
+	unsigned int n_inodes = build_stack(&tops);
+	if (ninodes == 0 || ninodes > n_inodes) {
+		ninodes = n_inodes;
+	}
+	if (fsize == 0) {
+		fsize = has_fs ? DEFAULT_FILE_SIZE : (*tops[0]->nblocks)(tops[0]);
+	}
+	uint64_t key, nkeys = (uint64_t) ninodes * fsize;
+	uint32_t *versions = calloc(nkeys, sizeof(*versions));
+	block_t block;
+	unsigned long nerrors = 0;
+
+	/* Write all the files, except when replaying a trace.
+	 */
+	if (pattern != W_TRACE) {
+		for (key = 0; key < nkeys; key++) {
+			unsigned int inode = key / fsize;
+			block_no offset = key % fsize;
+			fill_block(&block, inode, offset, versions[key] = 1);
+			if ((*tops[inode]->write)(tops[inode], offset, &block) < 0) {
+				nerrors++;
+			}
+		}
+		if (nerrors != 0) {
+			fprintf(stderr, "blockbench: %lu writes failed while creating the files\n", nerrors);
+			return 1;
+		}
+	}
+
+	unsigned int i;
+	for (i = 0; i < nlayers; i++) {
+		layer_stats(&layers[i], &layers[i].nread, &layers[i].nwrite);
+	}
+
+	/* Run the workload.
+	 */
+	rand_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	if (pattern == W_ZIPF || pattern == W_MIXED) {
+		zipf_init(nkeys, theta);
+	}
+	double start = now();
+	if (pattern == W_TRACE) {
+		nerrors = tracedisk_replay(tops, ninodes, workload + 6, False);
+	}
+	else {
+		uint64_t seq = 0;
+		unsigned long op;
+		for (op = 0; op < nops; op++) {
+			int p = pattern == W_MIXED ? rand_next() % 3 : pattern;
+			switch (p) {
+			case W_SEQ:
+				key = seq++ % nkeys;
+				break;
+			case W_RANDOM:
+				key = rand_next() % nkeys;
+				break;
+			default:
+				key = zipf_next();
+			}
+			unsigned int inode = key / fsize;
+			block_no offset = key % fsize;
+			block_if bi = tops[inode];
+			if ((int) (rand_next() % 100) < read_pct) {
+				struct bench_block *bb = (struct bench_block *) &block;
+				if ((*bi->read)(bi, offset, &block) < 0 || bb->inode != inode ||
+						bb->offset != offset || bb->version != versions[key]) {
+					nerrors++;
+				}
+			}
+			else {
+				fill_block(&block, inode, offset, ++versions[key]);
+				if ((*bi->write)(bi, offset, &block) < 0) {
+					nerrors++;
+				}
+			}
+		}
+	}
+	double elapsed = now() - start;
+
+	/* Report.
+	 */
+	unsigned int nread, nwrite, top_ops;
+	layer_stats(&layers[nlayers - 1], &nread, &nwrite);
+	top_ops = nread + nwrite - layers[nlayers - 1].nread - layers[nlayers - 1].nwrite;
+	printf("blockbench: %s, %s, %u files of %u blocks\n", spec, workload, ninodes, fsize);
+	printf("blockbench: %u ops in %.3f sec, %.0f ops/sec, %.0f KB/sec",
+			top_ops, elapsed, top_ops / elapsed, top_ops * (BLOCK_SIZE / 1024.0) / elapsed);
+	if (nerrors != 0) {
+		printf(", %lu errors", nerrors);
+	}
+	printf("\n");
+	printf("%-24s %10s %10s %8s %10s\n", "layer", "reads", "writes", "ampl", "hit ratio");
+	unsigned int below_read = 0;
+	for (i = nlayers; i-- > 0;) {
+		struct layer *l = &layers[i];
+		layer_stats(l, &nread, &nwrite);
+		nread -= l->nread;
+		nwrite -= l->nwrite;
+		printf("%-24s %10u %10u %8.2f", l->descr, nread, nwrite,
+					top_ops == 0 ? 0.0 : (double) (nread + nwrite) / top_ops);
+		if (l->type->is_cache && i > 0 && nread != 0) {
+			layer_stats(&layers[i - 1], &below_read, &nwrite);
+			below_read -= layers[i - 1].nread;
+			printf(" %9.1f%%", 100.0 * (1 - (double) below_read / nread));
+		}
+		printf("\n");
+	}
+
+	/* Clean up, which also completes the traces.
+	 */
+	while (nstores > 0) {
+		block_if bi = stores[--nstores];
+		(*bi->destroy)(bi);
+	}
+	return nerrors == 0 ? 0 : 2;
+}